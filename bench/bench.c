@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "db.h"
+#include "output.h"
+#include "wal.h"
+
+/* Benchmarks for the core table operations. Every scale runs in a child
+ * process of its own, and the peak RSS is reset before each operation,
+ * so the figure reported belongs to that operation alone. Results go to stdout as tab-separated lines, one per operation
+ * and scale, for diffing between versions.
+ */
+
+#define BENCH_TABLE "bench"
+#define BENCH_COLUMNS "id, user, score, host"
+#define BENCH_COLUMN_COUNT 4
+#define BENCH_FILE "bench.db"
+#define BENCH_SEED 0x9e3779b97f4a7c15ull
+
+/* Deterministic xorshift64* generator, so every run sees the same rows. */
+static uint64_t bench_state;
+
+static uint64_t next_random(void)
+{
+    bench_state ^= bench_state >> 12;
+    bench_state ^= bench_state << 25;
+    bench_state ^= bench_state >> 27;
+    return bench_state * 0x2545f4914f6cdd1dull;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Starts a new peak RSS measurement at the current RSS. Memory that
+ * earlier operations freed is handed back to the kernel first, so that
+ * it does not count towards the next one.
+ */
+static void reset_peak_rss(void)
+{
+    int fd;
+
+    malloc_trim(0);
+    fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0)
+    {
+        if (write(fd, "5", 1) != 1)
+        {
+            fprintf(stderr, "bench: could not reset the peak RSS\n");
+        }
+        close(fd);
+    }
+}
+
+/* Returns the peak resident set size of this process since the last
+ * reset_peak_rss() in kilobytes. Without /proc this is the peak over the
+ * whole process.
+ */
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    FILE *status;
+    char line[256];
+    long peak;
+
+    peak = -1;
+    status = fopen("/proc/self/status", "r");
+    if (status != NULL)
+    {
+        while (peak < 0 && fgets(line, sizeof(line), status) != NULL)
+        {
+            if (sscanf(line, "VmHWM: %ld kB", &peak) != 1)
+            {
+                peak = -1;
+            }
+        }
+        fclose(status);
+    }
+    if (peak < 0)
+    {
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+    return peak;
+}
+
+static void report(const char *name, long long cells, long long rows, double seconds)
+{
+    printf("%s\t%lld\t%lld\t%.6f\t%.0f\t%.1f\t%ld\n", name, cells, rows, seconds,
+           seconds > 0 ? rows / seconds : 0.0, rows > 0 ? seconds * 1e9 / rows : 0.0, peak_rss_kb());
+    fflush(stdout);
+}
+
+/* Sends stdout to /dev/null, or back to the saved descriptor.
+ * Returns the descriptor to restore stdout with.
+ */
+static int silence_stdout(int restore)
+{
+    int saved;
+    int null_fd;
+
+    fflush(stdout);
+    if (restore >= 0)
+    {
+        dup2(restore, STDOUT_FILENO);
+        close(restore);
+        return -1;
+    }
+    saved = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+/* Runs every benchmark at one scale.
+ * Returns 0 on success, 1 on failure.
+ */
+static int run_scale(long long cells)
+{
+    Database *db;
+    Table *table;
+    ByteBuffer sink;
+    char values[MAX_QUERY_LENGTH];
+    long long rows;
+    long long row;
+    uint64_t value;
+    double start;
+    int saved;
+
+    rows = cells / BENCH_COLUMN_COUNT;
+    bench_state = BENCH_SEED;
+    memset(&sink, 0, sizeof(ByteBuffer));
+
+    db = create_db();
+    output_capture(&sink);
+    create_table(db, BENCH_TABLE, BENCH_COLUMNS);
+    reset_peak_rss();
+    start = now_seconds();
+    for (row = 0; row < rows; row++)
+    {
+        value = next_random();
+        snprintf(values, sizeof(values), "%lld, user%08llx, %llu, host-%llu", row,
+                 (unsigned long long)(value >> 32), (unsigned long long)(value % 100000),
+                 (unsigned long long)(value >> 48) % 1000);
+        insert_into_table(db, BENCH_TABLE, values);
+        sink.length = 0;
+    }
+    report("insert_into_table", cells, rows, now_seconds() - start);
+    output_capture(NULL);
+    buffer_free(&sink);
+
+    table = find_table(db, BENCH_TABLE);
+    if (table == NULL || table->row_count != rows)
+    {
+        fprintf(stderr, "bench: expected %lld rows after inserting\n", rows);
+        free_database(db);
+        return 1;
+    }
+
+    saved = silence_stdout(-1);
+    reset_peak_rss();
+    start = now_seconds();
+    select_from_table(db, BENCH_TABLE);
+    start = now_seconds() - start;
+    silence_stdout(saved);
+    report("select_from_table", cells, rows, start);
+
+    saved = silence_stdout(-1);
+    reset_peak_rss();
+    start = now_seconds();
+    save_database_to_file(db, BENCH_FILE);
+    start = now_seconds() - start;
+    silence_stdout(saved);
+    report("save_database_to_file", cells, rows, start);
+    free_database(db);
+
+    db = create_db();
+    saved = silence_stdout(-1);
+    reset_peak_rss();
+    start = now_seconds();
+    db = load_database_from_file(db, BENCH_FILE);
+    start = now_seconds() - start;
+    silence_stdout(saved);
+    table = find_table(db, BENCH_TABLE);
+    if (table == NULL || table->row_count != rows)
+    {
+        fprintf(stderr, "bench: expected %lld rows after loading\n", rows);
+        free_database(db);
+        return 1;
+    }
+    report("load_database_from_file", cells, rows, start);
+    free_database(db);
+    return 0;
+}
+
+/* Usage: bench CELLS...
+ * Runs in a scratch directory under /tmp, since saving also writes the
+ * commit log next to the database file.
+ */
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/simpledb-bench-XXXXXX";
+    long long cells;
+    pid_t pid;
+    int status;
+    int failed;
+    int iter;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s CELLS...\n", argv[0]);
+        return 1;
+    }
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        perror("bench");
+        return 1;
+    }
+
+    printf("benchmark\tcells\trows\tseconds\tops_per_sec\tns_per_row\tpeak_rss_kb\n");
+    fflush(stdout);
+    failed = 0;
+    for (iter = 1; iter < argc && !failed; iter++)
+    {
+        cells = atoll(argv[iter]);
+        if (cells < BENCH_COLUMN_COUNT)
+        {
+            fprintf(stderr, "bench: invalid cell count '%s'\n", argv[iter]);
+            failed = 1;
+            break;
+        }
+        pid = fork();
+        if (pid == 0)
+        {
+            _exit(run_scale(cells));
+        }
+        failed = pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        unlink(BENCH_FILE);
+        unlink(DB_LOG_FILE);
+    }
+    if (chdir("/") == 0)
+    {
+        rmdir(dir);
+    }
+    return failed;
+}
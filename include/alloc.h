@@ -0,0 +1,42 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Bytes the allocator adds in front of every block it hands out. */
+#define MALLOC_HEADER sizeof(size_t)
+
+/* Bytes held for a table or a column, split by what they hold. The
+ * counters are statistics: they are updated with relaxed atomics and read
+ * while writers run.
+ */
+typedef struct MemoryUsage
+{
+    atomic_llong payload;  /* Cell text too long to keep inline */
+    atomic_llong metadata; /* Segments, zone maps, Bloom filters, bitmaps */
+    atomic_llong overhead; /* Allocator headers and size rounding */
+} MemoryUsage;
+
+/* Footprint gathered by one thread, to be added to a MemoryUsage in one
+ * go rather than cell by cell.
+ */
+typedef struct MemoryTally
+{
+    int64_t payload;
+    int64_t metadata;
+    int64_t overhead;
+} MemoryTally;
+
+/* Memory Operations */
+void *memory_alloc(MemoryUsage *usage, size_t size);
+void memory_free(MemoryUsage *usage, void *memory, size_t size);
+void memory_track(MemoryUsage *usage, const void *memory, size_t size);
+void memory_release(MemoryUsage *usage, const void *memory, size_t size);
+void tally_block(MemoryTally *tally, const void *memory, size_t size);
+void tally_text(MemoryTally *tally, const char *text, size_t length, int64_t copies);
+void memory_add(MemoryUsage *usage, const MemoryTally *tally);
+void memory_subtract(MemoryUsage *usage, const MemoryTally *tally);
+
+#endif /* ALLOC_H */
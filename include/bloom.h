@@ -0,0 +1,21 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+/* A split block Bloom filter: every key sets one bit in each of the
+ * eight 32-bit words of a single 256-bit block, so a probe touches one
+ * cache line. BLOOM_BLOCKS blocks give about 8 bits per row of a full
+ * segment and a false positive rate of about 2%.
+ */
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BLOCKS 512
+#define BLOOM_WORDS (BLOOM_BLOCKS * BLOOM_BLOCK_WORDS)
+#define BLOOM_SIZE (BLOOM_WORDS * sizeof(uint32_t))
+
+/* Bloom Filter Operations */
+uint32_t *bloom_create(void);
+void bloom_add(uint32_t *filter, const char *key);
+int bloom_may_contain(const uint32_t *filter, const char *key);
+
+#endif /* BLOOM_H */
@@ -0,0 +1,57 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Environment variable with the megabytes of SELECT results the cache
+ * may hold; 0 turns the cache off.
+ */
+#define RESULT_CACHE_ENV "SIMPLEDB_RESULT_CACHE_MB"
+#define DEFAULT_RESULT_CACHE_MB 64
+
+/* Largest share of the cache one result may take. */
+#define RESULT_CACHE_ENTRY_SHARE 8
+
+/* The output of one SELECT, kept for as long as its table is unchanged. */
+typedef struct CacheEntry
+{
+    char *key;               /* Normalized statement text */
+    uint32_t hash;
+    uint64_t stamp;          /* Stamp of the table state the result was read from */
+    char *text;
+    size_t length;
+    int64_t rows;
+    int refcount;            /* One while cached, plus one per reader writing it out */
+    struct CacheEntry *next; /* Next entry of the same hash chain */
+    struct CacheEntry *newer;
+    struct CacheEntry *older;
+} CacheEntry;
+
+/* Results of recent SELECTs by statement text, evicted least recently
+ * used first once they outgrow the capacity. An entry is only served
+ * while its stamp matches that of the table the query pins, and every
+ * write to a table renews its stamp, so a hit is the result a scan
+ * would have produced.
+ */
+typedef struct ResultCache
+{
+    pthread_mutex_t lock;
+    size_t capacity;         /* Bytes of keys and results the cache may hold */
+    size_t size;
+    int entry_count;
+    int bucket_count;
+    CacheEntry **buckets;
+    CacheEntry *newest;
+    CacheEntry *oldest;
+} ResultCache;
+
+/* Cache Operations */
+ResultCache *create_result_cache(void);
+void free_result_cache(ResultCache *cache);
+size_t cache_entry_limit(const ResultCache *cache);
+int cache_fetch(ResultCache *cache, const char *key, uint64_t stamp, int64_t *rows);
+void cache_store(ResultCache *cache, const char *key, uint64_t stamp, const char *text, size_t length, int64_t rows);
+
+#endif /* CACHE_H */
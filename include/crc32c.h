@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Extends a CRC-32C (Castagnoli) checksum with more data.
+ * Start with crc = 0; the result of one call can be passed to the next
+ * to checksum data in pieces.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif /* CRC32C_H */
@@ -2,52 +2,253 @@
 #define DB_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "alloc.h"
 
 #define MAX_QUERY_LENGTH 256
 
 /* Default filename for saving/loading the database */
 #define DB_FILE "database.db"
 
+/* Columns of this name only take valid IPv4 addresses. */
+#define IPV4_COLUMN "IPv4"
+
 
 typedef struct Column
 {
     char *name;
-    char **data; /* Array of string data for each row */
+    uint32_t name_hash; /* hash_name() of name, checked before comparing names */
+    int ipv4;           /* Named IPV4_COLUMN: cells are validated on insert */
+    int bloom;          /* Full segments of the column carry a Bloom filter */
+    MemoryUsage memory; /* Cells, segments and Bloom filters of the column */
 } Column;
 
+/* Rows per column segment. A column is a list of segments that never
+ * move once allocated, so appends never copy existing cells beyond the
+ * first segment of a small table, and one segment is the unit of work
+ * of scans, writes and saves.
+ */
+#define SEGMENT_SHIFT 14
+#define SEGMENT_ROWS (1 << SEGMENT_SHIFT)
+#define SEGMENT_MASK (SEGMENT_ROWS - 1)
+#define SEGMENT_WORDS (SEGMENT_ROWS / 64)
+
+/* Bytes of its lowest and highest cell a zone map keeps. */
+#define ZONE_PREFIX 15
+
+/* Bounds of the cells of one segment, which let scans skip segments that
+ * no predicate can match. Bounds only widen as rows are added or
+ * updated, and are recomputed when a table is compacted or loaded.
+ * Texts are compared on their first ZONE_PREFIX bytes only.
+ */
+typedef struct ZoneMap
+{
+    int64_t rows;                   /* Cells added to the bounds */
+    int64_t numbers;                /* Cells added that are numbers */
+    double min_number;
+    double max_number;
+    char min_text[ZONE_PREFIX + 1]; /* Lowest and highest cell of all */
+    char max_text[ZONE_PREFIX + 1];
+} ZoneMap;
+
+/* Bytes a cell keeps inline: a text of up to that length, or the first
+ * CELL_PREFIX bytes of a longer text and a pointer to it.
+ */
+#define CELL_INLINE 12
+#define CELL_PREFIX 4
+
+/* Longest text a cell holds. Values come from queries of at most
+ * MAX_QUERY_LENGTH bytes, so only a damaged file or log has longer ones.
+ */
+#define CELL_MAX_LENGTH 0xffffff
+
+/* A 16-byte cell. Short texts, the most common kind, are kept inside the
+ * segment and cost neither an allocation nor a pointer to chase. Long
+ * texts live on the heap, but their length and first bytes are still at
+ * hand, so most comparisons are settled without reading them. The byte
+ * after the inline bytes is always NUL, so a text filling all of them is
+ * still a C string where it lies.
+ */
+typedef struct Cell
+{
+    char bytes[CELL_INLINE];  /* Inline text, or prefix and heap pointer */
+    unsigned int end : 8;     /* Always 0, ends inline text */
+    unsigned int length : 24; /* Bytes of text, not counting the NUL */
+} Cell;
+
+_Static_assert(sizeof(Cell) == 16, "cells must stay 16 bytes");
+
+/* Returns the text of a cell as a C string.
+ */
+static inline const char *cell_text(const Cell *cell)
+{
+    const char *text;
+
+    if (cell->length <= CELL_INLINE)
+    {
+        return cell->bytes;
+    }
+    memcpy(&text, cell->bytes + CELL_PREFIX, sizeof(char*));
+    return text;
+}
+
+/* Up to SEGMENT_ROWS cells of one column, their zone map and, once the
+ * segment is full, a Bloom filter of its cells if the column has one.
+ * Only the segment of a table that fits in one is allocated smaller, to
+ * its row count rounded up, and replaced by a larger copy as it fills.
+ */
+typedef struct SegmentData
+{
+    ZoneMap zone;
+    uint32_t *bloom;
+    int capacity; /* Cells allocated */
+    Cell cells[];
+} SegmentData;
+
+typedef SegmentData *Segment;
+
+/* Bytes of a segment with room for capacity cells. */
+#define SEGMENT_SIZE(capacity) (sizeof(SegmentData) + sizeof(Cell) * (size_t)(capacity))
+
+/* One generation of a table's storage. A version is never changed in a
+ * way its readers can see: rows are appended past the row count a reader
+ * pinned, and anything else is done on a copy that is published as a new
+ * version. Memory the new version no longer uses is retired to the old
+ * one and freed once no reader can reach it.
+ */
+typedef struct TableVersion
+{
+    int refcount;         /* Readers pinning this version, plus one while current */
+    int segment_count;    /* Segments allocated in every column */
+    int segment_capacity; /* Entries the segment lists have room for */
+    Segment **segments;   /* Segment list of each column */
+    uint64_t **deleted;   /* Tombstone bitmap of each segment, NULL where nothing is
+                             deleted; the list is NULL if nothing is deleted at all */
+    void **retired;       /* Memory to free when the version is reclaimed */
+    int retired_count;
+    int retired_capacity;
+    struct TableVersion *next; /* Next newer version */
+} TableVersion;
+
 typedef struct Table
 {
     char *name;
-    int row_count;
+    uint32_t name_hash;    /* hash_name() of name, checked before comparing names */
+    int64_t row_count;     /* Rows visible to new readers */
     int column_count;
     Column **columns;
+    int64_t deleted_count; /* Deleted rows among row_count */
+    uint64_t stamp;        /* Renewed by every write; unique across tables */
+    TableVersion *current;
+    TableVersion *oldest;          /* Versions from oldest to current are still alive */
+    pthread_mutex_t write_lock;    /* Serializes writers of the table */
+    pthread_mutex_t version_lock;  /* Guards pinning and publishing versions */
+    MemoryUsage memory;            /* Tombstone bitmaps */
+    struct View *views;            /* Materialized views over the table */
 } Table;
 
+/* What one reader or writer sees of a table. */
+typedef struct TableSnapshot
+{
+    Table *table;
+    TableVersion *version;
+    int64_t row_count;
+    int64_t deleted_count;
+    uint64_t stamp;        /* Names the table's contents as seen */
+} TableSnapshot;
+
+/* Rows written past the row count of a locked table by stage_rows(),
+ * which publish_appends() makes visible. */
+typedef struct Append
+{
+    TableSnapshot snapshot;  /* The writer's view, row count included */
+    int64_t first_row;       /* Row count readers see until publishing */
+    uint64_t previous_stamp; /* Stamp of the table before publishing */
+} Append;
+
 typedef struct Database
 {
     int table_count;
     Table **tables;
+    pthread_rwlock_t lock; /* Held shared by queries, exclusively by CREATE TABLE and LOAD */
+    pthread_mutex_t gate;  /* Held by an exclusive locker while it waits, to hold off new queries */
+    struct CommitLog *log; /* Transactions committed since the last SAVE */
+    struct ResultCache *cache; /* Results of recent SELECTs, or NULL if turned off */
 } Database;
 
+/* State kept between the queries of one client: the REPL, or one
+ * connection of the server.
+ */
+typedef struct Session
+{
+    struct Transaction *transaction; /* Open transaction, or NULL */
+    int timer;                       /* .timer on: report each statement's run time */
+    uint64_t id;                     /* Tells sessions apart in a recorded workload */
+} Session;
+
 /* Database Operations */
 Database *create_db(void);
 void free_database(Database *db);
 
 /* Table Operations */
 Table *find_table(Database *db, const char *table_name);
+int find_column(Table *table, const char *column_name);
 void create_table(Database *db, const char *table_name, const char *columns_str);
+char **parse_values(Table *table, const char *values_str);
+void stage_rows(Append *append, char **cells, int64_t count);
+void publish_appends(Append *appends, int count);
+int append_rows(TableSnapshot *snapshot, char **cells, int64_t count);
 void insert_into_table(Database *db, const char *table_name, const char *values_str);
 void select_from_table(Database *db, const char *table_name);
+void compact_table(Table *table);
+void create_bloom_filter(Database *db, const char *table_name, const char *column_name);
+void show_stats(Database *db, const char *table_name);
+
+/* Version Operations */
+int init_table_storage(Table *table, int64_t row_count);
+void free_table_storage(Table *table);
+void pin_table(Table *table, TableSnapshot *snapshot);
+void unpin_table(TableSnapshot *snapshot);
+void lock_table(Table *table, TableSnapshot *snapshot);
+void unlock_table(TableSnapshot *snapshot);
+TableVersion *copy_version(Table *table);
+void retire_memory(TableVersion *version, void *memory);
+void publish_version(Table *table, TableVersion *version, int64_t row_count, int64_t deleted_count);
+void publish_rows(Append *appends, int count);
+int reserve_rows(TableSnapshot *snapshot, int64_t count);
+int segments_for_rows(int64_t row_count);
+int first_segment_rows(int64_t row_count);
+Segment alloc_segment(MemoryUsage *usage, int capacity);
+Segment *alloc_segment_list(MemoryUsage *usage, int64_t row_count, int capacity);
+void free_segment_list(MemoryUsage *usage, Segment *list, int count);
+void retire_segment(TableVersion *version, MemoryUsage *usage, Segment segment);
+void build_bloom(MemoryUsage *usage, Segment segment);
+Cell *cell_at(const TableVersion *version, int column, int64_t row);
+void widen_zone(ZoneMap *zone, const char *cell);
+int row_is_deleted(const TableSnapshot *snapshot, int64_t row);
+
+/* Cell Operations */
+char *cell_heap(const Cell *cell);
+int store_cell(Cell *cell, const char *text, size_t length);
+void adopt_cell(Cell *cell, char *text);
+void tally_cell(MemoryTally *tally, const Cell *cell, int64_t copies);
 
 /* File Operations */
 void save_database_to_file(Database *db, const char *filename);
+void save_database_in_background(Database *db, const char *filename);
+void report_background_save(int show_status);
+void wait_for_background_save(void);
 Database *load_database_from_file(Database *db, const char *filename);
 
 /* Query Parsing */
-Database *parse_query(Database *db, const char *query);
+Database *parse_query(Database *db, Session *session, const char *query);
 
 /* Utility Functions */
 int validate_ipv4_address(const char *ip);
+uint32_t hash_name(const char *name);
 char *trim_whitespace(char *str);
+int parse_number(const char *str, double *value);
 
 #endif /* DB_H */
@@ -0,0 +1,37 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stddef.h>
+#include "db.h"
+
+/* Rows per column chunk in the save file. Every chunk is encoded on its
+ * own, so encodings adapt to local data and chunks decode independently.
+ */
+#define CHUNK_ROWS 16384
+
+typedef enum ChunkEncoding
+{
+    ENCODING_PLAIN, /* NUL-terminated cells back to back */
+    ENCODING_RLE,   /* Runs of identical cells: run length, then the cell */
+    ENCODING_DELTA, /* Integers: first value, then bit-packed zigzag deltas */
+    ENCODING_LZ     /* PLAIN layout compressed with an LZ77 byte coder */
+} ChunkEncoding;
+
+/* Growable byte buffer used to assemble encoded chunks. */
+typedef struct ByteBuffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+} ByteBuffer;
+
+/* Buffer Operations */
+int buffer_reserve(ByteBuffer *buffer, size_t extra);
+int buffer_append(ByteBuffer *buffer, const void *bytes, size_t length);
+void buffer_free(ByteBuffer *buffer);
+
+/* Chunk Operations */
+int encode_chunk(Cell *cells, int count, ByteBuffer *out, ChunkEncoding *encoding);
+int decode_chunk(ChunkEncoding encoding, const char *payload, size_t size, Cell *cells, int count);
+
+#endif /* ENCODING_H */
@@ -0,0 +1,53 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "encoding.h"
+
+/* Environment variables that make the server or REPL write its metrics
+ * to a file every SIMPLEDB_METRICS_INTERVAL seconds.
+ */
+#define METRICS_FILE_ENV "SIMPLEDB_METRICS_FILE"
+#define METRICS_INTERVAL_ENV "SIMPLEDB_METRICS_INTERVAL"
+#define DEFAULT_METRICS_INTERVAL 10
+
+typedef enum Counter
+{
+    COUNTER_ROWS_SCANNED,     /* Live rows of the segments scans read */
+    COUNTER_SEGMENTS_SKIPPED, /* Segments ruled out by zone maps or Bloom filters */
+    COUNTER_ROWS_INSERTED,
+    COUNTER_SAVE_BYTES,       /* Bytes of database files written */
+    COUNTER_WAL_BYTES,        /* Bytes of commit log records written */
+    COUNTER_CACHE_HITS,       /* SELECTs answered from the result cache */
+    COUNTER_CACHE_MISSES,     /* SELECTs that scanned with the cache on */
+    COUNTER_COUNT
+} Counter;
+
+/* Latency histograms: one per kind of statement, then the commit log's
+ * fdatasync().
+ */
+typedef enum Histogram
+{
+    HISTOGRAM_CREATE,
+    HISTOGRAM_INSERT,
+    HISTOGRAM_SELECT,
+    HISTOGRAM_UPDATE,
+    HISTOGRAM_DELETE,
+    HISTOGRAM_SAVE,
+    HISTOGRAM_LOAD,
+    HISTOGRAM_TRANSACTION, /* BEGIN, COMMIT, ROLLBACK */
+    HISTOGRAM_OTHER,
+    HISTOGRAM_WAL_SYNC,
+    HISTOGRAM_COUNT
+} Histogram;
+
+/* Metrics Operations */
+void metrics_add(Counter counter, uint64_t value);
+void metrics_observe(Histogram histogram, int64_t nanoseconds);
+Histogram statement_histogram(const char *query);
+int metrics_format(ByteBuffer *out);
+void print_metrics(void);
+void start_metrics_dump(void);
+void stop_metrics_dump(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,26 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include "encoding.h"
+
+/* Query results and messages go to stdout, unless the calling thread
+ * captures them into a buffer, as a server session does to send them to
+ * its client.
+ */
+
+/* A copy of a thread's output, kept while it fits a limit. */
+typedef struct OutputCopy
+{
+    ByteBuffer buffer;
+    size_t limit;
+    int overflowed; /* Output outgrew the limit or memory ran out; buffer is freed */
+} OutputCopy;
+
+/* Output Operations */
+ByteBuffer *output_capture(ByteBuffer *buffer);
+OutputCopy *output_copy(OutputCopy *copy);
+int output_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void output_write(const void *data, size_t length);
+
+#endif /* OUTPUT_H */
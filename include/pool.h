@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+
+typedef void (*TaskFunc)(void *arg);
+
+typedef struct ThreadPool ThreadPool;
+
+/* Tracks a set of submitted tasks so that the submitter can wait for
+ * exactly the work it created.
+ */
+typedef struct TaskGroup
+{
+    atomic_int pending;
+} TaskGroup;
+
+/* Pool Operations */
+ThreadPool *pool_create(int thread_count);
+void pool_destroy(ThreadPool *pool);
+ThreadPool *pool_shared(void);
+int pool_default_size(void);
+int pool_thread_count(ThreadPool *pool);
+
+/* Task Operations */
+void task_group_init(TaskGroup *group);
+void pool_submit(ThreadPool *pool, TaskGroup *group, TaskFunc func, void *arg);
+void pool_wait(ThreadPool *pool, TaskGroup *group);
+
+#endif /* POOL_H */
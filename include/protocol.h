@@ -0,0 +1,29 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include "encoding.h"
+
+/* Client and server exchange frames: a 4-byte big-endian payload length
+ * followed by the payload. A request carries one query, the response to
+ * it carries everything the query printed. Clients may send many
+ * requests without waiting; responses come back in the same order.
+ */
+#define FRAME_HEADER_SIZE 4
+
+/* Largest request a server accepts; queries are much shorter. */
+#define MAX_REQUEST_SIZE (1 << 20)
+
+/* Address used when none is given: TCP port 5433 on localhost. */
+#define DEFAULT_ADDRESS "5433"
+
+/* Socket Operations */
+int open_listener(const char *address);
+int open_connection(const char *address);
+
+/* Frame Operations */
+int frame_append(ByteBuffer *out, const char *payload, size_t length);
+void frame_finish(ByteBuffer *out, size_t offset);
+int frame_next(const char *data, size_t length, size_t *payload_length);
+
+#endif /* PROTOCOL_H */
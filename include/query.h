@@ -0,0 +1,133 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "db.h"
+
+/* Rows handled by one scan task: one segment of every column. Small
+ * enough to balance load across workers, large enough to amortise the
+ * per-morsel setup.
+ */
+#define MORSEL_ROWS SEGMENT_ROWS
+
+typedef enum AggregateKind
+{
+    AGG_NONE,
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_AVG,
+    AGG_APPROX_DISTINCT, /* APPROX_COUNT_DISTINCT, estimated by a HyperLogLog */
+    AGG_APPROX_QUANTILE  /* Estimated by a KLL sketch */
+} AggregateKind;
+
+typedef enum CompareOp
+{
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE
+} CompareOp;
+
+typedef struct SelectItem
+{
+    AggregateKind aggregate;
+    char *column_name; /* NULL for COUNT(*) */
+    int column;        /* Resolved column index, -1 for COUNT(*) */
+    double fraction;   /* Quantile APPROX_QUANTILE estimates, from 0 to 1 */
+} SelectItem;
+
+typedef struct Predicate
+{
+    char *column_name;
+    int column;
+    CompareOp op;
+    char *value;
+    uint32_t length;          /* Bytes of value */
+    char prefix[CELL_PREFIX]; /* First bytes of value, zero padded as in a cell */
+    double number;
+    int is_number; /* Compare numerically when the cell is a number too */
+} Predicate;
+
+/* One "column = value" entry of an UPDATE's SET list. */
+typedef struct Assignment
+{
+    char *column_name;
+    int column;
+    char *value;
+    Segment *source; /* Segments shared with readers when writing to a copy, else NULL */
+    Segment *target; /* Segment list the values are written to */
+} Assignment;
+
+/* Operators of a SELECT, bottom up, as EXPLAIN ANALYZE reports them. */
+typedef enum OperatorKind
+{
+    OP_SCAN,
+    OP_FILTER,
+    OP_COMPUTE, /* Projection, aggregation or grouping */
+    OP_OUTPUT,
+    OP_COUNT
+} OperatorKind;
+
+typedef struct OperatorStats
+{
+    int64_t rows_in;
+    int64_t rows_out;
+    int64_t bytes;       /* Bytes of cells read, or of output written */
+    int64_t nanoseconds; /* Summed over the workers that ran the operator */
+} OperatorStats;
+
+/* What EXPLAIN ANALYZE counts while a query runs. */
+typedef struct QueryProfile
+{
+    int64_t segments;
+    int64_t zone_skips;  /* Segments ruled out by their zone maps */
+    int64_t bloom_skips; /* Segments ruled out by their Bloom filters */
+    OperatorStats operators[OP_COUNT];
+} QueryProfile;
+
+typedef struct SelectQuery
+{
+    char *table_name;
+    Table *table;
+    int all_columns;
+    int item_count;
+    SelectItem *items;
+    int predicate_count;
+    Predicate *predicates; /* Combined with AND */
+    char *group_name;
+    int group_column;
+    int aggregate_count;
+    int assignment_count;
+    Assignment *assignments; /* SET list of an UPDATE */
+    TableSnapshot snapshot;  /* Version of the table the query runs on */
+    uint64_t **tombstones;   /* Bitmap list a DELETE marks rows in */
+    uint64_t **shared_tombstones; /* Bitmaps shared with readers when writing to a copy, else NULL */
+    QueryProfile *profile;   /* Counters of an EXPLAIN ANALYZE, else NULL */
+} SelectQuery;
+
+/* The groups of a grouped SELECT, kept up to date as rows are inserted
+ * into its table.
+ */
+typedef struct View View;
+
+/* Query Operations */
+int parse_select(const char *sql, SelectQuery *query);
+int plan_select(Database *db, SelectQuery *query);
+void execute_select(SelectQuery *query);
+void free_select(SelectQuery *query);
+void run_select(Database *db, const char *sql);
+void explain_select(Database *db, const char *sql);
+void run_delete(Database *db, const char *sql);
+void run_update(Database *db, const char *sql);
+
+/* Materialized View Operations */
+void create_view(Database *db, const char *sql);
+View *find_view(Database *db, const char *name);
+void update_views(const TableSnapshot *snapshot, int64_t first_row, uint64_t previous_stamp);
+void adopt_views(Database *db, Table **tables, int table_count);
+void free_views(Table *table);
+
+#endif /* QUERY_H */
@@ -0,0 +1,10 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "db.h"
+
+/* Server Operations */
+int run_server(Database *db, const char *address);
+int run_client(const char *address);
+
+#endif /* SERVER_H */
@@ -0,0 +1,53 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+/* A HyperLogLog of 2^HLL_PRECISION one-byte registers. It estimates the
+ * distinct cells it has seen to within about 1.6% in 4 KiB, however many
+ * there are, and two sketches merge by taking the larger register.
+ */
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+typedef struct DistinctSketch
+{
+    uint8_t registers[HLL_REGISTERS];
+} DistinctSketch;
+
+/* A KLL sketch: a stack of compactors, each of which sorts its values
+ * once full and passes every other one up to the next, where it stands
+ * for twice as many values. The top compactor keeps QUANTILE_K values
+ * and lower ones geometrically fewer, so a sketch holds about 3 *
+ * QUANTILE_K values and ranks to within about 1.5% however many it has
+ * seen. Compactors of two sketches merge level by level.
+ */
+#define QUANTILE_K 200
+#define QUANTILE_LEVELS 48
+
+typedef struct QuantileSketch
+{
+    int64_t count;                   /* Values seen */
+    double min;                      /* Lowest and highest value seen */
+    double max;
+    int level_count;
+    int sizes[QUANTILE_LEVELS];      /* Values held by each compactor */
+    int capacities[QUANTILE_LEVELS]; /* Values each compactor has room for */
+    double *levels[QUANTILE_LEVELS];
+    uint64_t random;                 /* Picks which half a compaction keeps */
+} QuantileSketch;
+
+/* Distinct Sketch Operations */
+DistinctSketch *distinct_create(void);
+void distinct_add(DistinctSketch *sketch, const char *cell);
+void distinct_merge(DistinctSketch *dst, const DistinctSketch *src);
+double distinct_estimate(const DistinctSketch *sketch);
+
+/* Quantile Sketch Operations */
+QuantileSketch *quantile_create(void);
+void quantile_free(QuantileSketch *sketch);
+int quantile_add(QuantileSketch *sketch, double value);
+int quantile_merge(QuantileSketch *dst, const QuantileSketch *src);
+int quantile_estimate(const QuantileSketch *sketch, double fraction, double *value);
+
+#endif /* SKETCH_H */
@@ -0,0 +1,26 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdint.h>
+#include "timer.h"
+
+/* Environment variables that make the server or REPL append every
+ * statement taking at least SIMPLEDB_SLOW_QUERY_MS milliseconds to a
+ * file.
+ */
+#define SLOW_LOG_FILE_ENV "SIMPLEDB_SLOW_QUERY_LOG"
+#define SLOW_LOG_THRESHOLD_ENV "SIMPLEDB_SLOW_QUERY_MS"
+#define DEFAULT_SLOW_QUERY_MS 100
+
+/* Entries waiting for the writer thread. Slow statements beyond this
+ * are counted and dropped rather than queued without bound.
+ */
+#define MAX_SLOW_LOG_PENDING 1024
+
+/* Slow Log Operations */
+int slow_log_enabled(void);
+void log_slow_query(const char *query, const StatementTimer *timer, int64_t total);
+void start_slow_log(void);
+void stop_slow_log(void);
+
+#endif /* SLOWLOG_H */
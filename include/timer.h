@@ -0,0 +1,43 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/* Phases of a statement that are timed separately. Whatever time is not
+ * spent parsing, planning or writing output counts as execution.
+ */
+typedef enum TimerPhase
+{
+    PHASE_PARSE,
+    PHASE_PLAN,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+} TimerPhase;
+
+/* Size of the buffer a statement's plan is described in */
+#define PLAN_LENGTH 1024
+
+/* Time spent on one statement, in nanoseconds of the monotonic clock,
+ * and the work it did.
+ */
+typedef struct StatementTimer
+{
+    int64_t start;
+    int64_t phases[PHASE_COUNT];
+    int64_t segments;         /* Segments its scans visited */
+    int64_t segments_skipped; /* Of those, ruled out without reading cells */
+    int64_t rows_scanned;     /* Live rows of the segments read */
+    int64_t rows_returned;    /* Rows output by a SELECT, or written by an INSERT, UPDATE or DELETE */
+    char *plan;               /* PLAN_LENGTH bytes the plan is described in, or NULL */
+} StatementTimer;
+
+/* Timer Operations */
+int64_t monotonic_ns(void);
+void timer_start(StatementTimer *timer);
+StatementTimer *timer_capture(StatementTimer *timer);
+void timer_add(TimerPhase phase, int64_t start);
+void timer_count(int64_t segments, int64_t skipped, int64_t scanned, int64_t returned);
+char *timer_plan(void);
+void timer_report(const StatementTimer *timer);
+
+#endif /* TIMER_H */
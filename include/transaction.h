@@ -0,0 +1,37 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include "db.h"
+
+/* Rows a transaction appends to one table. The table is looked up by
+ * name again at COMMIT, since a LOAD may replace it meanwhile.
+ */
+typedef struct PendingTable
+{
+    char *name;
+    int column_count;
+    char **column_names; /* So that replay can create the table; NULL in old records */
+    int row_count;
+    int capacity;     /* Rows cells has room for */
+    char **cells;     /* row_count rows of column_count cells, row by row */
+} PendingTable;
+
+/* An open transaction. Its INSERTs are buffered here, invisible to every
+ * other query, until COMMIT logs and publishes them or ROLLBACK drops
+ * them.
+ */
+typedef struct Transaction
+{
+    int table_count;
+    PendingTable *tables;
+} Transaction;
+
+/* Transaction Operations */
+void begin_transaction(Session *session);
+void queue_insert(Database *db, Session *session, const char *table_name, const char *values_str);
+void commit_transaction(Database *db, Session *session);
+void rollback_transaction(Session *session);
+void end_session(Session *session);
+int replay_commit_log(Database *db, uint64_t after);
+
+#endif /* TRANSACTION_H */
@@ -0,0 +1,51 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "encoding.h"
+
+/* Default filename of the commit log kept next to the database file */
+#define DB_LOG_FILE "database.wal"
+
+/* The commit log holds every transaction committed since the last SAVE,
+ * as records of a 4-byte payload length, a CRC-32C of the rest of the
+ * record, an 8-byte sequence number and the payload. Committers append
+ * their record to a shared buffer; whichever of them finds no flush in
+ * progress writes and syncs everything buffered so far, so concurrent
+ * committers share one fdatasync(). A SAVE leaves a marker record without
+ * payload that carries the last sequence number the file holds.
+ */
+typedef struct CommitLog
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  /* Signalled when a flush ends or a commit finishes */
+    char *filename;
+    int fd;                  /* -1 until the log is first used */
+    int failed;              /* A write failed; no more commits are accepted */
+    uint64_t sequence;       /* Last sequence number handed out */
+    uint64_t durable;        /* Last sequence number known to be on disk */
+    ByteBuffer pending;      /* Records waiting for the next flush */
+    ByteBuffer flushing;     /* Records being written by the current flush */
+    int flush_running;
+    int active;              /* Commits logged but not yet applied */
+    int checkpoint;          /* A checkpoint waits for active commits */
+} CommitLog;
+
+/* Called for each record read back from the log. */
+typedef void (*LogRecordFunc)(uint64_t sequence, const char *payload, size_t length, void *arg);
+
+/* Log Operations */
+CommitLog *create_commit_log(const char *filename);
+void free_commit_log(CommitLog *log);
+int log_commit(CommitLog *log, const char *payload, size_t length, uint64_t *sequence);
+void finish_commit(CommitLog *log);
+uint64_t begin_checkpoint(CommitLog *log);
+void end_checkpoint(CommitLog *log);
+void advance_commit_log(CommitLog *log, uint64_t sequence);
+int truncate_commit_log(CommitLog *log, uint64_t sequence);
+int read_commit_log(CommitLog *log, uint64_t after, LogRecordFunc func, void *arg);
+int sync_directory(const char *filename);
+
+#endif /* WAL_H */
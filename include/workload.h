@@ -0,0 +1,24 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include "db.h"
+
+/* Environment variable that makes the server or REPL record every
+ * statement it runs to a workload file.
+ */
+#define RECORD_FILE_ENV "SIMPLEDB_RECORD_FILE"
+
+/* A workload file holds one statement per line, in the order they
+ * arrived: microseconds since recording started, the id of the session
+ * that sent it and its text, separated by tabs. Backslashes, tabs and
+ * line breaks in the text are escaped as \\, \t, \n and \r. Lines
+ * starting with '#' are comments.
+ */
+
+/* Workload Operations */
+void start_recording(void);
+void record_statement(const Session *session, const char *query);
+void stop_recording(void);
+int run_replay(Database *db, const char *filename, double speed, const char *snapshot);
+
+#endif /* WORKLOAD_H */
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "alloc.h"
+
+/* Table storage is allocated and released through these functions, which
+ * keep the MemoryUsage of the table or column it belongs to up to date.
+ * Cells are an exception: they are parsed before it is known which table
+ * they go to, so they are tallied when a column takes them over and when
+ * it retires them.
+ */
+
+/* Adds a block of size requested bytes to a tally. What the allocator
+ * hands out beyond that, and its header, count as overhead.
+ */
+void tally_block(MemoryTally *tally, const void *memory, size_t size)
+{
+    if (memory == NULL)
+    {
+        return;
+    }
+    tally->metadata += size;
+    tally->overhead += malloc_usable_size((void *)memory) + MALLOC_HEADER - size;
+}
+
+/* Adds copies of a cell of length bytes to a tally, each allocated on
+ * its own. A negative count takes them away.
+ */
+void tally_text(MemoryTally *tally, const char *text, size_t length, int64_t copies)
+{
+    size_t size;
+
+    size = length + 1;
+    tally->payload += (int64_t)size * copies;
+    tally->overhead += (int64_t)(malloc_usable_size((void *)text) + MALLOC_HEADER - size) * copies;
+}
+
+void memory_add(MemoryUsage *usage, const MemoryTally *tally)
+{
+    atomic_fetch_add_explicit(&usage->payload, tally->payload, memory_order_relaxed);
+    atomic_fetch_add_explicit(&usage->metadata, tally->metadata, memory_order_relaxed);
+    atomic_fetch_add_explicit(&usage->overhead, tally->overhead, memory_order_relaxed);
+}
+
+void memory_subtract(MemoryUsage *usage, const MemoryTally *tally)
+{
+    atomic_fetch_sub_explicit(&usage->payload, tally->payload, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&usage->metadata, tally->metadata, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&usage->overhead, tally->overhead, memory_order_relaxed);
+}
+
+/* Counts a block that was allocated elsewhere, such as a Bloom filter.
+ */
+void memory_track(MemoryUsage *usage, const void *memory, size_t size)
+{
+    MemoryTally tally;
+
+    memset(&tally, 0, sizeof(MemoryTally));
+    tally_block(&tally, memory, size);
+    memory_add(usage, &tally);
+}
+
+/* Stops counting a block, which the caller frees or retires.
+ */
+void memory_release(MemoryUsage *usage, const void *memory, size_t size)
+{
+    MemoryTally tally;
+
+    memset(&tally, 0, sizeof(MemoryTally));
+    tally_block(&tally, memory, size);
+    memory_subtract(usage, &tally);
+}
+
+/* Allocates a zeroed block and counts it.
+ * Returns the block, or NULL if memory runs out.
+ */
+void *memory_alloc(MemoryUsage *usage, size_t size)
+{
+    void *memory;
+
+    memory = calloc(1, size);
+    memory_track(usage, memory, size);
+    return memory;
+}
+
+/* Frees a block allocated with memory_alloc().
+ */
+void memory_free(MemoryUsage *usage, void *memory, size_t size)
+{
+    memory_release(usage, memory, size);
+    free(memory);
+}
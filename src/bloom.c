@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include "bloom.h"
+
+/* Odd multipliers that derive the bit of each word from one hash */
+static const uint32_t bloom_salt[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+    0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+/* Hashes a key with 64-bit FNV-1a and a final avalanche, so that both
+ * halves of the result are well mixed.
+ */
+static uint64_t bloom_hash(const char *key)
+{
+    uint64_t hash;
+
+    hash = 14695981039346656037ull;
+    while (*key)
+    {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Returns the block a hash selects: the high half scaled to the block
+ * count, which avoids a division.
+ */
+static uint32_t bloom_block(uint64_t hash)
+{
+    return (uint32_t)(((hash >> 32) * BLOOM_BLOCKS) >> 32);
+}
+
+/* Allocates an empty filter.
+ * Returns the filter, or NULL if memory runs out.
+ */
+uint32_t *bloom_create(void)
+{
+    return calloc(BLOOM_WORDS, sizeof(uint32_t));
+}
+
+void bloom_add(uint32_t *filter, const char *key)
+{
+    uint32_t *block;
+    uint64_t hash;
+    int iter;
+
+    hash = bloom_hash(key);
+    block = filter + bloom_block(hash) * BLOOM_BLOCK_WORDS;
+    for (iter = 0; iter < BLOOM_BLOCK_WORDS; iter++)
+    {
+        block[iter] |= UINT32_C(1) << (((uint32_t)hash * bloom_salt[iter]) >> 27);
+    }
+}
+
+/* Returns 0 if the key was certainly never added, 1 if it may have been.
+ */
+int bloom_may_contain(const uint32_t *filter, const char *key)
+{
+    const uint32_t *block;
+    uint64_t hash;
+    int iter;
+
+    hash = bloom_hash(key);
+    block = filter + bloom_block(hash) * BLOOM_BLOCK_WORDS;
+    for (iter = 0; iter < BLOOM_BLOCK_WORDS; iter++)
+    {
+        if ((block[iter] & (UINT32_C(1) << (((uint32_t)hash * bloom_salt[iter]) >> 27))) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "output.h"
+
+/* Hash chains of a new cache. */
+#define INITIAL_BUCKETS 256
+
+static uint32_t hash_key(const char *key)
+{
+    uint32_t hash;
+
+    hash = 2166136261u;
+    while (*key != '\0')
+    {
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+/* Bytes an entry counts against the capacity. */
+static size_t entry_size(const CacheEntry *entry)
+{
+    return sizeof(CacheEntry) + strlen(entry->key) + 1 + entry->length;
+}
+
+/* Creates the result cache with the capacity SIMPLEDB_RESULT_CACHE_MB
+ * asks for.
+ * Returns NULL if the cache is turned off or memory runs out.
+ */
+ResultCache *create_result_cache(void)
+{
+    ResultCache *cache;
+    const char *setting;
+    double megabytes;
+
+    setting = getenv(RESULT_CACHE_ENV);
+    megabytes = DEFAULT_RESULT_CACHE_MB;
+    if (setting != NULL && *setting != '\0')
+    {
+        megabytes = atof(setting);
+    }
+    if (megabytes <= 0)
+    {
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(ResultCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->buckets = calloc(INITIAL_BUCKETS, sizeof(CacheEntry*));
+    if (cache->buckets == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->bucket_count = INITIAL_BUCKETS;
+    cache->capacity = (size_t)(megabytes * 1024 * 1024);
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+static void free_entry(CacheEntry *entry)
+{
+    free(entry->key);
+    free(entry->text);
+    free(entry);
+}
+
+/* Drops a reference to an entry, freeing it with the last one.
+ * The caller holds the cache lock.
+ */
+static void release_entry(CacheEntry *entry)
+{
+    if (--entry->refcount == 0)
+    {
+        free_entry(entry);
+    }
+}
+
+void free_result_cache(ResultCache *cache)
+{
+    CacheEntry *entry;
+    CacheEntry *older;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (entry = cache->newest; entry != NULL; entry = older)
+    {
+        older = entry->older;
+        free_entry(entry);
+    }
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/* Returns the most bytes of output a SELECT may print for its result to
+ * be cached, or 0 if there is no cache.
+ */
+size_t cache_entry_limit(const ResultCache *cache)
+{
+    return cache != NULL ? cache->capacity / RESULT_CACHE_ENTRY_SHARE : 0;
+}
+
+/* Finds the entry for a key. The caller holds the cache lock.
+ */
+static CacheEntry *find_entry(ResultCache *cache, const char *key, uint32_t hash)
+{
+    CacheEntry *entry;
+
+    for (entry = cache->buckets[hash % cache->bucket_count]; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Takes an entry out of its hash chain and the recency list and drops
+ * the cache's reference to it. The caller holds the cache lock.
+ */
+static void remove_entry(ResultCache *cache, CacheEntry *entry)
+{
+    CacheEntry **link;
+
+    link = &cache->buckets[entry->hash % cache->bucket_count];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    if (entry->newer != NULL)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        cache->newest = entry->older;
+    }
+    if (entry->older != NULL)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        cache->oldest = entry->newer;
+    }
+    cache->size -= entry_size(entry);
+    cache->entry_count--;
+    release_entry(entry);
+}
+
+/* Puts an entry at the front of the recency list. The caller holds the
+ * cache lock.
+ */
+static void push_newest(ResultCache *cache, CacheEntry *entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL)
+    {
+        cache->newest->newer = entry;
+    }
+    else
+    {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/* Doubles the hash chains. If memory runs out the chains just grow
+ * longer. The caller holds the cache lock.
+ */
+static void grow_buckets(ResultCache *cache)
+{
+    CacheEntry **buckets;
+    CacheEntry *entry;
+    CacheEntry *next;
+    int count;
+    int iter;
+
+    count = cache->bucket_count * 2;
+    buckets = calloc(count, sizeof(CacheEntry*));
+    if (buckets == NULL)
+    {
+        return;
+    }
+    for (iter = 0; iter < cache->bucket_count; iter++)
+    {
+        for (entry = cache->buckets[iter]; entry != NULL; entry = next)
+        {
+            next = entry->next;
+            entry->next = buckets[entry->hash % count];
+            buckets[entry->hash % count] = entry;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+}
+
+/* Writes the cached result of a statement to the current output, if
+ * there is one read from the table state the stamp names. The text is
+ * written outside the lock, while a reference keeps the entry alive.
+ * Returns 0 on a hit, -1 on a miss.
+ */
+int cache_fetch(ResultCache *cache, const char *key, uint64_t stamp, int64_t *rows)
+{
+    CacheEntry *entry;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = find_entry(cache, key, hash_key(key));
+    if (entry == NULL || entry->stamp != stamp)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    if (entry != cache->newest)
+    {
+        entry->newer->older = entry->older;
+        if (entry->older != NULL)
+        {
+            entry->older->newer = entry->newer;
+        }
+        else
+        {
+            cache->oldest = entry->newer;
+        }
+        push_newest(cache, entry);
+    }
+    entry->refcount++;
+    *rows = entry->rows;
+    pthread_mutex_unlock(&cache->lock);
+
+    output_write(entry->text, entry->length);
+
+    pthread_mutex_lock(&cache->lock);
+    release_entry(entry);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+/* Caches the result of a statement read from the table state the stamp
+ * names, replacing any older result of the same statement and evicting
+ * the least recently used ones to make room. Results too large for the
+ * cache, or that memory cannot be found for, are not cached.
+ */
+void cache_store(ResultCache *cache, const char *key, uint64_t stamp, const char *text, size_t length, int64_t rows)
+{
+    CacheEntry *entry;
+    CacheEntry *existing;
+
+    if (sizeof(CacheEntry) + strlen(key) + 1 + length > cache_entry_limit(cache))
+    {
+        return;
+    }
+    entry = calloc(1, sizeof(CacheEntry));
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->key = strdup(key);
+    entry->text = malloc(length > 0 ? length : 1);
+    if (entry->key == NULL || entry->text == NULL)
+    {
+        free_entry(entry);
+        return;
+    }
+    memcpy(entry->text, text, length);
+    entry->length = length;
+    entry->hash = hash_key(key);
+    entry->stamp = stamp;
+    entry->rows = rows;
+    entry->refcount = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    existing = find_entry(cache, key, entry->hash);
+    if (existing != NULL)
+    {
+        remove_entry(cache, existing);
+    }
+    entry->next = cache->buckets[entry->hash % cache->bucket_count];
+    cache->buckets[entry->hash % cache->bucket_count] = entry;
+    push_newest(cache, entry);
+    cache->size += entry_size(entry);
+    cache->entry_count++;
+    while (cache->size > cache->capacity && cache->oldest != entry)
+    {
+        remove_entry(cache, cache->oldest);
+    }
+    if (cache->entry_count > cache->bucket_count)
+    {
+        grow_buckets(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "linenoise.h"
+#include "db.h"
+#include "protocol.h"
+#include "server.h"
+
+/* Queries a piped-in script sends before reading their responses. */
+#define PIPELINE_DEPTH 256
+
+/* Sends all bytes of a buffer.
+ * Returns 0 on success, -1 if the connection failed.
+ */
+static int send_all(int fd, const char *data, size_t length)
+{
+    ssize_t sent;
+
+    while (length > 0)
+    {
+        sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* Reads from the connection until a whole frame is buffered and moves it
+ * into response, without its header.
+ * Returns 0 on success, -1 if the connection failed.
+ */
+static int receive_frame(int fd, ByteBuffer *in, ByteBuffer *response)
+{
+    size_t length;
+    ssize_t got;
+
+    while (!frame_next(in->data, in->length, &length))
+    {
+        if (buffer_reserve(in, 65536) != 0)
+        {
+            return -1;
+        }
+        got = recv(fd, in->data + in->length, 65536, 0);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return -1;
+        }
+        in->length += got;
+    }
+
+    response->length = 0;
+    if (buffer_append(response, in->data + FRAME_HEADER_SIZE, length) != 0)
+    {
+        return -1;
+    }
+    memmove(in->data, in->data + FRAME_HEADER_SIZE + length, in->length - FRAME_HEADER_SIZE - length);
+    in->length -= FRAME_HEADER_SIZE + length;
+    return 0;
+}
+
+/* Sends the queries queued in request, then reads and prints their
+ * responses. After the last queries the sending side is shut down, so
+ * the server knows nothing more is coming.
+ * Returns 0 on success, -1 if the connection failed.
+ */
+static int flush_pipeline(int fd, ByteBuffer *request, int count, int last, ByteBuffer *in, ByteBuffer *response)
+{
+    if (request->length > 0 && send_all(fd, request->data, request->length) != 0)
+    {
+        return -1;
+    }
+    if (last && shutdown(fd, SHUT_WR) != 0)
+    {
+        return -1;
+    }
+    request->length = 0;
+    for (; count > 0; count--)
+    {
+        if (receive_frame(fd, in, response) != 0)
+        {
+            return -1;
+        }
+        if (response->length > 0)
+        {
+            fwrite(response->data, 1, response->length, stdout);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* Runs queries read from a non-interactive stdin, one per line. Up to
+ * PIPELINE_DEPTH of them are sent at once, which the server runs as a
+ * batch, instead of waiting for each response in turn.
+ * Returns 0 at the end of input or EXIT, -1 if the connection failed.
+ */
+static int run_script(int fd, ByteBuffer *request, ByteBuffer *in, ByteBuffer *response)
+{
+    char *line;
+    char *query;
+    size_t size;
+    int count;
+
+    line = NULL;
+    size = 0;
+    count = 0;
+    while (getline(&line, &size, stdin) >= 0)
+    {
+        query = trim_whitespace(line);
+        if (strcmp(query, "EXIT") == 0)
+        {
+            break;
+        }
+        if (strlen(query) == 0)
+        {
+            continue;
+        }
+        if (frame_append(request, query, strlen(query)) != 0)
+        {
+            free(line);
+            return -1;
+        }
+        count++;
+        if (count == PIPELINE_DEPTH)
+        {
+            if (flush_pipeline(fd, request, count, 0, in, response) != 0)
+            {
+                free(line);
+                return -1;
+            }
+            count = 0;
+        }
+    }
+    free(line);
+    return flush_pipeline(fd, request, count, 1, in, response);
+}
+
+/* Runs an interactive prompt against a server: each query is sent as one
+ * frame and the response frame printed as it arrives. Piped-in queries
+ * are pipelined instead.
+ * Returns 0 when the user exits, -1 if the connection failed.
+ */
+int run_client(const char *address)
+{
+    ByteBuffer request;
+    ByteBuffer in;
+    ByteBuffer response;
+    char *query;
+    int status;
+    int fd;
+
+    fd = open_connection(address);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    memset(&request, 0, sizeof(ByteBuffer));
+    memset(&in, 0, sizeof(ByteBuffer));
+    memset(&response, 0, sizeof(ByteBuffer));
+
+    if (!isatty(STDIN_FILENO))
+    {
+        status = run_script(fd, &request, &in, &response);
+        if (status != 0)
+        {
+            printf("Error: Connection to '%s' lost.\n", address);
+        }
+        buffer_free(&request);
+        buffer_free(&in);
+        buffer_free(&response);
+        close(fd);
+        return status;
+    }
+
+    printf("Connected to '%s'.\n\n", address);
+
+    status = 0;
+    while (1)
+    {
+        query = linenoise("Enter SQL query: ");
+        if (!query)
+        {
+            break;
+        }
+
+        trim_whitespace(query);
+
+        if (strcmp(query, "EXIT") == 0)
+        {
+            free(query);
+            break;
+        }
+
+        if (strlen(query) > 0)
+        {
+            request.length = 0;
+            if (frame_append(&request, query, strlen(query)) != 0 ||
+                send_all(fd, request.data, request.length) != 0 ||
+                receive_frame(fd, &in, &response) != 0)
+            {
+                printf("Error: Connection to '%s' lost.\n", address);
+                free(query);
+                status = -1;
+                break;
+            }
+            if (response.length > 0)
+            {
+                fwrite(response.data, 1, response.length, stdout);
+                fflush(stdout);
+            }
+            linenoiseHistoryAdd(query);
+        }
+
+        free(query);
+    }
+
+    buffer_free(&request);
+    buffer_free(&in);
+    buffer_free(&response);
+    close(fd);
+    return status;
+}
@@ -0,0 +1,145 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_HAVE_ARMV8 1
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78u
+
+typedef uint32_t (*Crc32cFunc)(uint32_t crc, const unsigned char *data, size_t length);
+
+static uint32_t table[8][256];
+static Crc32cFunc crc32c_impl = NULL;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Software fallback: slicing-by-8, consuming eight bytes per step
+ * through eight lookup tables.
+ */
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t word;
+
+    while (length >= 8)
+    {
+        memcpy(&word, data, sizeof(uint64_t));
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^
+              table[6][(word >> 8) & 0xFF] ^
+              table[5][(word >> 16) & 0xFF] ^
+              table[4][(word >> 24) & 0xFF] ^
+              table[3][(word >> 32) & 0xFF] ^
+              table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^
+              table[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0)
+    {
+        crc = table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+/* SSE4.2 CRC32 instruction, eight bytes at a time. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+#if defined(__x86_64__)
+    uint64_t crc64;
+    uint64_t word;
+
+    crc64 = crc;
+    while (length >= 8)
+    {
+        memcpy(&word, data, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_HAVE_ARMV8
+/* ARMv8 CRC32C instructions, eight bytes at a time. */
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t word;
+
+    while (length >= 8)
+    {
+        memcpy(&word, data, sizeof(uint64_t));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+/* Builds the lookup tables and picks the fastest implementation the
+ * CPU supports.
+ */
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int byte;
+    int bit;
+    int slice;
+
+    for (byte = 0; byte < 256; byte++)
+    {
+        crc = (uint32_t)byte;
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][byte] = crc;
+    }
+    for (byte = 0; byte < 256; byte++)
+    {
+        for (slice = 1; slice < 8; slice++)
+        {
+            table[slice][byte] = table[0][table[slice - 1][byte] & 0xFF] ^ (table[slice - 1][byte] >> 8);
+        }
+    }
+
+    crc32c_impl = crc32c_soft;
+#ifdef CRC32C_HAVE_SSE42
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_impl = crc32c_sse42;
+    }
+#endif
+#ifdef CRC32C_HAVE_ARMV8
+    crc32c_impl = crc32c_armv8;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, data, length);
+}
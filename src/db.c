@@ -2,41 +2,43 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include "cache.h"
 #include "db.h"
-
-/* Writes a string to a file.
- * The string is preceded by its length (including the null terminator).
- */
-static void write_string(FILE *file, const char *str)
+#include "output.h"
+#include "pool.h"
+#include "metrics.h"
+#include "query.h"
+#include "slowlog.h"
+#include "timer.h"
+#include "transaction.h"
+#include "wal.h"
+#include "workload.h"
+
+/* A table is compacted once at least 1/COMPACT_FRACTION of its rows are deleted. */
+#define COMPACT_FRACTION 4
+
+/* Work of one column during compaction. */
+typedef struct CompactTask
 {
-    int len;
-
-    len = (int)strlen(str) + 1;
-    fwrite(&len, sizeof(int), 1, file);
-    fwrite(str, sizeof(char), len, file);
-}
+    const TableSnapshot *snapshot;
+    int column;
+    Segment *segments; /* Rebuilt segment list of live cells */
+    MemoryTally dead;  /* Deleted cells left behind */
+} CompactTask;
 
-/* Reads a string from a file that was written using write_string.
- * Returns a pointer to the heap-allocated string, or NULL on failure.
+/* Parses a string as a number.
+ * Returns 1 and stores the value if the whole string is numeric.
  */
-static char *read_string(FILE *file)
+int parse_number(const char *str, double *value)
 {
-    int len;
-    char *str;
-
-    if (fread(&len, sizeof(int), 1, file) != 1)
-    {
-        return NULL;
-    }
+    char *end;
 
-    str = malloc(len);
-    if (str == NULL)
+    if (*str == '\0')
     {
-        return NULL;
+        return 0;
     }
-
-    fread(str, sizeof(char), len, file);
-    return str;
+    *value = strtod(str, &end);
+    return *end == '\0';
 }
 
 /* Trims leading and trailing whitespace from a string in place.
@@ -69,6 +71,21 @@ char *trim_whitespace(char *str)
     return str;
 }
 
+/* Hashes a table, column or view name with 32-bit FNV-1a. Names keep
+ * their hash, so a lookup compares names only when the hashes match.
+ */
+uint32_t hash_name(const char *name)
+{
+    uint32_t hash;
+
+    hash = 2166136261u;
+    while (*name != '\0')
+    {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
 /* Validates if the provided string is in valid IPv4 format.
  * Returns 1 if valid, 0 otherwise.
  */
@@ -121,51 +138,70 @@ Database *create_db(void)
     db = malloc(sizeof(Database));
     if (db == NULL)
     {
-        printf("Failed to allocate memory for DB.\n");
+        output_printf("Failed to allocate memory for DB.\n");
         return NULL;
     }
 
     db->tables = NULL;
     db->table_count = 0;
+    db->log = create_commit_log(DB_LOG_FILE);
+    if (db->log == NULL)
+    {
+        output_printf("Failed to allocate memory for DB.\n");
+        free(db);
+        return NULL;
+    }
+    db->cache = create_result_cache();
+    pthread_rwlock_init(&db->lock, NULL);
+    pthread_mutex_init(&db->gate, NULL);
     return db;
 }
 
+/* Frees a table together with its columns and cell data.
+ * Tolerates partially constructed tables.
+ */
+static void free_table(Table *table)
+{
+    int iter;
+    Column *currColumn;
+
+    free_views(table);
+    free_table_storage(table);
+    for (iter = 0; iter < table->column_count && table->columns != NULL; iter++)
+    {
+        currColumn = table->columns[iter];
+        if (currColumn == NULL)
+        {
+            continue;
+        }
+        free(currColumn->name);
+        free(currColumn);
+    }
+    free(table->columns);
+    free(table->name);
+    free(table);
+}
+
 /* Frees all memory associated with the Database.
  */
 void free_database(Database *db)
 {
-    int iter1;
-    int iter2;
-    int row;
-    Table *currTable;
-    Column *currColumn;
+    int iter;
 
     if (db == NULL)
     {
         return;
     }
 
-    for (iter1 = 0; iter1 < db->table_count; iter1++)
+    for (iter = 0; iter < db->table_count; iter++)
     {
-        currTable = db->tables[iter1];
-        free(currTable->name);
-
-        for (iter2 = 0; iter2 < currTable->column_count; iter2++)
-        {
-            currColumn = currTable->columns[iter2];
-            free(currColumn->name);
-
-            for (row = 0; row < currTable->row_count; row++)
-            {
-                free(currColumn->data[row]);
-            }
-            free(currColumn->data);
-            free(currColumn);
-        }
-        free(currTable->columns);
-        free(currTable);
+        free_table(db->tables[iter]);
     }
     free(db->tables);
+    free_commit_log(db->log);
+    free_result_cache(db->cache);
+    pthread_rwlock_destroy(&db->lock);
+    pthread_mutex_destroy(&db->gate);
     free(db);
 }
 
@@ -174,11 +210,13 @@ void free_database(Database *db)
  */
 Table *find_table(Database *db, const char *table_name)
 {
+    uint32_t hash;
     int iter;
 
+    hash = hash_name(table_name);
     for (iter = 0; iter < db->table_count; iter++)
     {
-        if (strcmp(db->tables[iter]->name, table_name) == 0)
+        if (db->tables[iter]->name_hash == hash && strcmp(db->tables[iter]->name, table_name) == 0)
         {
             return db->tables[iter];
         }
@@ -186,6 +224,25 @@ Table *find_table(Database *db, const char *table_name)
     return NULL;
 }
 
+/* Searches for a column by name in the Table.
+ * Returns the column index if found, or -1 otherwise.
+ */
+int find_column(Table *table, const char *column_name)
+{
+    uint32_t hash;
+    int iter;
+
+    hash = hash_name(column_name);
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        if (table->columns[iter]->name_hash == hash && strcmp(table->columns[iter]->name, column_name) == 0)
+        {
+            return iter;
+        }
+    }
+    return -1;
+}
+
 /* Creates a new table with the given name and comma-separated column definitions.
  */
 void create_table(Database *db, const char *table_name, const char *columns_str)
@@ -193,451 +250,810 @@ void create_table(Database *db, const char *table_name, const char *columns_str)
     Table *table;
     char *cols_copy;
     char *token;
+    char *saveptr;
     Column *col;
 
     if (find_table(db, table_name) != NULL)
     {
-        printf("Error: Table '%s' already exists.\n", table_name);
+        output_printf("Error: Table '%s' already exists.\n", table_name);
+        return;
+    }
+    if (find_view(db, table_name) != NULL)
+    {
+        output_printf("Error: View '%s' already exists.\n", table_name);
         return;
     }
 
-    table = malloc(sizeof(Table));
+    table = calloc(1, sizeof(Table));
     if (table == NULL)
     {
-        printf("Error: Memory allocation failed for table '%s'.\n", table_name);
+        output_printf("Error: Memory allocation failed for table '%s'.\n", table_name);
         return;
     }
     table->name = strdup(table_name);
-    table->row_count = 0;
-    table->column_count = 0;
-    table->columns = NULL;
+    table->name_hash = hash_name(table_name);
 
     cols_copy = strdup(columns_str);
     if (cols_copy == NULL)
     {
-        printf("Error: Memory allocation failed for columns copy.\n");
+        output_printf("Error: Memory allocation failed for columns copy.\n");
         free(table);
         return;
     }
 
-    token = strtok(cols_copy, ",");
+    token = strtok_r(cols_copy, ",", &saveptr);
     while (token != NULL)
     {
         token = trim_whitespace(token);
-        col = malloc(sizeof(Column));
+        col = calloc(1, sizeof(Column));
         if (col == NULL)
         {
-            printf("Error: Memory allocation failed for column '%s'.\n", token);
+            output_printf("Error: Memory allocation failed for column '%s'.\n", token);
             free(cols_copy);
             return;
         }
         col->name = strdup(token);
-        col->data = NULL;
+        col->name_hash = hash_name(token);
+        col->ipv4 = strcmp(token, IPV4_COLUMN) == 0;
 
         table->columns = realloc(table->columns, sizeof(Column*) * (table->column_count + 1));
         if (table->columns == NULL)
         {
-            printf("Error: Memory allocation failed while adding column '%s'.\n", token);
+            output_printf("Error: Memory allocation failed while adding column '%s'.\n", token);
             free(col->name);
             free(col);
             free(cols_copy);
             return;
         }
         table->columns[table->column_count++] = col;
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
     free(cols_copy);
 
     if (table->column_count == 0)
     {
-        printf("Error: No columns defined for table '%s'.\n", table_name);
+        output_printf("Error: No columns defined for table '%s'.\n", table_name);
         free(table->name);
         free(table);
         return;
     }
 
+    if (init_table_storage(table, 0) != 0)
+    {
+        output_printf("Error: Memory allocation failed for table '%s'.\n", table_name);
+        free_table(table);
+        return;
+    }
+
     db->tables = realloc(db->tables, sizeof(Table*) * (db->table_count + 1));
     if (db->tables == NULL)
     {
-        printf("Error: Memory allocation failed while adding table '%s'.\n", table_name);
+        output_printf("Error: Memory allocation failed while adding table '%s'.\n", table_name);
         free_database(db);
         exit(EXIT_FAILURE);
     }
     db->tables[db->table_count++] = table;
 
-    printf("Table '%s' with %d columns created successfully.\n", table->name, table->column_count);
+    output_printf("Table '%s' with %d columns created successfully.\n", table->name, table->column_count);
 }
 
-/* Inserts a new row into the specified table using comma-separated values.
+/* Splits comma-separated values into a row of the table, validating
+ * IPv4 columns. Reports problems itself.
+ * Returns the row's cells, one per column, or NULL on failure.
  */
-void insert_into_table(Database *db, const char *table_name, const char *values_str)
+char **parse_values(Table *table, const char *values_str)
 {
-    Table *table;
-    Column *column;
     int iter;
     int column_index;
     char *vals_copy;
     char *token;
+    char *saveptr;
     char **values;
 
-    table = find_table(db, table_name);
-    if (table == NULL)
-    {
-        printf("Error: Table '%s' does not exist.\n", table_name);
-        return;
-    }
-
     vals_copy = strdup(values_str);
     if (vals_copy == NULL)
     {
-        printf("Error: Memory allocation failed for values copy.\n");
-        return;
+        output_printf("Error: Memory allocation failed for values copy.\n");
+        return NULL;
     }
 
-    token = strtok(vals_copy, ",");
+    token = strtok_r(vals_copy, ",", &saveptr);
     column_index = 0;
     values = malloc(sizeof(char*) * table->column_count);
     if (values == NULL)
     {
-        printf("Error: Memory allocation failed for values array.\n");
+        output_printf("Error: Memory allocation failed for values array.\n");
         free(vals_copy);
-        return;
+        return NULL;
     }
 
     while (token != NULL && column_index < table->column_count)
     {
         token = trim_whitespace(token);
         /* Validate IPv4 address if required */
-        if (strcmp(table->columns[column_index]->name, "IPv4") == 0)
+        if (table->columns[column_index]->ipv4)
         {
             if (!validate_ipv4_address(token))
             {
-                printf("Error: Invalid IPv4 address '%s'.\n", token);
+                output_printf("Error: Invalid IPv4 address '%s'.\n", token);
                 free(vals_copy);
                 for (iter = 0; iter < column_index; iter++)
                 {
                     free(values[iter]);
                 }
                 free(values);
-                return;
+                return NULL;
             }
         }
         values[column_index++] = strdup(token);
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
     free(vals_copy);
 
     if (column_index != table->column_count)
     {
-        printf("Error: Column count mismatch for table '%s'.\n", table_name);
+        output_printf("Error: Column count mismatch for table '%s'.\n", table->name);
         for (iter = 0; iter < column_index; iter++)
         {
             free(values[iter]);
         }
         free(values);
-        return;
+        return NULL;
     }
+    return values;
+}
 
+/* Writes rows, given cell by cell and row by row, past the row count of
+ * a table locked with lock_table() that has room for them (see
+ * reserve_rows()). The table takes over the cells. Readers see none of
+ * the rows before publish_appends().
+ */
+void stage_rows(Append *append, char **cells, int64_t count)
+{
+    TableSnapshot *snapshot;
+    Table *table;
+    MemoryTally tally;
+    Cell *cell;
+    int64_t row;
+    int segment;
+    int iter;
+
+    snapshot = &append->snapshot;
+    table = snapshot->table;
+    append->first_row = snapshot->row_count;
+    append->previous_stamp = snapshot->stamp;
+
+    /* The new rows lie past every pinned row count, so they can be
+     * written in place and then made visible by bumping the row count.
+     * Scans only consult the zone maps and Bloom filters of segments they
+     * see full, so a segment is sealed with its filter before that.
+     */
     for (iter = 0; iter < table->column_count; iter++)
     {
-        column = table->columns[iter];
-        column->data = realloc(column->data, sizeof(char*) * (table->row_count + 1));
-        if (column->data == NULL)
+        memset(&tally, 0, sizeof(MemoryTally));
+        for (row = 0; row < count; row++)
         {
-            printf("Error: Memory allocation failed while inserting row.\n");
-            free(values);
-            return;
+            segment = (snapshot->row_count + row) >> SEGMENT_SHIFT;
+            cell = cell_at(snapshot->version, iter, snapshot->row_count + row);
+            adopt_cell(cell, cells[(size_t)row * table->column_count + iter]);
+            widen_zone(&snapshot->version->segments[iter][segment]->zone, cell_text(cell));
+            tally_cell(&tally, cell, 1);
         }
-        column->data[table->row_count] = values[iter];
+        memory_add(&table->columns[iter]->memory, &tally);
     }
-    free(values);
-    table->row_count++;
-    printf("Row inserted into table '%s'.\n", table_name);
+    for (segment = snapshot->row_count >> SEGMENT_SHIFT; segment < (snapshot->row_count + count) >> SEGMENT_SHIFT; segment++)
+    {
+        for (iter = 0; iter < table->column_count; iter++)
+        {
+            if (table->columns[iter]->bloom)
+            {
+                build_bloom(&table->columns[iter]->memory, snapshot->version->segments[iter][segment]);
+            }
+        }
+    }
+    snapshot->row_count += count;
 }
 
-/* Displays the contents of the specified table.
+/* Makes the rows staged in one or more locked tables visible to readers,
+ * all at once, and then folds them into the tables' materialized views.
+ * The snapshots are kept current, so they can take further appends.
  */
-void select_from_table(Database *db, const char *table_name)
+void publish_appends(Append *appends, int count)
+{
+    int iter;
+
+    publish_rows(appends, count);
+    for (iter = 0; iter < count; iter++)
+    {
+        metrics_add(COUNTER_ROWS_INSERTED, appends[iter].snapshot.row_count - appends[iter].first_row);
+        timer_count(0, 0, 0, appends[iter].snapshot.row_count - appends[iter].first_row);
+        update_views(&appends[iter].snapshot, appends[iter].first_row, appends[iter].previous_stamp);
+    }
+}
+
+/* Appends rows, given cell by cell and row by row, to a table locked
+ * with lock_table(). The table takes over the cells. All rows become
+ * visible to readers at once, and are then folded into the table's
+ * materialized views. The snapshot is kept current, so it can take
+ * further appends.
+ * Returns 0 on success, -1 if memory runs out; the cells then still
+ * belong to the caller.
+ */
+int append_rows(TableSnapshot *snapshot, char **cells, int64_t count)
+{
+    Append append;
+
+    if (reserve_rows(snapshot, count) != 0)
+    {
+        return -1;
+    }
+    append.snapshot = *snapshot;
+    stage_rows(&append, cells, count);
+    publish_appends(&append, 1);
+    *snapshot = append.snapshot;
+    return 0;
+}
+
+/* Inserts a new row into the specified table using comma-separated values.
+ */
+void insert_into_table(Database *db, const char *table_name, const char *values_str)
 {
     Table *table;
+    TableSnapshot snapshot;
     int iter;
-    int column;
-    int row;
+    char **values;
 
     table = find_table(db, table_name);
     if (table == NULL)
     {
-        printf("Error: Table '%s' does not exist.\n", table_name);
+        output_printf("Error: Table '%s' does not exist.\n", table_name);
         return;
     }
 
-    printf("Table: %s\n", table->name);
-    for (iter = 0; iter < table->column_count; iter++)
+    values = parse_values(table, values_str);
+    if (values == NULL)
     {
-        printf("%s\t", table->columns[iter]->name);
+        return;
     }
-    printf("\n");
 
-    for (row = 0; row < table->row_count; row++)
+    lock_table(table, &snapshot);
+    if (append_rows(&snapshot, values, 1) != 0)
     {
-        for (column = 0; column < table->column_count; column++)
+        unlock_table(&snapshot);
+        output_printf("Error: Memory allocation failed while inserting row.\n");
+        for (iter = 0; iter < table->column_count; iter++)
         {
-            printf("%s\t", table->columns[column]->data[row]);
+            free(values[iter]);
         }
-        printf("\n");
+        free(values);
+        return;
     }
+    unlock_table(&snapshot);
+
+    free(values);
+    output_printf("Row inserted into table '%s'.\n", table_name);
 }
 
-/* Saves the database to a binary file.
+/* Pool task: gathers the live cells of one column into new segments,
+ * with zone maps that cover only the live cells.
  */
-void save_database_to_file(Database *db, const char *filename)
+static void compact_column(void *arg)
 {
-    FILE *file;
-    Table *table;
-    Column *col;
-    int iter1;
-    int iter2;
-    int row;
+    CompactTask *task;
+    Segment segment;
+    const Cell *cell;
+    int64_t live;
+    int64_t row;
+
+    task = arg;
+    live = 0;
+    for (row = 0; row < task->snapshot->row_count; row++)
+    {
+        cell = cell_at(task->snapshot->version, task->column, row);
+        if (row_is_deleted(task->snapshot, row))
+        {
+            tally_cell(&task->dead, cell, 1);
+        }
+        else
+        {
+            segment = task->segments[live >> SEGMENT_SHIFT];
+            segment->cells[live & SEGMENT_MASK] = *cell;
+            widen_zone(&segment->zone, cell_text(cell));
+            live++;
+        }
+    }
+    if (task->snapshot->table->columns[task->column]->bloom)
+    {
+        for (row = 0; row < live >> SEGMENT_SHIFT; row++)
+        {
+            build_bloom(&task->snapshot->table->columns[task->column]->memory, task->segments[row]);
+        }
+    }
+}
+
+/* Physically removes deleted rows of a locked table once they make up
+ * at least 1/COMPACT_FRACTION of it. Every column is rewritten into new
+ * segments on the thread pool and published as a new version without
+ * bitmaps. Readers that still pin the old version keep its segments and
+ * the deleted cells until they unpin it.
+ */
+void compact_table(Table *table)
+{
+    TableSnapshot snapshot;
+    TableVersion *version;
+    TableVersion *old;
+    ThreadPool *pool;
+    TaskGroup group;
+    CompactTask *tasks;
+    int64_t live;
+    int64_t row;
+    int segment_count;
+    int capacity;
+    int iter;
+    int segment;
+
+    snapshot.table = table;
+    snapshot.version = table->current;
+    snapshot.row_count = table->row_count;
+    snapshot.deleted_count = table->deleted_count;
+    if (snapshot.deleted_count == 0 || snapshot.deleted_count * COMPACT_FRACTION < snapshot.row_count)
+    {
+        return;
+    }
 
-    file = fopen(filename, "wb");
-    if (file == NULL)
+    old = snapshot.version;
+    live = snapshot.row_count - snapshot.deleted_count;
+    segment_count = segments_for_rows(live);
+    capacity = old->segment_capacity;
+    version = copy_version(table);
+    tasks = calloc(table->column_count, sizeof(CompactTask));
+    if (version == NULL || tasks == NULL)
     {
-        printf("Error: Could not open file '%s' for writing.\n", filename);
+        free(version != NULL ? version->segments : NULL);
+        free(version);
+        free(tasks);
         return;
     }
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        tasks[iter].snapshot = &snapshot;
+        tasks[iter].column = iter;
+        tasks[iter].segments = alloc_segment_list(&table->columns[iter]->memory, live, capacity);
+        if (tasks[iter].segments == NULL)
+        {
+            /* Not enough memory to compact; keep the tombstones */
+            while (--iter >= 0)
+            {
+                free_segment_list(&table->columns[iter]->memory, tasks[iter].segments, segment_count);
+            }
+            free(tasks);
+            free(version->segments);
+            free(version);
+            return;
+        }
+    }
 
-    fwrite(&db->table_count, sizeof(int), 1, file);
-    for (iter1 = 0; iter1 < db->table_count; iter1++)
+    pool = pool_shared();
+    task_group_init(&group);
+    for (iter = 0; iter < table->column_count; iter++)
     {
-        table = db->tables[iter1];
-        write_string(file, table->name);
-        fwrite(&table->column_count, sizeof(int), 1, file);
-        fwrite(&table->row_count, sizeof(int), 1, file);
+        pool_submit(pool, &group, compact_column, &tasks[iter]);
+    }
+    pool_wait(pool, &group);
 
-        for (iter2 = 0; iter2 < table->column_count; iter2++)
+    for (row = 0; row < snapshot.row_count; row++)
+    {
+        if (row_is_deleted(&snapshot, row))
         {
-            col = table->columns[iter2];
-            write_string(file, col->name);
-            for (row = 0; row < table->row_count; row++)
+            for (iter = 0; iter < table->column_count; iter++)
             {
-                write_string(file, col->data[row]);
+                retire_memory(old, cell_heap(cell_at(old, iter, row)));
             }
         }
     }
-    fclose(file);
-    printf("Database saved to '%s'.\n", filename);
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        for (segment = 0; segment < old->segment_count; segment++)
+        {
+            retire_segment(old, &table->columns[iter]->memory, old->segments[iter][segment]);
+        }
+        retire_memory(old, old->segments[iter]);
+        memory_subtract(&table->columns[iter]->memory, &tasks[iter].dead);
+        version->segments[iter] = tasks[iter].segments;
+    }
+    for (segment = 0; segment < old->segment_count; segment++)
+    {
+        memory_release(&table->memory, old->deleted[segment], SEGMENT_WORDS * sizeof(uint64_t));
+        retire_memory(old, old->deleted[segment]);
+    }
+    retire_memory(old, old->deleted);
+    version->deleted = NULL;
+    version->segment_count = segment_count;
+    free(tasks);
+    publish_version(table, version, live, 0);
 }
 
-/* Loads a database from a binary file.
- * Frees the current database and returns a new one loaded from the file.
+/* Gives a column a Bloom filter per full segment, which lets equality
+ * predicates on text skip the segments that cannot hold the value. The
+ * catalog is locked exclusively, so the current version's segments can
+ * be changed in place.
  */
-Database *load_database_from_file(Database *db, const char *filename)
+void create_bloom_filter(Database *db, const char *table_name, const char *column_name)
 {
-    FILE *file;
-    Database *new_db;
     Table *table;
-    Column *col;
-    int table_count;
-    int iter1;
-    int iter2;
-    int row;
-    char *cell;
+    TableVersion *version;
+    int column;
+    int segment;
 
-    file = fopen(filename, "rb");
-    if (file == NULL)
+    table = find_table(db, table_name);
+    if (table == NULL)
     {
-        printf("Error: Could not open file '%s' for reading.\n", filename);
-        return db;
+        output_printf("Error: Table '%s' does not exist.\n", table_name);
+        return;
+    }
+    column = find_column(table, column_name);
+    if (column < 0)
+    {
+        output_printf("Error: Column '%s' does not exist in table '%s'.\n", column_name, table_name);
+        return;
+    }
+    if (table->columns[column]->bloom)
+    {
+        output_printf("Error: Column '%s' already has a Bloom filter.\n", column_name);
+        return;
     }
 
-    free_database(db);
-    new_db = create_db();
-    if (new_db == NULL)
+    table->columns[column]->bloom = 1;
+    version = table->current;
+    for (segment = 0; segment < table->row_count >> SEGMENT_SHIFT; segment++)
     {
-        fclose(file);
-        return NULL;
+        build_bloom(&table->columns[column]->memory, version->segments[column][segment]);
     }
+    output_printf("Bloom filter created on '%s.%s'.\n", table_name, column_name);
+}
+
+/* Adds the counters of a MemoryUsage to a tally.
+ */
+static void tally_usage(MemoryTally *tally, MemoryUsage *usage)
+{
+    tally->payload += atomic_load_explicit(&usage->payload, memory_order_relaxed);
+    tally->metadata += atomic_load_explicit(&usage->metadata, memory_order_relaxed);
+    tally->overhead += atomic_load_explicit(&usage->overhead, memory_order_relaxed);
+}
+
+static void add_tally(MemoryTally *dst, const MemoryTally *src)
+{
+    dst->payload += src->payload;
+    dst->metadata += src->metadata;
+    dst->overhead += src->overhead;
+}
 
-    table_count = 0;
-    fread(&table_count, sizeof(int), 1, file);
-    for (iter1 = 0; iter1 < table_count; iter1++)
+static void print_usage(const char *table_name, const char *column_name, const MemoryTally *tally)
+{
+    output_printf("%s\t%s\t%lld\t%lld\t%lld\t%lld\t\n", table_name, column_name, (long long)tally->payload,
+                  (long long)tally->metadata, (long long)tally->overhead,
+                  (long long)(tally->payload + tally->metadata + tally->overhead));
+}
+
+/* Prints the memory one table holds, column by column, and adds it to
+ * a total. Cells, segments, Bloom filters and bitmaps are counted as
+ * they are allocated and retired; the structures of the current version
+ * are measured here. Versions that readers still pin are not counted.
+ */
+static void print_table_usage(Table *table, MemoryTally *total)
+{
+    TableSnapshot snapshot;
+    TableVersion *version;
+    MemoryTally column;
+    MemoryTally table_total;
+    MemoryTally own;
+    int iter;
+
+    pin_table(table, &snapshot);
+    version = snapshot.version;
+    memset(&table_total, 0, sizeof(MemoryTally));
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        memset(&column, 0, sizeof(MemoryTally));
+        tally_usage(&column, &table->columns[iter]->memory);
+        tally_block(&column, table->columns[iter], sizeof(Column));
+        tally_block(&column, table->columns[iter]->name, strlen(table->columns[iter]->name) + 1);
+        tally_block(&column, version->segments[iter], sizeof(Segment) * version->segment_capacity);
+        print_usage(table->name, table->columns[iter]->name, &column);
+        add_tally(&table_total, &column);
+    }
+
+    memset(&own, 0, sizeof(MemoryTally));
+    tally_usage(&own, &table->memory);
+    tally_block(&own, table, sizeof(Table));
+    tally_block(&own, table->name, strlen(table->name) + 1);
+    tally_block(&own, table->columns, sizeof(Column*) * table->column_count);
+    tally_block(&own, version, sizeof(TableVersion));
+    tally_block(&own, version->segments, sizeof(Segment*) * table->column_count);
+    tally_block(&own, version->deleted, sizeof(uint64_t*) * version->segment_capacity);
+    /* A writer grows the retired list of the version it replaces. */
+    pthread_mutex_lock(&table->write_lock);
+    tally_block(&own, version->retired, sizeof(void*) * version->retired_capacity);
+    pthread_mutex_unlock(&table->write_lock);
+    print_usage(table->name, "-", &own);
+    add_tally(&table_total, &own);
+    unpin_table(&snapshot);
+
+    print_usage(table->name, "*", &table_total);
+    add_tally(total, &table_total);
+}
+
+/* Reports the memory held by one table, or by every table and the
+ * database as a whole, split into cell text (payload), the structures
+ * around it (metadata) and what the allocator adds (overhead):
+ *   STATS [table]
+ */
+void show_stats(Database *db, const char *table_name)
+{
+    MemoryTally total;
+    Table *table;
+    int iter;
+
+    table = NULL;
+    if (table_name != NULL)
     {
-        table = malloc(sizeof(Table));
+        table = find_table(db, table_name);
         if (table == NULL)
         {
-            printf("Error: Memory allocation failed while loading table.\n");
-            continue;
+            output_printf("Error: Table '%s' does not exist.\n", table_name);
+            return;
         }
+    }
 
-        table->name = read_string(file);
-        fread(&table->column_count, sizeof(int), 1, file);
-        fread(&table->row_count, sizeof(int), 1, file);
-        table->columns = NULL;
+    memset(&total, 0, sizeof(MemoryTally));
+    output_printf("Table\tColumn\tPayload\tMetadata\tOverhead\tTotal\t\n");
+    if (table != NULL)
+    {
+        print_table_usage(table, &total);
+        return;
+    }
+    for (iter = 0; iter < db->table_count; iter++)
+    {
+        print_table_usage(db->tables[iter], &total);
+    }
+    tally_block(&total, db, sizeof(Database));
+    tally_block(&total, db->tables, sizeof(Table*) * db->table_count);
+    print_usage("*", "*", &total);
+}
 
-        for (iter2 = 0; iter2 < table->column_count; iter2++)
-        {
-            col = malloc(sizeof(Column));
-            if (col == NULL)
-            {
-                printf("Error: Memory allocation failed while loading column.\n");
-                continue;
-            }
-            col->name = read_string(file);
-            col->data = NULL;
+/* Displays the contents of the specified table.
+ */
+void select_from_table(Database *db, const char *table_name)
+{
+    SelectQuery query;
 
-            for (row = 0; row < table->row_count; row++)
-            {
-                cell = read_string(file);
-                col->data = realloc(col->data, sizeof(char*) * (row + 1));
-                if (col->data == NULL)
-                {
-                    printf("Error: Memory allocation failed while loading row data.\n");
-                    free(cell);
-                    continue;
-                }
-                col->data[row] = cell;
-            }
-            table->columns = realloc(table->columns, sizeof(Column*) * (iter2 + 1));
-            if (table->columns == NULL)
-            {
-                printf("Error: Memory allocation failed while loading columns array.\n");
-                free(col);
-                continue;
-            }
-            table->columns[iter2] = col;
-        }
-        new_db->tables = realloc(new_db->tables, sizeof(Table*) * (iter1 + 1));
-        if (new_db->tables == NULL)
-        {
-            printf("Error: Memory allocation failed while adding table to database.\n");
-            free(table);
-            continue;
-        }
-        new_db->tables[iter1] = table;
-        new_db->table_count++;
+    memset(&query, 0, sizeof(SelectQuery));
+    query.table_name = strdup(table_name);
+    query.all_columns = 1;
+    query.group_column = -1;
+
+    if (plan_select(db, &query) == 0)
+    {
+        execute_select(&query);
     }
-    fclose(file);
-    printf("Database loaded from '%s'.\n", filename);
-    return new_db;
+    free_select(&query);
 }
 
-/* Parses and executes a query string.
- * Supported commands: CREATE TABLE, INSERT INTO, SELECT, SAVE, LOAD.
+/* Executes a query string with the catalog locked.
  */
-Database *parse_query(Database *db, const char *query)
+static Database *execute_query(Database *db, Session *session, const char *query)
 {
     char query_copy[MAX_QUERY_LENGTH];
+    char *saveptr;
     char *command;
     char *next_token;
     char *table_name;
     char *columns;
     char *closing_paren;
     char *values;
+    char *list;
 
     strncpy(query_copy, query, MAX_QUERY_LENGTH - 1);
     query_copy[MAX_QUERY_LENGTH - 1] = '\0';
 
-    command = strtok(query_copy, " ");
+    command = strtok_r(query_copy, " ", &saveptr);
     if (command == NULL)
     {
-        printf("Error: Empty query.\n");
+        output_printf("Error: Empty query.\n");
+        return db;
+    }
+
+    /* A transaction only buffers appends; statements that change rows
+     * in place or replace tables have to wait for COMMIT or ROLLBACK.
+     */
+    if (session->transaction != NULL &&
+        (strcmp(command, "CREATE") == 0 || strcmp(command, "DELETE") == 0 ||
+         strcmp(command, "UPDATE") == 0 || strcmp(command, "LOAD") == 0))
+    {
+        output_printf("Error: %s is not supported inside a transaction.\n", command);
         return db;
     }
 
-    if (strcmp(command, "CREATE") == 0)
+    if (strcmp(command, "BEGIN") == 0)
     {
-        next_token = strtok(NULL, " ");
+        begin_transaction(session);
+    }
+    else if (strcmp(command, "COMMIT") == 0)
+    {
+        commit_transaction(db, session);
+    }
+    else if (strcmp(command, "ROLLBACK") == 0)
+    {
+        rollback_transaction(session);
+    }
+    else if (strcmp(command, "CREATE") == 0)
+    {
+        next_token = strtok_r(NULL, " ", &saveptr);
+        if (next_token != NULL && strcmp(next_token, "MATERIALIZED") == 0)
+        {
+            create_view(db, query);
+            return db;
+        }
+        if (next_token != NULL && strcmp(next_token, "BLOOM") == 0)
+        {
+            next_token = strtok_r(NULL, " ", &saveptr);
+            if (next_token == NULL || strcmp(next_token, "FILTER") != 0 ||
+                (next_token = strtok_r(NULL, " ", &saveptr)) == NULL || strcmp(next_token, "ON") != 0)
+            {
+                output_printf("Error: Invalid CREATE BLOOM FILTER syntax.\n");
+                return db;
+            }
+            table_name = strtok_r(NULL, " (", &saveptr);
+            columns = strtok_r(NULL, " ()", &saveptr);
+            if (table_name == NULL || columns == NULL)
+            {
+                output_printf("Error: Invalid CREATE BLOOM FILTER syntax.\n");
+                return db;
+            }
+            create_bloom_filter(db, table_name, columns);
+            return db;
+        }
         if (next_token == NULL || strcmp(next_token, "TABLE") != 0)
         {
-            printf("Error: Invalid CREATE TABLE syntax.\n");
+            output_printf("Error: Invalid CREATE TABLE syntax.\n");
             return db;
         }
 
-        table_name = strtok(NULL, " ");
+        table_name = strtok_r(NULL, " ", &saveptr);
         if (table_name == NULL)
         {
-            printf("Error: Table name is missing.\n");
+            output_printf("Error: Table name is missing.\n");
             return db;
         }
 
         columns = strchr(query, '(');
         if (columns == NULL)
         {
-            printf("Error: Missing column definitions.\n");
+            output_printf("Error: Missing column definitions.\n");
             return db;
         }
         columns++;
         closing_paren = strchr(columns, ')');
         if (closing_paren == NULL)
         {
-            printf("Error: Missing closing parenthesis in column definitions.\n");
+            output_printf("Error: Missing closing parenthesis in column definitions.\n");
+            return db;
+        }
+        /* Copy the list out rather than cutting the query short, which
+         * the slow-query log still has to record as it was sent.
+         */
+        list = strndup(columns, closing_paren - columns);
+        if (list == NULL)
+        {
+            output_printf("Error: Memory allocation failed for column definitions.\n");
             return db;
         }
-        *closing_paren = '\0';
 
-        columns = trim_whitespace(columns);
+        columns = trim_whitespace(list);
         if (strlen(columns) == 0)
         {
-            printf("Error: No columns defined for table '%s'.\n", table_name);
-            return db;
+            output_printf("Error: No columns defined for table '%s'.\n", table_name);
         }
-        create_table(db, table_name, columns);
+        else
+        {
+            create_table(db, table_name, columns);
+        }
+        free(list);
     }
     else if (strcmp(command, "INSERT") == 0)
     {
-        next_token = strtok(NULL, " ");
+        next_token = strtok_r(NULL, " ", &saveptr);
         if (next_token == NULL || strcmp(next_token, "INTO") != 0)
         {
-            printf("Error: Invalid INSERT INTO syntax.\n");
+            output_printf("Error: Invalid INSERT INTO syntax.\n");
             return db;
         }
 
-        table_name = strtok(NULL, " ");
+        table_name = strtok_r(NULL, " ", &saveptr);
         if (table_name == NULL)
         {
-            printf("Error: Table name is missing.\n");
+            output_printf("Error: Table name is missing.\n");
             return db;
         }
 
         values = strchr(query, '(');
         if (values == NULL)
         {
-            printf("Error: Missing values.\n");
+            output_printf("Error: Missing values.\n");
             return db;
         }
         values++;
         closing_paren = strchr(values, ')');
         if (closing_paren == NULL)
         {
-            printf("Error: Missing closing parenthesis in values.\n");
+            output_printf("Error: Missing closing parenthesis in values.\n");
+            return db;
+        }
+        list = strndup(values, closing_paren - values);
+        if (list == NULL)
+        {
+            output_printf("Error: Memory allocation failed for values.\n");
             return db;
         }
-        *closing_paren = '\0';
 
-        values = trim_whitespace(values);
+        values = trim_whitespace(list);
         if (strlen(values) == 0)
         {
-            printf("Error: No values provided for table '%s'.\n", table_name);
-            return db;
+            output_printf("Error: No values provided for table '%s'.\n", table_name);
+        }
+        else if (session->transaction != NULL)
+        {
+            queue_insert(db, session, table_name, values);
         }
-        insert_into_table(db, table_name, values);
+        else
+        {
+            insert_into_table(db, table_name, values);
+        }
+        free(list);
     }
     else if (strcmp(command, "SELECT") == 0)
     {
-        /* Expected syntax: SELECT * FROM table_name */
-        strtok(NULL, " ");  /* Skip '*' */
-        strtok(NULL, " ");  /* Skip 'FROM' */
-        table_name = strtok(NULL, " ");
-        if (table_name == NULL)
-        {
-            printf("Error: Table name is missing in SELECT query.\n");
-            return db;
-        }
-        select_from_table(db, table_name);
+        run_select(db, query);
+    }
+    else if (strcmp(command, "EXPLAIN") == 0)
+    {
+        explain_select(db, query);
+    }
+    else if (strcmp(command, "STATS") == 0)
+    {
+        show_stats(db, strtok_r(NULL, " ", &saveptr));
+    }
+    else if (strcmp(command, "METRICS") == 0)
+    {
+        print_metrics();
+    }
+    else if (strcmp(command, "DELETE") == 0)
+    {
+        run_delete(db, query);
+    }
+    else if (strcmp(command, "UPDATE") == 0)
+    {
+        run_update(db, query);
     }
     else if (strcmp(command, "SAVE") == 0)
     {
-        save_database_to_file(db, DB_FILE);
+        next_token = strtok_r(NULL, " ", &saveptr);
+        if (next_token == NULL)
+        {
+            save_database_to_file(db, DB_FILE);
+        }
+        else if (strcmp(next_token, "ASYNC") == 0)
+        {
+            save_database_in_background(db, DB_FILE);
+        }
+        else if (strcmp(next_token, "STATUS") == 0)
+        {
+            report_background_save(1);
+        }
+        else
+        {
+            output_printf("Error: Invalid SAVE syntax.\n");
+        }
     }
     else if (strcmp(command, "LOAD") == 0)
     {
@@ -645,8 +1061,99 @@ Database *parse_query(Database *db, const char *query)
     }
     else
     {
-        printf("Error: Unsupported query.\n");
+        output_printf("Error: Unsupported query.\n");
+    }
+
+    return db;
+}
+
+/* Runs a command that sets an option of the session rather than
+ * querying the database:
+ *   .timer on|off
+ */
+static void run_dot_command(Session *session, const char *command)
+{
+    if (strcmp(command, ".timer on") == 0)
+    {
+        session->timer = 1;
+    }
+    else if (strcmp(command, ".timer off") == 0)
+    {
+        session->timer = 0;
+    }
+    else if (strncmp(command, ".timer", 6) == 0)
+    {
+        output_printf("Error: Invalid .timer syntax, expected .timer on or .timer off.\n");
+    }
+    else
+    {
+        output_printf("Error: Unsupported command '%s'.\n", command);
+    }
+}
+
+/* Parses and executes a query string on behalf of a session.
+ * Supported commands: CREATE TABLE, CREATE BLOOM FILTER, CREATE MATERIALIZED VIEW, INSERT INTO,
+ * SELECT, UPDATE, DELETE FROM, SAVE [ASYNC|STATUS], LOAD, BEGIN, COMMIT, ROLLBACK, EXPLAIN ANALYZE,
+ * STATS, METRICS, .timer on|off.
+ * Queries may run concurrently from several threads. CREATE TABLE, CREATE
+ * MATERIALIZED VIEW and LOAD change the catalog, and CREATE BLOOM FILTER changes segments
+ * in place, so they run alone; every other query shares the catalog and
+ * synchronizes per table.
+ * Every statement is written to the workload being recorded, if any,
+ * and timed into the metrics; with .timer on the session is also told
+ * how long it took in each phase. Slow statements are queued for the
+ * slow-query log, with their plans described while they are planned.
+ */
+Database *parse_query(Database *db, Session *session, const char *query)
+{
+    StatementTimer timer;
+    StatementTimer *previous;
+    char plan[PLAN_LENGTH];
+    int64_t total;
+
+    while (isspace((unsigned char)*query))
+    {
+        query++;
+    }
+    record_statement(session, query);
+    if (*query == '.')
+    {
+        run_dot_command(session, query);
+        return db;
+    }
+
+    timer_start(&timer);
+    if (slow_log_enabled())
+    {
+        plan[0] = '\0';
+        timer.plan = plan;
+    }
+    previous = timer_capture(&timer);
+
+    /* Passing through the gate keeps a stream of queries from starving
+     * a CREATE TABLE or LOAD that waits for the catalog.
+     */
+    pthread_mutex_lock(&db->gate);
+    if (strncmp(query, "CREATE ", 7) == 0 || strcmp(query, "LOAD") == 0 || strncmp(query, "LOAD ", 5) == 0)
+    {
+        pthread_rwlock_wrlock(&db->lock);
+        pthread_mutex_unlock(&db->gate);
+    }
+    else
+    {
+        pthread_mutex_unlock(&db->gate);
+        pthread_rwlock_rdlock(&db->lock);
     }
+    db = execute_query(db, session, query);
+    pthread_rwlock_unlock(&db->lock);
 
+    total = monotonic_ns() - timer.start;
+    metrics_observe(statement_histogram(query), total);
+    log_slow_query(query, &timer, total);
+    if (session->timer)
+    {
+        timer_report(&timer);
+    }
+    timer_capture(previous);
     return db;
 }
@@ -0,0 +1,702 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "encoding.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* Chunks whose plain form is smaller than this are not worth an LZ pass. */
+#define LZ_MIN_INPUT 64
+
+/* Makes room for at least extra more bytes.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int buffer_reserve(ByteBuffer *buffer, size_t extra)
+{
+    size_t capacity;
+    char *grown;
+
+    if (buffer->length + extra <= buffer->capacity)
+    {
+        return 0;
+    }
+
+    capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+    while (capacity < buffer->length + extra)
+    {
+        capacity *= 2;
+    }
+    grown = realloc(buffer->data, capacity);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/* Appends bytes to the buffer.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int buffer_append(ByteBuffer *buffer, const void *bytes, size_t length)
+{
+    if (buffer_reserve(buffer, length) != 0)
+    {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+    return 0;
+}
+
+void buffer_free(ByteBuffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+/* Parses a cell that is an integer in canonical form, i.e. one that
+ * prints back to exactly the same text. Only such cells may be stored
+ * as numbers without changing what SELECT shows after a reload.
+ * Returns 1 and stores the value on success, 0 otherwise.
+ */
+static int parse_canonical_int(const char *str, int64_t *value)
+{
+    const char *ptr;
+    uint64_t magnitude;
+    uint64_t limit;
+    int negative;
+
+    ptr = str;
+    negative = (*ptr == '-');
+    if (negative)
+    {
+        ptr++;
+    }
+    if (*ptr < '0' || *ptr > '9' || (*ptr == '0' && (ptr[1] != '\0' || negative)))
+    {
+        return 0;
+    }
+
+    limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    magnitude = 0;
+    while (*ptr >= '0' && *ptr <= '9')
+    {
+        if (magnitude > (limit - (*ptr - '0')) / 10)
+        {
+            return 0;
+        }
+        magnitude = magnitude * 10 + (*ptr - '0');
+        ptr++;
+    }
+    if (*ptr != '\0')
+    {
+        return 0;
+    }
+
+    *value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+    return 1;
+}
+
+/* Writes the decimal form of a value into buf, which must hold 21 bytes.
+ * Returns the number of characters written, excluding the terminator.
+ */
+static int format_int(int64_t value, char *buf)
+{
+    char digits[20];
+    uint64_t magnitude;
+    int count;
+    int len;
+
+    len = 0;
+    magnitude = (uint64_t)value;
+    if (value < 0)
+    {
+        buf[len++] = '-';
+        magnitude = 0 - magnitude;
+    }
+
+    count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    while (count > 0)
+    {
+        buf[len++] = digits[--count];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/* Returns 1 if two cells hold the same text, 0 otherwise.
+ */
+static int same_cell(const Cell *a, const Cell *b)
+{
+    return a->length == b->length && memcmp(cell_text(a), cell_text(b), a->length) == 0;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Encodes integers as the first value followed by the zigzag-encoded
+ * differences of consecutive values, each packed into width bits.
+ * Sorted ids and small counters need only a few bits per row.
+ */
+static int encode_delta(const int64_t *values, int count, ByteBuffer *out)
+{
+    unsigned __int128 acc;
+    uint64_t highest;
+    uint64_t delta;
+    unsigned char width;
+    unsigned char byte;
+    int bits;
+    int iter;
+
+    highest = 0;
+    for (iter = 1; iter < count; iter++)
+    {
+        highest |= zigzag((int64_t)((uint64_t)values[iter] - (uint64_t)values[iter - 1]));
+    }
+    width = highest == 0 ? 0 : (unsigned char)(64 - __builtin_clzll(highest));
+
+    if (buffer_append(out, &values[0], sizeof(int64_t)) != 0 ||
+        buffer_append(out, &width, 1) != 0 ||
+        buffer_reserve(out, ((size_t)(count - 1) * width + 7) / 8) != 0)
+    {
+        return -1;
+    }
+
+    acc = 0;
+    bits = 0;
+    for (iter = 1; iter < count && width > 0; iter++)
+    {
+        delta = zigzag((int64_t)((uint64_t)values[iter] - (uint64_t)values[iter - 1]));
+        acc |= (unsigned __int128)delta << bits;
+        bits += width;
+        while (bits >= 8)
+        {
+            byte = (unsigned char)acc;
+            out->data[out->length++] = (char)byte;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0)
+    {
+        out->data[out->length++] = (char)(unsigned char)acc;
+    }
+    return 0;
+}
+
+static int decode_delta(const char *payload, size_t size, Cell *cells, int count)
+{
+    const unsigned char *packed;
+    unsigned __int128 acc;
+    uint64_t mask;
+    int64_t value;
+    unsigned char width;
+    char text[21];
+    size_t pos;
+    int bits;
+    int len;
+    int row;
+
+    if (size < sizeof(int64_t) + 1)
+    {
+        return -1;
+    }
+    memcpy(&value, payload, sizeof(int64_t));
+    width = (unsigned char)payload[sizeof(int64_t)];
+    if (width > 64 || size != sizeof(int64_t) + 1 + ((size_t)(count - 1) * width + 7) / 8)
+    {
+        return -1;
+    }
+
+    packed = (const unsigned char *)payload + sizeof(int64_t) + 1;
+    mask = width == 64 ? UINT64_MAX : (((uint64_t)1 << width) - 1);
+    acc = 0;
+    bits = 0;
+    pos = 0;
+    for (row = 0; row < count; row++)
+    {
+        if (row > 0 && width > 0)
+        {
+            while (bits < width)
+            {
+                acc |= (unsigned __int128)packed[pos++] << bits;
+                bits += 8;
+            }
+            value = (int64_t)((uint64_t)value + (uint64_t)unzigzag((uint64_t)acc & mask));
+            acc >>= width;
+            bits -= width;
+        }
+
+        len = format_int(value, text);
+        if (store_cell(&cells[row], text, len) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int encode_rle(Cell *cells, int count, ByteBuffer *out)
+{
+    int run;
+    int row;
+
+    for (row = 0; row < count; row += run)
+    {
+        run = 1;
+        while (row + run < count && same_cell(&cells[row + run], &cells[row]))
+        {
+            run++;
+        }
+        if (buffer_append(out, &run, sizeof(int)) != 0 ||
+            buffer_append(out, cell_text(&cells[row]), cells[row].length + 1) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_rle(const char *payload, size_t size, Cell *cells, int count)
+{
+    const char *end;
+    size_t pos;
+    size_t len;
+    int run;
+    int row;
+
+    pos = 0;
+    row = 0;
+    while (row < count)
+    {
+        if (size - pos < sizeof(int))
+        {
+            return -1;
+        }
+        memcpy(&run, payload + pos, sizeof(int));
+        pos += sizeof(int);
+        end = memchr(payload + pos, '\0', size - pos);
+        if (run < 1 || run > count - row || end == NULL)
+        {
+            return -1;
+        }
+        len = end - (payload + pos);
+        while (run-- > 0)
+        {
+            if (store_cell(&cells[row++], payload + pos, len) != 0)
+            {
+                return -1;
+            }
+        }
+        pos += len + 1;
+    }
+    return pos == size ? 0 : -1;
+}
+
+static int encode_plain(Cell *cells, int count, ByteBuffer *out)
+{
+    int row;
+
+    for (row = 0; row < count; row++)
+    {
+        if (buffer_append(out, cell_text(&cells[row]), cells[row].length + 1) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_plain(const char *payload, size_t size, Cell *cells, int count)
+{
+    const char *end;
+    size_t pos;
+    size_t len;
+    int row;
+
+    pos = 0;
+    for (row = 0; row < count; row++)
+    {
+        end = memchr(payload + pos, '\0', size - pos);
+        if (end == NULL)
+        {
+            return -1;
+        }
+        len = end - (payload + pos);
+        if (store_cell(&cells[row], payload + pos, len) != 0)
+        {
+            return -1;
+        }
+        pos += len + 1;
+    }
+    return pos == size ? 0 : -1;
+}
+
+static void write_length(ByteBuffer *out, size_t length)
+{
+    while (length >= 255)
+    {
+        out->data[out->length++] = (char)255;
+        length -= 255;
+    }
+    out->data[out->length++] = (char)length;
+}
+
+/* Emits one LZ sequence: a token holding the literal and match lengths,
+ * the literals, then the match offset. The final sequence of a block
+ * carries literals only.
+ */
+static int emit_sequence(ByteBuffer *out, const unsigned char *literals, size_t literal_length,
+                         int offset, size_t match_length)
+{
+    unsigned char token;
+    uint16_t offset16;
+
+    if (buffer_reserve(out, 1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1) != 0)
+    {
+        return -1;
+    }
+
+    token = (unsigned char)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (offset > 0)
+    {
+        token |= (unsigned char)(match_length - LZ_MIN_MATCH >= 15 ? 15 : match_length - LZ_MIN_MATCH);
+    }
+    out->data[out->length++] = (char)token;
+    if (literal_length >= 15)
+    {
+        write_length(out, literal_length - 15);
+    }
+    memcpy(out->data + out->length, literals, literal_length);
+    out->length += literal_length;
+
+    if (offset > 0)
+    {
+        offset16 = (uint16_t)offset;
+        memcpy(out->data + out->length, &offset16, sizeof(uint16_t));
+        out->length += sizeof(uint16_t);
+        if (match_length - LZ_MIN_MATCH >= 15)
+        {
+            write_length(out, match_length - LZ_MIN_MATCH - 15);
+        }
+    }
+    return 0;
+}
+
+/* Compresses src with a greedy LZ77 coder in the spirit of LZ4: a hash
+ * of the next four bytes finds an earlier occurrence, matches are stored
+ * as offset and length, everything else as literals.
+ */
+static int lz_compress(const unsigned char *src, size_t size, ByteBuffer *out)
+{
+    int table[1 << LZ_HASH_BITS];
+    uint32_t sequence;
+    uint32_t candidate_sequence;
+    size_t anchor;
+    size_t pos;
+    size_t length;
+    int candidate;
+    int slot;
+
+    memset(table, 0, sizeof(table));
+    anchor = 0;
+    pos = 0;
+    while (size >= LZ_MIN_MATCH && pos <= size - LZ_MIN_MATCH)
+    {
+        memcpy(&sequence, src + pos, sizeof(uint32_t));
+        slot = (int)((sequence * 2654435761u) >> (32 - LZ_HASH_BITS));
+        candidate = table[slot] - 1;
+        table[slot] = (int)pos + 1;
+
+        if (candidate >= 0 && pos - candidate <= LZ_MAX_OFFSET)
+        {
+            memcpy(&candidate_sequence, src + candidate, sizeof(uint32_t));
+            if (candidate_sequence == sequence)
+            {
+                length = LZ_MIN_MATCH;
+                while (pos + length < size && src[candidate + length] == src[pos + length])
+                {
+                    length++;
+                }
+                if (emit_sequence(out, src + anchor, pos - anchor, (int)(pos - candidate), length) != 0)
+                {
+                    return -1;
+                }
+                pos += length;
+                anchor = pos;
+                continue;
+            }
+        }
+        pos++;
+    }
+    return emit_sequence(out, src + anchor, size - anchor, 0, 0);
+}
+
+/* Reads an extended length that follows a saturated token nibble.
+ * Returns -1 if the input ends early.
+ */
+static int read_length(const unsigned char *src, size_t size, size_t *pos, size_t *length)
+{
+    unsigned char byte;
+
+    do
+    {
+        if (*pos >= size)
+        {
+            return -1;
+        }
+        byte = src[(*pos)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/* Decompresses an LZ block into exactly dst_size bytes.
+ * Returns 0 on success, -1 if the block is malformed.
+ */
+static int lz_decompress(const unsigned char *src, size_t size, unsigned char *dst, size_t dst_size)
+{
+    size_t literal_length;
+    size_t match_length;
+    size_t offset;
+    size_t pos;
+    size_t out;
+    uint16_t offset16;
+    unsigned char token;
+
+    pos = 0;
+    out = 0;
+    while (pos < size)
+    {
+        token = src[pos++];
+        literal_length = token >> 4;
+        if (literal_length == 15 && read_length(src, size, &pos, &literal_length) != 0)
+        {
+            return -1;
+        }
+        if (literal_length > size - pos || literal_length > dst_size - out)
+        {
+            return -1;
+        }
+        memcpy(dst + out, src + pos, literal_length);
+        pos += literal_length;
+        out += literal_length;
+
+        if (pos == size)
+        {
+            break;
+        }
+
+        if (size - pos < sizeof(uint16_t))
+        {
+            return -1;
+        }
+        memcpy(&offset16, src + pos, sizeof(uint16_t));
+        pos += sizeof(uint16_t);
+        offset = offset16;
+        match_length = token & 15;
+        if (match_length == 15 && read_length(src, size, &pos, &match_length) != 0)
+        {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match_length > dst_size - out)
+        {
+            return -1;
+        }
+
+        /* Byte-wise copy so that overlapping matches repeat correctly */
+        while (match_length-- > 0)
+        {
+            dst[out] = dst[out - offset];
+            out++;
+        }
+    }
+    return out == dst_size ? 0 : -1;
+}
+
+static int decode_lz(const char *payload, size_t size, Cell *cells, int count)
+{
+    unsigned char *raw;
+    uint32_t raw_size;
+    int result;
+
+    if (size < sizeof(uint32_t))
+    {
+        return -1;
+    }
+    memcpy(&raw_size, payload, sizeof(uint32_t));
+    /* A match byte expands to at most 255 output bytes */
+    if (raw_size < (uint32_t)count || raw_size > (uint64_t)size * 255)
+    {
+        return -1;
+    }
+
+    raw = malloc(raw_size);
+    if (raw == NULL)
+    {
+        return -1;
+    }
+
+    result = lz_decompress((const unsigned char *)payload + sizeof(uint32_t), size - sizeof(uint32_t), raw, raw_size);
+    if (result == 0)
+    {
+        result = decode_plain((const char *)raw, raw_size, cells, count);
+    }
+    free(raw);
+    return result;
+}
+
+/* Encodes a chunk of cells, choosing the smallest of the encodings that
+ * apply: DELTA when every cell is a canonical integer, RLE when cells
+ * repeat in runs, LZ when the plain form compresses, PLAIN otherwise.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int encode_chunk(Cell *cells, int count, ByteBuffer *out, ChunkEncoding *encoding)
+{
+    ByteBuffer compressed;
+    int64_t *values;
+    size_t plain_size;
+    size_t rle_size;
+    uint32_t raw_size;
+    int is_integer;
+    int row;
+
+    out->length = 0;
+    plain_size = 0;
+    rle_size = 0;
+    is_integer = 1;
+    values = malloc(sizeof(int64_t) * count);
+    if (values == NULL)
+    {
+        return -1;
+    }
+
+    for (row = 0; row < count; row++)
+    {
+        plain_size += cells[row].length + 1;
+        if (row == 0 || !same_cell(&cells[row], &cells[row - 1]))
+        {
+            rle_size += sizeof(int) + cells[row].length + 1;
+        }
+        if (is_integer && !parse_canonical_int(cell_text(&cells[row]), &values[row]))
+        {
+            is_integer = 0;
+        }
+    }
+
+    if (is_integer)
+    {
+        if (encode_delta(values, count, out) != 0)
+        {
+            free(values);
+            return -1;
+        }
+        if (out->length <= rle_size && out->length <= plain_size)
+        {
+            free(values);
+            *encoding = ENCODING_DELTA;
+            return 0;
+        }
+        out->length = 0;
+    }
+    free(values);
+
+    if (plain_size >= LZ_MIN_INPUT && plain_size <= UINT32_MAX)
+    {
+        memset(&compressed, 0, sizeof(ByteBuffer));
+        raw_size = (uint32_t)plain_size;
+        if (encode_plain(cells, count, out) != 0 ||
+            buffer_append(&compressed, &raw_size, sizeof(uint32_t)) != 0 ||
+            lz_compress((const unsigned char *)out->data, plain_size, &compressed) != 0)
+        {
+            buffer_free(&compressed);
+            return -1;
+        }
+
+        if (compressed.length < plain_size && compressed.length < rle_size)
+        {
+            out->length = 0;
+            buffer_append(out, compressed.data, compressed.length);
+            buffer_free(&compressed);
+            *encoding = ENCODING_LZ;
+            return 0;
+        }
+        buffer_free(&compressed);
+
+        if (plain_size <= rle_size)
+        {
+            *encoding = ENCODING_PLAIN;
+            return 0;
+        }
+        out->length = 0;
+    }
+
+    if (rle_size < plain_size)
+    {
+        *encoding = ENCODING_RLE;
+        return encode_rle(cells, count, out);
+    }
+    *encoding = ENCODING_PLAIN;
+    return encode_plain(cells, count, out);
+}
+
+/* Decodes a chunk into cells, allocating the texts too long to keep
+ * inline. On failure every cell decoded so far is freed and cells are
+ * reset to empty. Returns 0 on success, -1 if the payload is malformed.
+ */
+int decode_chunk(ChunkEncoding encoding, const char *payload, size_t size, Cell *cells, int count)
+{
+    int result;
+    int row;
+
+    memset(cells, 0, sizeof(Cell) * count);
+    switch (encoding)
+    {
+        case ENCODING_PLAIN:
+            result = decode_plain(payload, size, cells, count);
+            break;
+        case ENCODING_RLE:
+            result = decode_rle(payload, size, cells, count);
+            break;
+        case ENCODING_DELTA:
+            result = decode_delta(payload, size, cells, count);
+            break;
+        case ENCODING_LZ:
+            result = decode_lz(payload, size, cells, count);
+            break;
+        default:
+            result = -1;
+            break;
+    }
+
+    if (result != 0)
+    {
+        for (row = 0; row < count; row++)
+        {
+            free(cell_heap(&cells[row]));
+        }
+        memset(cells, 0, sizeof(Cell) * count);
+    }
+    return result;
+}
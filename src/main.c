@@ -3,20 +3,113 @@
 #include <stdlib.h>
 #include "linenoise.h"
 #include "db.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "server.h"
+#include "slowlog.h"
+#include "transaction.h"
+#include "workload.h"
 
-int main(void)
+/* Returns the address following a --listen or --connect option, or the
+ * default address if none follows.
+ */
+static const char *option_address(int argc, char **argv, int index)
+{
+    if (index + 1 < argc && strncmp(argv[index + 1], "--", 2) != 0)
+    {
+        return argv[index + 1];
+    }
+    return DEFAULT_ADDRESS;
+}
+
+/* Replays a recorded workload:
+ *   --replay FILE [--speed N] [--snapshot FILE]
+ * Commits go to a scratch commit log and SAVE and LOAD are skipped, so
+ * the database files of the current directory are left alone.
+ * Returns 0 on success, -1 on failure.
+ */
+static int replay_workload(Database *db, int argc, char **argv)
+{
+    const char *snapshot;
+    double speed;
+    int iter;
+
+    speed = 1;
+    snapshot = NULL;
+    for (iter = 3; iter < argc; iter++)
+    {
+        if (strcmp(argv[iter], "--speed") == 0 && iter + 1 < argc && parse_number(argv[iter + 1], &speed) && speed >= 0)
+        {
+            iter++;
+        }
+        else if (strcmp(argv[iter], "--snapshot") == 0 && iter + 1 < argc)
+        {
+            snapshot = argv[++iter];
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (argc < 3 || iter < argc)
+    {
+        printf("Usage: %s --replay FILE [--speed N] [--snapshot FILE]\n", argv[0]);
+        printf("Commits go to a scratch commit log and SAVE and LOAD statements are skipped.\n");
+        return -1;
+    }
+    return run_replay(db, argv[2], speed, snapshot);
+}
+
+int main(int argc, char **argv)
 {
     char *query;
     Database *db;
-    
+    Session session;
+    int status;
+
+    if (argc > 1 && strcmp(argv[1], "--connect") == 0)
+    {
+        return run_client(option_address(argc, argv, 1)) == 0 ? 0 : 1;
+    }
+
     db = create_db();
+    session.transaction = NULL;
+    session.timer = 0;
+    session.id = 0;
+    start_metrics_dump();
+    start_slow_log();
+
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0)
+    {
+        status = replay_workload(db, argc, argv);
+        stop_metrics_dump();
+        stop_slow_log();
+        wait_for_background_save();
+        free_database(db);
+        return status == 0 ? 0 : 1;
+    }
+
+    start_recording();
+    if (argc > 1 && strcmp(argv[1], "--listen") == 0)
+    {
+        status = run_server(db, option_address(argc, argv, 1));
+        stop_recording();
+        stop_metrics_dump();
+        stop_slow_log();
+        wait_for_background_save();
+        free_database(db);
+        return status == 0 ? 0 : 1;
+    }
 
     printf("Simple SQL-like Database\n");
     printf("Copyright (c) 2025 Ivan Nikolskiy, All Rights Reserved.\n\n");
-    printf("Supported commands: CREATE TABLE, INSERT INTO, SELECT * FROM, SAVE, LOAD\n\n");
+    printf("Supported commands: CREATE TABLE, INSERT INTO, SELECT, UPDATE, DELETE FROM, SAVE [ASYNC|STATUS], LOAD,\n");
+    printf("                    BEGIN, COMMIT, ROLLBACK, CREATE BLOOM FILTER, EXPLAIN ANALYZE, STATS, METRICS,\n");
+    printf("                    CREATE MATERIALIZED VIEW, .timer on|off\n\n");
 
     while (1)
     {
+        report_background_save(0);
         query = linenoise("Enter SQL query: ");
         if (!query)
         {
@@ -33,13 +126,18 @@ int main(void)
 
         if (strlen(query) > 0)
         {
-            db = parse_query(db, query);
+            db = parse_query(db, &session, query);
             linenoiseHistoryAdd(query);
         }
 
         free(query);
     }
 
+    end_session(&session);
+    stop_recording();
+    stop_metrics_dump();
+    stop_slow_log();
+    wait_for_background_save();
     free_database(db);
     
     return 0;
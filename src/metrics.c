@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include "metrics.h"
+#include "output.h"
+
+/* Latencies are counted in HDR-style buckets: every power of two from
+ * 2^MIN_EXPONENT to 2^MAX_EXPONENT nanoseconds, about 1 us to 69 s, is
+ * split into SUB_BUCKETS linear steps, so a bucket's bounds are within
+ * 1/SUB_BUCKETS of any latency it holds. Shorter latencies go to the
+ * first bucket, longer ones to a last bucket that only +Inf covers.
+ */
+#define MIN_EXPONENT 10
+#define MAX_EXPONENT 36
+#define SUB_BUCKET_BITS 2
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((MAX_EXPONENT - MIN_EXPONENT) * SUB_BUCKETS + 1)
+
+/* Metrics recorded by one thread. Only that thread adds to them, so the
+ * relaxed atomics on the hot path never contend; exporting sums the
+ * shards of all threads.
+ */
+typedef struct MetricShard
+{
+    atomic_ullong counters[COUNTER_COUNT];
+    atomic_ullong buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+    atomic_ullong sums[HISTOGRAM_COUNT]; /* Nanoseconds observed */
+    struct MetricShard *next;            /* Never changes once registered */
+} MetricShard;
+
+/* Shard of threads whose own shard could not be allocated. */
+static MetricShard shared_shard;
+
+/* Every shard ever registered. Shards are only ever prepended, without
+ * a lock, so that registering never blocks, not even in a forked child.
+ */
+static MetricShard *_Atomic shards = &shared_shard;
+
+static __thread MetricShard *thread_shard = NULL;
+
+static const char *histogram_labels[HISTOGRAM_COUNT] = {
+    "create", "insert", "select", "update", "delete", "save", "load", "transaction", "other", "wal_sync"
+};
+
+/* Periodic dump of the metrics to a file. */
+typedef struct MetricsDump
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* Signalled to stop the dump thread */
+    int running;
+    int stop;
+    int interval;        /* Seconds between dumps */
+    char *filename;
+    pthread_t thread;
+} MetricsDump;
+
+static MetricsDump dump = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, 0};
+
+/* Returns the calling thread's shard, registering it on first use.
+ */
+static MetricShard *get_shard(void)
+{
+    MetricShard *shard;
+
+    if (thread_shard != NULL)
+    {
+        return thread_shard;
+    }
+    shard = calloc(1, sizeof(MetricShard));
+    if (shard == NULL)
+    {
+        thread_shard = &shared_shard;
+        return thread_shard;
+    }
+    shard->next = atomic_load(&shards);
+    while (!atomic_compare_exchange_weak(&shards, &shard->next, shard))
+    {
+    }
+    thread_shard = shard;
+    return shard;
+}
+
+void metrics_add(Counter counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(&get_shard()->counters[counter], value, memory_order_relaxed);
+}
+
+static int bucket_index(int64_t nanoseconds)
+{
+    uint64_t value;
+    int exponent;
+
+    if (nanoseconds < (INT64_C(1) << MIN_EXPONENT))
+    {
+        return 0;
+    }
+    value = (uint64_t)nanoseconds;
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent >= MAX_EXPONENT)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    return (exponent - MIN_EXPONENT) * SUB_BUCKETS + (int)((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Returns the upper bound of a bucket in nanoseconds.
+ */
+static uint64_t bucket_bound(int bucket)
+{
+    int exponent;
+
+    exponent = MIN_EXPONENT + bucket / SUB_BUCKETS;
+    return (UINT64_C(1) << exponent) + (uint64_t)(bucket % SUB_BUCKETS + 1) * (UINT64_C(1) << (exponent - SUB_BUCKET_BITS));
+}
+
+/* Records one latency in a histogram.
+ */
+void metrics_observe(Histogram histogram, int64_t nanoseconds)
+{
+    MetricShard *shard;
+
+    if (nanoseconds < 0)
+    {
+        nanoseconds = 0;
+    }
+    shard = get_shard();
+    atomic_fetch_add_explicit(&shard->buckets[histogram][bucket_index(nanoseconds)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->sums[histogram], (uint64_t)nanoseconds, memory_order_relaxed);
+}
+
+/* Tells whether a query starts with a keyword.
+ */
+static int starts_with(const char *query, const char *keyword)
+{
+    size_t length;
+
+    length = strlen(keyword);
+    return strncmp(query, keyword, length) == 0 && (query[length] == ' ' || query[length] == '\0');
+}
+
+/* Returns the histogram the latency of a statement goes to.
+ */
+Histogram statement_histogram(const char *query)
+{
+    if (starts_with(query, "CREATE"))
+    {
+        return HISTOGRAM_CREATE;
+    }
+    if (starts_with(query, "INSERT"))
+    {
+        return HISTOGRAM_INSERT;
+    }
+    if (starts_with(query, "SELECT"))
+    {
+        return HISTOGRAM_SELECT;
+    }
+    if (starts_with(query, "UPDATE"))
+    {
+        return HISTOGRAM_UPDATE;
+    }
+    if (starts_with(query, "DELETE"))
+    {
+        return HISTOGRAM_DELETE;
+    }
+    if (starts_with(query, "SAVE"))
+    {
+        return HISTOGRAM_SAVE;
+    }
+    if (starts_with(query, "LOAD"))
+    {
+        return HISTOGRAM_LOAD;
+    }
+    if (starts_with(query, "BEGIN") || starts_with(query, "COMMIT") || starts_with(query, "ROLLBACK"))
+    {
+        return HISTOGRAM_TRANSACTION;
+    }
+    return HISTOGRAM_OTHER;
+}
+
+/* printf() onto the end of a buffer.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int buffer_printf(ByteBuffer *out, const char *format, ...)
+{
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0 || buffer_reserve(out, (size_t)length + 1) != 0)
+    {
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(out->data + out->length, (size_t)length + 1, format, args);
+    va_end(args);
+    out->length += length;
+    return 0;
+}
+
+/* Appends one histogram in Prometheus text format. The label, if any,
+ * goes in front of the bucket bound.
+ */
+static int format_histogram(ByteBuffer *out, const char *name, const char *label, const uint64_t *buckets,
+                            uint64_t sum)
+{
+    uint64_t count;
+    int failed;
+    int iter;
+
+    count = 0;
+    failed = 0;
+    for (iter = 0; iter < HISTOGRAM_BUCKETS - 1; iter++)
+    {
+        count += buckets[iter];
+        failed |= buffer_printf(out, "%s_bucket{%sle=\"%.9g\"} %llu\n", name, label, bucket_bound(iter) / 1e9,
+                                (unsigned long long)count);
+    }
+    count += buckets[HISTOGRAM_BUCKETS - 1];
+    failed |= buffer_printf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, label, (unsigned long long)count);
+    if (*label != '\0')
+    {
+        failed |= buffer_printf(out, "%s_sum{%.*s} %.9f\n", name, (int)strlen(label) - 1, label, sum / 1e9);
+        failed |= buffer_printf(out, "%s_count{%.*s} %llu\n", name, (int)strlen(label) - 1, label,
+                                (unsigned long long)count);
+    }
+    else
+    {
+        failed |= buffer_printf(out, "%s_sum %.9f\n", name, sum / 1e9);
+        failed |= buffer_printf(out, "%s_count %llu\n", name, (unsigned long long)count);
+    }
+    return failed;
+}
+
+/* Appends every metric, summed over all threads, to a buffer in the
+ * Prometheus text exposition format.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int metrics_format(ByteBuffer *out)
+{
+    uint64_t buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t sums[HISTOGRAM_COUNT];
+    MetricShard *shard;
+    char label[64];
+    int failed;
+    int iter;
+    int bucket;
+
+    memset(counters, 0, sizeof(counters));
+    memset(sums, 0, sizeof(sums));
+    memset(buckets, 0, sizeof(buckets));
+    for (shard = atomic_load(&shards); shard != NULL; shard = shard->next)
+    {
+        for (iter = 0; iter < COUNTER_COUNT; iter++)
+        {
+            counters[iter] += atomic_load_explicit(&shard->counters[iter], memory_order_relaxed);
+        }
+        for (iter = 0; iter < HISTOGRAM_COUNT; iter++)
+        {
+            sums[iter] += atomic_load_explicit(&shard->sums[iter], memory_order_relaxed);
+            for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+            {
+                buckets[iter][bucket] += atomic_load_explicit(&shard->buckets[iter][bucket], memory_order_relaxed);
+            }
+        }
+    }
+
+    failed = buffer_printf(out,
+                           "# HELP simpledb_rows_scanned_total Live rows read by scans.\n"
+                           "# TYPE simpledb_rows_scanned_total counter\n"
+                           "simpledb_rows_scanned_total %llu\n"
+                           "# HELP simpledb_segments_skipped_total Segments ruled out by zone maps or Bloom filters.\n"
+                           "# TYPE simpledb_segments_skipped_total counter\n"
+                           "simpledb_segments_skipped_total %llu\n"
+                           "# HELP simpledb_rows_inserted_total Rows appended to tables.\n"
+                           "# TYPE simpledb_rows_inserted_total counter\n"
+                           "simpledb_rows_inserted_total %llu\n"
+                           "# HELP simpledb_bytes_written_total Bytes written to the database file and the commit log.\n"
+                           "# TYPE simpledb_bytes_written_total counter\n"
+                           "simpledb_bytes_written_total{file=\"database\"} %llu\n"
+                           "simpledb_bytes_written_total{file=\"wal\"} %llu\n"
+                           "# HELP simpledb_result_cache_lookups_total SELECTs looked up in the result cache.\n"
+                           "# TYPE simpledb_result_cache_lookups_total counter\n"
+                           "simpledb_result_cache_lookups_total{result=\"hit\"} %llu\n"
+                           "simpledb_result_cache_lookups_total{result=\"miss\"} %llu\n",
+                           (unsigned long long)counters[COUNTER_ROWS_SCANNED],
+                           (unsigned long long)counters[COUNTER_SEGMENTS_SKIPPED],
+                           (unsigned long long)counters[COUNTER_ROWS_INSERTED],
+                           (unsigned long long)counters[COUNTER_SAVE_BYTES],
+                           (unsigned long long)counters[COUNTER_WAL_BYTES],
+                           (unsigned long long)counters[COUNTER_CACHE_HITS],
+                           (unsigned long long)counters[COUNTER_CACHE_MISSES]);
+
+    failed |= buffer_printf(out,
+                            "# HELP simpledb_statement_duration_seconds Time statements took, by kind.\n"
+                            "# TYPE simpledb_statement_duration_seconds histogram\n");
+    for (iter = 0; iter < HISTOGRAM_WAL_SYNC; iter++)
+    {
+        snprintf(label, sizeof(label), "type=\"%s\",", histogram_labels[iter]);
+        failed |= format_histogram(out, "simpledb_statement_duration_seconds", label, buckets[iter], sums[iter]);
+    }
+    failed |= buffer_printf(out,
+                            "# HELP simpledb_wal_sync_duration_seconds Time the commit log took to sync to disk.\n"
+                            "# TYPE simpledb_wal_sync_duration_seconds histogram\n");
+    failed |= format_histogram(out, "simpledb_wal_sync_duration_seconds", "", buckets[HISTOGRAM_WAL_SYNC],
+                               sums[HISTOGRAM_WAL_SYNC]);
+    return failed ? -1 : 0;
+}
+
+/* Prints the metrics in Prometheus text format:
+ *   METRICS
+ */
+void print_metrics(void)
+{
+    ByteBuffer out;
+
+    memset(&out, 0, sizeof(ByteBuffer));
+    if (metrics_format(&out) != 0)
+    {
+        output_printf("Error: Memory allocation failed for metrics.\n");
+    }
+    else
+    {
+        output_write(out.data, out.length);
+    }
+    buffer_free(&out);
+}
+
+/* Writes the metrics to a file under a temporary name and renames it
+ * into place, so a scraper never reads half a file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int write_metrics_file(const char *filename)
+{
+    char temp_name[PATH_MAX];
+    ByteBuffer out;
+    FILE *file;
+    int failed;
+
+    memset(&out, 0, sizeof(ByteBuffer));
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+    failed = metrics_format(&out) != 0;
+    if (!failed)
+    {
+        file = fopen(temp_name, "wb");
+        failed = file == NULL;
+        if (file != NULL)
+        {
+            failed = fwrite(out.data, 1, out.length, file) != out.length;
+            failed |= fclose(file) != 0;
+        }
+        failed = failed || rename(temp_name, filename) != 0;
+    }
+    buffer_free(&out);
+    return failed ? -1 : 0;
+}
+
+/* Thread that writes the metrics file every interval until stopped.
+ * A failure is reported once, not on every attempt.
+ */
+static void *dump_thread(void *arg)
+{
+    struct timespec deadline;
+    int reported;
+
+    (void)arg;
+    reported = 0;
+    pthread_mutex_lock(&dump.lock);
+    while (!dump.stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += dump.interval;
+        while (!dump.stop && pthread_cond_timedwait(&dump.wake, &dump.lock, &deadline) == 0)
+        {
+        }
+        pthread_mutex_unlock(&dump.lock);
+        if (write_metrics_file(dump.filename) != 0 && !reported)
+        {
+            output_printf("Error: Could not write metrics to '%s'.\n", dump.filename);
+            reported = 1;
+        }
+        pthread_mutex_lock(&dump.lock);
+    }
+    pthread_mutex_unlock(&dump.lock);
+    return NULL;
+}
+
+/* Starts writing the metrics to the file named by SIMPLEDB_METRICS_FILE,
+ * if it is set, every SIMPLEDB_METRICS_INTERVAL seconds.
+ */
+void start_metrics_dump(void)
+{
+    const char *filename;
+    const char *interval;
+
+    filename = getenv(METRICS_FILE_ENV);
+    if (filename == NULL || *filename == '\0')
+    {
+        return;
+    }
+    interval = getenv(METRICS_INTERVAL_ENV);
+    dump.interval = interval != NULL ? atoi(interval) : 0;
+    if (dump.interval <= 0)
+    {
+        dump.interval = DEFAULT_METRICS_INTERVAL;
+    }
+    dump.filename = strdup(filename);
+    dump.stop = 0;
+    if (dump.filename == NULL || pthread_create(&dump.thread, NULL, dump_thread, NULL) != 0)
+    {
+        output_printf("Error: Could not start writing metrics to '%s'.\n", filename);
+        free(dump.filename);
+        dump.filename = NULL;
+        return;
+    }
+    dump.running = 1;
+}
+
+/* Stops the periodic dump, which writes the file one last time.
+ */
+void stop_metrics_dump(void)
+{
+    if (!dump.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&dump.lock);
+    dump.stop = 1;
+    pthread_cond_signal(&dump.wake);
+    pthread_mutex_unlock(&dump.lock);
+    pthread_join(dump.thread, NULL);
+    dump.running = 0;
+    free(dump.filename);
+    dump.filename = NULL;
+}
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "output.h"
+
+/* Buffer the calling thread's output goes to; NULL means stdout. */
+static __thread ByteBuffer *capture = NULL;
+
+/* Copy the calling thread's output is also appended to, or NULL. */
+static __thread OutputCopy *copy = NULL;
+
+/* Sends the calling thread's output to a buffer, or back to stdout if
+ * buffer is NULL. Returns the previous buffer so that nested captures
+ * can restore it.
+ */
+ByteBuffer *output_capture(ByteBuffer *buffer)
+{
+    ByteBuffer *previous;
+
+    previous = capture;
+    capture = buffer;
+    return previous;
+}
+
+/* Also appends the calling thread's output to a copy until it would
+ * grow past the copy's limit, or stops copying if copy is NULL. Returns
+ * the previous copy so that nested copies can restore it.
+ */
+OutputCopy *output_copy(OutputCopy *next)
+{
+    OutputCopy *previous;
+
+    previous = copy;
+    copy = next;
+    return previous;
+}
+
+/* Appends output to the copy, if any, giving the copy up once it
+ * overflows.
+ */
+static void copy_output(const void *data, size_t length)
+{
+    if (copy == NULL || copy->overflowed)
+    {
+        return;
+    }
+    if (copy->buffer.length + length > copy->limit || buffer_append(&copy->buffer, data, length) != 0)
+    {
+        buffer_free(&copy->buffer);
+        copy->overflowed = 1;
+    }
+}
+
+/* printf() to the current output.
+ * Returns the number of characters written, or -1 on failure.
+ */
+int output_printf(const char *format, ...)
+{
+    va_list args;
+    char line[256];
+    char *text;
+    int length;
+
+    va_start(args, format);
+    if (capture == NULL && (copy == NULL || copy->overflowed))
+    {
+        length = vprintf(format, args);
+        va_end(args);
+        return length;
+    }
+    if (capture == NULL)
+    {
+        /* Output to stdout that is copied is formatted once for both. */
+        length = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        if (length < 0)
+        {
+            return -1;
+        }
+        text = line;
+        if ((size_t)length >= sizeof(line))
+        {
+            text = malloc((size_t)length + 1);
+            if (text == NULL)
+            {
+                return -1;
+            }
+            va_start(args, format);
+            vsnprintf(text, (size_t)length + 1, format, args);
+            va_end(args);
+        }
+        output_write(text, length);
+        if (text != line)
+        {
+            free(text);
+        }
+        return length;
+    }
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length < 0 || buffer_reserve(capture, (size_t)length + 1) != 0)
+    {
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(capture->data + capture->length, (size_t)length + 1, format, args);
+    va_end(args);
+    copy_output(capture->data + capture->length, length);
+    capture->length += length;
+    return length;
+}
+
+/* Writes raw bytes to the current output.
+ */
+void output_write(const void *data, size_t length)
+{
+    copy_output(data, length);
+    if (capture == NULL)
+    {
+        fwrite(data, sizeof(char), length, stdout);
+        return;
+    }
+    buffer_append(capture, data, length);
+}
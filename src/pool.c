@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.h"
+
+typedef struct Task
+{
+    TaskFunc func;
+    void *arg;
+    TaskGroup *group;
+    struct Task *prev;
+    struct Task *next;
+} Task;
+
+/* Double-ended task queue. The owning worker pushes and pops at the
+ * bottom, so it keeps working on the freshest (cache-warm) task, while
+ * thieves take from the top and pick up the oldest work.
+ */
+typedef struct Deque
+{
+    pthread_mutex_t lock;
+    Task *top;
+    Task *bottom;
+} Deque;
+
+/* Every worker owns one deque. One extra deque at index thread_count
+ * receives tasks submitted from threads outside the pool.
+ */
+struct ThreadPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    Deque *deques;
+    pthread_t *threads;
+    int thread_count;
+    int started;
+    int waiters;
+    int shutdown;
+    atomic_int queued;
+    atomic_int next_worker;
+};
+
+/* Worker identity of the calling thread, used to route submissions to
+ * the worker's own deque and to skip it when stealing.
+ */
+static __thread ThreadPool *current_pool = NULL;
+static __thread int current_worker = -1;
+
+static ThreadPool *shared_pool = NULL;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
+static void push_bottom(Deque *deque, Task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    task->next = NULL;
+    task->prev = deque->bottom;
+    if (deque->bottom != NULL)
+    {
+        deque->bottom->next = task;
+    }
+    else
+    {
+        deque->top = task;
+    }
+    deque->bottom = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static Task *pop_bottom(Deque *deque)
+{
+    Task *task;
+
+    pthread_mutex_lock(&deque->lock);
+    task = deque->bottom;
+    if (task != NULL)
+    {
+        deque->bottom = task->prev;
+        if (deque->bottom != NULL)
+        {
+            deque->bottom->next = NULL;
+        }
+        else
+        {
+            deque->top = NULL;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static Task *pop_top(Deque *deque)
+{
+    Task *task;
+
+    pthread_mutex_lock(&deque->lock);
+    task = deque->top;
+    if (task != NULL)
+    {
+        deque->top = task->next;
+        if (deque->top != NULL)
+        {
+            deque->top->prev = NULL;
+        }
+        else
+        {
+            deque->bottom = NULL;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/* Finds the next task for the calling thread: its own deque first, then
+ * the injection queue, then the other workers' deques.
+ * Returns NULL if no work is queued anywhere.
+ */
+static Task *find_task(ThreadPool *pool)
+{
+    Task *task;
+    int self;
+    int victim;
+    int iter;
+
+    if (atomic_load_explicit(&pool->queued, memory_order_acquire) == 0)
+    {
+        return NULL;
+    }
+
+    self = (current_pool == pool) ? current_worker : -1;
+    task = NULL;
+    if (self >= 0)
+    {
+        task = pop_bottom(&pool->deques[self]);
+    }
+    if (task == NULL)
+    {
+        task = pop_top(&pool->deques[pool->thread_count]);
+    }
+    for (iter = 1; task == NULL && iter <= pool->thread_count; iter++)
+    {
+        victim = (self + iter) % pool->thread_count;
+        if (victim != self)
+        {
+            task = pop_top(&pool->deques[victim]);
+        }
+    }
+
+    if (task != NULL)
+    {
+        atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/* Runs a task and marks it finished in its group.
+ */
+static void run_task(ThreadPool *pool, Task *task)
+{
+    TaskGroup *group;
+
+    group = task->group;
+    task->func(task->arg);
+    free(task);
+
+    if (atomic_fetch_sub_explicit(&group->pending, 1, memory_order_acq_rel) == 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->work_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Worker thread body: executes and steals tasks until the pool shuts down.
+ */
+static void *worker_main(void *arg)
+{
+    ThreadPool *pool;
+    Task *task;
+
+    pool = arg;
+    current_pool = pool;
+    current_worker = atomic_fetch_add(&pool->next_worker, 1);
+
+    while (1)
+    {
+        task = find_task(pool);
+        if (task != NULL)
+        {
+            run_task(pool, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && atomic_load(&pool->queued) == 0)
+        {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutdown && atomic_load(&pool->queued) == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void create_shared_pool(void)
+{
+    shared_pool = pool_create(pool_default_size());
+}
+
+/* Returns the number of worker threads that fits the machine.
+ * The SIMPLEDB_THREADS environment variable overrides the detected value.
+ */
+int pool_default_size(void)
+{
+    const char *env;
+    long count;
+
+    env = getenv("SIMPLEDB_THREADS");
+    if (env != NULL && atoi(env) > 0)
+    {
+        return atoi(env);
+    }
+
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1)
+    {
+        count = 1;
+    }
+    return (int)count;
+}
+
+/* Creates a new pool with the given number of worker threads.
+ * Returns a pointer to the new ThreadPool or NULL on failure.
+ */
+ThreadPool *pool_create(int thread_count)
+{
+    ThreadPool *pool;
+    int iter;
+
+    pool = malloc(sizeof(ThreadPool));
+    if (pool == NULL)
+    {
+        printf("Error: Memory allocation failed for thread pool.\n");
+        return NULL;
+    }
+
+    pool->threads = malloc(sizeof(pthread_t) * thread_count);
+    pool->deques = malloc(sizeof(Deque) * (thread_count + 1));
+    if (pool->threads == NULL || pool->deques == NULL)
+    {
+        printf("Error: Memory allocation failed for thread pool.\n");
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    for (iter = 0; iter <= thread_count; iter++)
+    {
+        pthread_mutex_init(&pool->deques[iter].lock, NULL);
+        pool->deques[iter].top = NULL;
+        pool->deques[iter].bottom = NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->next_worker, 0);
+    pool->thread_count = thread_count;
+    pool->started = 0;
+    pool->waiters = 0;
+    pool->shutdown = 0;
+
+    for (iter = 0; iter < thread_count; iter++)
+    {
+        if (pthread_create(&pool->threads[iter], NULL, worker_main, pool) != 0)
+        {
+            break;
+        }
+        pool->started++;
+    }
+    return pool;
+}
+
+/* Stops all workers after the queues drain and frees the pool.
+ */
+void pool_destroy(ThreadPool *pool)
+{
+    int iter;
+
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (iter = 0; iter < pool->started; iter++)
+    {
+        pthread_join(pool->threads[iter], NULL);
+    }
+
+    for (iter = 0; iter <= pool->thread_count; iter++)
+    {
+        pthread_mutex_destroy(&pool->deques[iter].lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/* Returns the process-wide pool, creating it on first use.
+ */
+ThreadPool *pool_shared(void)
+{
+    pthread_once(&shared_pool_once, create_shared_pool);
+    return shared_pool;
+}
+
+/* Returns the number of worker threads, or 0 if there is no pool.
+ */
+int pool_thread_count(ThreadPool *pool)
+{
+    return pool == NULL ? 0 : pool->started;
+}
+
+void task_group_init(TaskGroup *group)
+{
+    atomic_init(&group->pending, 0);
+}
+
+/* Queues a task on the pool as part of the given group. Workers push to
+ * their own deque, other threads to the injection queue.
+ * Falls back to running it inline if no pool or memory is available.
+ */
+void pool_submit(ThreadPool *pool, TaskGroup *group, TaskFunc func, void *arg)
+{
+    Task *task;
+    int deque;
+
+    task = NULL;
+    if (pool != NULL && pool->started > 0)
+    {
+        task = malloc(sizeof(Task));
+    }
+    if (task == NULL)
+    {
+        func(arg);
+        return;
+    }
+
+    task->func = func;
+    task->arg = arg;
+    task->group = group;
+
+    deque = (current_pool == pool && current_worker >= 0) ? current_worker : pool->thread_count;
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+    push_bottom(&pool->deques[deque], task);
+    atomic_fetch_add_explicit(&pool->queued, 1, memory_order_release);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_ready);
+    if (pool->waiters > 0)
+    {
+        pthread_cond_broadcast(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Blocks until every task of the group has finished.
+ * The caller runs queued tasks while it waits, so waiting from inside
+ * a task cannot deadlock the pool.
+ */
+void pool_wait(ThreadPool *pool, TaskGroup *group)
+{
+    Task *task;
+
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    while (atomic_load_explicit(&group->pending, memory_order_acquire) > 0)
+    {
+        task = find_task(pool);
+        if (task != NULL)
+        {
+            run_task(pool, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (atomic_load(&group->pending) > 0 && atomic_load(&pool->queued) == 0)
+        {
+            pool->waiters++;
+            pthread_cond_wait(&pool->work_done, &pool->lock);
+            pool->waiters--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
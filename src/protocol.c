@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "protocol.h"
+
+/* Addresses containing a '/' are Unix socket paths; anything else is a
+ * TCP port, optionally preceded by "host:". TCP hosts default to
+ * localhost.
+ */
+static int is_unix_address(const char *address)
+{
+    return strchr(address, '/') != NULL;
+}
+
+/* Fills a Unix socket address.
+ * Returns 0 on success, -1 if the path is too long.
+ */
+static int unix_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        printf("Error: Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Resolves a "[host:]port" TCP address.
+ * Returns the address list, or NULL on failure.
+ */
+static struct addrinfo *tcp_address(const char *address, int passive)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+    char host[256];
+    const char *port;
+    const char *colon;
+    int status;
+
+    colon = strrchr(address, ':');
+    if (colon == NULL)
+    {
+        snprintf(host, sizeof(host), "localhost");
+        port = address;
+    }
+    else
+    {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        port = colon + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    status = getaddrinfo(host, port, &hints, &result);
+    if (status != 0)
+    {
+        printf("Error: Could not resolve '%s': %s.\n", address, gai_strerror(status));
+        return NULL;
+    }
+    return result;
+}
+
+/* Opens a listening socket on the given address.
+ * Returns the socket, or -1 on failure.
+ */
+int open_listener(const char *address)
+{
+    struct sockaddr_un unix_addr;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    struct stat info;
+    int reuse;
+    int fd;
+
+    if (is_unix_address(address))
+    {
+        if (unix_address(address, &unix_addr) != 0)
+        {
+            return -1;
+        }
+        /* Replace a socket left behind by a previous server */
+        if (stat(address, &info) == 0 && S_ISSOCK(info.st_mode))
+        {
+            unlink(address);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && (bind(fd, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) != 0 || listen(fd, SOMAXCONN) != 0))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        addrs = tcp_address(address, 1);
+        if (addrs == NULL)
+        {
+            return -1;
+        }
+        fd = -1;
+        for (addr = addrs; addr != NULL && fd < 0; addr = addr->ai_next)
+        {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd < 0)
+            {
+                continue;
+            }
+            reuse = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (bind(fd, addr->ai_addr, addr->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+    }
+
+    if (fd < 0)
+    {
+        printf("Error: Could not listen on '%s'.\n", address);
+    }
+    return fd;
+}
+
+/* Connects to a server at the given address.
+ * Returns the socket, or -1 on failure.
+ */
+int open_connection(const char *address)
+{
+    struct sockaddr_un unix_addr;
+    struct addrinfo *addrs;
+    struct addrinfo *addr;
+    int fd;
+
+    if (is_unix_address(address))
+    {
+        if (unix_address(address, &unix_addr) != 0)
+        {
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        addrs = tcp_address(address, 0);
+        if (addrs == NULL)
+        {
+            return -1;
+        }
+        fd = -1;
+        for (addr = addrs; addr != NULL && fd < 0; addr = addr->ai_next)
+        {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+    }
+
+    if (fd < 0)
+    {
+        printf("Error: Could not connect to '%s'.\n", address);
+    }
+    return fd;
+}
+
+/* Appends one frame carrying the payload to a buffer.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int frame_append(ByteBuffer *out, const char *payload, size_t length)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    header[0] = (unsigned char)(length >> 24);
+    header[1] = (unsigned char)(length >> 16);
+    header[2] = (unsigned char)(length >> 8);
+    header[3] = (unsigned char)length;
+    if (buffer_append(out, header, FRAME_HEADER_SIZE) != 0)
+    {
+        return -1;
+    }
+    return buffer_append(out, payload, length);
+}
+
+/* Fills in the length of a frame appended empty at the given offset and
+ * grown since, such as one an output capture was written behind.
+ */
+void frame_finish(ByteBuffer *out, size_t offset)
+{
+    size_t length;
+    unsigned char *header;
+
+    length = out->length - offset - FRAME_HEADER_SIZE;
+    header = (unsigned char*)out->data + offset;
+    header[0] = (unsigned char)(length >> 24);
+    header[1] = (unsigned char)(length >> 16);
+    header[2] = (unsigned char)(length >> 8);
+    header[3] = (unsigned char)length;
+}
+
+/* Checks whether data starts with a complete frame.
+ * Returns 1 and the payload length if it does, 0 if more bytes are
+ * needed.
+ */
+int frame_next(const char *data, size_t length, size_t *payload_length)
+{
+    const unsigned char *header;
+
+    if (length < FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+    header = (const unsigned char*)data;
+    *payload_length = (size_t)header[0] << 24 | (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+    return length - FRAME_HEADER_SIZE >= *payload_length;
+}
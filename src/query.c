@@ -0,0 +1,3210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include "bloom.h"
+#include "cache.h"
+#include "db.h"
+#include "metrics.h"
+#include "output.h"
+#include "pool.h"
+#include "query.h"
+#include "sketch.h"
+#include "timer.h"
+
+/* Morsels in flight per worker. Output of a wave is merged and printed
+ * before the next wave starts, which bounds buffered output.
+ */
+#define MORSELS_PER_WORKER 4
+
+typedef enum TokenKind
+{
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_STRING,
+    TOKEN_SYMBOL
+} TokenKind;
+
+typedef struct Lexer
+{
+    const char *pos;
+    TokenKind kind;
+    char text[MAX_QUERY_LENGTH];
+} Lexer;
+
+/* Running state of one aggregate over a set of rows. */
+typedef struct AggState
+{
+    int64_t count;
+    int64_t int_sum;
+    double sum;
+    int all_integers;
+    const char *extreme; /* Current MIN or MAX cell */
+    DistinctSketch *distinct; /* Sketches of APPROX_ aggregates, allocated by the first value */
+    QuantileSketch *quantile;
+    int lost;                 /* A sketch ran out of memory, so the result is NULL */
+} AggState;
+
+typedef struct GroupEntry
+{
+    const char *key; /* NULL marks an empty slot */
+    uint32_t length; /* Bytes of key */
+    uint32_t hash;   /* hash_cell() of the key's cell */
+    int64_t first_row;
+    AggState *aggs;
+} GroupEntry;
+
+/* Open-addressing hash table from group key to aggregate states. */
+typedef struct GroupTable
+{
+    GroupEntry *entries;
+    int capacity;
+    int count;
+    int agg_count; /* Aggregate states of each entry */
+} GroupTable;
+
+/* Partial result of one morsel. */
+typedef struct MorselResult
+{
+    char *text;
+    size_t length;
+    size_t capacity;
+    AggState *aggs;
+    GroupTable groups;
+    QueryProfile profile; /* Counted in full only for EXPLAIN ANALYZE */
+} MorselResult;
+
+/* Shared state of a parallel scan. Workers claim morsels from
+ * next_morsel until the current wave is exhausted.
+ */
+typedef struct Scan
+{
+    SelectQuery *query;
+    atomic_int next_morsel;
+    int first_morsel;
+    int end_morsel;
+    MorselResult *results;
+} Scan;
+
+/* Parses one kind of statement into a query.
+ * Returns 0 on success, -1 on a syntax error.
+ */
+typedef int (*ParseFunc)(const char *sql, SelectQuery *query);
+
+/* Applies a DELETE or UPDATE to the selected rows of one segment.
+ * Returns the number of rows written.
+ */
+typedef int (*WriteFunc)(SelectQuery *query, int segment, const int *selection, int count);
+
+/* Shared state of a parallel DELETE or UPDATE. Workers claim morsels
+ * until none are left; a morsel is one segment, so no two workers write
+ * the same cell, segment or tombstone bitmap.
+ */
+typedef struct WriteScan
+{
+    SelectQuery *query;
+    WriteFunc apply;
+    atomic_int next_morsel;
+    int morsel_count;
+    atomic_llong rows;
+    atomic_llong scanned;  /* Live rows of the segments read */
+    atomic_llong skipped;  /* Segments ruled out without reading cells */
+} WriteScan;
+
+/* Reads the next token. Words run until whitespace or punctuation,
+ * strings are enclosed in single quotes.
+ */
+static void next_token(Lexer *lex)
+{
+    int len;
+
+    while (isspace((unsigned char)*lex->pos))
+    {
+        lex->pos++;
+    }
+
+    len = 0;
+    if (*lex->pos == '\0')
+    {
+        lex->kind = TOKEN_END;
+    }
+    else if (*lex->pos == '\'')
+    {
+        lex->kind = TOKEN_STRING;
+        lex->pos++;
+        while (*lex->pos != '\0' && *lex->pos != '\'' && len < MAX_QUERY_LENGTH - 1)
+        {
+            lex->text[len++] = *lex->pos++;
+        }
+        if (*lex->pos == '\'')
+        {
+            lex->pos++;
+        }
+    }
+    else if (strchr("(),*", *lex->pos) != NULL)
+    {
+        lex->kind = TOKEN_SYMBOL;
+        lex->text[len++] = *lex->pos++;
+    }
+    else if (strchr("=!<>", *lex->pos) != NULL)
+    {
+        lex->kind = TOKEN_SYMBOL;
+        lex->text[len++] = *lex->pos++;
+        if (*lex->pos == '=' || (lex->text[0] == '<' && *lex->pos == '>'))
+        {
+            lex->text[len++] = *lex->pos++;
+        }
+    }
+    else
+    {
+        lex->kind = TOKEN_WORD;
+        while (*lex->pos != '\0' && !isspace((unsigned char)*lex->pos) &&
+               strchr("(),*=!<>'", *lex->pos) == NULL && len < MAX_QUERY_LENGTH - 1)
+        {
+            lex->text[len++] = *lex->pos++;
+        }
+    }
+    lex->text[len] = '\0';
+}
+
+/* Consumes the current token if it is the given keyword or symbol.
+ * Returns 1 if it was consumed, 0 otherwise.
+ */
+static int accept(Lexer *lex, const char *text)
+{
+    if ((lex->kind == TOKEN_WORD || lex->kind == TOKEN_SYMBOL) && strcmp(lex->text, text) == 0)
+    {
+        next_token(lex);
+        return 1;
+    }
+    return 0;
+}
+
+/* Compares two cells, numerically if both are numbers.
+ */
+static int compare_cells(const char *a, const char *b)
+{
+    double x;
+    double y;
+
+    if (parse_number(a, &x) && parse_number(b, &y))
+    {
+        return (x > y) - (x < y);
+    }
+    return strcmp(a, b);
+}
+
+static AggregateKind aggregate_from_name(const char *name)
+{
+    if (strcmp(name, "COUNT") == 0)
+    {
+        return AGG_COUNT;
+    }
+    if (strcmp(name, "SUM") == 0)
+    {
+        return AGG_SUM;
+    }
+    if (strcmp(name, "MIN") == 0)
+    {
+        return AGG_MIN;
+    }
+    if (strcmp(name, "MAX") == 0)
+    {
+        return AGG_MAX;
+    }
+    if (strcmp(name, "AVG") == 0)
+    {
+        return AGG_AVG;
+    }
+    if (strcmp(name, "APPROX_COUNT_DISTINCT") == 0)
+    {
+        return AGG_APPROX_DISTINCT;
+    }
+    if (strcmp(name, "APPROX_QUANTILE") == 0)
+    {
+        return AGG_APPROX_QUANTILE;
+    }
+    return AGG_NONE;
+}
+
+static const char *aggregate_name(AggregateKind aggregate)
+{
+    switch (aggregate)
+    {
+        case AGG_COUNT:
+            return "COUNT";
+        case AGG_SUM:
+            return "SUM";
+        case AGG_MIN:
+            return "MIN";
+        case AGG_MAX:
+            return "MAX";
+        case AGG_AVG:
+            return "AVG";
+        case AGG_APPROX_DISTINCT:
+            return "APPROX_COUNT_DISTINCT";
+        case AGG_APPROX_QUANTILE:
+            return "APPROX_QUANTILE";
+        default:
+            return "";
+    }
+}
+
+/* Parses one entry of the select list: a column or an aggregate call.
+ * APPROX_QUANTILE takes the quantile as a second argument:
+ *   APPROX_QUANTILE(column, 0.99)
+ * Returns 0 on success, -1 on a syntax error.
+ */
+static int parse_item(Lexer *lex, SelectItem *item)
+{
+    char name[MAX_QUERY_LENGTH];
+
+    if (lex->kind != TOKEN_WORD)
+    {
+        output_printf("Error: Expected column name in SELECT list.\n");
+        return -1;
+    }
+    strcpy(name, lex->text);
+    next_token(lex);
+
+    item->aggregate = AGG_NONE;
+    item->column_name = NULL;
+    item->column = -1;
+
+    if (!accept(lex, "("))
+    {
+        item->column_name = strdup(name);
+        return 0;
+    }
+
+    item->aggregate = aggregate_from_name(name);
+    if (item->aggregate == AGG_NONE)
+    {
+        output_printf("Error: Unknown function '%s'.\n", name);
+        return -1;
+    }
+
+    if (item->aggregate == AGG_COUNT && accept(lex, "*"))
+    {
+        /* COUNT(*) needs no column */
+    }
+    else if (lex->kind == TOKEN_WORD)
+    {
+        item->column_name = strdup(lex->text);
+        next_token(lex);
+    }
+    else
+    {
+        output_printf("Error: Expected column name in %s().\n", name);
+        return -1;
+    }
+
+    if (item->aggregate == AGG_APPROX_QUANTILE)
+    {
+        if (!accept(lex, ",") || lex->kind != TOKEN_WORD || !parse_number(lex->text, &item->fraction) ||
+            item->fraction < 0.0 || item->fraction > 1.0)
+        {
+            output_printf("Error: Expected a quantile from 0 to 1 in %s().\n", name);
+            return -1;
+        }
+        next_token(lex);
+    }
+
+    if (!accept(lex, ")"))
+    {
+        output_printf("Error: Missing closing parenthesis in %s().\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Parses a single "column op value" condition.
+ * Returns 0 on success, -1 on a syntax error.
+ */
+static int parse_predicate(Lexer *lex, Predicate *predicate)
+{
+    static const char *ops[] = {"=", "!=", "<", "<=", ">", ">="};
+    static const CompareOp codes[] = {CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE};
+    int iter;
+
+    if (lex->kind != TOKEN_WORD)
+    {
+        output_printf("Error: Expected column name in WHERE clause.\n");
+        return -1;
+    }
+    predicate->column_name = strdup(lex->text);
+    predicate->column = -1;
+    next_token(lex);
+
+    if (lex->kind == TOKEN_SYMBOL && strcmp(lex->text, "<>") == 0)
+    {
+        strcpy(lex->text, "!=");
+    }
+    for (iter = 0; iter < 6; iter++)
+    {
+        if (accept(lex, ops[iter]))
+        {
+            break;
+        }
+    }
+    if (iter == 6)
+    {
+        output_printf("Error: Expected comparison operator after '%s'.\n", predicate->column_name);
+        return -1;
+    }
+    predicate->op = codes[iter];
+
+    if (lex->kind != TOKEN_WORD && lex->kind != TOKEN_STRING)
+    {
+        output_printf("Error: Expected value after comparison operator.\n");
+        return -1;
+    }
+    predicate->value = strdup(lex->text);
+    predicate->length = (uint32_t)strlen(lex->text);
+    memset(predicate->prefix, 0, CELL_PREFIX);
+    memcpy(predicate->prefix, lex->text, predicate->length < CELL_PREFIX ? predicate->length : CELL_PREFIX);
+    predicate->is_number = lex->kind == TOKEN_WORD && parse_number(lex->text, &predicate->number);
+    next_token(lex);
+    return 0;
+}
+
+/* Parses an optional "WHERE column op value [AND ...]" clause.
+ * Returns 0 on success, -1 on a syntax error.
+ */
+static int parse_where(Lexer *lex, SelectQuery *query)
+{
+    Predicate *predicates;
+
+    if (!accept(lex, "WHERE"))
+    {
+        return 0;
+    }
+    do
+    {
+        predicates = realloc(query->predicates, sizeof(Predicate) * (query->predicate_count + 1));
+        if (predicates == NULL)
+        {
+            output_printf("Error: Memory allocation failed for WHERE clause.\n");
+            return -1;
+        }
+        query->predicates = predicates;
+        memset(&query->predicates[query->predicate_count], 0, sizeof(Predicate));
+        if (parse_predicate(lex, &query->predicates[query->predicate_count++]) != 0)
+        {
+            return -1;
+        }
+    } while (accept(lex, "AND"));
+    return 0;
+}
+
+/* Parses a SELECT statement:
+ *   SELECT * | item [, item ...] FROM table
+ *     [WHERE column op value [AND ...]] [GROUP BY column]
+ * where item is a column or COUNT(*), COUNT/SUM/MIN/MAX/AVG(column),
+ * APPROX_COUNT_DISTINCT(column) or APPROX_QUANTILE(column, quantile).
+ * Returns 0 on success, -1 on a syntax error.
+ */
+int parse_select(const char *sql, SelectQuery *query)
+{
+    Lexer lex;
+    SelectItem *items;
+
+    memset(query, 0, sizeof(SelectQuery));
+    query->group_column = -1;
+
+    lex.pos = sql;
+    next_token(&lex);
+    if (!accept(&lex, "SELECT"))
+    {
+        output_printf("Error: Invalid SELECT syntax.\n");
+        return -1;
+    }
+
+    if (accept(&lex, "*"))
+    {
+        query->all_columns = 1;
+    }
+    else
+    {
+        do
+        {
+            items = realloc(query->items, sizeof(SelectItem) * (query->item_count + 1));
+            if (items == NULL)
+            {
+                output_printf("Error: Memory allocation failed for SELECT list.\n");
+                return -1;
+            }
+            query->items = items;
+            memset(&query->items[query->item_count], 0, sizeof(SelectItem));
+            if (parse_item(&lex, &query->items[query->item_count++]) != 0)
+            {
+                return -1;
+            }
+        } while (accept(&lex, ","));
+    }
+
+    if (!accept(&lex, "FROM"))
+    {
+        output_printf("Error: Expected FROM in SELECT query.\n");
+        return -1;
+    }
+    if (lex.kind != TOKEN_WORD)
+    {
+        output_printf("Error: Table name is missing in SELECT query.\n");
+        return -1;
+    }
+    query->table_name = strdup(lex.text);
+    next_token(&lex);
+
+    if (parse_where(&lex, query) != 0)
+    {
+        return -1;
+    }
+
+    if (accept(&lex, "GROUP"))
+    {
+        if (!accept(&lex, "BY") || lex.kind != TOKEN_WORD)
+        {
+            output_printf("Error: Expected column after GROUP BY.\n");
+            return -1;
+        }
+        query->group_name = strdup(lex.text);
+        next_token(&lex);
+    }
+
+    if (lex.kind != TOKEN_END)
+    {
+        output_printf("Error: Unexpected '%s' in SELECT query.\n", lex.text);
+        return -1;
+    }
+    return 0;
+}
+
+/* Resolves a column name to its index and reports unknown columns.
+ * Returns the index or -1.
+ */
+static int resolve_column(Table *table, const char *column_name)
+{
+    int column;
+
+    column = find_column(table, column_name);
+    if (column < 0)
+    {
+        output_printf("Error: Column '%s' does not exist in table '%s'.\n", column_name, table->name);
+    }
+    return column;
+}
+
+/* Binds a parsed query to the database: resolves the table and all
+ * column references and checks that the select list fits GROUP BY.
+ * Returns 0 on success, -1 on error.
+ */
+int plan_select(Database *db, SelectQuery *query)
+{
+    Table *table;
+    SelectItem *item;
+    int iter;
+
+    table = find_table(db, query->table_name);
+    if (table == NULL)
+    {
+        output_printf("Error: Table '%s' does not exist.\n", query->table_name);
+        return -1;
+    }
+    query->table = table;
+
+    if (query->all_columns)
+    {
+        query->items = calloc(table->column_count, sizeof(SelectItem));
+        if (query->items == NULL)
+        {
+            output_printf("Error: Memory allocation failed for SELECT list.\n");
+            return -1;
+        }
+        query->item_count = table->column_count;
+        for (iter = 0; iter < table->column_count; iter++)
+        {
+            query->items[iter].aggregate = AGG_NONE;
+            query->items[iter].column_name = strdup(table->columns[iter]->name);
+            query->items[iter].column = iter;
+        }
+    }
+
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        item = &query->items[iter];
+        if (item->column_name != NULL)
+        {
+            item->column = resolve_column(table, item->column_name);
+            if (item->column < 0)
+            {
+                return -1;
+            }
+        }
+        if (item->aggregate != AGG_NONE)
+        {
+            query->aggregate_count++;
+        }
+    }
+
+    for (iter = 0; iter < query->predicate_count; iter++)
+    {
+        query->predicates[iter].column = resolve_column(table, query->predicates[iter].column_name);
+        if (query->predicates[iter].column < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (query->group_name != NULL)
+    {
+        query->group_column = resolve_column(table, query->group_name);
+        if (query->group_column < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (query->aggregate_count > 0 || query->group_column >= 0)
+    {
+        for (iter = 0; iter < query->item_count; iter++)
+        {
+            item = &query->items[iter];
+            if (item->aggregate == AGG_NONE && item->column != query->group_column)
+            {
+                output_printf("Error: Column '%s' must appear in GROUP BY or be aggregated.\n", item->column_name);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Frees everything owned by a query.
+ */
+void free_select(SelectQuery *query)
+{
+    int iter;
+
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        free(query->items[iter].column_name);
+    }
+    for (iter = 0; iter < query->predicate_count; iter++)
+    {
+        free(query->predicates[iter].column_name);
+        free(query->predicates[iter].value);
+    }
+    for (iter = 0; iter < query->assignment_count; iter++)
+    {
+        free(query->assignments[iter].column_name);
+        free(query->assignments[iter].value);
+    }
+    free(query->items);
+    free(query->predicates);
+    free(query->assignments);
+    free(query->table_name);
+    free(query->group_name);
+}
+
+/* Evaluates a predicate against one cell. Texts are compared on length
+ * and prefix first, which settles most comparisons without touching a
+ * long cell's heap text.
+ */
+static int match_predicate(const Predicate *predicate, const Cell *cell)
+{
+    double number;
+    int cmp;
+
+    if (predicate->is_number && parse_number(cell_text(cell), &number))
+    {
+        cmp = (number > predicate->number) - (number < predicate->number);
+    }
+    else if (predicate->op == CMP_EQ || predicate->op == CMP_NE)
+    {
+        cmp = cell->length != predicate->length || memcmp(cell->bytes, predicate->prefix, CELL_PREFIX) != 0 ||
+              memcmp(cell_text(cell), predicate->value, cell->length) != 0;
+    }
+    else
+    {
+        cmp = memcmp(cell->bytes, predicate->prefix, CELL_PREFIX);
+        if (cmp == 0)
+        {
+            cmp = strcmp(cell_text(cell), predicate->value);
+        }
+    }
+
+    switch (predicate->op)
+    {
+        case CMP_EQ:
+            return cmp == 0;
+        case CMP_NE:
+            return cmp != 0;
+        case CMP_LT:
+            return cmp < 0;
+        case CMP_LE:
+            return cmp <= 0;
+        case CMP_GT:
+            return cmp > 0;
+        default:
+            return cmp >= 0;
+    }
+}
+
+/* Returns the number of rows of a segment the query's snapshot sees.
+ */
+static int segment_rows(const SelectQuery *query, int segment)
+{
+    int64_t rows;
+
+    rows = query->snapshot.row_count - ((int64_t)segment << SEGMENT_SHIFT);
+    return rows < SEGMENT_ROWS ? (int)rows : SEGMENT_ROWS;
+}
+
+/* Tells from the signs of the lowest and highest value compared with a
+ * predicate's value whether any value in between can satisfy it. Bounds
+ * that are only exact up to a prefix make strict comparisons inclusive.
+ */
+static int range_may_match(CompareOp op, int low, int high, int exact)
+{
+    switch (op)
+    {
+        case CMP_EQ:
+            return low <= 0 && high >= 0;
+        case CMP_NE:
+            return 1;
+        case CMP_LT:
+            return exact ? low < 0 : low <= 0;
+        case CMP_LE:
+            return low <= 0;
+        case CMP_GT:
+            return exact ? high > 0 : high >= 0;
+        default:
+            return high >= 0;
+    }
+}
+
+/* Checks a segment's zone map against a predicate, comparing the way
+ * match_predicate() would: numbers numerically when the predicate's value
+ * is a number, everything else as text.
+ * Returns 0 if no cell of the segment can match, 1 otherwise.
+ */
+static int zone_may_match(const Predicate *predicate, const ZoneMap *zone)
+{
+    int low;
+    int high;
+
+    if (predicate->is_number && zone->numbers > 0)
+    {
+        low = (zone->min_number > predicate->number) - (zone->min_number < predicate->number);
+        high = (zone->max_number > predicate->number) - (zone->max_number < predicate->number);
+        if (range_may_match(predicate->op, low, high, 1))
+        {
+            return 1;
+        }
+    }
+    if (predicate->is_number && zone->numbers == zone->rows)
+    {
+        return 0;
+    }
+    low = strncmp(zone->min_text, predicate->value, ZONE_PREFIX);
+    high = strncmp(zone->max_text, predicate->value, ZONE_PREFIX);
+    return range_may_match(predicate->op, low, high, 0);
+}
+
+/* Outcomes of checking a segment against a query's predicates. */
+typedef enum SegmentCheck
+{
+    SEGMENT_SCANNED,
+    SEGMENT_ZONE_SKIP,  /* A zone map rules out a predicate */
+    SEGMENT_BLOOM_SKIP  /* A Bloom filter rules out a predicate */
+} SegmentCheck;
+
+/* Checks whether a segment can hold rows that satisfy every predicate,
+ * without reading its cells.
+ */
+static SegmentCheck check_segment(const SelectQuery *query, int segment)
+{
+    const Predicate *predicate;
+    const SegmentData *zone_segment;
+    int iter;
+
+    /* Only a full segment's zone map and filter are settled; the last
+     * one may still be widened by a concurrent append. A filter holds
+     * cells as text, so it only answers text equality.
+     */
+    if (segment_rows(query, segment) < SEGMENT_ROWS)
+    {
+        return SEGMENT_SCANNED;
+    }
+    for (iter = 0; iter < query->predicate_count; iter++)
+    {
+        predicate = &query->predicates[iter];
+        zone_segment = query->snapshot.version->segments[predicate->column][segment];
+        if (!zone_may_match(predicate, &zone_segment->zone))
+        {
+            metrics_add(COUNTER_SEGMENTS_SKIPPED, 1);
+            return SEGMENT_ZONE_SKIP;
+        }
+        if (predicate->op == CMP_EQ && !predicate->is_number && zone_segment->bloom != NULL &&
+            !bloom_may_contain(zone_segment->bloom, predicate->value))
+        {
+            metrics_add(COUNTER_SEGMENTS_SKIPPED, 1);
+            return SEGMENT_BLOOM_SKIP;
+        }
+    }
+    return SEGMENT_SCANNED;
+}
+
+/* Collects the live rows of a segment as offsets within the segment.
+ * Returns the number of rows selected.
+ */
+static int live_rows(const SelectQuery *query, int segment, int *selection)
+{
+    const uint64_t *deleted;
+    uint64_t live;
+    int count;
+    int end;
+    int row;
+
+    count = 0;
+    end = segment_rows(query, segment);
+    deleted = query->snapshot.version->deleted == NULL ? NULL : query->snapshot.version->deleted[segment];
+    if (deleted == NULL)
+    {
+        for (row = 0; row < end; row++)
+        {
+            selection[count++] = row;
+        }
+        metrics_add(COUNTER_ROWS_SCANNED, count);
+        return count;
+    }
+
+    /* Take the live rows of each bitmap word by peeling off its lowest
+     * set bit.
+     */
+    for (row = 0; row < end; row += 64)
+    {
+        live = ~deleted[row / 64];
+        if (end - row < 64)
+        {
+            live &= (UINT64_C(1) << (end - row)) - 1;
+        }
+        while (live != 0)
+        {
+            selection[count++] = row + __builtin_ctzll(live);
+            live &= live - 1;
+        }
+    }
+    metrics_add(COUNTER_ROWS_SCANNED, count);
+    return count;
+}
+
+/* Narrows a selection of a segment's rows to those satisfying a predicate.
+ * Returns the number of rows kept.
+ */
+static int apply_predicate(const SelectQuery *query, const Predicate *predicate, int segment, int *selection, int count)
+{
+    const Cell *data;
+    int kept;
+    int row;
+
+    data = query->snapshot.version->segments[predicate->column][segment]->cells;
+    kept = 0;
+    for (row = 0; row < count; row++)
+    {
+        if (match_predicate(predicate, &data[selection[row]]))
+        {
+            selection[kept++] = selection[row];
+        }
+    }
+    return kept;
+}
+
+/* Collects the live rows of a segment that satisfy every predicate, as
+ * offsets within the segment. Segments whose zone maps or Bloom filters
+ * rule out a predicate are skipped without reading their cells. Predicates are
+ * applied one column at a time, each narrowing the selection left by
+ * the previous one. The segment and the rows read are counted in counts.
+ * Returns the number of rows selected.
+ */
+static int filter_rows(const SelectQuery *query, int segment, int *selection, QueryProfile *counts)
+{
+    SegmentCheck check;
+    int count;
+    int iter;
+
+    counts->segments++;
+    check = check_segment(query, segment);
+    if (check != SEGMENT_SCANNED)
+    {
+        if (check == SEGMENT_ZONE_SKIP)
+        {
+            counts->zone_skips++;
+        }
+        else
+        {
+            counts->bloom_skips++;
+        }
+        return 0;
+    }
+    count = live_rows(query, segment, selection);
+    counts->operators[OP_SCAN].rows_out += count;
+    for (iter = 0; iter < query->predicate_count && count > 0; iter++)
+    {
+        count = apply_predicate(query, &query->predicates[iter], segment, selection, count);
+    }
+    return count;
+}
+
+static void init_aggs(AggState *aggs, int count)
+{
+    int iter;
+
+    for (iter = 0; iter < count; iter++)
+    {
+        aggs[iter].count = 0;
+        aggs[iter].int_sum = 0;
+        aggs[iter].sum = 0.0;
+        aggs[iter].all_integers = 1;
+        aggs[iter].extreme = NULL;
+        aggs[iter].distinct = NULL;
+        aggs[iter].quantile = NULL;
+        aggs[iter].lost = 0;
+    }
+}
+
+/* Frees the sketches of aggregate states.
+ */
+static void release_aggs(AggState *aggs, int count)
+{
+    int iter;
+
+    for (iter = 0; iter < count; iter++)
+    {
+        free(aggs[iter].distinct);
+        quantile_free(aggs[iter].quantile);
+        aggs[iter].distinct = NULL;
+        aggs[iter].quantile = NULL;
+    }
+}
+
+/* Folds one cell into an aggregate.
+ */
+static void update_agg(AggState *agg, AggregateKind aggregate, const char *cell)
+{
+    double number;
+    long long integer;
+    char *end;
+
+    switch (aggregate)
+    {
+        case AGG_COUNT:
+            agg->count++;
+            break;
+        case AGG_SUM:
+        case AGG_AVG:
+            if (!parse_number(cell, &number))
+            {
+                break;
+            }
+            agg->count++;
+            agg->sum += number;
+            integer = strtoll(cell, &end, 10);
+            if (!agg->all_integers || *end != '\0' ||
+                __builtin_add_overflow(agg->int_sum, integer, &agg->int_sum))
+            {
+                agg->all_integers = 0;
+            }
+            break;
+        case AGG_MIN:
+            if (agg->extreme == NULL || compare_cells(cell, agg->extreme) < 0)
+            {
+                agg->extreme = cell;
+            }
+            break;
+        case AGG_MAX:
+            if (agg->extreme == NULL || compare_cells(cell, agg->extreme) > 0)
+            {
+                agg->extreme = cell;
+            }
+            break;
+        case AGG_APPROX_DISTINCT:
+            if (agg->distinct == NULL && !agg->lost)
+            {
+                agg->distinct = distinct_create();
+                agg->lost = agg->distinct == NULL;
+            }
+            if (agg->distinct != NULL)
+            {
+                distinct_add(agg->distinct, cell);
+            }
+            break;
+        case AGG_APPROX_QUANTILE:
+            if (!parse_number(cell, &number))
+            {
+                break;
+            }
+            if (agg->quantile == NULL && !agg->lost)
+            {
+                agg->quantile = quantile_create();
+                agg->lost = agg->quantile == NULL;
+            }
+            if (agg->quantile != NULL && quantile_add(agg->quantile, number) != 0)
+            {
+                agg->lost = 1;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Combines a partial aggregate into an accumulated one.
+ */
+static void merge_agg(AggState *dst, const AggState *src, AggregateKind aggregate)
+{
+    switch (aggregate)
+    {
+        case AGG_COUNT:
+            dst->count += src->count;
+            break;
+        case AGG_SUM:
+        case AGG_AVG:
+            dst->count += src->count;
+            dst->sum += src->sum;
+            if (!dst->all_integers || !src->all_integers ||
+                __builtin_add_overflow(dst->int_sum, src->int_sum, &dst->int_sum))
+            {
+                dst->all_integers = 0;
+            }
+            break;
+        case AGG_MIN:
+        case AGG_MAX:
+            if (src->extreme != NULL)
+            {
+                update_agg(dst, aggregate, src->extreme);
+            }
+            break;
+        case AGG_APPROX_DISTINCT:
+            dst->lost |= src->lost;
+            if (src->distinct == NULL || dst->lost)
+            {
+                break;
+            }
+            if (dst->distinct == NULL)
+            {
+                dst->distinct = distinct_create();
+                dst->lost = dst->distinct == NULL;
+            }
+            if (dst->distinct != NULL)
+            {
+                distinct_merge(dst->distinct, src->distinct);
+            }
+            break;
+        case AGG_APPROX_QUANTILE:
+            dst->lost |= src->lost;
+            if (src->quantile == NULL || dst->lost)
+            {
+                break;
+            }
+            if (dst->quantile == NULL)
+            {
+                dst->quantile = quantile_create();
+                dst->lost = dst->quantile == NULL;
+            }
+            if (dst->quantile != NULL && quantile_merge(dst->quantile, src->quantile) != 0)
+            {
+                dst->lost = 1;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Formats the final value of an aggregate.
+ */
+static void format_agg(const AggState *agg, const SelectItem *item, char *buf, size_t size)
+{
+    double value;
+
+    switch (item->aggregate)
+    {
+        case AGG_COUNT:
+            snprintf(buf, size, "%lld", (long long)agg->count);
+            break;
+        case AGG_SUM:
+            if (agg->count == 0)
+            {
+                snprintf(buf, size, "NULL");
+            }
+            else if (agg->all_integers)
+            {
+                snprintf(buf, size, "%lld", (long long)agg->int_sum);
+            }
+            else
+            {
+                snprintf(buf, size, "%.15g", agg->sum);
+            }
+            break;
+        case AGG_AVG:
+            if (agg->count == 0)
+            {
+                snprintf(buf, size, "NULL");
+            }
+            else
+            {
+                snprintf(buf, size, "%.15g", agg->sum / agg->count);
+            }
+            break;
+        case AGG_APPROX_DISTINCT:
+            if (agg->lost)
+            {
+                snprintf(buf, size, "NULL");
+            }
+            else
+            {
+                snprintf(buf, size, "%.0f", agg->distinct != NULL ? distinct_estimate(agg->distinct) : 0.0);
+            }
+            break;
+        case AGG_APPROX_QUANTILE:
+            if (agg->lost || agg->quantile == NULL || quantile_estimate(agg->quantile, item->fraction, &value) != 0)
+            {
+                snprintf(buf, size, "NULL");
+            }
+            else
+            {
+                snprintf(buf, size, "%.15g", value);
+            }
+            break;
+        default:
+            snprintf(buf, size, "%s", agg->extreme != NULL ? agg->extreme : "NULL");
+            break;
+    }
+}
+
+/* Hashes a cell as a group key. An inline cell is hashed as its two
+ * words, which its zero padding makes equal for equal texts, without a
+ * pass over its bytes; a longer one by its text. Whether a text is kept
+ * inline depends on its length alone, so equal texts hash alike.
+ */
+static uint32_t hash_cell(const Cell *cell)
+{
+    uint64_t words[2];
+    uint64_t hash;
+    const char *text;
+    uint32_t iter;
+
+    if (cell->length <= CELL_INLINE)
+    {
+        memcpy(words, cell, sizeof(Cell));
+        hash = words[0] * 0x9e3779b97f4a7c15ull ^ words[1];
+    }
+    else
+    {
+        text = cell_text(cell);
+        hash = 14695981039346656037ull;
+        for (iter = 0; iter < cell->length; iter++)
+        {
+            hash = (hash ^ (unsigned char)text[iter]) * 1099511628211ull;
+        }
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static void free_groups(GroupTable *groups)
+{
+    int iter;
+
+    for (iter = 0; iter < groups->capacity; iter++)
+    {
+        if (groups->entries[iter].aggs != NULL)
+        {
+            release_aggs(groups->entries[iter].aggs, groups->agg_count);
+        }
+        free(groups->entries[iter].aggs);
+    }
+    free(groups->entries);
+    groups->entries = NULL;
+    groups->capacity = 0;
+    groups->count = 0;
+}
+
+/* Finds the entry for a group key, inserting a fresh one if needed.
+ * Returns NULL if memory runs out.
+ */
+static GroupEntry *find_group(GroupTable *groups, const char *key, uint32_t length, uint32_t hash, int agg_count)
+{
+    GroupEntry *old_entries;
+    GroupEntry *entry;
+    int old_capacity;
+    int slot;
+    int iter;
+
+    if ((groups->count + 1) * 2 > groups->capacity)
+    {
+        old_entries = groups->entries;
+        old_capacity = groups->capacity;
+        groups->capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+        groups->entries = calloc(groups->capacity, sizeof(GroupEntry));
+        if (groups->entries == NULL)
+        {
+            groups->entries = old_entries;
+            groups->capacity = old_capacity;
+            return NULL;
+        }
+        for (iter = 0; iter < old_capacity; iter++)
+        {
+            if (old_entries[iter].key == NULL)
+            {
+                continue;
+            }
+            slot = old_entries[iter].hash & (groups->capacity - 1);
+            while (groups->entries[slot].key != NULL)
+            {
+                slot = (slot + 1) & (groups->capacity - 1);
+            }
+            groups->entries[slot] = old_entries[iter];
+        }
+        free(old_entries);
+    }
+
+    slot = hash & (groups->capacity - 1);
+    while (groups->entries[slot].key != NULL)
+    {
+        entry = &groups->entries[slot];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->key, key, length) == 0)
+        {
+            return entry;
+        }
+        slot = (slot + 1) & (groups->capacity - 1);
+    }
+
+    entry = &groups->entries[slot];
+    entry->aggs = malloc(sizeof(AggState) * (agg_count > 0 ? agg_count : 1));
+    if (entry->aggs == NULL)
+    {
+        return NULL;
+    }
+    init_aggs(entry->aggs, agg_count);
+    groups->agg_count = agg_count;
+    entry->key = key;
+    entry->length = length;
+    entry->hash = hash;
+    entry->first_row = -1;
+    groups->count++;
+    return entry;
+}
+
+/* Appends bytes to a morsel's output buffer.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int append_text(MorselResult *result, const char *text, size_t length)
+{
+    size_t capacity;
+    char *grown;
+
+    if (result->length + length > result->capacity)
+    {
+        capacity = result->capacity == 0 ? 4096 : result->capacity;
+        while (capacity < result->length + length)
+        {
+            capacity *= 2;
+        }
+        grown = realloc(result->text, capacity);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        result->text = grown;
+        result->capacity = capacity;
+    }
+    memcpy(result->text + result->length, text, length);
+    result->length += length;
+    return 0;
+}
+
+/* Formats the selected rows of a morsel as output lines.
+ */
+static void project_rows(const SelectQuery *query, int segment, const int *selection, int count, MorselResult *result)
+{
+    const Cell *cell;
+    int iter;
+    int row;
+
+    for (row = 0; row < count; row++)
+    {
+        for (iter = 0; iter < query->item_count; iter++)
+        {
+            cell = &query->snapshot.version->segments[query->items[iter].column][segment]->cells[selection[row]];
+            append_text(result, cell_text(cell), cell->length);
+            append_text(result, "\t", 1);
+        }
+        append_text(result, "\n", 1);
+    }
+}
+
+/* Folds the selected rows of a morsel into aggregate states.
+ */
+static void aggregate_rows(const SelectQuery *query, int segment, const int *selection, int count, AggState *aggs)
+{
+    const SelectItem *item;
+    const Cell *data;
+    int iter;
+    int row;
+
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        item = &query->items[iter];
+        if (item->aggregate == AGG_NONE)
+        {
+            continue;
+        }
+        if (item->column < 0)
+        {
+            aggs[iter].count += count;
+            continue;
+        }
+        data = query->snapshot.version->segments[item->column][segment]->cells;
+        for (row = 0; row < count; row++)
+        {
+            update_agg(&aggs[iter], item->aggregate, cell_text(&data[selection[row]]));
+        }
+    }
+}
+
+/* Folds the selected rows of a morsel into per-group aggregate states.
+ */
+static void group_rows(const SelectQuery *query, int segment, const int *selection, int count, GroupTable *groups)
+{
+    const SelectItem *item;
+    GroupEntry *entry;
+    const Cell *keys;
+    const Cell *key;
+    const char *cell;
+    int iter;
+    int row;
+
+    keys = query->snapshot.version->segments[query->group_column][segment]->cells;
+    for (row = 0; row < count; row++)
+    {
+        key = &keys[selection[row]];
+        entry = find_group(groups, cell_text(key), key->length, hash_cell(key), query->item_count);
+        if (entry == NULL)
+        {
+            return;
+        }
+        if (entry->first_row < 0)
+        {
+            entry->first_row = ((int64_t)segment << SEGMENT_SHIFT) + selection[row];
+        }
+        for (iter = 0; iter < query->item_count; iter++)
+        {
+            item = &query->items[iter];
+            if (item->aggregate == AGG_NONE)
+            {
+                continue;
+            }
+            cell = item->column < 0 ? NULL : cell_text(&query->snapshot.version->segments[item->column][segment]->cells[selection[row]]);
+            if (cell == NULL)
+            {
+                entry->aggs[iter].count++;
+            }
+            else
+            {
+                update_agg(&entry->aggs[iter], item->aggregate, cell);
+            }
+        }
+    }
+}
+
+/* Returns the bytes read by visiting the selected cells of a column: the
+ * cells themselves and the heap text of those too long to keep inline.
+ */
+static int64_t cell_bytes(const SelectQuery *query, int column, int segment, const int *selection, int count)
+{
+    const Cell *data;
+    int64_t bytes;
+    int row;
+
+    data = query->snapshot.version->segments[column][segment]->cells;
+    bytes = (int64_t)count * sizeof(Cell);
+    for (row = 0; row < count; row++)
+    {
+        if (data[selection[row]].length > CELL_INLINE)
+        {
+            bytes += data[selection[row]].length + 1;
+        }
+    }
+    return bytes;
+}
+
+/* Runs one morsel the way scan_worker() does, counting rows, bytes and
+ * time per operator into its result. Bytes are counted outside the timed
+ * sections.
+ */
+static void profile_morsel(const SelectQuery *query, int segment, int *selection, MorselResult *result)
+{
+    OperatorStats *scan;
+    OperatorStats *filter;
+    OperatorStats *compute;
+    SegmentCheck check;
+    int64_t start;
+    int count;
+    int iter;
+
+    scan = &result->profile.operators[OP_SCAN];
+    filter = &result->profile.operators[OP_FILTER];
+    compute = &result->profile.operators[OP_COMPUTE];
+
+    start = monotonic_ns();
+    check = check_segment(query, segment);
+    count = check == SEGMENT_SCANNED ? live_rows(query, segment, selection) : 0;
+    scan->nanoseconds += monotonic_ns() - start;
+
+    result->profile.segments++;
+    if (check == SEGMENT_ZONE_SKIP)
+    {
+        result->profile.zone_skips++;
+    }
+    else if (check == SEGMENT_BLOOM_SKIP)
+    {
+        result->profile.bloom_skips++;
+    }
+    if (segment_rows(query, segment) == SEGMENT_ROWS)
+    {
+        scan->bytes += query->predicate_count * sizeof(ZoneMap);
+    }
+    if (check == SEGMENT_SCANNED && query->snapshot.version->deleted != NULL &&
+        query->snapshot.version->deleted[segment] != NULL)
+    {
+        scan->bytes += SEGMENT_WORDS * sizeof(uint64_t);
+    }
+    scan->rows_in += segment_rows(query, segment);
+    scan->rows_out += count;
+
+    filter->rows_in += count;
+    for (iter = 0; iter < query->predicate_count && count > 0; iter++)
+    {
+        filter->bytes += cell_bytes(query, query->predicates[iter].column, segment, selection, count);
+        start = monotonic_ns();
+        count = apply_predicate(query, &query->predicates[iter], segment, selection, count);
+        filter->nanoseconds += monotonic_ns() - start;
+    }
+    filter->rows_out += count;
+
+    compute->rows_in += count;
+    if (query->group_column >= 0)
+    {
+        compute->bytes += cell_bytes(query, query->group_column, segment, selection, count);
+    }
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        if (query->items[iter].column >= 0 &&
+            (query->group_column < 0 || query->items[iter].aggregate != AGG_NONE))
+        {
+            compute->bytes += cell_bytes(query, query->items[iter].column, segment, selection, count);
+        }
+    }
+    start = monotonic_ns();
+    if (query->group_column >= 0)
+    {
+        group_rows(query, segment, selection, count, &result->groups);
+    }
+    else if (query->aggregate_count > 0)
+    {
+        aggregate_rows(query, segment, selection, count, result->aggs);
+    }
+    else
+    {
+        project_rows(query, segment, selection, count, result);
+        compute->rows_out += count;
+    }
+    compute->nanoseconds += monotonic_ns() - start;
+}
+
+/* Adds the counters of one morsel to a query's profile.
+ */
+static void merge_profile(QueryProfile *dst, const QueryProfile *src)
+{
+    int iter;
+
+    dst->segments += src->segments;
+    dst->zone_skips += src->zone_skips;
+    dst->bloom_skips += src->bloom_skips;
+    for (iter = 0; iter < OP_COUNT; iter++)
+    {
+        dst->operators[iter].rows_in += src->operators[iter].rows_in;
+        dst->operators[iter].rows_out += src->operators[iter].rows_out;
+        dst->operators[iter].bytes += src->operators[iter].bytes;
+        dst->operators[iter].nanoseconds += src->operators[iter].nanoseconds;
+    }
+}
+
+/* Worker task: claims morsels of the current wave until none are left
+ * and runs filter, projection or aggregation on each of them.
+ */
+static void scan_worker(void *arg)
+{
+    Scan *scan;
+    SelectQuery *query;
+    MorselResult *result;
+    int *selection;
+    int morsel;
+    int count;
+
+    scan = arg;
+    query = scan->query;
+    selection = malloc(sizeof(int) * MORSEL_ROWS);
+    if (selection == NULL)
+    {
+        return;
+    }
+
+    while (1)
+    {
+        morsel = atomic_fetch_add_explicit(&scan->next_morsel, 1, memory_order_relaxed);
+        if (morsel >= scan->end_morsel)
+        {
+            break;
+        }
+
+        result = &scan->results[morsel - scan->first_morsel];
+        if (query->profile != NULL)
+        {
+            profile_morsel(query, morsel, selection, result);
+            continue;
+        }
+        count = filter_rows(query, morsel, selection, &result->profile);
+
+        if (query->group_column >= 0)
+        {
+            group_rows(query, morsel, selection, count, &result->groups);
+        }
+        else if (query->aggregate_count > 0)
+        {
+            aggregate_rows(query, morsel, selection, count, result->aggs);
+        }
+        else
+        {
+            project_rows(query, morsel, selection, count, result);
+            result->profile.operators[OP_COMPUTE].rows_out += count;
+        }
+    }
+    free(selection);
+}
+
+static int compare_first_row(const void *a, const void *b)
+{
+    const GroupEntry *x;
+    const GroupEntry *y;
+
+    x = a;
+    y = b;
+    return (x->first_row > y->first_row) - (x->first_row < y->first_row);
+}
+
+/* Prints one output row per group, in order of first appearance.
+ */
+static void print_groups(const SelectQuery *query, GroupTable *groups)
+{
+    GroupEntry *entries;
+    char value[64];
+    int count;
+    int iter;
+    int item;
+
+    entries = malloc(sizeof(GroupEntry) * (groups->count + 1));
+    if (entries == NULL)
+    {
+        output_printf("Error: Memory allocation failed while grouping rows.\n");
+        return;
+    }
+
+    count = 0;
+    for (iter = 0; iter < groups->capacity; iter++)
+    {
+        if (groups->entries[iter].key != NULL)
+        {
+            entries[count++] = groups->entries[iter];
+        }
+    }
+    qsort(entries, count, sizeof(GroupEntry), compare_first_row);
+
+    for (iter = 0; iter < count; iter++)
+    {
+        for (item = 0; item < query->item_count; item++)
+        {
+            if (query->items[item].aggregate == AGG_NONE)
+            {
+                output_printf("%s\t", entries[iter].key);
+            }
+            else
+            {
+                format_agg(&entries[iter].aggs[item], &query->items[item], value, sizeof(value));
+                output_printf("%s\t", value);
+            }
+        }
+        output_printf("\n");
+    }
+    free(entries);
+}
+
+/* Prints the labels of a query's select list on one line.
+ */
+static void print_labels(const SelectQuery *query)
+{
+    const SelectItem *item;
+    int iter;
+
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        item = &query->items[iter];
+        if (item->aggregate == AGG_NONE)
+        {
+            output_printf("%s\t", item->column_name);
+        }
+        else if (item->aggregate == AGG_APPROX_QUANTILE)
+        {
+            output_printf("%s(%s, %g)\t", aggregate_name(item->aggregate), item->column_name, item->fraction);
+        }
+        else
+        {
+            output_printf("%s(%s)\t", aggregate_name(item->aggregate), item->column_name != NULL ? item->column_name : "*");
+        }
+    }
+    output_printf("\n");
+}
+
+/* Prints the header line of a result: the table name and item labels.
+ */
+static void print_header(const SelectQuery *query)
+{
+    output_printf("Table: %s\n", query->table->name);
+    print_labels(query);
+}
+
+/* Scans the pinned snapshot of a query. The rows are split into morsels
+ * of MORSEL_ROWS rows that pool workers claim dynamically; each morsel is
+ * filtered and then projected or aggregated into its own result slot.
+ * Slots are merged in morsel order, so output matches a serial scan.
+ * Returns the number of rows output, or -1 if memory ran out.
+ */
+static int64_t scan_snapshot(SelectQuery *query)
+{
+    Scan scan;
+    ThreadPool *pool;
+    TaskGroup group;
+    MorselResult *result;
+    QueryProfile counts;
+    QueryProfile *profile;
+    AggState *totals;
+    GroupTable groups;
+    GroupEntry *src;
+    GroupEntry *dst;
+    char value[64];
+    int64_t start;
+    int failed;
+    int morsel_count;
+    int wave_size;
+    int worker_count;
+    int iter;
+    int slot;
+    int item;
+
+    start = monotonic_ns();
+    print_header(query);
+    timer_add(PHASE_OUTPUT, start);
+
+    pool = pool_shared();
+    worker_count = pool_thread_count(pool);
+    if (worker_count < 1)
+    {
+        worker_count = 1;
+    }
+    morsel_count = segments_for_rows(query->snapshot.row_count);
+    wave_size = worker_count * MORSELS_PER_WORKER;
+
+    /* A plain SELECT counts only what the statement's timer reports. */
+    memset(&counts, 0, sizeof(QueryProfile));
+    profile = query->profile != NULL ? query->profile : &counts;
+
+    scan.query = query;
+    scan.results = calloc(wave_size, sizeof(MorselResult));
+    totals = malloc(sizeof(AggState) * (query->item_count + 1));
+    memset(&groups, 0, sizeof(GroupTable));
+    if (scan.results == NULL || totals == NULL)
+    {
+        output_printf("Error: Memory allocation failed for query execution.\n");
+        free(scan.results);
+        free(totals);
+        return -1;
+    }
+    init_aggs(totals, query->item_count);
+    failed = 0;
+    for (slot = 0; slot < wave_size; slot++)
+    {
+        scan.results[slot].aggs = malloc(sizeof(AggState) * (query->item_count + 1));
+        if (scan.results[slot].aggs == NULL)
+        {
+            output_printf("Error: Memory allocation failed for query execution.\n");
+            morsel_count = 0;
+            failed = 1;
+        }
+    }
+
+    for (scan.first_morsel = 0; scan.first_morsel < morsel_count; scan.first_morsel += wave_size)
+    {
+        scan.end_morsel = scan.first_morsel + wave_size;
+        if (scan.end_morsel > morsel_count)
+        {
+            scan.end_morsel = morsel_count;
+        }
+        atomic_store(&scan.next_morsel, scan.first_morsel);
+        for (slot = 0; slot < scan.end_morsel - scan.first_morsel; slot++)
+        {
+            scan.results[slot].length = 0;
+            init_aggs(scan.results[slot].aggs, query->item_count);
+            memset(&scan.results[slot].profile, 0, sizeof(QueryProfile));
+        }
+
+        if (scan.end_morsel - scan.first_morsel == 1)
+        {
+            scan_worker(&scan);
+        }
+        else
+        {
+            task_group_init(&group);
+            for (iter = 0; iter < worker_count && iter < scan.end_morsel - scan.first_morsel; iter++)
+            {
+                pool_submit(pool, &group, scan_worker, &scan);
+            }
+            pool_wait(pool, &group);
+        }
+
+        for (slot = 0; slot < scan.end_morsel - scan.first_morsel; slot++)
+        {
+            result = &scan.results[slot];
+            merge_profile(profile, &result->profile);
+            if (query->group_column >= 0)
+            {
+                for (iter = 0; iter < result->groups.capacity; iter++)
+                {
+                    src = &result->groups.entries[iter];
+                    if (src->key == NULL)
+                    {
+                        continue;
+                    }
+                    dst = find_group(&groups, src->key, src->length, src->hash, query->item_count);
+                    if (dst == NULL)
+                    {
+                        failed = 1;
+                        break;
+                    }
+                    if (dst->first_row < 0)
+                    {
+                        dst->first_row = src->first_row;
+                    }
+                    for (item = 0; item < query->item_count; item++)
+                    {
+                        merge_agg(&dst->aggs[item], &src->aggs[item], query->items[item].aggregate);
+                    }
+                }
+                free_groups(&result->groups);
+            }
+            else if (query->aggregate_count > 0)
+            {
+                for (item = 0; item < query->item_count; item++)
+                {
+                    merge_agg(&totals[item], &result->aggs[item], query->items[item].aggregate);
+                }
+                release_aggs(result->aggs, query->item_count);
+            }
+            else if (result->length > 0)
+            {
+                start = monotonic_ns();
+                output_write(result->text, result->length);
+                timer_add(PHASE_OUTPUT, start);
+            }
+        }
+    }
+
+    start = monotonic_ns();
+    if (query->group_column >= 0)
+    {
+        profile->operators[OP_COMPUTE].rows_out = groups.count;
+        print_groups(query, &groups);
+        free_groups(&groups);
+    }
+    else if (query->aggregate_count > 0)
+    {
+        profile->operators[OP_COMPUTE].rows_out = 1;
+        for (item = 0; item < query->item_count; item++)
+        {
+            format_agg(&totals[item], &query->items[item], value, sizeof(value));
+            output_printf("%s\t", value);
+        }
+        output_printf("\n");
+    }
+    timer_add(PHASE_OUTPUT, start);
+    timer_count(profile->segments, profile->zone_skips + profile->bloom_skips,
+                profile->operators[OP_SCAN].rows_out, profile->operators[OP_COMPUTE].rows_out);
+
+    for (slot = 0; slot < wave_size; slot++)
+    {
+        free(scan.results[slot].text);
+        free(scan.results[slot].aggs);
+    }
+    free(scan.results);
+    release_aggs(totals, query->item_count);
+    free(totals);
+    return failed ? -1 : profile->operators[OP_COMPUTE].rows_out;
+}
+
+/* Executes a planned query on a pinned version of its table, so that
+ * writers can go on changing the table while the query runs.
+ */
+void execute_select(SelectQuery *query)
+{
+    pin_table(query->table, &query->snapshot);
+    scan_snapshot(query);
+    unpin_table(&query->snapshot);
+}
+
+static const char *compare_name(CompareOp op)
+{
+    switch (op)
+    {
+        case CMP_EQ:
+            return "=";
+        case CMP_NE:
+            return "!=";
+        case CMP_LT:
+            return "<";
+        case CMP_LE:
+            return "<=";
+        case CMP_GT:
+            return ">";
+        default:
+            return ">=";
+    }
+}
+
+/* Appends formatted text to a label, truncating it to the label's size.
+ * Returns the new length, which may exceed the size once truncated.
+ */
+static size_t append_label(char *label, size_t size, size_t length, const char *format, ...)
+{
+    va_list args;
+    int written;
+
+    if (length >= size)
+    {
+        return length;
+    }
+    va_start(args, format);
+    written = vsnprintf(label + length, size - length, format, args);
+    va_end(args);
+    return written < 0 ? length : length + written;
+}
+
+/* Describes the operator that computes a query's result: its projection,
+ * aggregation or grouping, or the write of an UPDATE or DELETE.
+ * Returns the length of the description.
+ */
+static size_t format_compute(const SelectQuery *query, char *label, size_t size)
+{
+    const SelectItem *item;
+    size_t length;
+    int iter;
+
+    if (query->assignment_count > 0)
+    {
+        length = append_label(label, size, 0, "Update (");
+        for (iter = 0; iter < query->assignment_count; iter++)
+        {
+            length = append_label(label, size, length, "%s%s = '%s'", iter > 0 ? ", " : "",
+                                  query->assignments[iter].column_name, query->assignments[iter].value);
+        }
+        return append_label(label, size, length, ")");
+    }
+    if (query->item_count == 0)
+    {
+        return append_label(label, size, 0, "Delete");
+    }
+
+    if (query->group_column >= 0)
+    {
+        length = append_label(label, size, 0, "Group by %s (", query->group_name);
+    }
+    else if (query->aggregate_count > 0)
+    {
+        length = append_label(label, size, 0, "Aggregate (");
+    }
+    else
+    {
+        length = append_label(label, size, 0, "Project (");
+    }
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        item = &query->items[iter];
+        if (item->aggregate == AGG_NONE)
+        {
+            length = append_label(label, size, length, "%s%s", iter > 0 ? ", " : "", item->column_name);
+        }
+        else if (item->aggregate == AGG_APPROX_QUANTILE)
+        {
+            length = append_label(label, size, length, "%s%s(%s, %g)", iter > 0 ? ", " : "",
+                                  aggregate_name(item->aggregate), item->column_name, item->fraction);
+        }
+        else
+        {
+            length = append_label(label, size, length, "%s%s(%s)", iter > 0 ? ", " : "",
+                                  aggregate_name(item->aggregate), item->column_name != NULL ? item->column_name : "*");
+        }
+    }
+    return append_label(label, size, length, ")");
+}
+
+/* Describes the WHERE clause of a query that has one.
+ * Returns the length of the description.
+ */
+static size_t format_filter(const SelectQuery *query, char *label, size_t size)
+{
+    const Predicate *predicate;
+    size_t length;
+    int iter;
+
+    length = append_label(label, size, 0, "Filter (");
+    for (iter = 0; iter < query->predicate_count; iter++)
+    {
+        predicate = &query->predicates[iter];
+        length = append_label(label, size, length, predicate->is_number ? "%s%s %s %s" : "%s%s %s '%s'",
+                              iter > 0 ? " AND " : "", predicate->column_name, compare_name(predicate->op),
+                              predicate->value);
+    }
+    return append_label(label, size, length, ")");
+}
+
+/* Describes the plan of a prepared query on one line, top operator
+ * first, for the slow-query log:
+ *   Aggregate (COUNT(*)) <- Filter (name = 'x') <- Scan t (Bloom filters on name)
+ */
+static void describe_plan(const SelectQuery *query, char *plan, size_t size)
+{
+    const Predicate *predicate;
+    size_t length;
+    int blooms;
+    int iter;
+
+    length = format_compute(query, plan, size);
+    if (query->predicate_count > 0)
+    {
+        length = append_label(plan, size, length, " <- ");
+        if (length < size)
+        {
+            length += format_filter(query, plan + length, size - length);
+        }
+    }
+    length = append_label(plan, size, length, " <- Scan %s", query->table->name);
+    blooms = 0;
+    for (iter = 0; iter < query->predicate_count; iter++)
+    {
+        predicate = &query->predicates[iter];
+        if (predicate->op == CMP_EQ && !predicate->is_number && query->table->columns[predicate->column]->bloom)
+        {
+            length = append_label(plan, size, length, "%s%s", blooms++ > 0 ? ", " : " (Bloom filters on ",
+                                  predicate->column_name);
+        }
+    }
+    if (blooms > 0)
+    {
+        append_label(plan, size, length, ")");
+    }
+}
+
+/* Parses and plans a statement, timing both phases, and describes its
+ * plan if the statement's timer asks for it. The query has to be
+ * freed with free_select() whether this succeeds or not.
+ * Returns 0 on success, -1 on failure.
+ */
+static int prepare_query(Database *db, const char *sql, ParseFunc parse, SelectQuery *query)
+{
+    char *plan;
+    int64_t start;
+    int status;
+
+    start = monotonic_ns();
+    status = parse(sql, query);
+    timer_add(PHASE_PARSE, start);
+    if (status != 0)
+    {
+        return -1;
+    }
+    start = monotonic_ns();
+    status = plan_select(db, query);
+    timer_add(PHASE_PLAN, start);
+    plan = timer_plan();
+    if (status == 0 && plan != NULL)
+    {
+        describe_plan(query, plan, PLAN_LENGTH);
+    }
+    return status;
+}
+
+/* Rewrites a statement as its tokens separated by single spaces, so
+ * that statements differing only in spacing share a cache entry.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int normalize_statement(const char *sql, ByteBuffer *key)
+{
+    Lexer lex;
+    int failed;
+
+    failed = 0;
+    lex.pos = sql;
+    for (next_token(&lex); lex.kind != TOKEN_END && !failed; next_token(&lex))
+    {
+        if (key->length > 0)
+        {
+            failed |= buffer_append(key, " ", 1);
+        }
+        if (lex.kind == TOKEN_STRING)
+        {
+            failed |= buffer_append(key, "'", 1);
+        }
+        failed |= buffer_append(key, lex.text, strlen(lex.text));
+        if (lex.kind == TOKEN_STRING)
+        {
+            failed |= buffer_append(key, "'", 1);
+        }
+    }
+    failed |= buffer_append(key, "", 1);
+    return failed ? -1 : 0;
+}
+
+/* Runs a planned SELECT through the result cache: a result cached for
+ * the same statement and the same state of its table is written out
+ * with no scan; otherwise the table is scanned and the output, if it
+ * fits, is cached for the next time.
+ */
+static void execute_cached_select(ResultCache *cache, const char *key, SelectQuery *query)
+{
+    OutputCopy copy;
+    OutputCopy *previous;
+    char *plan;
+    int64_t rows;
+
+    pin_table(query->table, &query->snapshot);
+    if (cache_fetch(cache, key, query->snapshot.stamp, &rows) == 0)
+    {
+        unpin_table(&query->snapshot);
+        metrics_add(COUNTER_CACHE_HITS, 1);
+        timer_count(0, 0, 0, rows);
+        plan = timer_plan();
+        if (plan != NULL)
+        {
+            snprintf(plan, PLAN_LENGTH, "Result cache");
+        }
+        return;
+    }
+
+    metrics_add(COUNTER_CACHE_MISSES, 1);
+    memset(&copy, 0, sizeof(OutputCopy));
+    copy.limit = cache_entry_limit(cache);
+    previous = output_copy(&copy);
+    rows = scan_snapshot(query);
+    output_copy(previous);
+    if (rows >= 0 && !copy.overflowed)
+    {
+        cache_store(cache, key, query->snapshot.stamp, copy.buffer.data, copy.buffer.length, rows);
+    }
+    buffer_free(&copy.buffer);
+    unpin_table(&query->snapshot);
+}
+
+/* A materialized view: the groups of a grouped SELECT, kept up to date
+ * as rows are inserted into its table. Group keys and MIN and MAX cells
+ * are copies, so the view never points into the table.
+ */
+struct View
+{
+    char *name;
+    uint32_t name_hash;   /* hash_name() of name */
+    char *definition;     /* The SELECT the view was created with */
+    SelectQuery query;    /* The definition, planned on the view's table */
+    GroupTable groups;
+    uint64_t stamp;       /* State of the table the groups reflect, 0 if stale */
+    pthread_mutex_t lock; /* Guards the groups and the stamp */
+    View *next;           /* Next view over the same table */
+};
+
+/* Finds the entry for a group key without inserting one.
+ * Returns NULL if the group is not in the table.
+ */
+static GroupEntry *lookup_group(GroupTable *groups, const char *key, uint32_t length, uint32_t hash)
+{
+    GroupEntry *entry;
+    int slot;
+
+    if (groups->capacity == 0)
+    {
+        return NULL;
+    }
+    slot = hash & (groups->capacity - 1);
+    while (groups->entries[slot].key != NULL)
+    {
+        entry = &groups->entries[slot];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->key, key, length) == 0)
+        {
+            return entry;
+        }
+        slot = (slot + 1) & (groups->capacity - 1);
+    }
+    return NULL;
+}
+
+/* Frees a view's groups together with the keys and cells they own.
+ */
+static void clear_view_groups(View *view)
+{
+    GroupEntry *entry;
+    int iter;
+    int item;
+
+    for (iter = 0; iter < view->groups.capacity; iter++)
+    {
+        entry = &view->groups.entries[iter];
+        if (entry->key == NULL)
+        {
+            continue;
+        }
+        for (item = 0; item < view->query.item_count; item++)
+        {
+            if (view->query.items[item].aggregate == AGG_MIN || view->query.items[item].aggregate == AGG_MAX)
+            {
+                free((char*)entry->aggs[item].extreme);
+            }
+        }
+        free((char*)entry->key);
+    }
+    free_groups(&view->groups);
+}
+
+static void free_view(View *view)
+{
+    clear_view_groups(view);
+    free_select(&view->query);
+    pthread_mutex_destroy(&view->lock);
+    free(view->name);
+    free(view->definition);
+    free(view);
+}
+
+/* Tells whether a row of a table version satisfies every predicate of
+ * a query.
+ */
+static int row_matches(const SelectQuery *query, const TableVersion *version, int64_t row)
+{
+    const Predicate *predicate;
+    int iter;
+
+    for (iter = 0; iter < query->predicate_count; iter++)
+    {
+        predicate = &query->predicates[iter];
+        if (!match_predicate(predicate, cell_at(version, predicate->column, row)))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Folds one row of a table version into a view's groups, copying the
+ * group key of a new group and every new MIN or MAX cell.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int fold_view_row(View *view, const TableVersion *version, int64_t row)
+{
+    const SelectQuery *query;
+    const SelectItem *item;
+    GroupEntry *entry;
+    AggState *agg;
+    const Cell *key;
+    const char *extreme;
+    const char *cell;
+    char *copy;
+    uint32_t hash;
+    int iter;
+
+    query = &view->query;
+    key = cell_at(version, query->group_column, row);
+    hash = hash_cell(key);
+    entry = lookup_group(&view->groups, cell_text(key), key->length, hash);
+    if (entry == NULL)
+    {
+        copy = strdup(cell_text(key));
+        entry = copy == NULL ? NULL : find_group(&view->groups, copy, key->length, hash, query->item_count);
+        if (entry == NULL)
+        {
+            free(copy);
+            return -1;
+        }
+        entry->first_row = row;
+    }
+
+    for (iter = 0; iter < query->item_count; iter++)
+    {
+        item = &query->items[iter];
+        agg = &entry->aggs[iter];
+        if (item->aggregate == AGG_NONE)
+        {
+            continue;
+        }
+        if (item->column < 0)
+        {
+            agg->count++;
+            continue;
+        }
+        cell = cell_text(cell_at(version, item->column, row));
+        extreme = agg->extreme;
+        update_agg(agg, item->aggregate, cell);
+        if (agg->extreme != extreme)
+        {
+            agg->extreme = strdup(cell);
+            if (agg->extreme == NULL)
+            {
+                agg->extreme = extreme;
+                return -1;
+            }
+            free((char*)extreme);
+        }
+    }
+    return 0;
+}
+
+/* Rebuilds a view's groups from a pinned snapshot of its table, one
+ * segment at a time, skipping the segments that zone maps and Bloom
+ * filters rule out. The caller holds the view's lock.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int refresh_view(View *view, const TableSnapshot *snapshot)
+{
+    QueryProfile counts;
+    int *selection;
+    int64_t row;
+    int segment_count;
+    int segment;
+    int failed;
+    int count;
+    int iter;
+
+    clear_view_groups(view);
+    view->stamp = 0;
+    selection = malloc(sizeof(int) * SEGMENT_ROWS);
+    if (selection == NULL)
+    {
+        return -1;
+    }
+
+    memset(&counts, 0, sizeof(QueryProfile));
+    view->query.snapshot = *snapshot;
+    segment_count = segments_for_rows(snapshot->row_count);
+    failed = 0;
+    for (segment = 0; segment < segment_count && !failed; segment++)
+    {
+        count = filter_rows(&view->query, segment, selection, &counts);
+        for (iter = 0; iter < count && !failed; iter++)
+        {
+            row = ((int64_t)segment << SEGMENT_SHIFT) + selection[iter];
+            failed = fold_view_row(view, snapshot->version, row) != 0;
+        }
+    }
+    free(selection);
+    timer_count(counts.segments, counts.zone_skips + counts.bloom_skips, counts.operators[OP_SCAN].rows_out, 0);
+
+    if (failed)
+    {
+        clear_view_groups(view);
+        return -1;
+    }
+    view->stamp = snapshot->stamp;
+    return 0;
+}
+
+/* Folds rows just appended to a locked table, from first_row on, into
+ * the views over it. Only a view that reflects the table as it was
+ * right before the append is brought forward; one that missed a DELETE,
+ * UPDATE or compaction is left stale and rebuilt when it is next read.
+ */
+void update_views(const TableSnapshot *snapshot, int64_t first_row, uint64_t previous_stamp)
+{
+    View *view;
+    int64_t row;
+    int failed;
+
+    for (view = snapshot->table->views; view != NULL; view = view->next)
+    {
+        pthread_mutex_lock(&view->lock);
+        if (view->stamp == previous_stamp)
+        {
+            failed = 0;
+            for (row = first_row; row < snapshot->row_count && !failed; row++)
+            {
+                if (row_matches(&view->query, snapshot->version, row))
+                {
+                    failed = fold_view_row(view, snapshot->version, row) != 0;
+                }
+            }
+            view->stamp = failed ? 0 : snapshot->stamp;
+        }
+        pthread_mutex_unlock(&view->lock);
+    }
+}
+
+/* Creates a materialized view over the groups of a SELECT and fills it
+ * from its table:
+ *   CREATE MATERIALIZED VIEW name AS SELECT ... FROM table [WHERE ...] GROUP BY column
+ * The caller holds the catalog lock exclusively.
+ */
+void create_view(Database *db, const char *sql)
+{
+    TableSnapshot snapshot;
+    View *view;
+    Lexer lex;
+    int status;
+
+    lex.pos = sql;
+    next_token(&lex);
+    if (!accept(&lex, "CREATE") || !accept(&lex, "MATERIALIZED") || !accept(&lex, "VIEW") || lex.kind != TOKEN_WORD)
+    {
+        output_printf("Error: Invalid CREATE MATERIALIZED VIEW syntax.\n");
+        return;
+    }
+    if (find_table(db, lex.text) != NULL)
+    {
+        output_printf("Error: Table '%s' already exists.\n", lex.text);
+        return;
+    }
+    if (find_view(db, lex.text) != NULL)
+    {
+        output_printf("Error: View '%s' already exists.\n", lex.text);
+        return;
+    }
+
+    view = calloc(1, sizeof(View));
+    if (view == NULL)
+    {
+        output_printf("Error: Memory allocation failed for view '%s'.\n", lex.text);
+        return;
+    }
+    pthread_mutex_init(&view->lock, NULL);
+    view->query.group_column = -1;
+    view->name = strdup(lex.text);
+    view->name_hash = hash_name(lex.text);
+    next_token(&lex);
+    if (lex.kind != TOKEN_WORD || strcmp(lex.text, "AS") != 0)
+    {
+        output_printf("Error: Expected AS SELECT after the name of view '%s'.\n", view->name);
+        free_view(view);
+        return;
+    }
+    while (isspace((unsigned char)*lex.pos))
+    {
+        lex.pos++;
+    }
+    view->definition = strdup(lex.pos);
+    if (view->name == NULL || view->definition == NULL)
+    {
+        output_printf("Error: Memory allocation failed for view.\n");
+        free_view(view);
+        return;
+    }
+
+    if (parse_select(view->definition, &view->query) != 0 || plan_select(db, &view->query) != 0)
+    {
+        free_view(view);
+        return;
+    }
+    if (view->query.group_column < 0)
+    {
+        output_printf("Error: A materialized view needs a GROUP BY clause.\n");
+        free_view(view);
+        return;
+    }
+
+    pin_table(view->query.table, &snapshot);
+    pthread_mutex_lock(&view->lock);
+    status = refresh_view(view, &snapshot);
+    pthread_mutex_unlock(&view->lock);
+    unpin_table(&snapshot);
+    if (status != 0)
+    {
+        output_printf("Error: Memory allocation failed while filling view '%s'.\n", view->name);
+        free_view(view);
+        return;
+    }
+
+    view->next = view->query.table->views;
+    view->query.table->views = view;
+    output_printf("Materialized view '%s' created with %d groups.\n", view->name, view->groups.count);
+}
+
+/* Searches for a materialized view by name in the Database.
+ * Returns the view if found, or NULL otherwise.
+ */
+View *find_view(Database *db, const char *name)
+{
+    View *view;
+    uint32_t hash;
+    int iter;
+
+    hash = hash_name(name);
+    for (iter = 0; iter < db->table_count; iter++)
+    {
+        for (view = db->tables[iter]->views; view != NULL; view = view->next)
+        {
+            if (view->name_hash == hash && strcmp(view->name, name) == 0)
+            {
+                return view;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Returns the view a "SELECT * FROM name" statement reads, or NULL if
+ * the statement reads anything else.
+ */
+static View *selected_view(Database *db, const char *sql)
+{
+    View *view;
+    Lexer lex;
+
+    lex.pos = sql;
+    next_token(&lex);
+    if (!accept(&lex, "SELECT") || !accept(&lex, "*") || !accept(&lex, "FROM") || lex.kind != TOKEN_WORD)
+    {
+        return NULL;
+    }
+    view = find_view(db, lex.text);
+    next_token(&lex);
+    return lex.kind == TOKEN_END ? view : NULL;
+}
+
+/* Prints the groups of a view, in order of first appearance. A view
+ * whose table changed other than by inserts since it was last brought
+ * up to date is rebuilt first. The groups are formatted under the
+ * view's lock and written after it, so a slow client never holds up
+ * inserts into the table.
+ */
+static void print_view(View *view)
+{
+    TableSnapshot snapshot;
+    ByteBuffer result;
+    ByteBuffer *output;
+    char *plan;
+    int64_t start;
+    int64_t rows;
+    int status;
+
+    memset(&result, 0, sizeof(ByteBuffer));
+    plan = timer_plan();
+    pthread_mutex_lock(&view->lock);
+    pin_table(view->query.table, &snapshot);
+    status = 0;
+    if (plan != NULL)
+    {
+        snprintf(plan, PLAN_LENGTH, "Materialized view %s", view->name);
+    }
+    if (view->stamp != snapshot.stamp)
+    {
+        status = refresh_view(view, &snapshot);
+        if (plan != NULL)
+        {
+            snprintf(plan, PLAN_LENGTH, "Materialized view %s, rebuilt from %s", view->name, view->query.table->name);
+        }
+    }
+    unpin_table(&snapshot);
+
+    start = monotonic_ns();
+    rows = view->groups.count;
+    if (status == 0)
+    {
+        output = output_capture(&result);
+        output_printf("View: %s\n", view->name);
+        print_labels(&view->query);
+        print_groups(&view->query, &view->groups);
+        output_capture(output);
+    }
+    pthread_mutex_unlock(&view->lock);
+
+    if (status != 0)
+    {
+        output_printf("Error: Memory allocation failed while rebuilding view '%s'.\n", view->name);
+    }
+    else
+    {
+        output_write(result.data, result.length);
+        timer_count(0, 0, 0, rows);
+    }
+    timer_add(PHASE_OUTPUT, start);
+    buffer_free(&result);
+}
+
+/* Moves the views over tables that LOAD replaced onto the loaded tables
+ * of the same names, planning their definitions again; a view whose
+ * table or columns are gone is dropped. The views are rebuilt when they
+ * are next read. The caller holds the catalog lock exclusively.
+ */
+void adopt_views(Database *db, Table **tables, int table_count)
+{
+    View *view;
+    View *next;
+    int iter;
+
+    for (iter = 0; iter < table_count; iter++)
+    {
+        for (view = tables[iter]->views; view != NULL; view = next)
+        {
+            next = view->next;
+            clear_view_groups(view);
+            free_select(&view->query);
+            view->stamp = 0;
+            if (parse_select(view->definition, &view->query) != 0 || plan_select(db, &view->query) != 0)
+            {
+                output_printf("View '%s' dropped.\n", view->name);
+                free_view(view);
+                continue;
+            }
+            view->next = view->query.table->views;
+            view->query.table->views = view;
+        }
+        tables[iter]->views = NULL;
+    }
+}
+
+/* Frees the views over a table.
+ */
+void free_views(Table *table)
+{
+    View *view;
+    View *next;
+
+    for (view = table->views; view != NULL; view = next)
+    {
+        next = view->next;
+        free_view(view);
+    }
+    table->views = NULL;
+}
+
+/* Parses, plans and executes a SELECT statement, answering it from the
+ * result cache when the cache is on. SELECT * FROM a materialized view
+ * prints the view.
+ */
+void run_select(Database *db, const char *sql)
+{
+    SelectQuery query;
+    ByteBuffer key;
+    View *view;
+
+    view = selected_view(db, sql);
+    if (view != NULL)
+    {
+        print_view(view);
+        return;
+    }
+
+    memset(&key, 0, sizeof(ByteBuffer));
+    if (prepare_query(db, sql, parse_select, &query) == 0)
+    {
+        if (db->cache != NULL && normalize_statement(sql, &key) == 0)
+        {
+            execute_cached_select(db->cache, key.data, &query);
+        }
+        else
+        {
+            execute_select(&query);
+        }
+    }
+    buffer_free(&key);
+    free_select(&query);
+}
+
+/* Prints one operator of an EXPLAIN ANALYZE tree, indented by its depth.
+ */
+static void print_operator(int depth, const char *label, const OperatorStats *stats)
+{
+    output_printf("%*s%s: rows in=%lld out=%lld bytes=%lld time=%.3f ms\n", depth * 2, "", label,
+                  (long long)stats->rows_in, (long long)stats->rows_out, (long long)stats->bytes,
+                  stats->nanoseconds / 1e6);
+}
+
+/* Prints the operator tree of an analyzed query, output first.
+ */
+static void print_profile(const SelectQuery *query, const QueryProfile *profile)
+{
+    char label[MAX_QUERY_LENGTH];
+    int depth;
+
+    print_operator(0, "Output", &profile->operators[OP_OUTPUT]);
+    format_compute(query, label, sizeof(label));
+    print_operator(1, label, &profile->operators[OP_COMPUTE]);
+
+    depth = 2;
+    if (query->predicate_count > 0)
+    {
+        format_filter(query, label, sizeof(label));
+        print_operator(depth++, label, &profile->operators[OP_FILTER]);
+    }
+
+    snprintf(label, sizeof(label), "Scan %s", query->table->name);
+    print_operator(depth, label, &profile->operators[OP_SCAN]);
+    output_printf("%*sSegments: %lld, skipped by zone maps %lld, by Bloom filters %lld\n", depth * 2 + 2, "",
+                  (long long)profile->segments, (long long)profile->zone_skips, (long long)profile->bloom_skips);
+}
+
+/* Runs a SELECT with its result discarded and prints the operator tree,
+ * with the rows each operator took in and passed on, the bytes it read
+ * or wrote and the time it spent, summed over the workers:
+ *   EXPLAIN ANALYZE SELECT ...
+ */
+void explain_select(Database *db, const char *sql)
+{
+    SelectQuery query;
+    QueryProfile profile;
+    StatementTimer timer;
+    StatementTimer *previous;
+    ByteBuffer result;
+    ByteBuffer *output;
+    Lexer lex;
+    int64_t start;
+
+    lex.pos = sql;
+    next_token(&lex);
+    if (!accept(&lex, "EXPLAIN") || lex.kind != TOKEN_WORD || strcmp(lex.text, "ANALYZE") != 0)
+    {
+        output_printf("Error: Invalid EXPLAIN ANALYZE syntax.\n");
+        return;
+    }
+
+    timer_start(&timer);
+    previous = timer_capture(&timer);
+    if (prepare_query(db, lex.pos, parse_select, &query) != 0)
+    {
+        timer_capture(previous);
+        free_select(&query);
+        return;
+    }
+
+    memset(&profile, 0, sizeof(QueryProfile));
+    memset(&result, 0, sizeof(ByteBuffer));
+    query.profile = &profile;
+    output = output_capture(&result);
+    start = monotonic_ns();
+    execute_select(&query);
+    start = monotonic_ns() - start;
+    output_capture(output);
+    timer_capture(previous);
+
+    profile.operators[OP_OUTPUT].rows_in = profile.operators[OP_COMPUTE].rows_out;
+    profile.operators[OP_OUTPUT].rows_out = profile.operators[OP_COMPUTE].rows_out;
+    profile.operators[OP_OUTPUT].bytes = result.length;
+    profile.operators[OP_OUTPUT].nanoseconds = timer.phases[PHASE_OUTPUT];
+    print_profile(&query, &profile);
+    output_printf("Planning: parse %.3f ms, plan %.3f ms\n", timer.phases[PHASE_PARSE] / 1e6,
+                  timer.phases[PHASE_PLAN] / 1e6);
+    output_printf("Execution: %.3f ms\n", start / 1e6);
+
+    buffer_free(&result);
+    free_select(&query);
+}
+
+/* Parses a DELETE statement:
+ *   DELETE FROM table [WHERE column op value [AND ...]]
+ * Returns 0 on success, -1 on a syntax error.
+ */
+static int parse_delete(const char *sql, SelectQuery *query)
+{
+    Lexer lex;
+
+    memset(query, 0, sizeof(SelectQuery));
+    query->group_column = -1;
+
+    lex.pos = sql;
+    next_token(&lex);
+    if (!accept(&lex, "DELETE") || !accept(&lex, "FROM"))
+    {
+        output_printf("Error: Invalid DELETE FROM syntax.\n");
+        return -1;
+    }
+    if (lex.kind != TOKEN_WORD)
+    {
+        output_printf("Error: Table name is missing in DELETE query.\n");
+        return -1;
+    }
+    query->table_name = strdup(lex.text);
+    next_token(&lex);
+
+    if (parse_where(&lex, query) != 0)
+    {
+        return -1;
+    }
+    if (lex.kind != TOKEN_END)
+    {
+        output_printf("Error: Unexpected '%s' in DELETE query.\n", lex.text);
+        return -1;
+    }
+    return 0;
+}
+
+/* Worker task: claims morsels and applies the write to their
+ * matching rows.
+ */
+static void write_worker(void *arg)
+{
+    WriteScan *scan;
+    QueryProfile counts;
+    int *selection;
+    int morsel;
+    int count;
+
+    scan = arg;
+    selection = malloc(sizeof(int) * MORSEL_ROWS);
+    if (selection == NULL)
+    {
+        return;
+    }
+
+    memset(&counts, 0, sizeof(QueryProfile));
+    while (1)
+    {
+        morsel = atomic_fetch_add_explicit(&scan->next_morsel, 1, memory_order_relaxed);
+        if (morsel >= scan->morsel_count)
+        {
+            break;
+        }
+
+        count = filter_rows(scan->query, morsel, selection, &counts);
+        count = count > 0 ? scan->apply(scan->query, morsel, selection, count) : 0;
+        atomic_fetch_add_explicit(&scan->rows, count, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&scan->scanned, counts.operators[OP_SCAN].rows_out, memory_order_relaxed);
+    atomic_fetch_add_explicit(&scan->skipped, counts.zone_skips + counts.bloom_skips, memory_order_relaxed);
+    free(selection);
+}
+
+/* Runs a write over every row matching the query's WHERE clause, with
+ * morsels spread over the thread pool. Returns the number of rows written.
+ */
+static int64_t run_write_scan(SelectQuery *query, WriteFunc apply)
+{
+    WriteScan scan;
+    ThreadPool *pool;
+    TaskGroup group;
+    int worker_count;
+    int iter;
+
+    scan.query = query;
+    scan.apply = apply;
+    scan.morsel_count = segments_for_rows(query->snapshot.row_count);
+    atomic_store(&scan.next_morsel, 0);
+    atomic_store(&scan.rows, 0);
+    atomic_store(&scan.scanned, 0);
+    atomic_store(&scan.skipped, 0);
+
+    pool = pool_shared();
+    worker_count = pool_thread_count(pool);
+    if (scan.morsel_count <= 1 || worker_count < 1)
+    {
+        write_worker(&scan);
+    }
+    else
+    {
+        task_group_init(&group);
+        for (iter = 0; iter < worker_count && iter < scan.morsel_count; iter++)
+        {
+            pool_submit(pool, &group, write_worker, &scan);
+        }
+        pool_wait(pool, &group);
+    }
+    timer_count(scan.morsel_count, atomic_load(&scan.skipped), atomic_load(&scan.scanned), atomic_load(&scan.rows));
+    return atomic_load(&scan.rows);
+}
+
+/* Sets the tombstone bits of the selected rows. A segment's bitmap is
+ * created on its first deletion, or copied if it is still shared with
+ * readers of the old version. Returns the number of rows marked, which
+ * is 0 if memory runs out.
+ */
+static int mark_deleted(SelectQuery *query, int segment, const int *selection, int count)
+{
+    uint64_t *deleted;
+    int iter;
+
+    deleted = query->tombstones[segment];
+    if (deleted == NULL || (query->shared_tombstones != NULL && deleted == query->shared_tombstones[segment]))
+    {
+        deleted = memory_alloc(&query->table->memory, SEGMENT_WORDS * sizeof(uint64_t));
+        if (deleted == NULL)
+        {
+            return 0;
+        }
+        if (query->tombstones[segment] != NULL)
+        {
+            memcpy(deleted, query->tombstones[segment], sizeof(uint64_t) * SEGMENT_WORDS);
+        }
+        query->tombstones[segment] = deleted;
+    }
+    for (iter = 0; iter < count; iter++)
+    {
+        deleted[selection[iter] / 64] |= UINT64_C(1) << (selection[iter] % 64);
+    }
+    return count;
+}
+
+/* Deletes the rows of a planned query's table that match its WHERE
+ * clause. Rows are only marked in the tombstone bitmaps of their
+ * segments, which scans skip; the table is compacted once enough rows
+ * are dead. The rows are marked in a copy of the bitmap list, and only
+ * the bitmaps of segments with deleted rows are copied, before it is
+ * published as a new version, so readers never wait for the scan.
+ */
+static void execute_delete(SelectQuery *query)
+{
+    Table *table;
+    TableSnapshot *snapshot;
+    TableVersion *old;
+    TableVersion *version;
+    int64_t deleted;
+    int segment;
+
+    table = query->table;
+    snapshot = &query->snapshot;
+    lock_table(table, snapshot);
+    old = snapshot->version;
+    version = copy_version(table);
+    query->tombstones = NULL;
+    query->shared_tombstones = old->deleted;
+    if (version != NULL)
+    {
+        query->tombstones = calloc(old->segment_capacity, sizeof(uint64_t*));
+        if (query->tombstones != NULL && old->deleted != NULL)
+        {
+            memcpy(query->tombstones, old->deleted, sizeof(uint64_t*) * old->segment_count);
+        }
+    }
+    if (version == NULL || query->tombstones == NULL)
+    {
+        if (version != NULL)
+        {
+            free(version->segments);
+            free(version);
+        }
+        unlock_table(snapshot);
+        output_printf("Error: Memory allocation failed for DELETE.\n");
+        return;
+    }
+
+    deleted = run_write_scan(query, mark_deleted);
+    for (segment = 0; old->deleted != NULL && segment < old->segment_count; segment++)
+    {
+        if (query->tombstones[segment] != old->deleted[segment])
+        {
+            memory_release(&table->memory, old->deleted[segment], SEGMENT_WORDS * sizeof(uint64_t));
+            retire_memory(old, old->deleted[segment]);
+        }
+    }
+    retire_memory(old, old->deleted);
+    version->deleted = query->tombstones;
+    publish_version(table, version, snapshot->row_count, snapshot->deleted_count + deleted);
+    output_printf("%lld rows deleted from table '%s'.\n", (long long)deleted, table->name);
+    compact_table(table);
+    unlock_table(snapshot);
+}
+
+/* Parses, plans and executes a DELETE statement.
+ */
+void run_delete(Database *db, const char *sql)
+{
+    SelectQuery query;
+
+    if (prepare_query(db, sql, parse_delete, &query) == 0)
+    {
+        execute_delete(&query);
+    }
+    free_select(&query);
+}
+
+/* Parses an UPDATE statement:
+ *   UPDATE table SET column = value [, ...] [WHERE column op value [AND ...]]
+ * Returns 0 on success, -1 on a syntax error.
+ */
+static int parse_update(const char *sql, SelectQuery *query)
+{
+    Lexer lex;
+    Assignment *assignments;
+    Assignment *assignment;
+
+    memset(query, 0, sizeof(SelectQuery));
+    query->group_column = -1;
+
+    lex.pos = sql;
+    next_token(&lex);
+    if (!accept(&lex, "UPDATE"))
+    {
+        output_printf("Error: Invalid UPDATE syntax.\n");
+        return -1;
+    }
+    if (lex.kind != TOKEN_WORD)
+    {
+        output_printf("Error: Table name is missing in UPDATE query.\n");
+        return -1;
+    }
+    query->table_name = strdup(lex.text);
+    next_token(&lex);
+
+    if (!accept(&lex, "SET"))
+    {
+        output_printf("Error: Expected SET in UPDATE query.\n");
+        return -1;
+    }
+    do
+    {
+        assignments = realloc(query->assignments, sizeof(Assignment) * (query->assignment_count + 1));
+        if (assignments == NULL)
+        {
+            output_printf("Error: Memory allocation failed for SET list.\n");
+            return -1;
+        }
+        query->assignments = assignments;
+        assignment = &query->assignments[query->assignment_count++];
+        memset(assignment, 0, sizeof(Assignment));
+        assignment->column = -1;
+
+        if (lex.kind != TOKEN_WORD)
+        {
+            output_printf("Error: Expected column name in SET list.\n");
+            return -1;
+        }
+        assignment->column_name = strdup(lex.text);
+        next_token(&lex);
+        if (!accept(&lex, "="))
+        {
+            output_printf("Error: Expected '=' after '%s'.\n", assignment->column_name);
+            return -1;
+        }
+        if (lex.kind != TOKEN_WORD && lex.kind != TOKEN_STRING)
+        {
+            output_printf("Error: Expected value for column '%s'.\n", assignment->column_name);
+            return -1;
+        }
+        assignment->value = strdup(lex.text);
+        next_token(&lex);
+    } while (accept(&lex, ","));
+
+    if (parse_where(&lex, query) != 0)
+    {
+        return -1;
+    }
+    if (lex.kind != TOKEN_END)
+    {
+        output_printf("Error: Unexpected '%s' in UPDATE query.\n", lex.text);
+        return -1;
+    }
+    return 0;
+}
+
+/* Overwrites the assigned cells of the selected rows of a segment. A
+ * segment still shared with readers of the old version is copied first.
+ * Short values are stored inline. A heap text that no reader can see
+ * and that a long value fits in is overwritten in place; otherwise the
+ * value gets a heap text of its own.
+ * Returns the number of rows updated, which is 0 if memory runs out.
+ */
+static int assign_rows(SelectQuery *query, int segment, const int *selection, int count)
+{
+    const Assignment *assignment;
+    MemoryUsage *usage;
+    MemoryTally tally;
+    Segment data;
+    Segment shared;
+    Cell *cell;
+    Cell previous;
+    char *text;
+    size_t length;
+    int iter;
+    int row;
+
+    for (iter = 0; iter < query->assignment_count; iter++)
+    {
+        assignment = &query->assignments[iter];
+        usage = &query->table->columns[assignment->column]->memory;
+        shared = assignment->source[segment];
+        if (assignment->target[segment] == shared)
+        {
+            data = alloc_segment(usage, shared->capacity);
+            if (data == NULL)
+            {
+                return 0;
+            }
+            data->zone = shared->zone;
+            memcpy(data->cells, shared->cells, sizeof(Cell) * segment_rows(query, segment));
+            if (shared->bloom != NULL)
+            {
+                /* Without a copy of the filter the segment is just never skipped */
+                data->bloom = bloom_create();
+                if (data->bloom != NULL)
+                {
+                    memcpy(data->bloom, shared->bloom, BLOOM_SIZE);
+                    memory_track(usage, data->bloom, BLOOM_SIZE);
+                }
+            }
+            assignment->target[segment] = data;
+        }
+    }
+
+    /* Cells are tallied per segment and added to their column once, so
+     * that workers do not contend on its counters.
+     */
+    for (iter = 0; iter < query->assignment_count; iter++)
+    {
+        assignment = &query->assignments[iter];
+        data = assignment->target[segment];
+        shared = assignment->source[segment];
+        length = strlen(assignment->value);
+        memset(&tally, 0, sizeof(MemoryTally));
+        widen_zone(&data->zone, assignment->value);
+        if (data->bloom != NULL)
+        {
+            bloom_add(data->bloom, assignment->value);
+        }
+        for (row = 0; row < count; row++)
+        {
+            cell = &data->cells[selection[row]];
+            text = cell_heap(cell);
+            if (text != NULL && text == cell_heap(&shared->cells[selection[row]]))
+            {
+                /* Still shared with readers of the old version */
+                text = NULL;
+            }
+            if (text != NULL && length > CELL_INLINE && cell->length >= length)
+            {
+                tally_cell(&tally, cell, -1);
+                memcpy(text, assignment->value, length + 1);
+                memcpy(cell->bytes, assignment->value, CELL_PREFIX);
+                cell->length = (uint32_t)length;
+                tally_cell(&tally, cell, 1);
+                continue;
+            }
+            previous = *cell;
+            if (store_cell(cell, assignment->value, length) == 0)
+            {
+                if (text != NULL)
+                {
+                    tally_cell(&tally, &previous, -1);
+                    free(text);
+                }
+                tally_cell(&tally, cell, 1);
+            }
+        }
+        memory_add(&query->table->columns[assignment->column]->memory, &tally);
+    }
+    return count;
+}
+
+/* Points every assignment at a private copy of its column's segment list
+ * in a new version. The segments stay shared until assign_rows() first
+ * writes to them. Assignments to the same column share one copy.
+ * Returns the version, or NULL if memory runs out.
+ */
+static TableVersion *copy_assigned_columns(SelectQuery *query)
+{
+    TableSnapshot *snapshot;
+    TableVersion *version;
+    Assignment *assignment;
+    int iter;
+    int other;
+
+    snapshot = &query->snapshot;
+    version = copy_version(query->table);
+    if (version == NULL)
+    {
+        return NULL;
+    }
+
+    for (iter = 0; iter < query->assignment_count; iter++)
+    {
+        assignment = &query->assignments[iter];
+        assignment->source = snapshot->version->segments[assignment->column];
+        assignment->target = NULL;
+        for (other = 0; other < iter; other++)
+        {
+            if (query->assignments[other].column == assignment->column)
+            {
+                assignment->target = query->assignments[other].target;
+                break;
+            }
+        }
+        if (assignment->target != NULL)
+        {
+            continue;
+        }
+
+        assignment->target = calloc(snapshot->version->segment_capacity, sizeof(Segment));
+        if (assignment->target == NULL)
+        {
+            for (other = 0; other < iter; other++)
+            {
+                if (version->segments[query->assignments[other].column] == query->assignments[other].target)
+                {
+                    version->segments[query->assignments[other].column] = NULL;
+                    free(query->assignments[other].target);
+                }
+            }
+            free(version->segments);
+            free(version);
+            return NULL;
+        }
+        memcpy(assignment->target, assignment->source, sizeof(Segment) * snapshot->version->segment_count);
+        version->segments[assignment->column] = assignment->target;
+    }
+    return version;
+}
+
+/* Retires the cells, segments and lists an UPDATE replaced in its new
+ * version.
+ */
+static void retire_assigned_columns(SelectQuery *query)
+{
+    TableVersion *old;
+    Assignment *assignment;
+    MemoryUsage *usage;
+    MemoryTally tally;
+    char *text;
+    int segment_count;
+    int segment;
+    int iter;
+    int other;
+    int rows;
+    int row;
+
+    old = query->snapshot.version;
+    segment_count = segments_for_rows(query->snapshot.row_count);
+    for (iter = 0; iter < query->assignment_count; iter++)
+    {
+        assignment = &query->assignments[iter];
+        for (other = 0; other < iter; other++)
+        {
+            if (query->assignments[other].column == assignment->column)
+            {
+                break;
+            }
+        }
+        if (other < iter)
+        {
+            continue;
+        }
+        usage = &query->table->columns[assignment->column]->memory;
+        memset(&tally, 0, sizeof(MemoryTally));
+        for (segment = 0; segment < segment_count; segment++)
+        {
+            if (assignment->target[segment] == assignment->source[segment])
+            {
+                continue;
+            }
+            rows = segment_rows(query, segment);
+            for (row = 0; row < rows; row++)
+            {
+                text = cell_heap(&assignment->source[segment]->cells[row]);
+                if (text != NULL && text != cell_heap(&assignment->target[segment]->cells[row]))
+                {
+                    tally_cell(&tally, &assignment->source[segment]->cells[row], -1);
+                    retire_memory(old, text);
+                }
+            }
+            retire_segment(old, usage, assignment->source[segment]);
+        }
+        memory_add(usage, &tally);
+        retire_memory(old, assignment->source);
+    }
+}
+
+/* Runs a planned UPDATE. The segments with matching rows are copied,
+ * updated and published as a new version while readers keep the old
+ * one, so a reader never waits for the scan, whenever it arrives.
+ * Returns the number of rows updated, or -1 if memory runs out.
+ */
+static int64_t execute_update(SelectQuery *query)
+{
+    Table *table;
+    TableVersion *version;
+    int64_t updated;
+
+    table = query->table;
+    lock_table(table, &query->snapshot);
+    version = copy_assigned_columns(query);
+    if (version == NULL)
+    {
+        unlock_table(&query->snapshot);
+        return -1;
+    }
+    updated = run_write_scan(query, assign_rows);
+    retire_assigned_columns(query);
+    publish_version(table, version, query->snapshot.row_count, query->snapshot.deleted_count);
+    unlock_table(&query->snapshot);
+    return updated;
+}
+
+/* Parses, plans and executes an UPDATE statement.
+ */
+void run_update(Database *db, const char *sql)
+{
+    SelectQuery query;
+    Assignment *assignment;
+    int64_t updated;
+    int iter;
+
+    if (prepare_query(db, sql, parse_update, &query) != 0)
+    {
+        free_select(&query);
+        return;
+    }
+
+    for (iter = 0; iter < query.assignment_count; iter++)
+    {
+        assignment = &query.assignments[iter];
+        assignment->column = resolve_column(query.table, assignment->column_name);
+        if (assignment->column < 0)
+        {
+            free_select(&query);
+            return;
+        }
+        /* Validate IPv4 address if required */
+        if (query.table->columns[assignment->column]->ipv4 && !validate_ipv4_address(assignment->value))
+        {
+            output_printf("Error: Invalid IPv4 address '%s'.\n", assignment->value);
+            free_select(&query);
+            return;
+        }
+    }
+
+    updated = execute_update(&query);
+    if (updated < 0)
+    {
+        output_printf("Error: Memory allocation failed for UPDATE.\n");
+    }
+    else
+    {
+        output_printf("%lld rows updated in table '%s'.\n", (long long)updated, query.table->name);
+    }
+    free_select(&query);
+}
@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include "db.h"
+#include "output.h"
+#include "pool.h"
+#include "protocol.h"
+#include "server.h"
+#include "transaction.h"
+
+#define MAX_EVENTS 64
+
+/* Bytes read from a socket at a time. */
+#define READ_SIZE 65536
+
+/* A connection stops reading once this much input is waiting. */
+#define MAX_PENDING_INPUT (4 * MAX_REQUEST_SIZE)
+
+/* Most requests run as one batch, so that a client pipelining a long
+ * stream of statements still gets responses back regularly.
+ */
+#define MAX_BATCH_REQUESTS 1024
+
+/* Session threads per core. Sessions spend much of their time waiting on
+ * table locks and commit log syncs rather than computing, and committers
+ * can only share a sync if several of them run at once.
+ */
+#define SESSIONS_PER_CORE 4
+
+typedef struct Server Server;
+
+/* One client connection. The event loop owns everything except the
+ * batch, query and result while a session task runs the batch.
+ */
+typedef struct Connection
+{
+    Server *server;
+    int fd;
+    ByteBuffer in;    /* Received bytes not yet executed */
+    ByteBuffer out;   /* Framed responses not yet sent */
+    size_t out_sent;  /* Bytes of out already sent */
+    uint32_t events;  /* Events the connection is registered for */
+    int busy;         /* A session task is running a batch */
+    int closed;       /* The peer is gone; free once no longer busy */
+    int read_closed;  /* The peer sent all it will; close once answered */
+    ByteBuffer batch; /* Request frames the session task runs */
+    ByteBuffer query; /* The request being run, as a string */
+    ByteBuffer result; /* Framed responses to the batch */
+    Session session;
+    struct Connection *next_done;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+struct Server
+{
+    Database *db;
+    ThreadPool *sessions; /* Runs queries; separate from the scan pool so
+                             that a query waiting on its scan never picks
+                             up another client's query */
+    TaskGroup group;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;          /* Signalled when a batch finishes */
+    int signal_fd;        /* SIGINT and SIGTERM */
+    pthread_mutex_t lock; /* Guards done */
+    Connection *done;     /* Connections whose batch finished */
+    Connection *connections;
+    uint64_t last_session; /* Id of the newest connection's session */
+};
+
+/* Registers interest in events for a connection, if it changed.
+ */
+static void watch(Connection *conn, uint32_t events)
+{
+    struct epoll_event event;
+
+    if (conn->events == events)
+    {
+        return;
+    }
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(conn->server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+}
+
+/* Frees a connection. It must not be busy.
+ */
+static void free_connection(Connection *conn)
+{
+    Server *server;
+
+    server = conn->server;
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        server->connections = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    if (conn->fd >= 0)
+    {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    end_session(&conn->session);
+    buffer_free(&conn->batch);
+    buffer_free(&conn->query);
+    buffer_free(&conn->result);
+    free(conn);
+}
+
+/* Drops a connection whose peer went away or misbehaved. A running query
+ * still finishes; the connection is freed when it does.
+ */
+static void close_connection(Connection *conn)
+{
+    if (conn->busy)
+    {
+        conn->closed = 1;
+        epoll_ctl(conn->server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    free_connection(conn);
+}
+
+/* Sends as much pending output as the socket takes.
+ * Returns 0 on success, -1 if the connection failed.
+ */
+static int flush_output(Connection *conn)
+{
+    ssize_t sent;
+
+    while (conn->out_sent < conn->out.length)
+    {
+        sent = send(conn->fd, conn->out.data + conn->out_sent, conn->out.length - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+
+    if (conn->out_sent == conn->out.length)
+    {
+        conn->out.length = 0;
+        conn->out_sent = 0;
+    }
+    return 0;
+}
+
+/* Runs one request and appends its response frame to the result: the
+ * frame header is written first and filled in once the query's output
+ * has been captured behind it.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int run_request(Connection *conn, const char *payload, size_t length)
+{
+    ByteBuffer *previous;
+    char *query;
+    size_t header;
+
+    conn->query.length = 0;
+    if (buffer_append(&conn->query, payload, length) != 0 || buffer_append(&conn->query, "", 1) != 0)
+    {
+        return -1;
+    }
+
+    header = conn->result.length;
+    if (frame_append(&conn->result, "", 0) != 0)
+    {
+        return -1;
+    }
+
+    query = trim_whitespace(conn->query.data);
+    if (query[0] != '\0')
+    {
+        previous = output_capture(&conn->result);
+        parse_query(conn->server->db, &conn->session, query);
+        output_capture(previous);
+    }
+    frame_finish(&conn->result, header);
+    return 0;
+}
+
+/* Session task: runs a batch of requests in order with their output
+ * captured for the client, then hands the connection back to the event
+ * loop, which sends all responses with one write.
+ */
+static void run_batch(void *arg)
+{
+    Connection *conn;
+    Server *server;
+    size_t offset;
+    size_t length;
+    uint64_t one;
+
+    conn = arg;
+    server = conn->server;
+    for (offset = 0; offset < conn->batch.length; offset += FRAME_HEADER_SIZE + length)
+    {
+        frame_next(conn->batch.data + offset, conn->batch.length - offset, &length);
+        if (run_request(conn, conn->batch.data + offset + FRAME_HEADER_SIZE, length) != 0)
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    conn->next_done = server->done;
+    server->done = conn;
+    pthread_mutex_unlock(&server->lock);
+
+    one = 1;
+    if (write(server->wake_fd, &one, sizeof(one)) < 0)
+    {
+        /* The counter is only full if wakeups are already pending */
+    }
+}
+
+/* Starts a batch of every complete request a connection has queued, up
+ * to MAX_BATCH_REQUESTS, if it is idle.
+ * Returns 0 on success, -1 if a request is too large or memory runs out.
+ */
+static int dispatch(Connection *conn)
+{
+    size_t offset;
+    size_t length;
+    int count;
+
+    if (conn->busy || conn->closed)
+    {
+        return 0;
+    }
+
+    offset = 0;
+    count = 0;
+    while (count < MAX_BATCH_REQUESTS && frame_next(conn->in.data + offset, conn->in.length - offset, &length))
+    {
+        if (length > MAX_REQUEST_SIZE)
+        {
+            return -1;
+        }
+        offset += FRAME_HEADER_SIZE + length;
+        count++;
+    }
+
+    /* Refuse an oversized request before buffering all of it */
+    if (conn->in.length - offset >= FRAME_HEADER_SIZE)
+    {
+        frame_next(conn->in.data + offset, FRAME_HEADER_SIZE, &length);
+        if (length > MAX_REQUEST_SIZE)
+        {
+            return -1;
+        }
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    conn->batch.length = 0;
+    if (buffer_append(&conn->batch, conn->in.data, offset) != 0)
+    {
+        return -1;
+    }
+    memmove(conn->in.data, conn->in.data + offset, conn->in.length - offset);
+    conn->in.length -= offset;
+
+    conn->busy = 1;
+    conn->result.length = 0;
+    pool_submit(conn->server->sessions, &conn->server->group, run_batch, conn);
+    return 0;
+}
+
+/* Re-registers a connection for the events it needs now: input while
+ * its backlog is short and the peer may still send, output while
+ * responses are pending.
+ */
+static void update_interest(Connection *conn)
+{
+    uint32_t events;
+
+    events = 0;
+    if (!conn->read_closed && conn->in.length < MAX_PENDING_INPUT)
+    {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (conn->out.length > conn->out_sent)
+    {
+        events |= EPOLLOUT;
+    }
+    watch(conn, events);
+}
+
+/* Starts the next request and sends what can be sent.
+ * Returns 0 on success, -1 if the connection must be closed, which is
+ * also the case once a peer that stopped sending has every response.
+ */
+static int progress_connection(Connection *conn)
+{
+    if (dispatch(conn) != 0 || flush_output(conn) != 0)
+    {
+        return -1;
+    }
+    if (conn->read_closed && !conn->busy && conn->out.length == 0)
+    {
+        return -1;
+    }
+    update_interest(conn);
+    return 0;
+}
+
+/* Reads everything available from a connection. When the peer stops
+ * sending, the requests it sent still run before the connection closes.
+ * Returns 0 on success, -1 if the read failed.
+ */
+static int read_input(Connection *conn)
+{
+    ssize_t got;
+
+    while (conn->in.length < MAX_PENDING_INPUT)
+    {
+        if (buffer_reserve(&conn->in, READ_SIZE) != 0)
+        {
+            return -1;
+        }
+        got = recv(conn->fd, conn->in.data + conn->in.length, READ_SIZE, 0);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        if (got == 0)
+        {
+            conn->read_closed = 1;
+            return 0;
+        }
+        if (got < 0)
+        {
+            return -1;
+        }
+        conn->in.length += got;
+    }
+    return 0;
+}
+
+/* Accepts all pending connections.
+ */
+static void accept_connections(Server *server)
+{
+    struct epoll_event event;
+    Connection *conn;
+    int fd;
+
+    while (1)
+    {
+        fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+
+        conn = calloc(1, sizeof(Connection));
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        conn->server = server;
+        conn->fd = fd;
+        conn->session.id = ++server->last_session;
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        event.events = conn->events;
+        event.data.ptr = conn;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        conn->next = server->connections;
+        if (server->connections != NULL)
+        {
+            server->connections->prev = conn;
+        }
+        server->connections = conn;
+    }
+}
+
+/* Takes back the connections whose batch finished, queues their
+ * responses and starts their next batches.
+ */
+static void finish_queries(Server *server)
+{
+    Connection *conn;
+    Connection *next;
+    uint64_t count;
+
+    if (read(server->wake_fd, &count, sizeof(count)) < 0)
+    {
+        /* Nothing pending */
+    }
+
+    pthread_mutex_lock(&server->lock);
+    conn = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    for (; conn != NULL; conn = next)
+    {
+        next = conn->next_done;
+        conn->busy = 0;
+        if (conn->closed)
+        {
+            free_connection(conn);
+            continue;
+        }
+        if (buffer_append(&conn->out, conn->result.data, conn->result.length) != 0 ||
+            progress_connection(conn) != 0)
+        {
+            close_connection(conn);
+        }
+    }
+}
+
+/* Handles readiness of a client connection.
+ */
+static void handle_connection(Connection *conn, uint32_t events)
+{
+    int failed;
+
+    failed = 0;
+    if (events & EPOLLIN)
+    {
+        failed = read_input(conn) != 0;
+    }
+    if (!failed && (events & (EPOLLERR | EPOLLHUP)))
+    {
+        failed = 1;
+    }
+    if (failed || progress_connection(conn) != 0)
+    {
+        close_connection(conn);
+    }
+}
+
+/* Adds one of the server's own descriptors to the epoll set, tagged with
+ * the address of the field holding it.
+ */
+static int watch_server_fd(Server *server, int *fd)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.ptr = fd;
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, *fd, &event);
+}
+
+/* Serves the database to clients on the given address until SIGINT or
+ * SIGTERM. One event loop thread does all socket I/O over epoll; queries
+ * run on a pool of session threads against the shared database, at most
+ * one at a time per connection, and their output is framed and sent back
+ * in order.
+ * Returns 0 on a clean shutdown, -1 if the server could not start.
+ */
+int run_server(Database *db, const char *address)
+{
+    Server server;
+    struct epoll_event events[MAX_EVENTS];
+    struct signalfd_siginfo info;
+    sigset_t signals;
+    void *tag;
+    int running;
+    int count;
+    int iter;
+
+    memset(&server, 0, sizeof(Server));
+    server.db = db;
+    server.listen_fd = -1;
+    server.wake_fd = -1;
+    server.signal_fd = -1;
+    pthread_mutex_init(&server.lock, NULL);
+    task_group_init(&server.group);
+
+    /* Block the signals before any thread starts, so that only the
+     * signalfd sees them.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    server.listen_fd = open_listener(address);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server.listen_fd < 0 || server.epoll_fd < 0 || server.wake_fd < 0 || server.signal_fd < 0 ||
+        fcntl(server.listen_fd, F_SETFL, O_NONBLOCK) != 0 || watch_server_fd(&server, &server.listen_fd) != 0 ||
+        watch_server_fd(&server, &server.wake_fd) != 0 || watch_server_fd(&server, &server.signal_fd) != 0)
+    {
+        if (server.listen_fd >= 0)
+        {
+            output_printf("Error: Could not start server.\n");
+        }
+        running = -1;
+    }
+    else
+    {
+        server.sessions = pool_create(pool_default_size() * SESSIONS_PER_CORE);
+        running = server.sessions != NULL ? 1 : -1;
+    }
+
+    if (running == 1)
+    {
+        output_printf("Listening on '%s'.\n", address);
+        fflush(stdout);
+    }
+
+    while (running == 1)
+    {
+        count = epoll_wait(server.epoll_fd, events, MAX_EVENTS, 1000);
+        for (iter = 0; iter < count; iter++)
+        {
+            tag = events[iter].data.ptr;
+            if (tag == &server.listen_fd)
+            {
+                accept_connections(&server);
+            }
+            else if (tag == &server.wake_fd)
+            {
+                finish_queries(&server);
+            }
+            else if (tag == &server.signal_fd)
+            {
+                /* Consume the signal so that unblocking it later does
+                 * not deliver it again.
+                 */
+                if (read(server.signal_fd, &info, sizeof(info)) == sizeof(info))
+                {
+                    running = 0;
+                }
+            }
+            else
+            {
+                handle_connection(tag, events[iter].events);
+            }
+        }
+        report_background_save(0);
+        fflush(stdout);
+    }
+
+    /* Let running queries finish, then drop every connection */
+    if (server.sessions != NULL)
+    {
+        pool_wait(server.sessions, &server.group);
+        pool_destroy(server.sessions);
+        finish_queries(&server);
+    }
+    while (server.connections != NULL)
+    {
+        free_connection(server.connections);
+    }
+
+    if (server.listen_fd >= 0)
+    {
+        close(server.listen_fd);
+        if (strchr(address, '/') != NULL)
+        {
+            unlink(address);
+        }
+    }
+    if (server.epoll_fd >= 0)
+    {
+        close(server.epoll_fd);
+    }
+    if (server.wake_fd >= 0)
+    {
+        close(server.wake_fd);
+    }
+    if (server.signal_fd >= 0)
+    {
+        close(server.signal_fd);
+    }
+    pthread_mutex_destroy(&server.lock);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    if (running == 0)
+    {
+        output_printf("Server stopped.\n");
+    }
+    return running == 0 ? 0 : -1;
+}
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sketch.h"
+
+/* Compactors below the top one never shrink below this many values,
+ * which keeps compactions of the lowest levels from running on every
+ * other value.
+ */
+#define QUANTILE_MIN_WIDTH 8
+
+/* Hashes a cell with 64-bit FNV-1a and the MurmurHash3 finalizer, so
+ * that every bit of the result depends on every byte of the cell.
+ */
+static uint64_t hash_cell(const char *cell)
+{
+    uint64_t hash;
+
+    hash = 14695981039346656037ull;
+    while (*cell)
+    {
+        hash ^= (unsigned char)*cell++;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Allocates an empty distinct sketch.
+ * Returns the sketch, or NULL if memory runs out.
+ */
+DistinctSketch *distinct_create(void)
+{
+    return calloc(1, sizeof(DistinctSketch));
+}
+
+/* Adds a cell to a distinct sketch: the top bits of its hash pick a
+ * register, which keeps the longest run of leading zeros seen in the
+ * remaining bits.
+ */
+void distinct_add(DistinctSketch *sketch, const char *cell)
+{
+    uint64_t hash;
+    uint8_t rank;
+    int index;
+
+    hash = hash_cell(cell);
+    index = (int)(hash >> (64 - HLL_PRECISION));
+    rank = (uint8_t)(__builtin_clzll((hash << HLL_PRECISION) | (UINT64_C(1) << (HLL_PRECISION - 1))) + 1);
+    if (rank > sketch->registers[index])
+    {
+        sketch->registers[index] = rank;
+    }
+}
+
+void distinct_merge(DistinctSketch *dst, const DistinctSketch *src)
+{
+    int iter;
+
+    for (iter = 0; iter < HLL_REGISTERS; iter++)
+    {
+        if (src->registers[iter] > dst->registers[iter])
+        {
+            dst->registers[iter] = src->registers[iter];
+        }
+    }
+}
+
+/* Estimates the distinct cells added to a sketch from the harmonic mean
+ * of its registers, switching to linear counting of the empty registers
+ * while few are set, where that is the more accurate of the two.
+ */
+double distinct_estimate(const DistinctSketch *sketch)
+{
+    double sum;
+    double estimate;
+    double registers;
+    int zeros;
+    int iter;
+
+    sum = 0.0;
+    zeros = 0;
+    for (iter = 0; iter < HLL_REGISTERS; iter++)
+    {
+        sum += ldexp(1.0, -sketch->registers[iter]);
+        if (sketch->registers[iter] == 0)
+        {
+            zeros++;
+        }
+    }
+
+    registers = HLL_REGISTERS;
+    estimate = 0.7213 / (1.0 + 1.079 / registers) * registers * registers / sum;
+    if (estimate <= 2.5 * registers && zeros > 0)
+    {
+        estimate = registers * log(registers / zeros);
+    }
+    return estimate;
+}
+
+/* Allocates an empty quantile sketch.
+ * Returns the sketch, or NULL if memory runs out.
+ */
+QuantileSketch *quantile_create(void)
+{
+    QuantileSketch *sketch;
+
+    sketch = calloc(1, sizeof(QuantileSketch));
+    if (sketch == NULL)
+    {
+        return NULL;
+    }
+    sketch->level_count = 1;
+    sketch->random = 0x9e3779b97f4a7c15ull;
+    return sketch;
+}
+
+void quantile_free(QuantileSketch *sketch)
+{
+    int iter;
+
+    if (sketch == NULL)
+    {
+        return;
+    }
+    for (iter = 0; iter < sketch->level_count; iter++)
+    {
+        free(sketch->levels[iter]);
+    }
+    free(sketch);
+}
+
+/* Returns how many values a compactor may hold before it compacts: the
+ * top one QUANTILE_K, each one below two thirds of the one above.
+ */
+static int level_limit(const QuantileSketch *sketch, int level)
+{
+    int limit;
+    int depth;
+
+    limit = QUANTILE_K;
+    for (depth = sketch->level_count - 1 - level; depth > 0 && limit > QUANTILE_MIN_WIDTH; depth--)
+    {
+        limit = (limit * 2 + 2) / 3;
+    }
+    return limit > QUANTILE_MIN_WIDTH ? limit : QUANTILE_MIN_WIDTH;
+}
+
+/* Makes room in a compactor for count values in all.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int reserve_level(QuantileSketch *sketch, int level, int count)
+{
+    double *values;
+    int capacity;
+
+    if (count <= sketch->capacities[level])
+    {
+        return 0;
+    }
+    capacity = sketch->capacities[level] == 0 ? QUANTILE_MIN_WIDTH : sketch->capacities[level];
+    while (capacity < count)
+    {
+        capacity *= 2;
+    }
+    values = realloc(sketch->levels[level], sizeof(double) * capacity);
+    if (values == NULL)
+    {
+        return -1;
+    }
+    sketch->levels[level] = values;
+    sketch->capacities[level] = capacity;
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x;
+    double y;
+
+    x = *(const double*)a;
+    y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Sorts a compactor and passes every other value, starting at a random
+ * one of the first two, up to the next compactor, where each stands for
+ * twice as many values. An odd value out stays behind.
+ * Returns 0 on success, -1 if memory runs out or the sketch has no room
+ * for another level.
+ */
+static int compact_level(QuantileSketch *sketch, int level)
+{
+    double *values;
+    int pairs;
+    int offset;
+    int iter;
+
+    if (level + 1 == sketch->level_count)
+    {
+        if (sketch->level_count == QUANTILE_LEVELS)
+        {
+            return -1;
+        }
+        sketch->level_count++;
+    }
+    pairs = sketch->sizes[level] / 2;
+    if (reserve_level(sketch, level + 1, sketch->sizes[level + 1] + pairs) != 0)
+    {
+        return -1;
+    }
+
+    values = sketch->levels[level];
+    qsort(values, sketch->sizes[level], sizeof(double), compare_doubles);
+    sketch->random ^= sketch->random << 13;
+    sketch->random ^= sketch->random >> 7;
+    sketch->random ^= sketch->random << 17;
+    offset = (int)(sketch->random >> 63);
+    for (iter = 0; iter < pairs; iter++)
+    {
+        sketch->levels[level + 1][sketch->sizes[level + 1]++] = values[iter * 2 + offset];
+    }
+    if (sketch->sizes[level] % 2 != 0)
+    {
+        values[0] = values[sketch->sizes[level] - 1];
+    }
+    sketch->sizes[level] %= 2;
+    return 0;
+}
+
+/* Compacts every compactor that is full, bottom up, until none is.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int compress(QuantileSketch *sketch)
+{
+    int compacted;
+    int level;
+
+    do
+    {
+        compacted = 0;
+        for (level = 0; level < sketch->level_count; level++)
+        {
+            if (sketch->sizes[level] >= level_limit(sketch, level))
+            {
+                if (compact_level(sketch, level) != 0)
+                {
+                    return -1;
+                }
+                compacted = 1;
+            }
+        }
+    } while (compacted);
+    return 0;
+}
+
+/* Adds a value to a quantile sketch.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int quantile_add(QuantileSketch *sketch, double value)
+{
+    if (reserve_level(sketch, 0, sketch->sizes[0] + 1) != 0)
+    {
+        return -1;
+    }
+    sketch->levels[0][sketch->sizes[0]++] = value;
+    if (sketch->count == 0 || value < sketch->min)
+    {
+        sketch->min = value;
+    }
+    if (sketch->count == 0 || value > sketch->max)
+    {
+        sketch->max = value;
+    }
+    sketch->count++;
+    if (sketch->sizes[0] >= level_limit(sketch, 0))
+    {
+        return compress(sketch);
+    }
+    return 0;
+}
+
+/* Folds the values of one sketch into another, compactor by compactor.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+int quantile_merge(QuantileSketch *dst, const QuantileSketch *src)
+{
+    int level;
+
+    if (src->count == 0)
+    {
+        return 0;
+    }
+    if (dst->level_count < src->level_count)
+    {
+        dst->level_count = src->level_count;
+    }
+    for (level = 0; level < src->level_count; level++)
+    {
+        if (src->sizes[level] == 0)
+        {
+            continue;
+        }
+        if (reserve_level(dst, level, dst->sizes[level] + src->sizes[level]) != 0)
+        {
+            return -1;
+        }
+        memcpy(dst->levels[level] + dst->sizes[level], src->levels[level], sizeof(double) * src->sizes[level]);
+        dst->sizes[level] += src->sizes[level];
+    }
+    if (dst->count == 0 || src->min < dst->min)
+    {
+        dst->min = src->min;
+    }
+    if (dst->count == 0 || src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+    dst->count += src->count;
+    return compress(dst);
+}
+
+/* One value held by a sketch and the number of values it stands for. */
+typedef struct WeightedValue
+{
+    double value;
+    int64_t weight;
+} WeightedValue;
+
+static int compare_weighted(const void *a, const void *b)
+{
+    return compare_doubles(&((const WeightedValue*)a)->value, &((const WeightedValue*)b)->value);
+}
+
+/* Estimates the value below which the given fraction of the values
+ * added to a sketch lie. Fractions 0 and 1 give the exact lowest and
+ * highest value.
+ * Returns 0 on success, -1 if the sketch is empty or memory runs out.
+ */
+int quantile_estimate(const QuantileSketch *sketch, double fraction, double *value)
+{
+    WeightedValue *values;
+    double target;
+    int64_t rank;
+    int count;
+    int level;
+    int iter;
+
+    if (sketch->count == 0)
+    {
+        return -1;
+    }
+    if (fraction <= 0.0 || fraction >= 1.0)
+    {
+        *value = fraction <= 0.0 ? sketch->min : sketch->max;
+        return 0;
+    }
+
+    count = 0;
+    for (level = 0; level < sketch->level_count; level++)
+    {
+        count += sketch->sizes[level];
+    }
+    values = malloc(sizeof(WeightedValue) * count);
+    if (values == NULL)
+    {
+        return -1;
+    }
+    count = 0;
+    for (level = 0; level < sketch->level_count; level++)
+    {
+        for (iter = 0; iter < sketch->sizes[level]; iter++)
+        {
+            values[count].value = sketch->levels[level][iter];
+            values[count++].weight = INT64_C(1) << level;
+        }
+    }
+    qsort(values, count, sizeof(WeightedValue), compare_weighted);
+
+    /* Every compaction keeps the weight it passes up, so the weights add
+     * up to the values seen.
+     */
+    target = fraction * sketch->count;
+    rank = 0;
+    for (iter = 0; iter < count - 1; iter++)
+    {
+        rank += values[iter].weight;
+        if (rank >= target)
+        {
+            break;
+        }
+    }
+    *value = values[iter].value;
+    free(values);
+    return 0;
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "output.h"
+#include "slowlog.h"
+
+/* One slow statement waiting to be written. */
+typedef struct SlowEntry
+{
+    struct timespec time;    /* Wall clock when the statement finished */
+    int64_t total;
+    StatementTimer timer;
+    char plan[PLAN_LENGTH];  /* Empty if the statement has no plan */
+    char *query;
+    struct SlowEntry *next;
+} SlowEntry;
+
+/* Slow-query log. Statements queue their entries; a writer thread
+ * formats and appends them, so no statement waits for the file.
+ */
+typedef struct SlowLog
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  /* Signalled when an entry is queued or the log stops */
+    int running;
+    int stop;
+    int64_t threshold;    /* Nanoseconds a statement must take to be logged */
+    char *filename;
+    FILE *file;
+    SlowEntry *head;      /* Entries in the order they were queued */
+    SlowEntry *tail;
+    int pending;
+    int64_t dropped;      /* Entries dropped since the last write */
+    pthread_t thread;
+} SlowLog;
+
+static SlowLog slow_log = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, NULL, NULL, NULL, 0, 0, 0};
+
+/* Tells whether statements should describe their plans for the log.
+ */
+int slow_log_enabled(void)
+{
+    return slow_log.running;
+}
+
+static void free_entries(SlowEntry *entry)
+{
+    SlowEntry *next;
+
+    while (entry != NULL)
+    {
+        next = entry->next;
+        free(entry->query);
+        free(entry);
+        entry = next;
+    }
+}
+
+/* Queues a statement for the log if it took at least the threshold.
+ * Only copies are made here; formatting and writing are left to the
+ * writer thread.
+ */
+void log_slow_query(const char *query, const StatementTimer *timer, int64_t total)
+{
+    SlowEntry *entry;
+
+    if (!slow_log.running || total < slow_log.threshold)
+    {
+        return;
+    }
+
+    entry = malloc(sizeof(SlowEntry));
+    if (entry != NULL)
+    {
+        entry->query = strdup(query);
+        if (entry->query == NULL)
+        {
+            free(entry);
+            entry = NULL;
+        }
+    }
+    if (entry != NULL)
+    {
+        clock_gettime(CLOCK_REALTIME, &entry->time);
+        entry->total = total;
+        entry->timer = *timer;
+        entry->timer.plan = NULL;
+        snprintf(entry->plan, sizeof(entry->plan), "%s", timer->plan != NULL ? timer->plan : "");
+        entry->next = NULL;
+    }
+
+    pthread_mutex_lock(&slow_log.lock);
+    if (entry == NULL || slow_log.pending >= MAX_SLOW_LOG_PENDING)
+    {
+        slow_log.dropped++;
+        pthread_mutex_unlock(&slow_log.lock);
+        free_entries(entry);
+        return;
+    }
+    if (slow_log.tail != NULL)
+    {
+        slow_log.tail->next = entry;
+    }
+    else
+    {
+        slow_log.head = entry;
+    }
+    slow_log.tail = entry;
+    slow_log.pending++;
+    pthread_cond_signal(&slow_log.wake);
+    pthread_mutex_unlock(&slow_log.lock);
+}
+
+/* Appends one entry to the log file:
+ *   # Time: 2025-06-01T12:00:00.000123Z
+ *   # Query_time: 812.345 ms, parse 0.011 ms, plan 0.004 ms, execute 801.950 ms, output 10.380 ms
+ *   # Rows: scanned 1048576, returned 3; segments 64, skipped 0
+ *   # Plan: Group by name (name, COUNT(*)) <- Scan t
+ *   SELECT name, COUNT(*) FROM t GROUP BY name
+ */
+static void write_entry(FILE *file, const SlowEntry *entry)
+{
+    const StatementTimer *timer;
+    struct tm utc;
+    char stamp[32];
+    int64_t execute;
+
+    timer = &entry->timer;
+    gmtime_r(&entry->time.tv_sec, &utc);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    execute = entry->total - timer->phases[PHASE_PARSE] - timer->phases[PHASE_PLAN] - timer->phases[PHASE_OUTPUT];
+
+    fprintf(file, "# Time: %s.%06ldZ\n", stamp, entry->time.tv_nsec / 1000);
+    fprintf(file, "# Query_time: %.3f ms, parse %.3f ms, plan %.3f ms, execute %.3f ms, output %.3f ms\n",
+            entry->total / 1e6, timer->phases[PHASE_PARSE] / 1e6, timer->phases[PHASE_PLAN] / 1e6, execute / 1e6,
+            timer->phases[PHASE_OUTPUT] / 1e6);
+    fprintf(file, "# Rows: scanned %lld, returned %lld; segments %lld, skipped %lld\n",
+            (long long)timer->rows_scanned, (long long)timer->rows_returned, (long long)timer->segments,
+            (long long)timer->segments_skipped);
+    if (entry->plan[0] != '\0')
+    {
+        fprintf(file, "# Plan: %s\n", entry->plan);
+    }
+    fprintf(file, "%s\n", entry->query);
+}
+
+/* Writer thread: takes every queued entry at once and appends them to
+ * the file until stopped, then drains what is left. A failure is
+ * reported once, not on every attempt.
+ */
+static void *slow_log_thread(void *arg)
+{
+    SlowEntry *batch;
+    SlowEntry *entry;
+    int64_t dropped;
+    int reported;
+    int failed;
+
+    (void)arg;
+    reported = 0;
+    pthread_mutex_lock(&slow_log.lock);
+    while (1)
+    {
+        while (!slow_log.stop && slow_log.head == NULL && slow_log.dropped == 0)
+        {
+            pthread_cond_wait(&slow_log.wake, &slow_log.lock);
+        }
+        batch = slow_log.head;
+        dropped = slow_log.dropped;
+        if (batch == NULL && dropped == 0)
+        {
+            break;
+        }
+        slow_log.head = NULL;
+        slow_log.tail = NULL;
+        slow_log.pending = 0;
+        slow_log.dropped = 0;
+        pthread_mutex_unlock(&slow_log.lock);
+
+        for (entry = batch; entry != NULL; entry = entry->next)
+        {
+            write_entry(slow_log.file, entry);
+        }
+        if (dropped > 0)
+        {
+            fprintf(slow_log.file, "# Dropped: %lld slow statements\n", (long long)dropped);
+        }
+        failed = fflush(slow_log.file) != 0 || ferror(slow_log.file);
+        if (failed && !reported)
+        {
+            output_printf("Error: Could not write slow-query log '%s'.\n", slow_log.filename);
+            reported = 1;
+        }
+        free_entries(batch);
+        pthread_mutex_lock(&slow_log.lock);
+    }
+    pthread_mutex_unlock(&slow_log.lock);
+    return NULL;
+}
+
+/* Starts appending statements that take at least SIMPLEDB_SLOW_QUERY_MS
+ * milliseconds to the file named by SIMPLEDB_SLOW_QUERY_LOG, if it is
+ * set.
+ */
+void start_slow_log(void)
+{
+    const char *filename;
+    const char *threshold;
+    char *end;
+    double milliseconds;
+
+    filename = getenv(SLOW_LOG_FILE_ENV);
+    if (filename == NULL || *filename == '\0')
+    {
+        return;
+    }
+    threshold = getenv(SLOW_LOG_THRESHOLD_ENV);
+    milliseconds = DEFAULT_SLOW_QUERY_MS;
+    if (threshold != NULL && *threshold != '\0')
+    {
+        milliseconds = strtod(threshold, &end);
+        if (*end != '\0' || milliseconds < 0)
+        {
+            output_printf("Error: Invalid %s '%s', using %d ms.\n", SLOW_LOG_THRESHOLD_ENV, threshold,
+                          DEFAULT_SLOW_QUERY_MS);
+            milliseconds = DEFAULT_SLOW_QUERY_MS;
+        }
+    }
+    slow_log.threshold = (int64_t)(milliseconds * 1e6);
+
+    slow_log.filename = strdup(filename);
+    slow_log.file = fopen(filename, "a");
+    slow_log.stop = 0;
+    if (slow_log.filename == NULL || slow_log.file == NULL ||
+        pthread_create(&slow_log.thread, NULL, slow_log_thread, NULL) != 0)
+    {
+        output_printf("Error: Could not start slow-query log '%s'.\n", filename);
+        if (slow_log.file != NULL)
+        {
+            fclose(slow_log.file);
+            slow_log.file = NULL;
+        }
+        free(slow_log.filename);
+        slow_log.filename = NULL;
+        return;
+    }
+    slow_log.running = 1;
+}
+
+/* Stops the log once every queued entry is written.
+ */
+void stop_slow_log(void)
+{
+    if (!slow_log.running)
+    {
+        return;
+    }
+    slow_log.running = 0;
+    pthread_mutex_lock(&slow_log.lock);
+    slow_log.stop = 1;
+    pthread_cond_signal(&slow_log.wake);
+    pthread_mutex_unlock(&slow_log.lock);
+    pthread_join(slow_log.thread, NULL);
+    fclose(slow_log.file);
+    slow_log.file = NULL;
+    free(slow_log.filename);
+    slow_log.filename = NULL;
+}
@@ -0,0 +1,1514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "bloom.h"
+#include "db.h"
+#include "crc32c.h"
+#include "encoding.h"
+#include "metrics.h"
+#include "output.h"
+#include "pool.h"
+#include "query.h"
+#include "transaction.h"
+#include "wal.h"
+
+/* On-disk layout:
+ *   header     magic, format version, directory offset and size,
+ *              directory checksum, header checksum
+ *   data       one block per column: a series of chunks, each a header
+ *              (encoding, row count, payload size, checksum) followed by
+ *              the encoded cells
+ *   directory  sequence number of the last logged transaction the file
+ *              holds; table count; per table its name, column count and
+ *              64-bit row count, per column its name, the offset and
+ *              size of its data block, the zone map of every chunk, and
+ *              whether it has Bloom filters followed by the filter of
+ *              every full chunk
+ * Checksums are CRC-32C. The directory lets LOAD hand every column block
+ * to a separate worker, which verifies each chunk right before decoding
+ * it while the bytes are still in cache. Zone maps and Bloom filters are
+ * kept in the directory so that they can be read without touching the
+ * data.
+ */
+#define DB_FILE_MAGIC "SDB\x7f"
+#define DB_FILE_MAGIC_LENGTH 4
+#define DB_FILE_VERSION 7
+#define DB_HEADER_SIZE 32
+#define CHUNK_HEADER_SIZE 16
+
+/* Header field positions */
+#define HEADER_VERSION_POS 4
+#define HEADER_DIRECTORY_OFFSET_POS 8
+#define HEADER_DIRECTORY_SIZE_POS 16
+#define HEADER_DIRECTORY_CRC_POS 24
+#define HEADER_CRC_POS 28
+
+/* Chunk header field positions; the checksum covers everything before it
+ * plus the payload.
+ */
+#define CHUNK_ENCODING_POS 0
+#define CHUNK_COUNT_POS 4
+#define CHUNK_SIZE_POS 8
+#define CHUNK_CRC_POS 12
+
+/* Bytes of a zone map in the directory */
+#define ZONE_RECORD_SIZE (2 * sizeof(int64_t) + 2 * sizeof(double) + 2 * (ZONE_PREFIX + 1))
+
+/* A chunk is saved from, and loaded into, exactly one segment. */
+_Static_assert(CHUNK_ROWS == SEGMENT_ROWS, "chunks must match column segments");
+
+typedef enum LoadError
+{
+    LOAD_OK,
+    LOAD_ABORTED, /* Skipped because another block already failed */
+    LOAD_READ_FAILED,
+    LOAD_CHECKSUM_MISMATCH,
+    LOAD_MALFORMED,
+    LOAD_OUT_OF_MEMORY
+} LoadError;
+
+/* Location of a column block inside a database file. */
+typedef struct BlockRef
+{
+    int64_t offset;
+    int64_t size;
+} BlockRef;
+
+/* State shared by all workers of one LOAD. Once a block fails, the
+ * remaining workers skip their blocks instead of decoding them.
+ */
+typedef struct LoadContext
+{
+    int fd;
+    atomic_int failed;
+} LoadContext;
+
+/* State of one column block being decoded by a LOAD worker. */
+typedef struct ColumnLoad
+{
+    LoadContext *context;
+    const char *table_name;
+    Column *col;
+    Segment *segments; /* Segment list of the column in the table's first version */
+    int64_t row_count;
+    BlockRef block;
+    LoadError error;
+    int error_chunk;
+} ColumnLoad;
+
+/* One encoded chunk of a column block and where its cells go. */
+typedef struct ChunkLoad
+{
+    LoadContext *context;
+    const char *header;
+    int encoding;
+    int count;
+    int size;
+    uint32_t crc;
+    Cell *cells;
+    MemoryUsage *usage; /* Usage of the column the cells go to */
+    LoadError error;
+} ChunkLoad;
+
+/* Rows written so far by a save, for progress reporting. */
+typedef struct SaveProgress
+{
+    int64_t total;
+    int64_t done;
+    int percent;
+    int report;
+} SaveProgress;
+
+/* Background save started by SAVE ASYNC: the child process and the read
+ * end of the pipe carrying its output.
+ */
+typedef struct BackgroundSave
+{
+    pthread_mutex_t lock;
+    pid_t pid;
+    int fd;
+    int percent;
+    CommitLog *log;    /* Truncated up to sequence once the save succeeds */
+    uint64_t sequence;
+    char filename[PATH_MAX];
+    char output[MAX_QUERY_LENGTH];
+    size_t length;
+} BackgroundSave;
+
+static BackgroundSave background_save = {PTHREAD_MUTEX_INITIALIZER, -1, -1, 0, NULL, 0, "", "", 0};
+
+static int background_save_running(void);
+
+/* Cursor over an in-memory copy of the directory. */
+typedef struct Reader
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+} Reader;
+
+/* Appends a name to a buffer, preceded by its length (including the
+ * null terminator). Returns 0 on success, -1 if memory runs out.
+ */
+static int append_name(ByteBuffer *buffer, const char *name)
+{
+    int len;
+
+    len = (int)strlen(name) + 1;
+    if (buffer_append(buffer, &len, sizeof(int)) != 0 ||
+        buffer_append(buffer, name, len) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Appends a zone map to a buffer.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int append_zone(ByteBuffer *buffer, const ZoneMap *zone)
+{
+    if (buffer_append(buffer, &zone->rows, sizeof(int64_t)) != 0 ||
+        buffer_append(buffer, &zone->numbers, sizeof(int64_t)) != 0 ||
+        buffer_append(buffer, &zone->min_number, sizeof(double)) != 0 ||
+        buffer_append(buffer, &zone->max_number, sizeof(double)) != 0 ||
+        buffer_append(buffer, zone->min_text, ZONE_PREFIX + 1) != 0 ||
+        buffer_append(buffer, zone->max_text, ZONE_PREFIX + 1) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Appends the Bloom filter of a full chunk to a buffer, building it
+ * from the chunk's cells if the chunk has none yet.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int append_bloom(ByteBuffer *buffer, const uint32_t *filter, const Cell *cells)
+{
+    uint32_t *built;
+    int failed;
+    int row;
+
+    if (filter != NULL)
+    {
+        return buffer_append(buffer, filter, BLOOM_SIZE);
+    }
+    built = bloom_create();
+    if (built == NULL)
+    {
+        return -1;
+    }
+    for (row = 0; row < CHUNK_ROWS; row++)
+    {
+        bloom_add(built, cell_text(&cells[row]));
+    }
+    failed = buffer_append(buffer, built, BLOOM_SIZE);
+    free(built);
+    return failed;
+}
+
+/* Copies the next length bytes out of the reader.
+ * Returns 0 on success, -1 if the directory ends early.
+ */
+static int read_bytes(Reader *reader, void *out, size_t length)
+{
+    if (reader->size - reader->pos < length)
+    {
+        return -1;
+    }
+    memcpy(out, reader->data + reader->pos, length);
+    reader->pos += length;
+    return 0;
+}
+
+/* Reads a name that was written using append_name.
+ * Names come from a query, so anything longer than a query is rejected.
+ * Returns a pointer to the heap-allocated string, or NULL on failure.
+ */
+static char *read_name(Reader *reader)
+{
+    char *name;
+    int len;
+
+    if (read_bytes(reader, &len, sizeof(int)) != 0 || len < 1 || len > MAX_QUERY_LENGTH ||
+        reader->size - reader->pos < (size_t)len || reader->data[reader->pos + len - 1] != '\0')
+    {
+        return NULL;
+    }
+
+    name = malloc(len);
+    if (name != NULL)
+    {
+        read_bytes(reader, name, len);
+    }
+    return name;
+}
+
+/* Reads a zone map that was written using append_zone.
+ * Returns 0 on success, -1 if it is cut short or inconsistent.
+ */
+static int read_zone(Reader *reader, ZoneMap *zone)
+{
+    if (read_bytes(reader, &zone->rows, sizeof(int64_t)) != 0 ||
+        read_bytes(reader, &zone->numbers, sizeof(int64_t)) != 0 ||
+        read_bytes(reader, &zone->min_number, sizeof(double)) != 0 ||
+        read_bytes(reader, &zone->max_number, sizeof(double)) != 0 ||
+        read_bytes(reader, zone->min_text, ZONE_PREFIX + 1) != 0 ||
+        read_bytes(reader, zone->max_text, ZONE_PREFIX + 1) != 0 ||
+        zone->numbers < 0 || zone->numbers > zone->rows ||
+        zone->min_text[ZONE_PREFIX] != '\0' || zone->max_text[ZONE_PREFIX] != '\0')
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Counts written rows and prints the percentage done whenever it
+ * changes, if reporting is enabled.
+ */
+static void advance_progress(SaveProgress *progress, int64_t rows)
+{
+    int percent;
+
+    progress->done += rows;
+    if (!progress->report || progress->total == 0)
+    {
+        return;
+    }
+    percent = (int)(progress->done * 100 / progress->total);
+    if (percent != progress->percent)
+    {
+        progress->percent = percent;
+        output_printf("Progress: %d%%\n", percent);
+        fflush(stdout);
+    }
+}
+
+/* Encodes one column into chunks and writes them to the file, and
+ * appends the zone map of every chunk to zones and, unless blooms is
+ * NULL, the Bloom filter of every full chunk to blooms. A chunk that is
+ * a whole segment takes over its zone map and filter; one gathered from
+ * the live rows of several segments gets new ones.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int write_column_block(FILE *file, const TableSnapshot *snapshot, int column, ByteBuffer *chunk,
+                              ByteBuffer *zones, ByteBuffer *blooms, SaveProgress *progress)
+{
+    char header[CHUNK_HEADER_SIZE];
+    ChunkEncoding chosen;
+    ZoneMap zone;
+    Segment segment;
+    Cell *cells;
+    uint32_t crc;
+    int64_t row;
+    int encoded;
+    int encoding;
+    int count;
+    int size;
+
+    cells = NULL;
+    if (snapshot->deleted_count > 0)
+    {
+        cells = malloc(sizeof(Cell) * CHUNK_ROWS);
+        if (cells == NULL)
+        {
+            return -1;
+        }
+    }
+
+    row = 0;
+    while (row < snapshot->row_count)
+    {
+        if (cells == NULL)
+        {
+            count = snapshot->row_count - row < CHUNK_ROWS ? (int)(snapshot->row_count - row) : CHUNK_ROWS;
+            segment = snapshot->version->segments[column][row >> SEGMENT_SHIFT];
+            encoded = encode_chunk(segment->cells, count, chunk, &chosen) | append_zone(zones, &segment->zone);
+            if (blooms != NULL && count == CHUNK_ROWS)
+            {
+                encoded |= append_bloom(blooms, segment->bloom, segment->cells);
+            }
+            row += count;
+        }
+        else
+        {
+            /* Deleted rows are left out of the file */
+            memset(&zone, 0, sizeof(ZoneMap));
+            for (count = 0; count < CHUNK_ROWS && row < snapshot->row_count; row++)
+            {
+                if (!row_is_deleted(snapshot, row))
+                {
+                    cells[count] = *cell_at(snapshot->version, column, row);
+                    widen_zone(&zone, cell_text(&cells[count++]));
+                }
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            encoded = encode_chunk(cells, count, chunk, &chosen) | append_zone(zones, &zone);
+            if (blooms != NULL && count == CHUNK_ROWS)
+            {
+                encoded |= append_bloom(blooms, NULL, cells);
+            }
+        }
+        if (encoded != 0)
+        {
+            free(cells);
+            return -1;
+        }
+
+        encoding = (int)chosen;
+        size = (int)chunk->length;
+        memcpy(header + CHUNK_ENCODING_POS, &encoding, sizeof(int));
+        memcpy(header + CHUNK_COUNT_POS, &count, sizeof(int));
+        memcpy(header + CHUNK_SIZE_POS, &size, sizeof(int));
+        crc = crc32c(crc32c(0, header, CHUNK_CRC_POS), chunk->data, chunk->length);
+        memcpy(header + CHUNK_CRC_POS, &crc, sizeof(uint32_t));
+
+        fwrite(header, sizeof(char), CHUNK_HEADER_SIZE, file);
+        fwrite(chunk->data, sizeof(char), chunk->length, file);
+        advance_progress(progress, count);
+    }
+    free(cells);
+    return 0;
+}
+
+/* Writes the database to a binary file.
+ * Column data is written first, one block per column, followed by a
+ * directory describing where every block lives. Each block is a series
+ * of chunks of CHUNK_ROWS rows, every chunk encoded the cheapest way.
+ * Tables are written as of the snapshots pinned by the caller, which
+ * hold every logged transaction up to sequence.
+ * The file is written under a temporary name, synced, renamed into place
+ * and its directory synced, so LOAD never sees a half-written file and
+ * the commit log can be truncated afterwards.
+ * Returns 0 on success, -1 on failure.
+ */
+static int write_database(Database *db, const TableSnapshot *snapshots, uint64_t sequence, const char *filename,
+                          int report_progress)
+{
+    FILE *file;
+    SaveProgress progress;
+    char temp_name[PATH_MAX];
+    Table *table;
+    ByteBuffer chunk;
+    ByteBuffer zones;
+    ByteBuffer blooms;
+    ByteBuffer directory;
+    char header[DB_HEADER_SIZE];
+    int64_t offset;
+    int64_t size;
+    int64_t directory_offset;
+    int64_t directory_size;
+    int64_t live_rows;
+    uint32_t crc;
+    int version;
+    int failed;
+    int iter1;
+    int iter2;
+
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+    file = fopen(temp_name, "wb");
+    if (file == NULL)
+    {
+        output_printf("Error: Could not open file '%s' for writing.\n", temp_name);
+        return -1;
+    }
+
+    progress.total = 0;
+    progress.done = 0;
+    progress.percent = -1;
+    progress.report = report_progress;
+    for (iter1 = 0; iter1 < db->table_count; iter1++)
+    {
+        table = db->tables[iter1];
+        progress.total += (snapshots[iter1].row_count - snapshots[iter1].deleted_count) * table->column_count;
+    }
+
+    memset(&chunk, 0, sizeof(ByteBuffer));
+    memset(&zones, 0, sizeof(ByteBuffer));
+    memset(&blooms, 0, sizeof(ByteBuffer));
+    memset(&directory, 0, sizeof(ByteBuffer));
+    memset(header, 0, sizeof(header));
+    fwrite(header, sizeof(char), DB_HEADER_SIZE, file);
+
+    failed = buffer_append(&directory, &sequence, sizeof(uint64_t));
+    failed |= buffer_append(&directory, &db->table_count, sizeof(int));
+    for (iter1 = 0; iter1 < db->table_count && !failed; iter1++)
+    {
+        table = db->tables[iter1];
+        failed |= append_name(&directory, table->name);
+        failed |= buffer_append(&directory, &table->column_count, sizeof(int));
+        live_rows = snapshots[iter1].row_count - snapshots[iter1].deleted_count;
+        failed |= buffer_append(&directory, &live_rows, sizeof(int64_t));
+
+        for (iter2 = 0; iter2 < table->column_count && !failed; iter2++)
+        {
+            offset = ftello(file);
+            zones.length = 0;
+            blooms.length = 0;
+            failed |= write_column_block(file, &snapshots[iter1], iter2, &chunk, &zones,
+                                         table->columns[iter2]->bloom ? &blooms : NULL, &progress);
+            size = ftello(file) - offset;
+
+            failed |= append_name(&directory, table->columns[iter2]->name);
+            failed |= buffer_append(&directory, &offset, sizeof(int64_t));
+            failed |= buffer_append(&directory, &size, sizeof(int64_t));
+            if (zones.length > 0)
+            {
+                failed |= buffer_append(&directory, zones.data, zones.length);
+            }
+            failed |= buffer_append(&directory, &table->columns[iter2]->bloom, sizeof(int));
+            if (blooms.length > 0)
+            {
+                failed |= buffer_append(&directory, blooms.data, blooms.length);
+            }
+        }
+    }
+
+    if (failed)
+    {
+        output_printf("Error: Memory allocation failed while saving to '%s'.\n", filename);
+        fclose(file);
+        unlink(temp_name);
+        buffer_free(&chunk);
+        buffer_free(&zones);
+        buffer_free(&blooms);
+        buffer_free(&directory);
+        return -1;
+    }
+
+    directory_offset = ftello(file);
+    directory_size = (int64_t)directory.length;
+    fwrite(directory.data, sizeof(char), directory.length, file);
+
+    version = DB_FILE_VERSION;
+    crc = crc32c(0, directory.data, directory.length);
+    memcpy(header, DB_FILE_MAGIC, DB_FILE_MAGIC_LENGTH);
+    memcpy(header + HEADER_VERSION_POS, &version, sizeof(int));
+    memcpy(header + HEADER_DIRECTORY_OFFSET_POS, &directory_offset, sizeof(int64_t));
+    memcpy(header + HEADER_DIRECTORY_SIZE_POS, &directory_size, sizeof(int64_t));
+    memcpy(header + HEADER_DIRECTORY_CRC_POS, &crc, sizeof(uint32_t));
+    crc = crc32c(0, header, HEADER_CRC_POS);
+    memcpy(header + HEADER_CRC_POS, &crc, sizeof(uint32_t));
+
+    fseeko(file, 0, SEEK_SET);
+    fwrite(header, sizeof(char), DB_HEADER_SIZE, file);
+    failed = fflush(file) != 0 || ferror(file);
+    failed |= fsync(fileno(file)) != 0;
+    failed |= fclose(file);
+    buffer_free(&chunk);
+    buffer_free(&zones);
+    buffer_free(&blooms);
+    buffer_free(&directory);
+
+    if (failed || rename(temp_name, filename) != 0)
+    {
+        output_printf("Error: Could not write file '%s'.\n", filename);
+        unlink(temp_name);
+        return -1;
+    }
+    /* The log may only drop what the file holds once the rename is durable */
+    if (sync_directory(filename) != 0)
+    {
+        output_printf("Error: Could not sync the directory of '%s'.\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* Pins the current version of every table, together with the sequence
+ * number of the last logged transaction they hold. Pinning never waits
+ * for a writer, only for the few instructions a version lock is held, so
+ * committers are not held up by the checkpoint for longer than that.
+ * Returns the snapshots, or NULL if memory runs out.
+ */
+static TableSnapshot *pin_database(Database *db, uint64_t *sequence)
+{
+    TableSnapshot *snapshots;
+    int iter;
+
+    snapshots = malloc(sizeof(TableSnapshot) * (db->table_count + 1));
+    if (snapshots == NULL)
+    {
+        output_printf("Error: Memory allocation failed while saving.\n");
+        return NULL;
+    }
+    *sequence = begin_checkpoint(db->log);
+    for (iter = 0; iter < db->table_count; iter++)
+    {
+        pin_table(db->tables[iter], &snapshots[iter]);
+    }
+    end_checkpoint(db->log);
+    return snapshots;
+}
+
+static void unpin_database(Database *db, TableSnapshot *snapshots)
+{
+    int iter;
+
+    for (iter = 0; iter < db->table_count; iter++)
+    {
+        unpin_table(&snapshots[iter]);
+    }
+    free(snapshots);
+}
+
+/* Counts the size of a file just saved as bytes written.
+ */
+static void count_saved_bytes(const char *filename)
+{
+    struct stat info;
+
+    if (stat(filename, &info) == 0)
+    {
+        metrics_add(COUNTER_SAVE_BYTES, (uint64_t)info.st_size);
+    }
+}
+
+/* Saves the database to a binary file. Writers may keep changing the
+ * tables; the file holds the versions pinned when the save started.
+ * The commit log then only keeps transactions committed since.
+ */
+void save_database_to_file(Database *db, const char *filename)
+{
+    TableSnapshot *snapshots;
+    uint64_t sequence;
+
+    if (background_save_running())
+    {
+        return;
+    }
+    snapshots = pin_database(db, &sequence);
+    if (snapshots == NULL)
+    {
+        return;
+    }
+    if (write_database(db, snapshots, sequence, filename, 0) == 0)
+    {
+        output_printf("Database saved to '%s'.\n", filename);
+        count_saved_bytes(filename);
+        truncate_commit_log(db->log, sequence);
+    }
+    unpin_database(db, snapshots);
+}
+
+/* Returns 1 and reports an error if a background save is running.
+ */
+static int background_save_running(void)
+{
+    int running;
+
+    pthread_mutex_lock(&background_save.lock);
+    running = background_save.pid > 0;
+    pthread_mutex_unlock(&background_save.lock);
+    if (running)
+    {
+        output_printf("Error: A background save is already in progress.\n");
+    }
+    return running;
+}
+
+/* Saves the database from a forked child process.
+ * fork() gives the child a copy-on-write image of the database as of
+ * this instant, so the snapshot stays consistent while the parent keeps
+ * executing queries and inserts. The child's output, including progress
+ * lines, goes to a pipe that report_background_save() drains.
+ * The versions are pinned before forking, so the child never has to take
+ * a lock that another thread may have held at the time of the fork.
+ */
+void save_database_in_background(Database *db, const char *filename)
+{
+    TableSnapshot *snapshots;
+    uint64_t sequence;
+    int fds[2];
+    pid_t pid;
+
+    pthread_mutex_lock(&background_save.lock);
+    if (background_save.pid > 0)
+    {
+        pthread_mutex_unlock(&background_save.lock);
+        output_printf("Error: A background save is already in progress.\n");
+        return;
+    }
+
+    snapshots = pin_database(db, &sequence);
+    if (snapshots == NULL)
+    {
+        pthread_mutex_unlock(&background_save.lock);
+        return;
+    }
+    if (pipe(fds) != 0)
+    {
+        unpin_database(db, snapshots);
+        pthread_mutex_unlock(&background_save.lock);
+        output_printf("Error: Could not start background save.\n");
+        return;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        unpin_database(db, snapshots);
+        pthread_mutex_unlock(&background_save.lock);
+        output_printf("Error: Could not start background save.\n");
+        return;
+    }
+
+    if (pid == 0)
+    {
+        /* Only this thread exists in the child; the save path must not
+         * touch the thread pool. Its output goes to the pipe, even if the
+         * parent thread was capturing output for a client.
+         */
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        output_capture(NULL);
+        _exit(write_database(db, snapshots, sequence, filename, 1) == 0 ? 0 : 1);
+    }
+
+    unpin_database(db, snapshots);
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    background_save.pid = pid;
+    background_save.fd = fds[0];
+    background_save.percent = 0;
+    background_save.log = db->log;
+    background_save.sequence = sequence;
+    background_save.length = 0;
+    snprintf(background_save.filename, sizeof(background_save.filename), "%s", filename);
+    pthread_mutex_unlock(&background_save.lock);
+
+    output_printf("Background save to '%s' started.\n", filename);
+}
+
+/* Reads whatever the child has written so far. Progress lines update the
+ * stored percentage, any other line is an error that is shown as is.
+ * The background save lock must be held.
+ */
+static void drain_background_save(void)
+{
+    char *line;
+    char *end;
+    ssize_t got;
+    int percent;
+
+    while (1)
+    {
+        got = read(background_save.fd, background_save.output + background_save.length,
+                   sizeof(background_save.output) - 1 - background_save.length);
+        if (got <= 0)
+        {
+            break;
+        }
+        background_save.length += got;
+        background_save.output[background_save.length] = '\0';
+
+        line = background_save.output;
+        while ((end = strchr(line, '\n')) != NULL)
+        {
+            *end = '\0';
+            if (sscanf(line, "Progress: %d%%", &percent) == 1)
+            {
+                background_save.percent = percent;
+            }
+            else
+            {
+                output_printf("%s\n", line);
+            }
+            line = end + 1;
+        }
+
+        background_save.length = strlen(line);
+        memmove(background_save.output, line, background_save.length + 1);
+        if (background_save.length == sizeof(background_save.output) - 1)
+        {
+            background_save.length = 0;
+        }
+    }
+}
+
+/* Reaps a background save that has finished and reports the outcome.
+ * With block set, waits for the child to finish first; with show_status
+ * set, also reports progress of a save that is still running.
+ */
+static void collect_background_save(int block, int show_status)
+{
+    pid_t done;
+    int status;
+
+    pthread_mutex_lock(&background_save.lock);
+    if (background_save.pid <= 0)
+    {
+        if (show_status)
+        {
+            output_printf("No background save in progress.\n");
+        }
+        pthread_mutex_unlock(&background_save.lock);
+        return;
+    }
+
+    drain_background_save();
+    done = waitpid(background_save.pid, &status, block ? 0 : WNOHANG);
+    if (done == background_save.pid)
+    {
+        fcntl(background_save.fd, F_SETFL, fcntl(background_save.fd, F_GETFL) & ~O_NONBLOCK);
+        drain_background_save();
+        close(background_save.fd);
+        background_save.pid = -1;
+        background_save.fd = -1;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+            output_printf("Background save to '%s' completed.\n", background_save.filename);
+            count_saved_bytes(background_save.filename);
+            truncate_commit_log(background_save.log, background_save.sequence);
+        }
+        else
+        {
+            output_printf("Error: Background save to '%s' failed.\n", background_save.filename);
+        }
+    }
+    else if (show_status)
+    {
+        output_printf("Background save to '%s' in progress: %d%%.\n", background_save.filename, background_save.percent);
+    }
+    pthread_mutex_unlock(&background_save.lock);
+}
+
+/* Reports a finished background save. With show_status set, also
+ * reports the progress of one that is still running.
+ */
+void report_background_save(int show_status)
+{
+    collect_background_save(0, show_status);
+}
+
+/* Waits for a running background save to finish and reports it.
+ */
+void wait_for_background_save(void)
+{
+    collect_background_save(1, 0);
+}
+
+/* Reads exactly size bytes at offset from a file descriptor.
+ * Returns 0 on success, -1 on a short read or I/O error.
+ */
+static int read_block(int fd, char *buf, int64_t size, int64_t offset)
+{
+    ssize_t got;
+
+    while (size > 0)
+    {
+        got = pread(fd, buf, size, offset);
+        if (got <= 0)
+        {
+            return -1;
+        }
+        buf += got;
+        size -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+/* Marks the whole LOAD as failed so that pending blocks are skipped.
+ */
+static void fail_load(LoadContext *context)
+{
+    atomic_store_explicit(&context->failed, 1, memory_order_relaxed);
+}
+
+static int load_failed(LoadContext *context)
+{
+    return atomic_load_explicit(&context->failed, memory_order_relaxed);
+}
+
+/* Worker task: verifies the checksum of one chunk and decodes it.
+ */
+static void load_chunk(void *arg)
+{
+    ChunkLoad *chunk;
+    MemoryTally tally;
+    const char *payload;
+    int row;
+
+    chunk = arg;
+    if (load_failed(chunk->context))
+    {
+        chunk->error = LOAD_ABORTED;
+        return;
+    }
+
+    payload = chunk->header + CHUNK_HEADER_SIZE;
+    if (crc32c(crc32c(0, chunk->header, CHUNK_CRC_POS), payload, chunk->size) != chunk->crc)
+    {
+        chunk->error = LOAD_CHECKSUM_MISMATCH;
+    }
+    else if (decode_chunk((ChunkEncoding)chunk->encoding, payload, chunk->size, chunk->cells, chunk->count) != 0)
+    {
+        chunk->error = LOAD_MALFORMED;
+    }
+    else
+    {
+        memset(&tally, 0, sizeof(MemoryTally));
+        for (row = 0; row < chunk->count; row++)
+        {
+            tally_cell(&tally, &chunk->cells[row], 1);
+        }
+        memory_add(chunk->usage, &tally);
+        chunk->error = LOAD_OK;
+        return;
+    }
+    fail_load(chunk->context);
+}
+
+/* Splits a column block into its chunks and checks that the chunk
+ * headers describe exactly the rows of the column.
+ * Returns the index of the first bad chunk, or -1 if all are well formed.
+ */
+static int split_chunks(ColumnLoad *load, const char *buf, ChunkLoad *chunks, int chunk_count)
+{
+    int64_t pos;
+    int64_t expected;
+    int iter;
+
+    pos = 0;
+    for (iter = 0; iter < chunk_count; iter++)
+    {
+        if (load->block.size - pos < CHUNK_HEADER_SIZE)
+        {
+            return iter;
+        }
+        chunks[iter].context = load->context;
+        chunks[iter].header = buf + pos;
+        memcpy(&chunks[iter].encoding, buf + pos + CHUNK_ENCODING_POS, sizeof(int));
+        memcpy(&chunks[iter].count, buf + pos + CHUNK_COUNT_POS, sizeof(int));
+        memcpy(&chunks[iter].size, buf + pos + CHUNK_SIZE_POS, sizeof(int));
+        memcpy(&chunks[iter].crc, buf + pos + CHUNK_CRC_POS, sizeof(uint32_t));
+        chunks[iter].cells = load->segments[iter]->cells;
+        chunks[iter].usage = &load->col->memory;
+        chunks[iter].error = LOAD_OK;
+        pos += CHUNK_HEADER_SIZE;
+
+        expected = load->row_count - (int64_t)iter * CHUNK_ROWS;
+        if (expected > CHUNK_ROWS)
+        {
+            expected = CHUNK_ROWS;
+        }
+        if (chunks[iter].count != expected || chunks[iter].size < 0 || chunks[iter].size > load->block.size - pos)
+        {
+            return iter;
+        }
+        pos += chunks[iter].size;
+    }
+    return pos == load->block.size ? -1 : chunk_count - 1;
+}
+
+/* Worker task: reads one column block and decodes its cells.
+ * The chunks of the block are verified and decoded as nested tasks, so a
+ * table with few but long columns still spreads across all workers.
+ * On failure the column is left without data and the error is recorded.
+ */
+static void load_column_block(void *arg)
+{
+    ColumnLoad *load;
+    ChunkLoad *chunks;
+    ThreadPool *pool;
+    TaskGroup group;
+    char *buf;
+    int chunk_count;
+    int iter;
+    int row;
+
+    load = arg;
+    load->error = LOAD_OK;
+    if (load_failed(load->context))
+    {
+        load->error = LOAD_ABORTED;
+        return;
+    }
+
+    chunk_count = segments_for_rows(load->row_count);
+    buf = malloc(load->block.size);
+    chunks = malloc(sizeof(ChunkLoad) * chunk_count);
+    if (buf == NULL || chunks == NULL)
+    {
+        load->error = LOAD_OUT_OF_MEMORY;
+    }
+    else if (read_block(load->context->fd, buf, load->block.size, load->block.offset) != 0)
+    {
+        load->error = LOAD_READ_FAILED;
+    }
+    else
+    {
+        load->error_chunk = split_chunks(load, buf, chunks, chunk_count);
+        if (load->error_chunk >= 0)
+        {
+            load->error = LOAD_MALFORMED;
+        }
+    }
+
+    if (load->error == LOAD_OK)
+    {
+        pool = pool_shared();
+        task_group_init(&group);
+        for (iter = 0; iter < chunk_count; iter++)
+        {
+            pool_submit(pool, &group, load_chunk, &chunks[iter]);
+        }
+        pool_wait(pool, &group);
+
+        /* Report the first chunk that really failed, not one that was
+         * merely skipped because of it.
+         */
+        for (iter = 0; iter < chunk_count; iter++)
+        {
+            if (chunks[iter].error != LOAD_OK &&
+                (load->error == LOAD_OK || (load->error == LOAD_ABORTED && chunks[iter].error != LOAD_ABORTED)))
+            {
+                load->error = chunks[iter].error;
+                load->error_chunk = iter;
+            }
+        }
+    }
+    free(buf);
+    free(chunks);
+
+    if (load->error != LOAD_OK)
+    {
+        fail_load(load->context);
+        for (iter = 0; iter < chunk_count; iter++)
+        {
+            for (row = 0; row < load->segments[iter]->capacity; row++)
+            {
+                free(cell_heap(&load->segments[iter]->cells[row]));
+                memset(&load->segments[iter]->cells[row], 0, sizeof(Cell));
+            }
+        }
+    }
+}
+
+/* Returns 1 if a file starts with the magic of a file with a header, 0
+ * if it must be in the format from before files had one.
+ */
+static int has_header(int fd, int64_t file_size)
+{
+    char magic[DB_FILE_MAGIC_LENGTH];
+
+    return file_size >= DB_FILE_MAGIC_LENGTH && read_block(fd, magic, DB_FILE_MAGIC_LENGTH, 0) == 0 &&
+           memcmp(magic, DB_FILE_MAGIC, DB_FILE_MAGIC_LENGTH) == 0;
+}
+
+/* Reads and verifies the file header. Files of earlier format versions
+ * are reported as such: no conversion from them exists.
+ * Returns 0 and the directory location on success, -1 on failure.
+ */
+static int read_header(int fd, int64_t file_size, BlockRef *directory, uint32_t *directory_crc)
+{
+    char header[DB_HEADER_SIZE];
+    uint32_t crc;
+    int version;
+
+    if (file_size < HEADER_VERSION_POS + (int64_t)sizeof(int) ||
+        read_block(fd, header, HEADER_VERSION_POS + sizeof(int), 0) != 0)
+    {
+        output_printf("Error: Not a database file.\n");
+        return -1;
+    }
+    memcpy(&version, header + HEADER_VERSION_POS, sizeof(int));
+    if (version > 0 && version < DB_FILE_VERSION)
+    {
+        output_printf("Error: Database file format version %d is no longer supported; this build reads version %d "
+                      "and files saved before format versions. Recreate the data and SAVE it again.\n",
+                      version, DB_FILE_VERSION);
+        return -1;
+    }
+    if (version > DB_FILE_VERSION)
+    {
+        output_printf("Error: Database file format version %d is newer than this build supports (%d).\n",
+                      version, DB_FILE_VERSION);
+        return -1;
+    }
+
+    if (file_size < DB_HEADER_SIZE || read_block(fd, header, DB_HEADER_SIZE, 0) != 0 || version != DB_FILE_VERSION)
+    {
+        output_printf("Error: Not a database file.\n");
+        return -1;
+    }
+    memcpy(&crc, header + HEADER_CRC_POS, sizeof(uint32_t));
+    if (crc != crc32c(0, header, HEADER_CRC_POS))
+    {
+        output_printf("Error: Database file header is corrupted (checksum mismatch).\n");
+        return -1;
+    }
+
+    memcpy(&directory->offset, header + HEADER_DIRECTORY_OFFSET_POS, sizeof(int64_t));
+    memcpy(&directory->size, header + HEADER_DIRECTORY_SIZE_POS, sizeof(int64_t));
+    memcpy(directory_crc, header + HEADER_DIRECTORY_CRC_POS, sizeof(uint32_t));
+    if (directory->offset < DB_HEADER_SIZE || directory->size < (int64_t)sizeof(int) ||
+        directory->offset + directory->size != file_size)
+    {
+        output_printf("Error: Database file is truncated.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Parses the directory. Builds the tables and columns without their
+ * data and fills one ColumnLoad per column block.
+ * Returns the new Database or NULL if the directory is inconsistent.
+ */
+static Database *parse_directory(Reader *reader, int64_t data_end, ColumnLoad **loads_out, int *load_count,
+                                 uint64_t *sequence)
+{
+    Database *new_db;
+    Table *table;
+    Column *col;
+    ColumnLoad *loads;
+    ColumnLoad *load;
+    int table_count;
+    int column_total;
+    int iter1;
+    int iter2;
+    int segment;
+
+    /* Every table takes at least a name, two counts and one column */
+    if (read_bytes(reader, sequence, sizeof(uint64_t)) != 0 ||
+        read_bytes(reader, &table_count, sizeof(int)) != 0 || table_count < 0 ||
+        (size_t)table_count > reader->size / (4 * sizeof(int)))
+    {
+        return NULL;
+    }
+
+    new_db = create_db();
+    if (new_db == NULL)
+    {
+        return NULL;
+    }
+    new_db->tables = calloc(table_count + 1, sizeof(Table*));
+    loads = malloc(sizeof(ColumnLoad) * (reader->size / (2 * sizeof(int64_t)) + 1));
+    if (new_db->tables == NULL || loads == NULL)
+    {
+        free(loads);
+        free_database(new_db);
+        return NULL;
+    }
+
+    column_total = 0;
+    for (iter1 = 0; iter1 < table_count; iter1++)
+    {
+        table = calloc(1, sizeof(Table));
+        if (table == NULL)
+        {
+            break;
+        }
+        new_db->tables[new_db->table_count++] = table;
+
+        table->name = read_name(reader);
+        table->name_hash = table->name != NULL ? hash_name(table->name) : 0;
+        if (table->name == NULL ||
+            read_bytes(reader, &table->column_count, sizeof(int)) != 0 ||
+            read_bytes(reader, &table->row_count, sizeof(int64_t)) != 0 ||
+            table->column_count < 1 || table->row_count < 0 ||
+            (size_t)table->column_count > reader->size / (2 * sizeof(int64_t)) ||
+            segments_for_rows(table->row_count) < 0 ||
+            (size_t)segments_for_rows(table->row_count) > reader->size / ZONE_RECORD_SIZE)
+        {
+            break;
+        }
+
+        /* Columns come first: segments are counted in their usage. */
+        table->columns = calloc(table->column_count, sizeof(Column*));
+        for (iter2 = 0; table->columns != NULL && iter2 < table->column_count; iter2++)
+        {
+            table->columns[iter2] = calloc(1, sizeof(Column));
+            if (table->columns[iter2] == NULL)
+            {
+                break;
+            }
+        }
+        if (table->columns == NULL || iter2 < table->column_count || init_table_storage(table, table->row_count) != 0)
+        {
+            break;
+        }
+
+        for (iter2 = 0; iter2 < table->column_count; iter2++)
+        {
+            col = table->columns[iter2];
+            load = &loads[column_total];
+            load->table_name = table->name;
+            load->col = col;
+            load->segments = table->current->segments[iter2];
+            load->row_count = table->row_count;
+            col->name = read_name(reader);
+            if (col->name == NULL ||
+                read_bytes(reader, &load->block.offset, sizeof(int64_t)) != 0 ||
+                read_bytes(reader, &load->block.size, sizeof(int64_t)) != 0 ||
+                load->block.offset < DB_HEADER_SIZE || load->block.size < 0 ||
+                load->block.offset > data_end || load->block.size > data_end - load->block.offset)
+            {
+                break;
+            }
+            col->name_hash = hash_name(col->name);
+            col->ipv4 = strcmp(col->name, IPV4_COLUMN) == 0;
+            for (segment = 0; segment < table->current->segment_count; segment++)
+            {
+                if (read_zone(reader, &load->segments[segment]->zone) != 0)
+                {
+                    break;
+                }
+            }
+            if (segment < table->current->segment_count ||
+                read_bytes(reader, &col->bloom, sizeof(int)) != 0 || col->bloom < 0 || col->bloom > 1)
+            {
+                break;
+            }
+            for (segment = 0; col->bloom && segment < table->row_count >> SEGMENT_SHIFT; segment++)
+            {
+                load->segments[segment]->bloom = bloom_create();
+                memory_track(&col->memory, load->segments[segment]->bloom, BLOOM_SIZE);
+                if (load->segments[segment]->bloom == NULL ||
+                    read_bytes(reader, load->segments[segment]->bloom, BLOOM_SIZE) != 0)
+                {
+                    break;
+                }
+            }
+            if (col->bloom && segment < table->row_count >> SEGMENT_SHIFT)
+            {
+                break;
+            }
+            column_total++;
+        }
+        if (iter2 < table->column_count)
+        {
+            break;
+        }
+    }
+
+    if (iter1 < table_count || reader->pos != reader->size)
+    {
+        free(loads);
+        free_database(new_db);
+        return NULL;
+    }
+
+    *loads_out = loads;
+    *load_count = column_total;
+    return new_db;
+}
+
+/* Prints why a column block could not be loaded.
+ */
+static void report_load_error(const ColumnLoad *load)
+{
+    switch (load->error)
+    {
+        case LOAD_READ_FAILED:
+            output_printf("Error: Could not read data of table '%s', column '%s'.\n",
+                   load->table_name, load->col->name);
+            break;
+        case LOAD_CHECKSUM_MISMATCH:
+            output_printf("Error: Checksum mismatch in table '%s', column '%s', chunk %d.\n",
+                   load->table_name, load->col->name, load->error_chunk);
+            break;
+        case LOAD_MALFORMED:
+            output_printf("Error: Corrupted data in table '%s', column '%s', chunk %d.\n",
+                   load->table_name, load->col->name, load->error_chunk);
+            break;
+        case LOAD_OUT_OF_MEMORY:
+            output_printf("Error: Memory allocation failed while loading table '%s', column '%s'.\n",
+                   load->table_name, load->col->name);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Reads a file saved before files had a header: the table count, then
+ * per table its name, column count and 32-bit row count, and per column
+ * its name followed by every cell, each string preceded by its length
+ * including the null terminator. Zone maps are rebuilt as cells are read.
+ * Returns the new Database or NULL if the file is not in that format.
+ */
+static Database *read_legacy_file(int fd, int64_t file_size)
+{
+    Database *new_db;
+    Table *table;
+    Column *col;
+    MemoryTally tally;
+    Reader reader;
+    Cell *cell;
+    char *data;
+    int64_t row;
+    int table_count;
+    int row_count;
+    int len;
+    int iter1;
+    int iter2;
+
+    data = malloc(file_size + 1);
+    if (data == NULL || read_block(fd, data, file_size, 0) != 0)
+    {
+        free(data);
+        return NULL;
+    }
+    reader.data = data;
+    reader.size = file_size;
+    reader.pos = 0;
+
+    /* Every table takes at least a name and two counts */
+    new_db = NULL;
+    if (read_bytes(&reader, &table_count, sizeof(int)) == 0 && table_count >= 0 &&
+        (size_t)table_count <= reader.size / (3 * sizeof(int)))
+    {
+        new_db = create_db();
+    }
+    if (new_db != NULL)
+    {
+        new_db->tables = calloc(table_count + 1, sizeof(Table*));
+    }
+
+    for (iter1 = 0; new_db != NULL && new_db->tables != NULL && iter1 < table_count; iter1++)
+    {
+        table = calloc(1, sizeof(Table));
+        if (table == NULL)
+        {
+            break;
+        }
+        new_db->tables[new_db->table_count++] = table;
+
+        table->name = read_name(&reader);
+        table->name_hash = table->name != NULL ? hash_name(table->name) : 0;
+        if (table->name == NULL ||
+            read_bytes(&reader, &table->column_count, sizeof(int)) != 0 ||
+            read_bytes(&reader, &row_count, sizeof(int)) != 0 ||
+            table->column_count < 1 || row_count < 0 ||
+            (size_t)table->column_count > reader.size / sizeof(int) || (size_t)row_count > reader.size / sizeof(int))
+        {
+            break;
+        }
+        table->row_count = row_count;
+
+        table->columns = calloc(table->column_count, sizeof(Column*));
+        for (iter2 = 0; table->columns != NULL && iter2 < table->column_count; iter2++)
+        {
+            table->columns[iter2] = calloc(1, sizeof(Column));
+            if (table->columns[iter2] == NULL)
+            {
+                break;
+            }
+        }
+        if (table->columns == NULL || iter2 < table->column_count || init_table_storage(table, table->row_count) != 0)
+        {
+            break;
+        }
+
+        for (iter2 = 0; iter2 < table->column_count; iter2++)
+        {
+            col = table->columns[iter2];
+            col->name = read_name(&reader);
+            if (col->name == NULL)
+            {
+                break;
+            }
+            col->name_hash = hash_name(col->name);
+            col->ipv4 = strcmp(col->name, IPV4_COLUMN) == 0;
+
+            memset(&tally, 0, sizeof(MemoryTally));
+            for (row = 0; row < table->row_count; row++)
+            {
+                cell = cell_at(table->current, iter2, row);
+                if (read_bytes(&reader, &len, sizeof(int)) != 0 || len < 1 || reader.size - reader.pos < (size_t)len ||
+                    reader.data[reader.pos + len - 1] != '\0' || store_cell(cell, reader.data + reader.pos, len - 1) != 0)
+                {
+                    break;
+                }
+                widen_zone(&table->current->segments[iter2][row >> SEGMENT_SHIFT]->zone, reader.data + reader.pos);
+                tally_cell(&tally, cell, 1);
+                reader.pos += len;
+            }
+            memory_add(&col->memory, &tally);
+            if (row < table->row_count)
+            {
+                break;
+            }
+        }
+        if (iter2 < table->column_count)
+        {
+            break;
+        }
+    }
+
+    if (new_db != NULL && (new_db->tables == NULL || iter1 < table_count || reader.pos != reader.size))
+    {
+        free_database(new_db);
+        new_db = NULL;
+    }
+    free(data);
+    return new_db;
+}
+
+/* Replaces the tables of a database with loaded ones, moves the
+ * materialized views over to them and replays the transactions
+ * committed after the file holding them was saved.
+ */
+static void install_tables(Database *db, Database *new_db, const char *filename, uint64_t sequence)
+{
+    Table **tables;
+    int table_count;
+
+    tables = db->tables;
+    table_count = db->table_count;
+    db->tables = new_db->tables;
+    db->table_count = new_db->table_count;
+    new_db->tables = tables;
+    new_db->table_count = table_count;
+    adopt_views(db, tables, table_count);
+    free_database(new_db);
+    output_printf("Database loaded from '%s'.\n", filename);
+    advance_commit_log(db->log, sequence);
+    replay_commit_log(db, sequence);
+}
+
+/* Loads a database from a binary file.
+ * The header and directory are verified first; column blocks are then
+ * read, verified and decoded concurrently on the shared thread pool.
+ * A file from before files had a header is read whole by
+ * read_legacy_file() instead.
+ * On success the tables of the database are replaced by the loaded ones,
+ * the materialized views move over to them, and the transactions committed after the file was saved are replayed
+ * from the commit log; if the file cannot be loaded the database is left
+ * unchanged.
+ * The caller must hold the catalog lock exclusively.
+ * Returns the database.
+ */
+Database *load_database_from_file(Database *db, const char *filename)
+{
+    LoadContext context;
+    Database *new_db;
+    ColumnLoad *loads;
+    ThreadPool *pool;
+    TaskGroup group;
+    Reader reader;
+    BlockRef directory;
+    struct stat info;
+    char *directory_data;
+    uint32_t directory_crc;
+    uint64_t sequence;
+    int load_count;
+    int iter;
+
+    context.fd = open(filename, O_RDONLY);
+    if (context.fd < 0)
+    {
+        output_printf("Error: Could not open file '%s' for reading.\n", filename);
+        return db;
+    }
+
+    if (fstat(context.fd, &info) != 0)
+    {
+        output_printf("Error: Could not read file '%s'.\n", filename);
+        close(context.fd);
+        return db;
+    }
+    if (!has_header(context.fd, info.st_size))
+    {
+        new_db = read_legacy_file(context.fd, info.st_size);
+        close(context.fd);
+        if (new_db == NULL)
+        {
+            output_printf("Error: Not a database file.\n");
+            return db;
+        }
+        install_tables(db, new_db, filename, 0);
+        output_printf("'%s' is in the format from before format versions; SAVE rewrites it in version %d.\n",
+                      filename, DB_FILE_VERSION);
+        return db;
+    }
+    if (read_header(context.fd, info.st_size, &directory, &directory_crc) != 0)
+    {
+        close(context.fd);
+        return db;
+    }
+
+    directory_data = malloc(directory.size);
+    if (directory_data == NULL || read_block(context.fd, directory_data, directory.size, directory.offset) != 0)
+    {
+        output_printf("Error: Could not read the directory of '%s'.\n", filename);
+        free(directory_data);
+        close(context.fd);
+        return db;
+    }
+    if (crc32c(0, directory_data, directory.size) != directory_crc)
+    {
+        output_printf("Error: Database directory is corrupted (checksum mismatch).\n");
+        free(directory_data);
+        close(context.fd);
+        return db;
+    }
+
+    reader.data = directory_data;
+    reader.size = directory.size;
+    reader.pos = 0;
+    loads = NULL;
+    new_db = parse_directory(&reader, directory.offset, &loads, &load_count, &sequence);
+    free(directory_data);
+    if (new_db == NULL)
+    {
+        output_printf("Error: Database directory is inconsistent.\n");
+        close(context.fd);
+        return db;
+    }
+
+    atomic_init(&context.failed, 0);
+    pool = pool_shared();
+    task_group_init(&group);
+    for (iter = 0; iter < load_count; iter++)
+    {
+        loads[iter].context = &context;
+        loads[iter].error = LOAD_OK;
+        loads[iter].error_chunk = 0;
+        if (loads[iter].row_count > 0)
+        {
+            pool_submit(pool, &group, load_column_block, &loads[iter]);
+        }
+    }
+    pool_wait(pool, &group);
+    close(context.fd);
+
+    if (load_failed(&context))
+    {
+        for (iter = 0; iter < load_count; iter++)
+        {
+            if (loads[iter].error != LOAD_OK && loads[iter].error != LOAD_ABORTED)
+            {
+                report_load_error(&loads[iter]);
+                break;
+            }
+        }
+        output_printf("Error: Could not load database from '%s'.\n", filename);
+        free(loads);
+        free_database(new_db);
+        return db;
+    }
+
+    free(loads);
+    install_tables(db, new_db, filename, sequence);
+    return db;
+}
@@ -0,0 +1,86 @@
+#include <string.h>
+#include <time.h>
+#include "output.h"
+#include "timer.h"
+
+/* Timer of the statement the calling thread runs, or NULL. */
+static __thread StatementTimer *current = NULL;
+
+/* Returns the monotonic clock in nanoseconds.
+ */
+int64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Starts a timer for a statement. Its plan is not described unless a
+ * buffer is set afterwards.
+ */
+void timer_start(StatementTimer *timer)
+{
+    memset(timer, 0, sizeof(StatementTimer));
+    timer->start = monotonic_ns();
+}
+
+/* Charges the phases of the calling thread's statement to a timer, or to
+ * none if timer is NULL. Returns the previous timer so that nested
+ * statements can restore it.
+ */
+StatementTimer *timer_capture(StatementTimer *timer)
+{
+    StatementTimer *previous;
+
+    previous = current;
+    current = timer;
+    return previous;
+}
+
+/* Charges the time since start to a phase of the calling thread's
+ * statement, if it is being timed.
+ */
+void timer_add(TimerPhase phase, int64_t start)
+{
+    if (current != NULL)
+    {
+        current->phases[phase] += monotonic_ns() - start;
+    }
+}
+
+/* Adds the work of a scan or write to the calling thread's statement,
+ * if it is being timed.
+ */
+void timer_count(int64_t segments, int64_t skipped, int64_t scanned, int64_t returned)
+{
+    if (current != NULL)
+    {
+        current->segments += segments;
+        current->segments_skipped += skipped;
+        current->rows_scanned += scanned;
+        current->rows_returned += returned;
+    }
+}
+
+/* Returns the buffer the calling thread's statement wants its plan
+ * described in, or NULL if it does not.
+ */
+char *timer_plan(void)
+{
+    return current != NULL ? current->plan : NULL;
+}
+
+/* Prints the time a statement has taken so far, phase by phase.
+ */
+void timer_report(const StatementTimer *timer)
+{
+    int64_t total;
+    int64_t execute;
+
+    total = monotonic_ns() - timer->start;
+    execute = total - timer->phases[PHASE_PARSE] - timer->phases[PHASE_PLAN] - timer->phases[PHASE_OUTPUT];
+    output_printf("Run Time: parse %.3f ms, plan %.3f ms, execute %.3f ms, output %.3f ms, total %.3f ms\n",
+                  timer->phases[PHASE_PARSE] / 1e6, timer->phases[PHASE_PLAN] / 1e6, execute / 1e6,
+                  timer->phases[PHASE_OUTPUT] / 1e6, total / 1e6);
+}
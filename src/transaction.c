@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "db.h"
+#include "encoding.h"
+#include "output.h"
+#include "transaction.h"
+#include "wal.h"
+
+/* A commit log record holds the rows of one transaction:
+ *   RECORD_WITH_SCHEMA, table count; per table its name, column count,
+ *   column names and row count, then every cell, row by row
+ * Names and cells are stored as their length, including the null
+ * terminator, followed by the bytes. Records written before tables
+ * carried their columns start with the table count and have no column
+ * names.
+ */
+#define RECORD_WITH_SCHEMA -1
+
+/* Cursor over the payload of a log record. */
+typedef struct RecordReader
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+} RecordReader;
+
+/* Frees the rows of a transaction and the transaction itself.
+ */
+static void free_transaction(Transaction *transaction)
+{
+    PendingTable *pending;
+    size_t cell_count;
+    size_t iter2;
+    int iter1;
+
+    for (iter1 = 0; iter1 < transaction->table_count; iter1++)
+    {
+        pending = &transaction->tables[iter1];
+        cell_count = (size_t)pending->row_count * pending->column_count;
+        for (iter2 = 0; iter2 < cell_count; iter2++)
+        {
+            free(pending->cells[iter2]);
+        }
+        free(pending->cells);
+        for (iter2 = 0; pending->column_names != NULL && iter2 < (size_t)pending->column_count; iter2++)
+        {
+            free(pending->column_names[iter2]);
+        }
+        free(pending->column_names);
+        free(pending->name);
+    }
+    free(transaction->tables);
+    free(transaction);
+}
+
+/* Finds the rows a transaction appends to a table, adding an empty entry
+ * if there is none yet.
+ * Returns the entry, or NULL if memory runs out.
+ */
+static PendingTable *pending_table(Transaction *transaction, const Table *table)
+{
+    PendingTable *tables;
+    PendingTable *pending;
+    int iter;
+
+    for (iter = 0; iter < transaction->table_count; iter++)
+    {
+        if (strcmp(transaction->tables[iter].name, table->name) == 0)
+        {
+            return &transaction->tables[iter];
+        }
+    }
+
+    tables = realloc(transaction->tables, sizeof(PendingTable) * (transaction->table_count + 1));
+    if (tables == NULL)
+    {
+        return NULL;
+    }
+    transaction->tables = tables;
+    pending = &tables[transaction->table_count];
+    memset(pending, 0, sizeof(PendingTable));
+    pending->name = strdup(table->name);
+    pending->column_names = calloc(table->column_count, sizeof(char*));
+    for (iter = 0; pending->column_names != NULL && iter < table->column_count; iter++)
+    {
+        pending->column_names[iter] = strdup(table->columns[iter]->name);
+        if (pending->column_names[iter] == NULL)
+        {
+            break;
+        }
+    }
+    if (pending->name == NULL || pending->column_names == NULL || iter < table->column_count)
+    {
+        while (pending->column_names != NULL && --iter >= 0)
+        {
+            free(pending->column_names[iter]);
+        }
+        free(pending->column_names);
+        free(pending->name);
+        return NULL;
+    }
+    pending->column_count = table->column_count;
+    transaction->table_count++;
+    return pending;
+}
+
+/* Adds one row, given as column_count cells, to a pending table. The
+ * pending table takes over the cells.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int add_pending_row(PendingTable *pending, char **row)
+{
+    char **cells;
+    int capacity;
+
+    if (pending->row_count == pending->capacity)
+    {
+        capacity = pending->capacity == 0 ? 16 : pending->capacity * 2;
+        cells = realloc(pending->cells, sizeof(char*) * (size_t)capacity * pending->column_count);
+        if (cells == NULL)
+        {
+            return -1;
+        }
+        pending->cells = cells;
+        pending->capacity = capacity;
+    }
+    memcpy(pending->cells + (size_t)pending->row_count * pending->column_count, row,
+           sizeof(char*) * pending->column_count);
+    pending->row_count++;
+    return 0;
+}
+
+/* Appends a string to a record, preceded by its length including the
+ * null terminator. Returns 0 on success, -1 if memory runs out.
+ */
+static int append_string(ByteBuffer *record, const char *string)
+{
+    int len;
+
+    len = (int)strlen(string) + 1;
+    if (buffer_append(record, &len, sizeof(int)) != 0 ||
+        buffer_append(record, string, len) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Builds the commit log record of a transaction.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int encode_transaction(const Transaction *transaction, ByteBuffer *record)
+{
+    const PendingTable *pending;
+    size_t cell_count;
+    size_t iter2;
+    int failed;
+    int tag;
+    int iter1;
+
+    tag = RECORD_WITH_SCHEMA;
+    failed = buffer_append(record, &tag, sizeof(int));
+    failed |= buffer_append(record, &transaction->table_count, sizeof(int));
+    for (iter1 = 0; iter1 < transaction->table_count && !failed; iter1++)
+    {
+        pending = &transaction->tables[iter1];
+        failed |= append_string(record, pending->name);
+        failed |= buffer_append(record, &pending->column_count, sizeof(int));
+        for (iter2 = 0; iter2 < (size_t)pending->column_count && !failed; iter2++)
+        {
+            failed |= append_string(record, pending->column_names[iter2]);
+        }
+        failed |= buffer_append(record, &pending->row_count, sizeof(int));
+        cell_count = (size_t)pending->row_count * pending->column_count;
+        for (iter2 = 0; iter2 < cell_count && !failed; iter2++)
+        {
+            failed |= append_string(record, pending->cells[iter2]);
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/* Copies the next length bytes out of the reader.
+ * Returns 0 on success, -1 if the record ends early.
+ */
+static int read_bytes(RecordReader *reader, void *out, size_t length)
+{
+    if (reader->size - reader->pos < length)
+    {
+        return -1;
+    }
+    memcpy(out, reader->data + reader->pos, length);
+    reader->pos += length;
+    return 0;
+}
+
+/* Reads a string written by append_string().
+ * Returns a pointer to the heap-allocated string, or NULL on failure.
+ */
+static char *read_string(RecordReader *reader)
+{
+    char *string;
+    int len;
+
+    if (read_bytes(reader, &len, sizeof(int)) != 0 || len < 1 ||
+        reader->size - reader->pos < (size_t)len || reader->data[reader->pos + len - 1] != '\0')
+    {
+        return NULL;
+    }
+
+    string = malloc(len);
+    if (string != NULL)
+    {
+        read_bytes(reader, string, len);
+    }
+    return string;
+}
+
+/* Rebuilds a transaction from its commit log record.
+ * Returns the transaction, or NULL if the record is malformed or memory
+ * runs out.
+ */
+static Transaction *decode_transaction(const char *payload, size_t length)
+{
+    RecordReader reader;
+    Transaction *transaction;
+    PendingTable *pending;
+    size_t cell_count;
+    size_t iter2;
+    int with_schema;
+    int table_count;
+    int iter1;
+
+    reader.data = payload;
+    reader.size = length;
+    reader.pos = 0;
+    if (read_bytes(&reader, &table_count, sizeof(int)) != 0)
+    {
+        return NULL;
+    }
+    with_schema = table_count == RECORD_WITH_SCHEMA;
+    if ((with_schema && read_bytes(&reader, &table_count, sizeof(int)) != 0) || table_count < 0 ||
+        (size_t)table_count > length / (4 * sizeof(int)))
+    {
+        return NULL;
+    }
+
+    transaction = calloc(1, sizeof(Transaction));
+    if (transaction == NULL)
+    {
+        return NULL;
+    }
+    transaction->tables = calloc(table_count + 1, sizeof(PendingTable));
+    if (transaction->tables == NULL)
+    {
+        free(transaction);
+        return NULL;
+    }
+
+    for (iter1 = 0; iter1 < table_count; iter1++)
+    {
+        pending = &transaction->tables[transaction->table_count++];
+        pending->name = read_string(&reader);
+        if (pending->name == NULL ||
+            read_bytes(&reader, &pending->column_count, sizeof(int)) != 0 ||
+            pending->column_count < 1 || (size_t)pending->column_count > length / sizeof(int))
+        {
+            break;
+        }
+        if (with_schema)
+        {
+            pending->column_names = calloc(pending->column_count, sizeof(char*));
+            for (iter2 = 0; pending->column_names != NULL && iter2 < (size_t)pending->column_count; iter2++)
+            {
+                pending->column_names[iter2] = read_string(&reader);
+                if (pending->column_names[iter2] == NULL)
+                {
+                    break;
+                }
+            }
+            if (pending->column_names == NULL || iter2 < (size_t)pending->column_count)
+            {
+                break;
+            }
+        }
+        if (read_bytes(&reader, &pending->capacity, sizeof(int)) != 0 || pending->capacity < 0 ||
+            (size_t)pending->capacity > length / ((size_t)pending->column_count * sizeof(int)))
+        {
+            break;
+        }
+
+        cell_count = (size_t)pending->capacity * pending->column_count;
+        pending->cells = calloc(cell_count + 1, sizeof(char*));
+        if (pending->cells == NULL)
+        {
+            break;
+        }
+        for (iter2 = 0; iter2 < cell_count; iter2++)
+        {
+            pending->cells[iter2] = read_string(&reader);
+            if (pending->cells[iter2] == NULL || strlen(pending->cells[iter2]) > CELL_MAX_LENGTH)
+            {
+                free(pending->cells[iter2]);
+                break;
+            }
+        }
+        if (iter2 < cell_count)
+        {
+            while (iter2 > 0)
+            {
+                free(pending->cells[--iter2]);
+            }
+            break;
+        }
+        pending->row_count = pending->capacity;
+    }
+
+    if (iter1 < table_count || reader.pos != reader.size)
+    {
+        free_transaction(transaction);
+        return NULL;
+    }
+    return transaction;
+}
+
+/* Appends the rows of a transaction to its tables. Readers see the rows
+ * of all tables at once, or, if any table cannot take its rows, none of
+ * them: those rows stay in the transaction. Tables missing or changed
+ * since are left out.
+ * The catalog lock must be held.
+ * Returns the number of rows appended.
+ */
+static int apply_transaction(Database *db, Transaction *transaction)
+{
+    PendingTable **pendings;
+    PendingTable *pending;
+    Append *appends;
+    Append append;
+    Table *table;
+    int applied;
+    int count;
+    int iter1;
+    int iter2;
+
+    appends = malloc((size_t)(transaction->table_count + 1) * sizeof(Append));
+    pendings = malloc((size_t)(transaction->table_count + 1) * sizeof(PendingTable *));
+    if (appends == NULL || pendings == NULL)
+    {
+        free(appends);
+        free(pendings);
+        return 0;
+    }
+
+    /* Write locks are taken in address order, so committers sharing
+     * tables cannot deadlock.
+     */
+    count = 0;
+    for (iter1 = 0; iter1 < transaction->table_count; iter1++)
+    {
+        pending = &transaction->tables[iter1];
+        table = find_table(db, pending->name);
+        if (table == NULL || table->column_count != pending->column_count || pending->row_count == 0)
+        {
+            continue;
+        }
+        for (iter2 = count; iter2 > 0 && (uintptr_t)appends[iter2 - 1].snapshot.table > (uintptr_t)table; iter2--)
+        {
+            appends[iter2] = appends[iter2 - 1];
+            pendings[iter2] = pendings[iter2 - 1];
+        }
+        appends[iter2].snapshot.table = table;
+        pendings[iter2] = pending;
+        count++;
+    }
+    for (iter1 = 0; iter1 < count; iter1++)
+    {
+        lock_table(appends[iter1].snapshot.table, &append.snapshot);
+        appends[iter1].snapshot = append.snapshot;
+    }
+
+    applied = 0;
+    for (iter1 = 0; iter1 < count; iter1++)
+    {
+        if (reserve_rows(&appends[iter1].snapshot, pendings[iter1]->row_count) != 0)
+        {
+            break;
+        }
+    }
+    if (iter1 == count)
+    {
+        for (iter1 = 0; iter1 < count; iter1++)
+        {
+            stage_rows(&appends[iter1], pendings[iter1]->cells, pendings[iter1]->row_count);
+            applied += pendings[iter1]->row_count;
+            pendings[iter1]->row_count = 0;
+        }
+        publish_appends(appends, count);
+    }
+
+    for (iter1 = count - 1; iter1 >= 0; iter1--)
+    {
+        unlock_table(&appends[iter1].snapshot);
+    }
+    free(appends);
+    free(pendings);
+    return applied;
+}
+
+/* Starts a transaction in the session.
+ */
+void begin_transaction(Session *session)
+{
+    if (session->transaction != NULL)
+    {
+        output_printf("Error: A transaction is already open.\n");
+        return;
+    }
+    session->transaction = calloc(1, sizeof(Transaction));
+    if (session->transaction == NULL)
+    {
+        output_printf("Error: Memory allocation failed while starting transaction.\n");
+        return;
+    }
+    output_printf("Transaction started.\n");
+}
+
+/* Buffers a row in the session's open transaction. The row is checked
+ * against the table now, but nobody sees it before COMMIT.
+ */
+void queue_insert(Database *db, Session *session, const char *table_name, const char *values_str)
+{
+    PendingTable *pending;
+    Table *table;
+    char **values;
+    int iter;
+
+    table = find_table(db, table_name);
+    if (table == NULL)
+    {
+        output_printf("Error: Table '%s' does not exist.\n", table_name);
+        return;
+    }
+
+    values = parse_values(table, values_str);
+    if (values == NULL)
+    {
+        return;
+    }
+
+    pending = pending_table(session->transaction, table);
+    if (pending == NULL || pending->column_count != table->column_count || add_pending_row(pending, values) != 0)
+    {
+        output_printf("Error: Could not add row to the transaction.\n");
+        for (iter = 0; iter < table->column_count; iter++)
+        {
+            free(values[iter]);
+        }
+        free(values);
+        return;
+    }
+    free(values);
+    output_printf("Row queued for table '%s'.\n", table_name);
+}
+
+/* Commits the session's open transaction: its rows are written to the
+ * commit log, and once that is on disk they are published to their
+ * tables. A table missing at this point fails the whole commit before
+ * anything is logged.
+ * The catalog lock must be held.
+ */
+void commit_transaction(Database *db, Session *session)
+{
+    Transaction *transaction;
+    PendingTable *pending;
+    Table *table;
+    ByteBuffer record;
+    uint64_t sequence;
+    int rows;
+    int iter;
+
+    transaction = session->transaction;
+    if (transaction == NULL)
+    {
+        output_printf("Error: No transaction is open.\n");
+        return;
+    }
+    session->transaction = NULL;
+
+    rows = 0;
+    for (iter = 0; iter < transaction->table_count; iter++)
+    {
+        pending = &transaction->tables[iter];
+        table = find_table(db, pending->name);
+        if (table == NULL || table->column_count != pending->column_count)
+        {
+            output_printf("Error: Table '%s' changed during the transaction; rolled back.\n", pending->name);
+            free_transaction(transaction);
+            return;
+        }
+        rows += pending->row_count;
+    }
+    if (rows == 0)
+    {
+        free_transaction(transaction);
+        output_printf("Transaction committed: 0 rows.\n");
+        return;
+    }
+
+    memset(&record, 0, sizeof(ByteBuffer));
+    if (encode_transaction(transaction, &record) != 0 || log_commit(db->log, record.data, record.length, &sequence) != 0)
+    {
+        output_printf("Error: Could not log the transaction; rolled back.\n");
+        buffer_free(&record);
+        free_transaction(transaction);
+        return;
+    }
+    buffer_free(&record);
+
+    if (apply_transaction(db, transaction) != rows)
+    {
+        output_printf("Error: Memory allocation failed while applying transaction %llu; none of its rows are "
+                      "visible yet, but it is in the commit log and will be applied by LOAD.\n",
+                      (unsigned long long)sequence);
+    }
+    else
+    {
+        output_printf("Transaction committed: %d rows.\n", rows);
+    }
+    finish_commit(db->log);
+    free_transaction(transaction);
+}
+
+/* Drops the session's open transaction.
+ */
+void rollback_transaction(Session *session)
+{
+    if (session->transaction == NULL)
+    {
+        output_printf("Error: No transaction is open.\n");
+        return;
+    }
+    free_transaction(session->transaction);
+    session->transaction = NULL;
+    output_printf("Transaction rolled back.\n");
+}
+
+/* Drops whatever a session leaves open when its client goes away.
+ */
+void end_session(Session *session)
+{
+    if (session->transaction != NULL)
+    {
+        free_transaction(session->transaction);
+        session->transaction = NULL;
+    }
+}
+
+/* State of one replay_commit_log(). */
+typedef struct Replay
+{
+    Database *db;
+    int transactions;
+    int rows;
+} Replay;
+
+/* Creates the table of a logged transaction if it was created after the
+ * database file was saved. Old records carry no column names and leave
+ * such tables missing.
+ */
+static void replay_table(Database *db, const PendingTable *pending)
+{
+    ByteBuffer columns;
+    int iter;
+
+    if (pending->column_names == NULL || find_table(db, pending->name) != NULL)
+    {
+        return;
+    }
+    memset(&columns, 0, sizeof(ByteBuffer));
+    for (iter = 0; iter < pending->column_count; iter++)
+    {
+        if ((iter > 0 && buffer_append(&columns, ", ", 2) != 0) ||
+            buffer_append(&columns, pending->column_names[iter], strlen(pending->column_names[iter]) + 1) != 0)
+        {
+            buffer_free(&columns);
+            return;
+        }
+        columns.length--;
+    }
+    create_table(db, pending->name, columns.data);
+    buffer_free(&columns);
+}
+
+/* Log record callback for replay_commit_log().
+ */
+static void replay_record(uint64_t sequence, const char *payload, size_t length, void *arg)
+{
+    Replay *replay;
+    Transaction *transaction;
+    int iter;
+
+    replay = arg;
+    transaction = decode_transaction(payload, length);
+    if (transaction == NULL)
+    {
+        output_printf("Error: Skipping malformed transaction %llu in the commit log.\n", (unsigned long long)sequence);
+        return;
+    }
+    for (iter = 0; iter < transaction->table_count; iter++)
+    {
+        replay_table(replay->db, &transaction->tables[iter]);
+    }
+    replay->rows += apply_transaction(replay->db, transaction);
+    replay->transactions++;
+    for (iter = 0; iter < transaction->table_count; iter++)
+    {
+        if (transaction->tables[iter].row_count > 0)
+        {
+            output_printf("Error: Could not replay rows of transaction %llu into table '%s'.\n",
+                          (unsigned long long)sequence, transaction->tables[iter].name);
+        }
+    }
+    free_transaction(transaction);
+}
+
+/* Re-applies the transactions logged after the given sequence number,
+ * which are the ones committed after the database file being loaded was
+ * saved. The catalog lock must be held exclusively.
+ * Returns 0 on success, -1 if the log could not be read.
+ */
+int replay_commit_log(Database *db, uint64_t after)
+{
+    Replay replay;
+
+    replay.db = db;
+    replay.transactions = 0;
+    replay.rows = 0;
+    if (read_commit_log(db->log, after, replay_record, &replay) != 0)
+    {
+        output_printf("Error: Could not replay the commit log.\n");
+        return -1;
+    }
+    if (replay.transactions > 0)
+    {
+        output_printf("Replayed %d transactions (%d rows) from the commit log.\n", replay.transactions, replay.rows);
+    }
+    return 0;
+}
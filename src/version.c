@@ -0,0 +1,779 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <math.h>
+#include "bloom.h"
+#include "db.h"
+
+/* Entries a new segment list has room for before it first grows. */
+#define INITIAL_SEGMENT_SLOTS 4
+
+/* Fewest cells a segment is allocated with. */
+#define MIN_SEGMENT_ROWS 16
+
+/* Last stamp handed out. Stamps are never reused, so one names a single
+ * state of a single table even after a LOAD replaces the table.
+ */
+static _Atomic uint64_t last_stamp = 0;
+
+static uint64_t next_stamp(void)
+{
+    return atomic_fetch_add(&last_stamp, 1) + 1;
+}
+
+/* Frees a version that no reader can reach any more, together with the
+ * memory retired to it.
+ */
+static void free_version(TableVersion *version)
+{
+    int iter;
+
+    for (iter = 0; iter < version->retired_count; iter++)
+    {
+        free(version->retired[iter]);
+    }
+    free(version->retired);
+    free(version->segments);
+    free(version);
+}
+
+/* Detaches versions from the oldest on for as long as nobody pins them.
+ * An unpinned version behind a pinned one is kept: memory it retired may
+ * still be shared with the older version.
+ * The version lock must be held. Returns the detached versions, which the
+ * caller frees with free_versions() once it has released the lock, so
+ * that readers never wait while retired memory is freed.
+ */
+static TableVersion *reclaim_versions(Table *table)
+{
+    TableVersion *reclaimed;
+    TableVersion *last;
+
+    reclaimed = table->oldest;
+    last = NULL;
+    while (table->oldest != table->current && table->oldest->refcount == 0)
+    {
+        last = table->oldest;
+        table->oldest = last->next;
+    }
+    if (last == NULL)
+    {
+        return NULL;
+    }
+    last->next = NULL;
+    return reclaimed;
+}
+
+/* Frees a chain of versions detached by reclaim_versions().
+ */
+static void free_versions(TableVersion *version)
+{
+    TableVersion *next;
+
+    for (; version != NULL; version = next)
+    {
+        next = version->next;
+        free_version(version);
+    }
+}
+
+/* Returns the cells the first segment of a table with row_count rows
+ * needs: all SEGMENT_ROWS once the table spans more than one segment,
+ * otherwise the row count rounded up to a power of two.
+ */
+int first_segment_rows(int64_t row_count)
+{
+    int rows;
+
+    rows = MIN_SEGMENT_ROWS;
+    while (rows < SEGMENT_ROWS && rows < row_count)
+    {
+        rows *= 2;
+    }
+    return rows;
+}
+
+/* Allocates a segment with room for capacity cells, every cell empty and
+ * an empty zone map, counted in the usage of its column.
+ */
+Segment alloc_segment(MemoryUsage *usage, int capacity)
+{
+    Segment segment;
+
+    segment = memory_alloc(usage, SEGMENT_SIZE(capacity));
+    if (segment != NULL)
+    {
+        segment->capacity = capacity;
+    }
+    return segment;
+}
+
+/* Allocates a segment list with room for capacity segments, and the
+ * segments that row_count rows take.
+ * Returns the list, or NULL if memory runs out.
+ */
+Segment *alloc_segment_list(MemoryUsage *usage, int64_t row_count, int capacity)
+{
+    Segment *list;
+    int count;
+    int iter;
+
+    count = segments_for_rows(row_count);
+    list = calloc(capacity, sizeof(Segment));
+    if (list == NULL)
+    {
+        return NULL;
+    }
+    for (iter = 0; iter < count; iter++)
+    {
+        list[iter] = alloc_segment(usage, iter == 0 ? first_segment_rows(row_count) : SEGMENT_ROWS);
+        if (list[iter] == NULL)
+        {
+            free_segment_list(usage, list, iter);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+/* Frees a segment list and its first count segments, but no cell texts.
+ */
+void free_segment_list(MemoryUsage *usage, Segment *list, int count)
+{
+    int iter;
+
+    if (list == NULL)
+    {
+        return;
+    }
+    for (iter = 0; iter < count; iter++)
+    {
+        if (list[iter] != NULL)
+        {
+            memory_free(usage, list[iter]->bloom, BLOOM_SIZE);
+            memory_free(usage, list[iter], SEGMENT_SIZE(list[iter]->capacity));
+        }
+    }
+    free(list);
+}
+
+/* Hands a segment over to a version to free when it is reclaimed. It no
+ * longer counts towards its column.
+ */
+void retire_segment(TableVersion *version, MemoryUsage *usage, Segment segment)
+{
+    if (segment != NULL)
+    {
+        memory_release(usage, segment->bloom, BLOOM_SIZE);
+        retire_memory(version, segment->bloom);
+        memory_release(usage, segment, SEGMENT_SIZE(segment->capacity));
+    }
+    retire_memory(version, segment);
+}
+
+/* Builds the Bloom filter of a full segment. Without memory the segment
+ * simply goes without one, and scans read it.
+ */
+void build_bloom(MemoryUsage *usage, Segment segment)
+{
+    int row;
+
+    memory_free(usage, segment->bloom, BLOOM_SIZE);
+    segment->bloom = bloom_create();
+    memory_track(usage, segment->bloom, BLOOM_SIZE);
+    for (row = 0; segment->bloom != NULL && row < SEGMENT_ROWS; row++)
+    {
+        bloom_add(segment->bloom, cell_text(&segment->cells[row]));
+    }
+}
+
+/* Returns the number of segments needed for row_count rows, or -1 if
+ * that many do not fit a segment list.
+ */
+int segments_for_rows(int64_t row_count)
+{
+    int64_t count;
+
+    count = (row_count + SEGMENT_ROWS - 1) >> SEGMENT_SHIFT;
+    return count > INT_MAX / 2 ? -1 : (int)count;
+}
+
+/* Gives a table its first version with segments for row_count rows, and
+ * sets up its locks. Returns 0 on success, -1 if memory runs out.
+ */
+int init_table_storage(Table *table, int64_t row_count)
+{
+    TableVersion *version;
+    int segment_count;
+    int capacity;
+    int iter;
+
+    segment_count = segments_for_rows(row_count);
+    if (segment_count < 0)
+    {
+        return -1;
+    }
+    capacity = segment_count > INITIAL_SEGMENT_SLOTS ? segment_count : INITIAL_SEGMENT_SLOTS;
+
+    version = calloc(1, sizeof(TableVersion));
+    if (version == NULL)
+    {
+        return -1;
+    }
+    version->refcount = 1;
+    version->segment_count = segment_count;
+    version->segment_capacity = capacity;
+    version->segments = calloc(table->column_count, sizeof(Segment*));
+    for (iter = 0; version->segments != NULL && iter < table->column_count; iter++)
+    {
+        version->segments[iter] = alloc_segment_list(&table->columns[iter]->memory, row_count, capacity);
+        if (version->segments[iter] == NULL)
+        {
+            break;
+        }
+    }
+    if (version->segments == NULL || iter < table->column_count)
+    {
+        for (iter = 0; version->segments != NULL && iter < table->column_count; iter++)
+        {
+            free_segment_list(&table->columns[iter]->memory, version->segments[iter], segment_count);
+        }
+        free(version->segments);
+        free(version);
+        return -1;
+    }
+
+    pthread_mutex_init(&table->write_lock, NULL);
+    pthread_mutex_init(&table->version_lock, NULL);
+    table->current = version;
+    table->oldest = version;
+    table->stamp = next_stamp();
+    return 0;
+}
+
+/* Frees all cells and versions of a table. Nobody may be using it.
+ * Tolerates tables whose storage was never set up.
+ */
+void free_table_storage(Table *table)
+{
+    TableVersion *version;
+    TableVersion *next;
+    int64_t rows;
+    int64_t row;
+    int segment;
+    int iter;
+
+    if (table->current == NULL)
+    {
+        return;
+    }
+
+    version = table->current;
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        for (segment = 0; segment < version->segment_count; segment++)
+        {
+            rows = table->row_count - ((int64_t)segment << SEGMENT_SHIFT);
+            for (row = 0; row < rows && row < SEGMENT_ROWS; row++)
+            {
+                free(cell_heap(&version->segments[iter][segment]->cells[row]));
+            }
+        }
+        free_segment_list(&table->columns[iter]->memory, version->segments[iter], version->segment_count);
+    }
+    if (version->deleted != NULL)
+    {
+        for (segment = 0; segment < version->segment_count; segment++)
+        {
+            free(version->deleted[segment]);
+        }
+        free(version->deleted);
+    }
+
+    for (version = table->oldest; version != NULL; version = next)
+    {
+        next = version->next;
+        free_version(version);
+    }
+    table->current = NULL;
+    table->oldest = NULL;
+    pthread_mutex_destroy(&table->write_lock);
+    pthread_mutex_destroy(&table->version_lock);
+}
+
+/* Pins the current version of a table for reading. The snapshot stays
+ * valid, and unchanged, until unpin_table() however the table is
+ * written to in the meantime.
+ */
+void pin_table(Table *table, TableSnapshot *snapshot)
+{
+    pthread_mutex_lock(&table->version_lock);
+    snapshot->table = table;
+    snapshot->version = table->current;
+    snapshot->row_count = table->row_count;
+    snapshot->deleted_count = table->deleted_count;
+    snapshot->stamp = table->stamp;
+    snapshot->version->refcount++;
+    pthread_mutex_unlock(&table->version_lock);
+}
+
+void unpin_table(TableSnapshot *snapshot)
+{
+    Table *table;
+    TableVersion *reclaimed;
+
+    table = snapshot->table;
+    pthread_mutex_lock(&table->version_lock);
+    snapshot->version->refcount--;
+    reclaimed = reclaim_versions(table);
+    pthread_mutex_unlock(&table->version_lock);
+    free_versions(reclaimed);
+}
+
+/* Makes the caller the only writer of a table and returns its current
+ * state. No other writer can publish a version until unlock_table().
+ */
+void lock_table(Table *table, TableSnapshot *snapshot)
+{
+    pthread_mutex_lock(&table->write_lock);
+    pthread_mutex_lock(&table->version_lock);
+    snapshot->table = table;
+    snapshot->version = table->current;
+    snapshot->row_count = table->row_count;
+    snapshot->deleted_count = table->deleted_count;
+    snapshot->stamp = table->stamp;
+    pthread_mutex_unlock(&table->version_lock);
+}
+
+void unlock_table(TableSnapshot *snapshot)
+{
+    pthread_mutex_unlock(&snapshot->table->write_lock);
+}
+
+/* Starts a new version of a locked table that shares every segment
+ * list, segment and bitmap with the current one. The writer replaces
+ * what it changes and retires the replaced memory to the current
+ * version. Returns NULL if memory runs out.
+ */
+TableVersion *copy_version(Table *table)
+{
+    TableVersion *version;
+
+    version = calloc(1, sizeof(TableVersion));
+    if (version == NULL)
+    {
+        return NULL;
+    }
+    version->segments = malloc(sizeof(Segment*) * table->column_count);
+    if (version->segments == NULL)
+    {
+        free(version);
+        return NULL;
+    }
+    memcpy(version->segments, table->current->segments, sizeof(Segment*) * table->column_count);
+    version->segment_count = table->current->segment_count;
+    version->segment_capacity = table->current->segment_capacity;
+    version->deleted = table->current->deleted;
+    return version;
+}
+
+/* Hands memory over to a version, to be freed once no reader can reach
+ * that version. If the list cannot grow the memory is leaked rather
+ * than freed under a reader.
+ */
+void retire_memory(TableVersion *version, void *memory)
+{
+    void **retired;
+    int capacity;
+
+    if (memory == NULL)
+    {
+        return;
+    }
+    if (version->retired_count == version->retired_capacity)
+    {
+        capacity = version->retired_capacity == 0 ? 16 : version->retired_capacity * 2;
+        retired = realloc(version->retired, sizeof(void*) * capacity);
+        if (retired == NULL)
+        {
+            return;
+        }
+        version->retired = retired;
+        version->retired_capacity = capacity;
+    }
+    version->retired[version->retired_count++] = memory;
+}
+
+/* Makes a version built with copy_version() current. Readers pinned to
+ * older versions keep them; new readers see the new one.
+ */
+void publish_version(Table *table, TableVersion *version, int64_t row_count, int64_t deleted_count)
+{
+    TableVersion *old;
+    TableVersion *reclaimed;
+
+    pthread_mutex_lock(&table->version_lock);
+    old = table->current;
+    version->refcount = 1;
+    old->next = version;
+    table->current = version;
+    table->row_count = row_count;
+    table->deleted_count = deleted_count;
+    table->stamp = next_stamp();
+    old->refcount--;
+    reclaimed = reclaim_versions(table);
+    pthread_mutex_unlock(&table->version_lock);
+    free_versions(reclaimed);
+}
+
+/* Makes rows staged past the row counts of locked tables visible to new
+ * readers, in every table at the same moment: no table can be pinned
+ * until all of them carry their new row count. The tables must be
+ * distinct, in the order their write locks were taken. Each snapshot
+ * takes its table's new stamp.
+ */
+void publish_rows(Append *appends, int count)
+{
+    Table *table;
+    int iter;
+
+    for (iter = 0; iter < count; iter++)
+    {
+        pthread_mutex_lock(&appends[iter].snapshot.table->version_lock);
+    }
+    for (iter = 0; iter < count; iter++)
+    {
+        table = appends[iter].snapshot.table;
+        table->row_count = appends[iter].snapshot.row_count;
+        table->stamp = next_stamp();
+        appends[iter].snapshot.stamp = table->stamp;
+    }
+    for (iter = count - 1; iter >= 0; iter--)
+    {
+        pthread_mutex_unlock(&appends[iter].snapshot.table->version_lock);
+    }
+}
+
+/* Publishes a version of a locked table whose segment lists have room
+ * for at least segment_count segments. Only the lists are copied; the
+ * segments themselves stay where they are.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int grow_segment_lists(TableSnapshot *snapshot, int segment_count)
+{
+    Table *table;
+    TableVersion *old;
+    TableVersion *version;
+    uint64_t **deleted;
+    int capacity;
+    int iter;
+
+    table = snapshot->table;
+    old = snapshot->version;
+    capacity = old->segment_capacity;
+    while (capacity < segment_count)
+    {
+        capacity *= 2;
+    }
+
+    version = copy_version(table);
+    if (version == NULL)
+    {
+        return -1;
+    }
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        version->segments[iter] = calloc(capacity, sizeof(Segment));
+        if (version->segments[iter] == NULL)
+        {
+            break;
+        }
+        memcpy(version->segments[iter], old->segments[iter], sizeof(Segment) * old->segment_count);
+    }
+    deleted = NULL;
+    if (iter == table->column_count && old->deleted != NULL)
+    {
+        deleted = calloc(capacity, sizeof(uint64_t*));
+        if (deleted != NULL)
+        {
+            memcpy(deleted, old->deleted, sizeof(uint64_t*) * old->segment_count);
+        }
+    }
+    if (iter < table->column_count || (old->deleted != NULL && deleted == NULL))
+    {
+        while (--iter >= 0)
+        {
+            free(version->segments[iter]);
+        }
+        free(version->segments);
+        free(version);
+        return -1;
+    }
+    version->segment_capacity = capacity;
+    version->deleted = deleted;
+
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        retire_memory(old, old->segments[iter]);
+    }
+    retire_memory(old, old->deleted);
+    publish_version(table, version, snapshot->row_count, snapshot->deleted_count);
+    snapshot->version = version;
+    return 0;
+}
+
+/* Publishes a version of a locked table whose first segment has room for
+ * rows cells in every column. The first segments are copied into larger
+ * ones, which take over their cell texts, and the lists are copied to
+ * point at them; readers of older versions keep the smaller segments.
+ * Returns 0 on success, -1 if memory runs out.
+ */
+static int grow_first_segment(TableSnapshot *snapshot, int rows)
+{
+    Table *table;
+    TableVersion *old;
+    TableVersion *version;
+    Segment segment;
+    int iter;
+
+    table = snapshot->table;
+    old = snapshot->version;
+    version = copy_version(table);
+    if (version == NULL)
+    {
+        return -1;
+    }
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        version->segments[iter] = calloc(old->segment_capacity, sizeof(Segment));
+        segment = alloc_segment(&table->columns[iter]->memory, rows);
+        if (version->segments[iter] == NULL || segment == NULL)
+        {
+            free(version->segments[iter]);
+            memory_free(&table->columns[iter]->memory, segment, SEGMENT_SIZE(rows));
+            break;
+        }
+        memcpy(version->segments[iter], old->segments[iter], sizeof(Segment) * old->segment_count);
+        memcpy(segment, old->segments[iter][0], SEGMENT_SIZE(old->segments[iter][0]->capacity));
+        segment->capacity = rows;
+        version->segments[iter][0] = segment;
+    }
+    if (iter < table->column_count)
+    {
+        while (--iter >= 0)
+        {
+            memory_free(&table->columns[iter]->memory, version->segments[iter][0], SEGMENT_SIZE(rows));
+            free(version->segments[iter]);
+        }
+        free(version->segments);
+        free(version);
+        return -1;
+    }
+
+    for (iter = 0; iter < table->column_count; iter++)
+    {
+        retire_segment(old, &table->columns[iter]->memory, old->segments[iter][0]);
+        retire_memory(old, old->segments[iter]);
+    }
+    publish_version(table, version, snapshot->row_count, snapshot->deleted_count);
+    snapshot->version = version;
+    return 0;
+}
+
+/* Makes room in a locked table for count more rows. New segments are
+ * added to the current version's lists past every row a reader can see;
+ * only when the lists are full, or the first segment of a small table
+ * fills up, is a version with longer lists or a larger segment published.
+ * Returns 0 on success, -1 if memory runs out or the table is too large.
+ */
+int reserve_rows(TableSnapshot *snapshot, int64_t count)
+{
+    TableVersion *version;
+    Segment segment;
+    int needed;
+    int rows;
+    int iter;
+
+    if (count > INT64_MAX - snapshot->row_count)
+    {
+        return -1;
+    }
+    needed = segments_for_rows(snapshot->row_count + count);
+    if (needed < 0)
+    {
+        return -1;
+    }
+    if (needed > snapshot->version->segment_capacity && grow_segment_lists(snapshot, needed) != 0)
+    {
+        return -1;
+    }
+    rows = first_segment_rows(snapshot->row_count + count);
+    if (snapshot->version->segment_count > 0 && snapshot->version->segments[0][0]->capacity < rows &&
+        grow_first_segment(snapshot, rows) != 0)
+    {
+        return -1;
+    }
+
+    version = snapshot->version;
+    while (version->segment_count < needed)
+    {
+        rows = version->segment_count == 0 ? first_segment_rows(snapshot->row_count + count) : SEGMENT_ROWS;
+        for (iter = 0; iter < snapshot->table->column_count; iter++)
+        {
+            segment = alloc_segment(&snapshot->table->columns[iter]->memory, rows);
+            if (segment == NULL)
+            {
+                while (--iter >= 0)
+                {
+                    memory_free(&snapshot->table->columns[iter]->memory, version->segments[iter][version->segment_count],
+                                SEGMENT_SIZE(rows));
+                    version->segments[iter][version->segment_count] = NULL;
+                }
+                return -1;
+            }
+            version->segments[iter][version->segment_count] = segment;
+        }
+        version->segment_count++;
+    }
+    return 0;
+}
+
+/* Returns where a cell of a version is stored.
+ */
+Cell *cell_at(const TableVersion *version, int column, int64_t row)
+{
+    return &version->segments[column][row >> SEGMENT_SHIFT]->cells[row & SEGMENT_MASK];
+}
+
+/* Widens a zone map to cover one more cell. A cell that reads as NaN
+ * compares equal to every number, so it widens the numeric bounds to
+ * everything.
+ */
+void widen_zone(ZoneMap *zone, const char *cell)
+{
+    double number;
+
+    if (parse_number(cell, &number))
+    {
+        if (isnan(number))
+        {
+            zone->min_number = -INFINITY;
+            zone->max_number = INFINITY;
+        }
+        else if (zone->numbers == 0)
+        {
+            zone->min_number = number;
+            zone->max_number = number;
+        }
+        else
+        {
+            zone->min_number = number < zone->min_number ? number : zone->min_number;
+            zone->max_number = number > zone->max_number ? number : zone->max_number;
+        }
+        zone->numbers++;
+    }
+
+    if (zone->rows == 0 || strncmp(cell, zone->min_text, ZONE_PREFIX) < 0)
+    {
+        strncpy(zone->min_text, cell, ZONE_PREFIX);
+        zone->min_text[ZONE_PREFIX] = '\0';
+    }
+    if (zone->rows == 0 || strncmp(cell, zone->max_text, ZONE_PREFIX) > 0)
+    {
+        strncpy(zone->max_text, cell, ZONE_PREFIX);
+        zone->max_text[ZONE_PREFIX] = '\0';
+    }
+    zone->rows++;
+}
+
+/* Returns 1 if the row is deleted in the snapshot, 0 otherwise.
+ */
+int row_is_deleted(const TableSnapshot *snapshot, int64_t row)
+{
+    const uint64_t *bitmap;
+
+    if (snapshot->version->deleted == NULL)
+    {
+        return 0;
+    }
+    bitmap = snapshot->version->deleted[row >> SEGMENT_SHIFT];
+    return bitmap != NULL && (bitmap[(row & SEGMENT_MASK) / 64] >> (row % 64) & 1);
+}
+
+/* Returns the heap text of a cell, or NULL if it is kept inline. This is
+ * what freeing or retiring the cell releases.
+ */
+char *cell_heap(const Cell *cell)
+{
+    return cell->length <= CELL_INLINE ? NULL : (char*)cell_text(cell);
+}
+
+/* Sets a cell to a copy of length bytes of text, inline if they fit.
+ * Whatever the cell held before is overwritten, not freed.
+ * Returns 0 on success, -1 if the text is longer than CELL_MAX_LENGTH or
+ * memory runs out.
+ */
+int store_cell(Cell *cell, const char *text, size_t length)
+{
+    char *copy;
+
+    if (length > CELL_MAX_LENGTH)
+    {
+        return -1;
+    }
+    cell->end = 0;
+    if (length <= CELL_INLINE)
+    {
+        memset(cell->bytes, 0, CELL_INLINE);
+        memcpy(cell->bytes, text, length);
+        cell->length = (uint32_t)length;
+        return 0;
+    }
+    copy = malloc(length + 1);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    memcpy(cell->bytes, text, CELL_PREFIX);
+    memcpy(cell->bytes + CELL_PREFIX, &copy, sizeof(char*));
+    cell->length = (uint32_t)length;
+    return 0;
+}
+
+/* Sets a cell to a text allocated with malloc(), which the cell takes
+ * over: a short text is copied inline and freed, a long one kept as is.
+ * The text must not be longer than CELL_MAX_LENGTH. Whatever the cell
+ * held before is overwritten, not freed.
+ */
+void adopt_cell(Cell *cell, char *text)
+{
+    size_t length;
+
+    length = strlen(text);
+    if (length <= CELL_INLINE)
+    {
+        store_cell(cell, text, length);
+        free(text);
+        return;
+    }
+    cell->end = 0;
+    memcpy(cell->bytes, text, CELL_PREFIX);
+    memcpy(cell->bytes + CELL_PREFIX, &text, sizeof(char*));
+    cell->length = (uint32_t)length;
+}
+
+/* Adds copies of a cell's heap text to a tally. Inline text is part of
+ * its segment and counted with it.
+ */
+void tally_cell(MemoryTally *tally, const Cell *cell, int64_t copies)
+{
+    if (cell->length > CELL_INLINE)
+    {
+        tally_text(tally, cell_text(cell), cell->length, copies);
+    }
+}
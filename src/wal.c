@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "metrics.h"
+#include "output.h"
+#include "timer.h"
+#include "wal.h"
+
+/* Record header field positions; the checksum covers everything after it. */
+#define RECORD_LENGTH_POS 0
+#define RECORD_CRC_POS 4
+#define RECORD_SEQUENCE_POS 8
+#define RECORD_HEADER_SIZE 16
+
+/* Creates a commit log kept in the given file. The file is opened when
+ * the log is first used.
+ * Returns the log, or NULL if memory runs out.
+ */
+CommitLog *create_commit_log(const char *filename)
+{
+    CommitLog *log;
+
+    log = calloc(1, sizeof(CommitLog));
+    if (log == NULL)
+    {
+        return NULL;
+    }
+    log->filename = strdup(filename);
+    if (log->filename == NULL)
+    {
+        free(log);
+        return NULL;
+    }
+    log->fd = -1;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->changed, NULL);
+    return log;
+}
+
+void free_commit_log(CommitLog *log)
+{
+    if (log == NULL)
+    {
+        return;
+    }
+    if (log->fd >= 0)
+    {
+        close(log->fd);
+    }
+    buffer_free(&log->pending);
+    buffer_free(&log->flushing);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->changed);
+    free(log->filename);
+    free(log);
+}
+
+/* Reads the whole log file into a buffer.
+ * Returns 0 on success, -1 on failure.
+ */
+static int read_log_file(CommitLog *log, ByteBuffer *out)
+{
+    struct stat info;
+    ssize_t got;
+
+    if (fstat(log->fd, &info) != 0 || buffer_reserve(out, (size_t)info.st_size + 1) != 0)
+    {
+        return -1;
+    }
+    while (out->length < (size_t)info.st_size)
+    {
+        got = pread(log->fd, out->data + out->length, (size_t)info.st_size - out->length, (off_t)out->length);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return -1;
+        }
+        out->length += got;
+    }
+    return 0;
+}
+
+/* Checks the record at offset.
+ * Returns the size of the whole record, or 0 if it is torn or corrupted.
+ */
+static size_t record_size(const char *data, size_t length, size_t offset, uint64_t *sequence)
+{
+    uint32_t payload_length;
+    uint32_t crc;
+
+    if (length - offset < RECORD_HEADER_SIZE)
+    {
+        return 0;
+    }
+    memcpy(&payload_length, data + offset + RECORD_LENGTH_POS, sizeof(uint32_t));
+    memcpy(&crc, data + offset + RECORD_CRC_POS, sizeof(uint32_t));
+    if (length - offset - RECORD_HEADER_SIZE < payload_length ||
+        crc32c(0, data + offset + RECORD_SEQUENCE_POS, RECORD_HEADER_SIZE - RECORD_SEQUENCE_POS + payload_length) != crc)
+    {
+        return 0;
+    }
+    memcpy(sequence, data + offset + RECORD_SEQUENCE_POS, sizeof(uint64_t));
+    return RECORD_HEADER_SIZE + payload_length;
+}
+
+/* Makes the directory entry of a file durable, so that a file just
+ * created or renamed into place keeps its name after a crash.
+ * Returns 0 on success, -1 on failure.
+ */
+int sync_directory(const char *filename)
+{
+    char directory[PATH_MAX];
+    const char *slash;
+    size_t length;
+    int failed;
+    int fd;
+
+    slash = strrchr(filename, '/');
+    length = slash == NULL ? 0 : slash == filename ? 1 : (size_t)(slash - filename);
+    if (length >= sizeof(directory))
+    {
+        return -1;
+    }
+    memcpy(directory, length > 0 ? filename : ".", length > 0 ? length : 1);
+    directory[length > 0 ? length : 1] = '\0';
+
+    fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    failed = fsync(fd) != 0;
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+/* Opens the log file on first use and finds the last sequence number in
+ * it. A record torn by a crash in the middle of a write is cut off.
+ * The log lock must be held.
+ * Returns 0 on success, -1 on failure.
+ */
+static int open_log(CommitLog *log)
+{
+    ByteBuffer data;
+    uint64_t sequence;
+    size_t offset;
+    size_t size;
+
+    if (log->fd >= 0)
+    {
+        return 0;
+    }
+
+    log->fd = open(log->filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd >= 0 && sync_directory(log->filename) != 0)
+    {
+        close(log->fd);
+        log->fd = -1;
+    }
+    if (log->fd < 0)
+    {
+        output_printf("Error: Could not open commit log '%s'.\n", log->filename);
+        return -1;
+    }
+
+    memset(&data, 0, sizeof(ByteBuffer));
+    if (read_log_file(log, &data) != 0)
+    {
+        output_printf("Error: Could not read commit log '%s'.\n", log->filename);
+        buffer_free(&data);
+        close(log->fd);
+        log->fd = -1;
+        return -1;
+    }
+    for (offset = 0; (size = record_size(data.data, data.length, offset, &sequence)) > 0; offset += size)
+    {
+        if (sequence > log->sequence)
+        {
+            log->sequence = sequence;
+        }
+    }
+    if (offset < data.length && ftruncate(log->fd, (off_t)offset) != 0)
+    {
+        output_printf("Error: Could not repair commit log '%s'.\n", log->filename);
+    }
+    buffer_free(&data);
+    log->durable = log->sequence;
+    return 0;
+}
+
+/* Writes all bytes to a file descriptor.
+ * Returns 0 on success, -1 on failure.
+ */
+static int write_all(int fd, const char *data, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0)
+    {
+        written = write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* Writes and syncs everything buffered so far on behalf of every waiting
+ * committer. The log lock must be held; it is released during the I/O,
+ * while new records collect in the pending buffer for the next flush.
+ */
+static void flush_log(CommitLog *log)
+{
+    ByteBuffer swap;
+    uint64_t last;
+    int64_t start;
+    int failed;
+
+    swap = log->flushing;
+    log->flushing = log->pending;
+    log->pending = swap;
+    log->pending.length = 0;
+    last = log->sequence;
+    log->flush_running = 1;
+    pthread_mutex_unlock(&log->lock);
+
+    failed = write_all(log->fd, log->flushing.data, log->flushing.length) != 0;
+    if (!failed)
+    {
+        metrics_add(COUNTER_WAL_BYTES, log->flushing.length);
+        start = monotonic_ns();
+        failed = fdatasync(log->fd) != 0;
+        metrics_observe(HISTOGRAM_WAL_SYNC, monotonic_ns() - start);
+    }
+
+    pthread_mutex_lock(&log->lock);
+    log->flush_running = 0;
+    if (failed)
+    {
+        log->failed = 1;
+        output_printf("Error: Could not write commit log '%s'.\n", log->filename);
+    }
+    else
+    {
+        log->durable = last;
+    }
+    pthread_cond_broadcast(&log->changed);
+}
+
+/* Appends a record with the given sequence number and payload to a
+ * buffer that has room for it.
+ */
+static void append_record(ByteBuffer *buffer, uint64_t sequence, const char *payload, size_t length)
+{
+    char header[RECORD_HEADER_SIZE];
+    uint32_t payload_length;
+    uint32_t crc;
+
+    payload_length = (uint32_t)length;
+    memcpy(header + RECORD_LENGTH_POS, &payload_length, sizeof(uint32_t));
+    memcpy(header + RECORD_SEQUENCE_POS, &sequence, sizeof(uint64_t));
+    crc = crc32c(0, header + RECORD_SEQUENCE_POS, RECORD_HEADER_SIZE - RECORD_SEQUENCE_POS);
+    crc = crc32c(crc, payload, length);
+    memcpy(header + RECORD_CRC_POS, &crc, sizeof(uint32_t));
+    buffer_append(buffer, header, RECORD_HEADER_SIZE);
+    if (length > 0)
+    {
+        buffer_append(buffer, payload, length);
+    }
+}
+
+/* Appends a record to the log and waits until it is on disk. Committers
+ * that arrive while a flush is running are written together by the next
+ * one. On success the commit counts as active until finish_commit(), so
+ * that a checkpoint never sees it logged but not yet applied.
+ * Returns 0 and the record's sequence number on success, -1 on failure.
+ */
+int log_commit(CommitLog *log, const char *payload, size_t length, uint64_t *sequence)
+{
+    int durable;
+
+    if (length > UINT32_MAX - RECORD_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    while (log->checkpoint)
+    {
+        pthread_cond_wait(&log->changed, &log->lock);
+    }
+    if (open_log(log) != 0 || log->failed ||
+        buffer_reserve(&log->pending, RECORD_HEADER_SIZE + length) != 0)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    *sequence = ++log->sequence;
+    append_record(&log->pending, *sequence, payload, length);
+    log->active++;
+
+    while (log->durable < *sequence && !log->failed)
+    {
+        if (log->flush_running)
+        {
+            pthread_cond_wait(&log->changed, &log->lock);
+        }
+        else
+        {
+            flush_log(log);
+        }
+    }
+
+    durable = log->durable >= *sequence;
+    if (!durable)
+    {
+        log->active--;
+        pthread_cond_broadcast(&log->changed);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return durable ? 0 : -1;
+}
+
+/* Marks a commit logged by log_commit() as applied to the tables.
+ */
+void finish_commit(CommitLog *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->active--;
+    pthread_cond_broadcast(&log->changed);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* Waits until every logged commit is applied and holds off new ones
+ * until end_checkpoint(), so that the caller can pin tables that contain
+ * exactly the commits up to the returned sequence number.
+ */
+uint64_t begin_checkpoint(CommitLog *log)
+{
+    uint64_t sequence;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->checkpoint)
+    {
+        pthread_cond_wait(&log->changed, &log->lock);
+    }
+    log->checkpoint = 1;
+    while (log->active > 0)
+    {
+        pthread_cond_wait(&log->changed, &log->lock);
+    }
+    open_log(log);
+    sequence = log->sequence;
+    pthread_mutex_unlock(&log->lock);
+    return sequence;
+}
+
+void end_checkpoint(CommitLog *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->checkpoint = 0;
+    pthread_cond_broadcast(&log->changed);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* Raises the last sequence number handed out to at least the given one,
+ * the sequence number of a database file being loaded, so that new
+ * commits are never taken for ones the file already holds.
+ */
+void advance_commit_log(CommitLog *log, uint64_t sequence)
+{
+    pthread_mutex_lock(&log->lock);
+    if (open_log(log) == 0 && sequence > log->sequence)
+    {
+        log->sequence = sequence;
+        log->durable = sequence;
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* Drops the records up to a sequence number, once a saved database file
+ * holds their effects. Later records are kept: the log is rewritten
+ * under a temporary name and renamed into place, behind a marker record
+ * without payload that carries the sequence number, so that numbering
+ * carries on from there after a restart.
+ * Returns 0 on success, -1 on failure.
+ */
+int truncate_commit_log(CommitLog *log, uint64_t sequence)
+{
+    char temp_name[PATH_MAX];
+    ByteBuffer data;
+    ByteBuffer marker;
+    uint64_t record_sequence;
+    size_t offset;
+    size_t size;
+    int fd;
+    int failed;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->flush_running)
+    {
+        pthread_cond_wait(&log->changed, &log->lock);
+    }
+    if (open_log(log) != 0)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    memset(&data, 0, sizeof(ByteBuffer));
+    failed = read_log_file(log, &data);
+    offset = 0;
+    while (!failed && (size = record_size(data.data, data.length, offset, &record_sequence)) > 0 &&
+           record_sequence <= sequence)
+    {
+        offset += size;
+    }
+
+    memset(&marker, 0, sizeof(ByteBuffer));
+    if (!failed && (offset > 0 || (data.length == 0 && sequence > 0)))
+    {
+        failed = buffer_reserve(&marker, RECORD_HEADER_SIZE) != 0;
+        if (!failed)
+        {
+            append_record(&marker, sequence, NULL, 0);
+        }
+        snprintf(temp_name, sizeof(temp_name), "%s.tmp", log->filename);
+        fd = failed ? -1 : open(temp_name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        failed = fd < 0 || write_all(fd, marker.data, marker.length) != 0 ||
+                 write_all(fd, data.data + offset, data.length - offset) != 0 || fsync(fd) != 0;
+        if (!failed)
+        {
+            failed = rename(temp_name, log->filename) != 0;
+        }
+        if (failed)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            unlink(temp_name);
+        }
+        else
+        {
+            close(log->fd);
+            log->fd = fd;
+            failed = sync_directory(log->filename) != 0;
+        }
+    }
+    buffer_free(&marker);
+    buffer_free(&data);
+    pthread_mutex_unlock(&log->lock);
+
+    if (failed)
+    {
+        output_printf("Error: Could not truncate commit log '%s'.\n", log->filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* Calls func for every record after the given sequence number, oldest
+ * first, skipping markers. No commit may run meanwhile.
+ * Returns 0 on success, -1 if the log could not be read.
+ */
+int read_commit_log(CommitLog *log, uint64_t after, LogRecordFunc func, void *arg)
+{
+    ByteBuffer data;
+    uint64_t sequence;
+    size_t offset;
+    size_t size;
+
+    pthread_mutex_lock(&log->lock);
+    memset(&data, 0, sizeof(ByteBuffer));
+    if (open_log(log) != 0 || read_log_file(log, &data) != 0)
+    {
+        pthread_mutex_unlock(&log->lock);
+        buffer_free(&data);
+        return -1;
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    for (offset = 0; (size = record_size(data.data, data.length, offset, &sequence)) > 0; offset += size)
+    {
+        if (sequence > after && size > RECORD_HEADER_SIZE)
+        {
+            func(sequence, data.data + offset + RECORD_HEADER_SIZE, size - RECORD_HEADER_SIZE, arg);
+        }
+    }
+    buffer_free(&data);
+    return 0;
+}
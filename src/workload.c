@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "output.h"
+#include "timer.h"
+#include "transaction.h"
+#include "wal.h"
+#include "workload.h"
+
+/* Statement stream being recorded. Statements are written under the lock
+ * to a buffered file, so the order of the file is the order in which
+ * they arrived and recording costs no more than a copy.
+ */
+typedef struct Recorder
+{
+    pthread_mutex_t lock;
+    int running;
+    int64_t start;  /* Monotonic time recording started */
+    char *filename;
+    FILE *file;
+} Recorder;
+
+static Recorder recorder = {PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL};
+
+/* One statement of a workload being replayed. */
+typedef struct ReplayStatement
+{
+    int64_t offset;   /* Nanoseconds after the workload's first statement */
+    uint64_t session;
+    int sequence;     /* Position in the workload file */
+    char *query;
+} ReplayStatement;
+
+/* The statements of one recorded session, replayed in order by one
+ * thread.
+ */
+typedef struct ReplaySession
+{
+    Database *db;
+    ReplayStatement *statements;
+    int count;
+    int64_t start;       /* Monotonic time the replay started */
+    double speed;        /* 0 runs statements back to back */
+    int64_t *latencies;  /* Nanoseconds each statement took */
+    int errors;          /* Statements that reported an error */
+    int64_t lag;         /* Most any statement started behind schedule */
+    pthread_t thread;
+} ReplaySession;
+
+/* Starts recording every statement to the file named by
+ * SIMPLEDB_RECORD_FILE, if it is set. An existing file is replaced.
+ */
+void start_recording(void)
+{
+    const char *filename;
+    time_t now;
+
+    filename = getenv(RECORD_FILE_ENV);
+    if (filename == NULL || *filename == '\0')
+    {
+        return;
+    }
+    recorder.filename = strdup(filename);
+    recorder.file = fopen(filename, "w");
+    if (recorder.filename == NULL || recorder.file == NULL)
+    {
+        output_printf("Error: Could not record the workload to '%s'.\n", filename);
+        if (recorder.file != NULL)
+        {
+            fclose(recorder.file);
+            recorder.file = NULL;
+        }
+        free(recorder.filename);
+        recorder.filename = NULL;
+        return;
+    }
+    now = time(NULL);
+    fprintf(recorder.file, "# SimpleDB workload recorded %s", ctime(&now));
+    recorder.start = monotonic_ns();
+    recorder.running = 1;
+}
+
+/* Writes a statement's text with backslashes, tabs and line breaks
+ * escaped, so that it stays on one line of its own.
+ */
+static void write_escaped(FILE *file, const char *text)
+{
+    const char *run;
+
+    while (*text != '\0')
+    {
+        run = text + strcspn(text, "\\\t\n\r");
+        fwrite(text, 1, run - text, file);
+        if (*run == '\0')
+        {
+            break;
+        }
+        fputc('\\', file);
+        fputc(*run == '\t' ? 't' : *run == '\n' ? 'n' : *run == '\r' ? 'r' : '\\', file);
+        text = run + 1;
+    }
+}
+
+/* Records a statement a session is about to run.
+ */
+void record_statement(const Session *session, const char *query)
+{
+    int64_t offset;
+
+    if (!recorder.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&recorder.lock);
+    offset = (monotonic_ns() - recorder.start) / 1000;
+    fprintf(recorder.file, "%lld\t%llu\t", (long long)offset, (unsigned long long)session->id);
+    write_escaped(recorder.file, query);
+    fputc('\n', recorder.file);
+    pthread_mutex_unlock(&recorder.lock);
+}
+
+/* Stops recording and closes the workload file.
+ */
+void stop_recording(void)
+{
+    int failed;
+
+    if (!recorder.running)
+    {
+        return;
+    }
+    recorder.running = 0;
+    failed = ferror(recorder.file);
+    failed |= fclose(recorder.file) != 0;
+    if (failed)
+    {
+        output_printf("Error: Could not write the workload to '%s'.\n", recorder.filename);
+    }
+    recorder.file = NULL;
+    free(recorder.filename);
+    recorder.filename = NULL;
+}
+
+/* Undoes write_escaped() in place.
+ */
+static void unescape(char *text)
+{
+    char *out;
+
+    for (out = text; *text != '\0'; text++)
+    {
+        if (*text == '\\' && text[1] != '\0')
+        {
+            text++;
+            *out++ = *text == 't' ? '\t' : *text == 'n' ? '\n' : *text == 'r' ? '\r' : *text;
+        }
+        else
+        {
+            *out++ = *text;
+        }
+    }
+    *out = '\0';
+}
+
+static void free_statements(ReplayStatement *statements, int count)
+{
+    int iter;
+
+    for (iter = 0; iter < count; iter++)
+    {
+        free(statements[iter].query);
+    }
+    free(statements);
+}
+
+/* Reads the statements of a workload file.
+ * Returns the number of statements read, or -1 on failure.
+ */
+static int read_workload(const char *filename, ReplayStatement **statements)
+{
+    ReplayStatement *list;
+    ReplayStatement *grown;
+    FILE *file;
+    char *line;
+    char *session;
+    char *query;
+    char *end;
+    int64_t offset;
+    size_t size;
+    ssize_t length;
+    int capacity;
+    int count;
+    int line_number;
+    int failed;
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        output_printf("Error: Could not open workload '%s'.\n", filename);
+        return -1;
+    }
+
+    list = NULL;
+    capacity = 0;
+    count = 0;
+    line = NULL;
+    size = 0;
+    line_number = 0;
+    failed = 0;
+    while (!failed && (length = getline(&line, &size, file)) >= 0)
+    {
+        line_number++;
+        if (length > 0 && line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        session = strchr(line, '\t');
+        query = session != NULL ? strchr(session + 1, '\t') : NULL;
+        offset = strtoll(line, &end, 10);
+        if (query == NULL || end != session)
+        {
+            output_printf("Error: Malformed statement on line %d of workload '%s'.\n", line_number, filename);
+            failed = 1;
+            continue;
+        }
+        *query++ = '\0';
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            grown = realloc(list, sizeof(ReplayStatement) * capacity);
+            if (grown == NULL)
+            {
+                output_printf("Error: Memory allocation failed for workload.\n");
+                failed = 1;
+                continue;
+            }
+            list = grown;
+        }
+        unescape(query);
+        list[count].offset = offset * 1000;
+        list[count].session = strtoull(session + 1, NULL, 10);
+        list[count].sequence = count;
+        list[count].query = strdup(query);
+        if (list[count].query == NULL)
+        {
+            output_printf("Error: Memory allocation failed for workload.\n");
+            failed = 1;
+            continue;
+        }
+        count++;
+    }
+    free(line);
+    fclose(file);
+    if (failed)
+    {
+        free_statements(list, count);
+        return -1;
+    }
+    *statements = list;
+    return count;
+}
+
+/* Returns 1 if a statement is a SAVE or LOAD, which would read or write
+ * the database files of the current directory.
+ */
+static int is_file_statement(const char *query)
+{
+    size_t length;
+
+    query += strspn(query, " \t");
+    length = strcspn(query, " \t");
+    return length == 4 && (strncmp(query, "SAVE", 4) == 0 || strncmp(query, "LOAD", 4) == 0);
+}
+
+/* Drops the SAVE and LOAD statements of a workload.
+ * Returns the number of statements left.
+ */
+static int drop_file_statements(ReplayStatement *statements, int count)
+{
+    int kept;
+    int iter;
+
+    kept = 0;
+    for (iter = 0; iter < count; iter++)
+    {
+        if (is_file_statement(statements[iter].query))
+        {
+            free(statements[iter].query);
+        }
+        else
+        {
+            statements[kept++] = statements[iter];
+        }
+    }
+    if (kept < count)
+    {
+        output_printf("Skipping %d SAVE and LOAD statements.\n", count - kept);
+    }
+    return kept;
+}
+
+/* Gives a database a commit log of its own in a new scratch directory,
+ * so that commits being replayed never touch the log of the current
+ * directory and a snapshot is loaded without it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int open_scratch_log(Database *db, char *directory, size_t size)
+{
+    CommitLog *log;
+    const char *parent;
+    char path[PATH_MAX];
+
+    parent = getenv("TMPDIR");
+    if (parent == NULL || *parent == '\0')
+    {
+        parent = "/tmp";
+    }
+    if ((size_t)snprintf(directory, size, "%s/simpledb-replay-XXXXXX", parent) >= size || mkdtemp(directory) == NULL ||
+        (size_t)snprintf(path, sizeof(path), "%s/%s", directory, DB_LOG_FILE) >= sizeof(path))
+    {
+        output_printf("Error: Could not create a scratch directory for the replay.\n");
+        return -1;
+    }
+    log = create_commit_log(path);
+    if (log == NULL)
+    {
+        output_printf("Error: Memory allocation failed for replay.\n");
+        rmdir(directory);
+        return -1;
+    }
+    free_commit_log(db->log);
+    db->log = log;
+    return 0;
+}
+
+/* Removes the scratch directory of a replay and its commit log.
+ */
+static void remove_scratch_log(Database *db, const char *directory)
+{
+    unlink(db->log->filename);
+    rmdir(directory);
+}
+
+/* Orders statements by session, keeping each session's statements in
+ * the order they were recorded.
+ */
+static int compare_statements(const void *a, const void *b)
+{
+    const ReplayStatement *x;
+    const ReplayStatement *y;
+
+    x = a;
+    y = b;
+    if (x->session != y->session)
+    {
+        return x->session < y->session ? -1 : 1;
+    }
+    return x->sequence - y->sequence;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    int64_t x;
+    int64_t y;
+
+    x = *(const int64_t*)a;
+    y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Replay thread: runs one session's statements in order, each no sooner
+ * than its recorded time scaled by the speed, with their output
+ * discarded.
+ */
+static void *replay_thread(void *arg)
+{
+    ReplaySession *replay;
+    ReplayStatement *statement;
+    Session session;
+    ByteBuffer output;
+    ByteBuffer *previous;
+    struct timespec due;
+    int64_t scheduled;
+    int64_t begin;
+    int iter;
+
+    replay = arg;
+    memset(&session, 0, sizeof(Session));
+    memset(&output, 0, sizeof(ByteBuffer));
+    previous = output_capture(&output);
+    for (iter = 0; iter < replay->count; iter++)
+    {
+        statement = &replay->statements[iter];
+        scheduled = replay->start;
+        if (replay->speed > 0)
+        {
+            scheduled += (int64_t)(statement->offset / replay->speed);
+            due.tv_sec = scheduled / 1000000000;
+            due.tv_nsec = scheduled % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+            {
+            }
+        }
+
+        begin = monotonic_ns();
+        if (replay->speed > 0 && begin - scheduled > replay->lag)
+        {
+            replay->lag = begin - scheduled;
+        }
+        output.length = 0;
+        parse_query(replay->db, &session, statement->query);
+        replay->latencies[iter] = monotonic_ns() - begin;
+        if (output.length > 0 && memmem(output.data, output.length, "Error:", 6) != NULL)
+        {
+            replay->errors++;
+        }
+    }
+    end_session(&session);
+    output_capture(previous);
+    buffer_free(&output);
+    return NULL;
+}
+
+/* Returns the latency below which a fraction of the sorted latencies
+ * fall, by the nearest-rank method.
+ */
+static int64_t percentile(const int64_t *latencies, int count, double fraction)
+{
+    int rank;
+
+    rank = (int)(fraction * count + 0.999999);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    return latencies[(rank > count ? count : rank) - 1];
+}
+
+/* Replays a recorded workload against a database, optionally loaded from
+ * a snapshot first, and reports its latency percentiles and throughput.
+ * Each recorded session is replayed by a thread of its own, so sessions
+ * overlap as they did when recorded; speed scales the recorded pace, and
+ * 0 runs every session's statements back to back. The replay commits to
+ * a scratch commit log and skips SAVE and LOAD, so it leaves the files
+ * of the current directory alone.
+ * Returns 0 on success, -1 on failure.
+ */
+int run_replay(Database *db, const char *filename, double speed, const char *snapshot)
+{
+    ReplayStatement *statements;
+    ReplaySession *sessions;
+    char scratch[PATH_MAX];
+    int64_t *latencies;
+    int64_t first;
+    int64_t elapsed;
+    int64_t lag;
+    int session_count;
+    int started;
+    int errors;
+    int count;
+    int iter;
+    int slot;
+
+    count = read_workload(filename, &statements);
+    if (count < 0)
+    {
+        return -1;
+    }
+    count = drop_file_statements(statements, count);
+    if (count == 0)
+    {
+        output_printf("Error: Workload '%s' has no statements.\n", filename);
+        free(statements);
+        return -1;
+    }
+    if (open_scratch_log(db, scratch, sizeof(scratch)) != 0)
+    {
+        free_statements(statements, count);
+        return -1;
+    }
+    if (snapshot != NULL)
+    {
+        db = load_database_from_file(db, snapshot);
+    }
+
+    first = statements[0].offset;
+    for (iter = 0; iter < count; iter++)
+    {
+        statements[iter].offset -= first;
+    }
+    qsort(statements, count, sizeof(ReplayStatement), compare_statements);
+    session_count = 1;
+    for (iter = 1; iter < count; iter++)
+    {
+        session_count += statements[iter].session != statements[iter - 1].session;
+    }
+
+    sessions = calloc(session_count, sizeof(ReplaySession));
+    latencies = malloc(sizeof(int64_t) * count);
+    if (sessions == NULL || latencies == NULL)
+    {
+        output_printf("Error: Memory allocation failed for replay.\n");
+        free(sessions);
+        free(latencies);
+        free_statements(statements, count);
+        remove_scratch_log(db, scratch);
+        return -1;
+    }
+    slot = -1;
+    for (iter = 0; iter < count; iter++)
+    {
+        if (iter == 0 || statements[iter].session != statements[iter - 1].session)
+        {
+            slot++;
+            sessions[slot].db = db;
+            sessions[slot].statements = &statements[iter];
+            sessions[slot].latencies = &latencies[iter];
+            sessions[slot].speed = speed;
+        }
+        sessions[slot].count++;
+    }
+
+    started = 0;
+    elapsed = monotonic_ns();
+    for (slot = 0; slot < session_count; slot++)
+    {
+        sessions[slot].start = elapsed;
+        if (pthread_create(&sessions[slot].thread, NULL, replay_thread, &sessions[slot]) != 0)
+        {
+            output_printf("Error: Could not start a replay thread.\n");
+            break;
+        }
+        started++;
+    }
+    errors = 0;
+    lag = 0;
+    for (slot = 0; slot < started; slot++)
+    {
+        pthread_join(sessions[slot].thread, NULL);
+        errors += sessions[slot].errors;
+        lag = sessions[slot].lag > lag ? sessions[slot].lag : lag;
+    }
+    elapsed = monotonic_ns() - elapsed;
+
+    if (started == session_count)
+    {
+        qsort(latencies, count, sizeof(int64_t), compare_latencies);
+        output_printf("Replayed %d statements of %d sessions in %.3f s: %.1f statements/s, %d errors\n", count,
+                      session_count, elapsed / 1e9, count / (elapsed / 1e9), errors);
+        output_printf("Latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+                      percentile(latencies, count, 0.5) / 1e6, percentile(latencies, count, 0.99) / 1e6,
+                      percentile(latencies, count, 0.999) / 1e6, latencies[count - 1] / 1e6);
+        if (speed > 0)
+        {
+            output_printf("Most behind schedule: %.3f ms\n", lag / 1e6);
+        }
+    }
+
+    free(sessions);
+    free(latencies);
+    free_statements(statements, count);
+    remove_scratch_log(db, scratch);
+    return started == session_count ? 0 : -1;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Restart regression checks for the commit log: transactions committed
+# after a SAVE must survive a restart and a LOAD.
+# Usage: tests/restart.sh [path/to/main]
+
+BIN=$(cd "$(dirname "${1:-bin/main}")" && pwd)/$(basename "${1:-bin/main}")
+DIR=$(mktemp -d)
+FAILED=0
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+# Runs one session of the REPL on the statements given as arguments.
+session()
+{
+    printf '%s\n' "$@" | "$BIN" 2>&1
+}
+
+# Fails the check named $1 unless the output $2 contains the line $3.
+expect()
+{
+    if ! printf '%s\n' "$2" | grep -qx "$3"; then
+        echo "FAIL: $1: expected '$3'"
+        printf '%s\n' "$2" | sed 's/^/    /'
+        FAILED=1
+    else
+        echo "ok: $1"
+    fi
+}
+
+# Commits after a SAVE get sequence numbers above the saved ones.
+session "CREATE TABLE t (a)" "BEGIN" "INSERT INTO t VALUES (1)" "COMMIT" \
+        "BEGIN" "INSERT INTO t VALUES (2)" "COMMIT" "SAVE" > /dev/null
+session "LOAD" "BEGIN" "INSERT INTO t VALUES (3)" "COMMIT" > /dev/null
+OUT=$(session "LOAD" "SELECT COUNT(*) FROM t")
+expect "commit after SAVE and restart survives LOAD" "$OUT" "3	"
+
+# A second SAVE and restart keeps numbering above the saved commits.
+session "LOAD" "SAVE" > /dev/null
+session "LOAD" "BEGIN" "INSERT INTO t VALUES (4)" "COMMIT" > /dev/null
+OUT=$(session "LOAD" "SELECT COUNT(*) FROM t")
+expect "commit after a second SAVE and restart survives LOAD" "$OUT" "4	"
+
+# A table created after the last SAVE is recreated from the commit log.
+session "LOAD" "CREATE TABLE u (a, b)" "BEGIN" "INSERT INTO u VALUES (1, x)" "COMMIT" > /dev/null
+OUT=$(session "LOAD" "SELECT COUNT(*) FROM u")
+expect "commit into a table created after SAVE survives LOAD" "$OUT" "1	"
+
+exit $FAILED
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Server regression checks: a client that pipelines its queries and then
+# shuts down its sending side must still get every response.
+# Usage: tests/server.sh [path/to/main]
+
+BIN=$(cd "$(dirname "${1:-bin/main}")" && pwd)/$(basename "${1:-bin/main}")
+DIR=$(mktemp -d)
+SOCKET="$DIR/server.sock"
+FAILED=0
+SERVER=
+trap '[ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null; rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+# Fails the check named $1 unless $2 equals $3.
+expect_equal()
+{
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: expected '$3', got '$2'"
+        FAILED=1
+    else
+        echo "ok: $1"
+    fi
+}
+
+"$BIN" --listen "$SOCKET" > server.log 2>&1 &
+SERVER=$!
+TRIES=0
+while [ ! -S "$SOCKET" ] && [ $TRIES -lt 50 ]; do
+    sleep 0.1
+    TRIES=$((TRIES + 1))
+done
+if [ ! -S "$SOCKET" ]; then
+    echo "FAIL: server did not start"
+    cat server.log
+    exit 1
+fi
+
+# 500 inserts go out as two pipelined batches, the second one followed by
+# the shutdown of the client's sending side.
+{
+    echo "CREATE TABLE t (a, b)"
+    ROW=0
+    while [ $ROW -lt 500 ]; do
+        echo "INSERT INTO t VALUES ($ROW, x$ROW)"
+        ROW=$((ROW + 1))
+    done
+    echo "SELECT COUNT(*) FROM t"
+} > script.sql
+OUT=$("$BIN" --connect "$SOCKET" < script.sql 2>&1)
+expect_equal "every pipelined insert is answered after a half-close" \
+             "$(printf '%s\n' "$OUT" | grep -c "^Row inserted into table 't'.$")" "500"
+expect_equal "the query after the inserts is answered after a half-close" \
+             "$(printf '%s\n' "$OUT" | grep -x "500	")" "500	"
+
+kill "$SERVER"
+wait "$SERVER"
+SERVER=
+
+exit $FAILED